@@ -442,6 +442,15 @@ int shell_wants_cpu() {
         || now.tv_sec == keydown_end_time.tv_sec && now.tv_usec >= keydown_end_time.tv_usec;
 }
 
+void shell_cpu_slice(int *instructions, int *milliseconds) {
+    Tracer T("shell_cpu_slice");
+    /* shell_wants_cpu() ends the keydown time slice; checking the
+     * clock every couple of milliseconds is plenty for that.
+     */
+    *instructions = 1000;
+    *milliseconds = 2;
+}
+
 void shell_delay(int duration) {
     Tracer T("shell_delay");
     struct timespec ts;
@@ -16,6 +16,7 @@
  *****************************************************************************/
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "core_commands1.h"
 #include "core_commands2.h"
@@ -43,7 +44,11 @@ int docmd_enter(arg_struct *arg) {
     vartype *v = dup_vartype(reg_x);
     if (v == NULL)
         return ERR_INSUFFICIENT_MEMORY;
-    free_vartype(reg_t);
+    if (!ensure_stack_capacity(1)) {
+        free_vartype(v);
+        return ERR_INSUFFICIENT_MEMORY;
+    }
+    push_t();
     reg_t = reg_z;
     reg_z = reg_y;
     reg_y = v;
@@ -64,7 +69,15 @@ int docmd_rdn(arg_struct *arg) {
     reg_x = reg_y;
     reg_y = reg_z;
     reg_z = reg_t;
-    reg_t = temp;
+    if (bigstack_depth == 0)
+        reg_t = temp;
+    else {
+        /* Big stack: X goes all the way to the bottom */
+        reg_t = bigstack[bigstack_depth - 1];
+        memmove(bigstack + 1, bigstack,
+                (bigstack_depth - 1) * sizeof(vartype *));
+        bigstack[0] = temp;
+    }
     print_trace();
     return ERR_NONE;
 }
@@ -87,7 +100,7 @@ int docmd_chs(arg_struct *arg) {
             int4 sz = rm->rows * rm->columns;
             int4 i;
             for (i = 0; i < sz; i++)
-                if (rm->array->is_string[i])
+                if (is_string_at(rm->array, i))
                     return ERR_ALPHA_DATA_IS_INVALID;
             if (!disentangle((vartype *) rm))
                 return ERR_INSUFFICIENT_MEMORY;
@@ -150,8 +163,7 @@ int docmd_lastx(arg_struct *arg) {
     vartype *v = dup_vartype(reg_lastx);
     if (v == NULL)
         return ERR_INSUFFICIENT_MEMORY;
-    recall_result(v);
-    return ERR_NONE;
+    return recall_result(v);
 }
 
 int docmd_complex(arg_struct *arg) {
@@ -178,13 +190,14 @@ int docmd_complex(arg_struct *arg) {
             reg_x = v;
             free_vartype(reg_y);
             reg_y = reg_z;
-            reg_z = dup_vartype(reg_t);
+            reg_z = drop_t();
             break;
         }
         case TYPE_COMPLEX: {
             vartype *new_x = new_real(0);
             vartype *new_y = new_real(0);
-            if (new_x == NULL || new_y == NULL) {
+            if (new_x == NULL || new_y == NULL
+                    || !ensure_stack_capacity(1)) {
                 free_vartype(new_x);
                 free_vartype(new_y);
                 return ERR_INSUFFICIENT_MEMORY;
@@ -210,7 +223,7 @@ int docmd_complex(arg_struct *arg) {
             }
             free_vartype(reg_lastx);
             reg_lastx = reg_x;
-            free_vartype(reg_t);
+            push_t();
             reg_t = reg_z;
             reg_z = reg_y;
             reg_y = new_y;
@@ -233,14 +246,14 @@ int docmd_complex(arg_struct *arg) {
 
                 sz = re_m->rows * re_m->columns;
                 for (i = 0; i < sz; i++)
-                    if (re_m->array->is_string[i])
+                    if (is_string_at(re_m->array, i))
                         return ERR_ALPHA_DATA_IS_INVALID;
                 for (i = 0; i < sz; i++)
-                    if (im_m->array->is_string[i])
+                    if (is_string_at(im_m->array, i))
                         return ERR_ALPHA_DATA_IS_INVALID;
 
                 cm = (vartype_complexmatrix *)
-                                new_complexmatrix(re_m->rows, re_m->columns);
+                            new_complexmatrix(re_m->rows, re_m->columns, false);
                 if (cm == NULL)
                     return ERR_INSUFFICIENT_MEMORY;
                 if (flags.f.polar) {
@@ -260,7 +273,7 @@ int docmd_complex(arg_struct *arg) {
                 reg_lastx = reg_x;
                 free_vartype(reg_y);
                 reg_y = reg_z;
-                reg_z = dup_vartype(reg_t);
+                reg_z = drop_t();
                 reg_x = (vartype *) cm;
                 break;
             }
@@ -272,12 +285,13 @@ int docmd_complex(arg_struct *arg) {
             int4 sz = rows * columns;
             int4 i;
             vartype_realmatrix *re_m = (vartype_realmatrix *)
-                                            new_realmatrix(rows, columns);
+                                           new_realmatrix(rows, columns, false);
             vartype_realmatrix *im_m;
             if (re_m == NULL)
                 return ERR_INSUFFICIENT_MEMORY;
-            im_m = (vartype_realmatrix *) new_realmatrix(rows, columns);
-            if (im_m == NULL) {
+            im_m = (vartype_realmatrix *) new_realmatrix(rows, columns, false);
+            if (im_m == NULL || !ensure_stack_capacity(1)) {
+                free_vartype((vartype *) im_m);
                 free_vartype((vartype *) re_m);
                 return ERR_INSUFFICIENT_MEMORY;
             }
@@ -305,7 +319,7 @@ int docmd_complex(arg_struct *arg) {
             }
             free_vartype(reg_lastx);
             reg_lastx = reg_x;
-            free_vartype(reg_t);
+            push_t();
             reg_t = reg_z;
             reg_z = reg_y;
             reg_y = (vartype *) re_m;
@@ -343,12 +357,12 @@ int docmd_rcl(arg_struct *arg) {
     vartype *v;
     int err = generic_rcl(arg, &v);
     if (err == ERR_NONE)
-        recall_result(v);
+        err = recall_result(v);
     return err;
 }
 
 /* Temporary for use by docmd_rcl_div() & docmd_rcl_mul() */
-static vartype *temp_v;
+static CORE_STATE vartype *temp_v;
 
 static void docmd_rcl_div_completion(int error, vartype *res) {
     free_vartype(temp_v);
@@ -478,11 +492,10 @@ int docmd_null(arg_struct *arg) {
 int docmd_asto(arg_struct *arg) {
     /* I'm lazy enough to spot that ASTO has exactly the same side effects as
      * STO with the first 6 characters of ALPHA in ST X (as long as the
-     * destination is not ST X or IND ST X). If you're also aware that
-     * new_string() constructs a string of no more than 6 characters,
-     * you'll see that this code does the job quite nicely.
+     * destination is not ST X or IND ST X), so that's what this code does.
      */
-    vartype *s = new_string(reg_alpha, reg_alpha_length);
+    vartype *s = new_string(reg_alpha,
+                            reg_alpha_length > 6 ? 6 : reg_alpha_length);
     if (s == NULL)
         return ERR_INSUFFICIENT_MEMORY;
     if (arg->type == ARGTYPE_STK && arg->val.stk == 'X') {
@@ -538,7 +551,7 @@ int docmd_arcl(arg_struct *arg) {
      */
     if (v->type == TYPE_STRING) {
         vartype_string *s = (vartype_string *) v;
-        append_alpha_string(s->text, s->length, 0);
+        append_alpha_string(TXT(s), s->length, 0);
     } else {
         char buf[100];
         int bufptr = vartype2string(v, buf, 100);
@@ -649,8 +662,11 @@ int docmd_clsigma(arg_struct *arg) {
     size = r->rows * r->columns;
     if (last > size)
         return ERR_SIZE_ERROR;
+    invalidate_lu(regs);
+    release_long_strings(r->array, first, last);
     for (i = first; i < last; i++) {
-        r->array->is_string[i] = 0;
+        if (r->array->is_string != NULL)
+            r->array->is_string[i] = 0;
         r->array->data[i] = 0;
     }
     flags.f.log_fit_invalid = 0;
@@ -694,6 +710,7 @@ int docmd_clst(arg_struct *arg) {
     reg_y = new_real(0);
     reg_z = new_real(0);
     reg_t = new_real(0);
+    clear_bigstack();
     return ERR_NONE;
 }
 
@@ -708,10 +725,11 @@ int docmd_clrg(arg_struct *arg) {
             return ERR_INSUFFICIENT_MEMORY;
         rm = (vartype_realmatrix *) regs;
         sz = rm->rows * rm->columns;
+        release_long_strings(rm->array, 0, sz);
         for (i = 0; i < sz; i++)
             rm->array->data[i] = 0;
-        for (i = 0; i < sz; i++)
-            rm->array->is_string[i] = 0;
+        free(rm->array->is_string);
+        rm->array->is_string = NULL;
         return ERR_NONE;
     } else if (regs->type == TYPE_COMPLEXMATRIX) {
         vartype_complexmatrix *cm;
@@ -770,6 +788,7 @@ int docmd_clall(arg_struct *arg) {
     reg_z = new_real(0);
     reg_t = new_real(0);
     reg_lastx = new_real(0);
+    clear_bigstack();
     reg_alpha_length = 0;
 
     /* Exit all menus (even leaving the matrix editor
@@ -828,8 +847,7 @@ int docmd_pi(arg_struct *arg) {
     vartype *v = new_real(PI);
     if (v == NULL)
         return ERR_INSUFFICIENT_MEMORY;
-    recall_result(v);
-    return ERR_NONE;
+    return recall_result(v);
 }
 
 static int mappable_to_deg(phloat x, phloat *y) {
@@ -1141,7 +1159,7 @@ int docmd_fp(arg_struct *arg) {
         return ERR_INVALID_TYPE;
 }
 
-static phloat rnd_multiplier;
+static CORE_STATE phloat rnd_multiplier;
 
 static int mappable_rnd_r(phloat x, phloat *y) {
     if (flags.f.fix_or_all) {
@@ -1259,7 +1277,7 @@ int docmd_abs(arg_struct *arg) {
             int4 size, i;
             src = (vartype_realmatrix *) reg_x;
             dst = (vartype_realmatrix *)
-                                new_realmatrix(src->rows, src->columns);
+                                new_realmatrix(src->rows, src->columns, false);
             if (dst == NULL)
                 return ERR_INSUFFICIENT_MEMORY;
             size = src->rows * src->columns;
@@ -1329,12 +1347,12 @@ int docmd_sign(arg_struct *arg) {
             int4 size, i;
             src = (vartype_realmatrix *) reg_x;
             dst = (vartype_realmatrix *)
-                                new_realmatrix(src->rows, src->columns);
+                                new_realmatrix(src->rows, src->columns, false);
             if (dst == NULL)
                 return ERR_INSUFFICIENT_MEMORY;
             size = src->rows * src->columns;
             for (i = 0; i < size; i++) {
-                if (src->array->is_string[i])
+                if (is_string_at(src->array, i))
                     dst->array->data[i] = 0;
                 else
                     dst->array->data[i] = src->array->data[i] < 0 ? -1 : 1;
@@ -1383,3 +1401,8 @@ int docmd_mod(arg_struct *arg) {
     else
         return ERR_INVALID_TYPE;
 }
+
+void visit_commands1_state(state_visitor visit, void *cd) {
+    VISIT_STATE(temp_v);
+    VISIT_STATE(rnd_multiplier);
+}
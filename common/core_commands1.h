@@ -88,4 +88,6 @@ int docmd_abs(arg_struct *arg);
 int docmd_sign(arg_struct *arg);
 int docmd_mod(arg_struct *arg);
 
+void visit_commands1_state(state_visitor visit, void *cd);
+
 #endif
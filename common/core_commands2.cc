@@ -16,6 +16,7 @@
  *****************************************************************************/
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "core_commands1.h"
 #include "core_commands2.h"
@@ -303,8 +304,7 @@ int docmd_ran(arg_struct *arg) {
     vartype *v = new_real(math_random());
     if (v == NULL)
         return ERR_INSUFFICIENT_MEMORY;
-    recall_result(v);
-    return ERR_NONE;
+    return recall_result(v);
 }
 
 int docmd_seed(arg_struct *arg) {
@@ -442,8 +442,8 @@ int docmd_input(arg_struct *arg) {
     }
 
     docmd_cld(NULL);
-    recall_result(v);
-    return ERR_STOP;
+    err = recall_result(v);
+    return err != ERR_NONE ? err : ERR_STOP;
 }
 
 int view_helper(arg_struct *arg, int print) {
@@ -692,7 +692,7 @@ static int generic_loop(arg_struct *arg, bool isg) {
                 int4 index = arg->val.num;
                 if (index >= size)
                     return ERR_SIZE_ERROR;
-                if (rm->array->is_string[index])
+                if (is_string_at(rm->array, index))
                     return ERR_ALPHA_DATA_IS_INVALID;
                 else {
                     if (!disentangle(regs))
@@ -726,7 +726,7 @@ static int generic_loop(arg_struct *arg, bool isg) {
                 return ERR_INVALID_TYPE;
         }
         case ARGTYPE_STR: {
-            vartype *v = recall_var(arg->val.text, arg->length);
+            vartype *v = recall_arg_var(arg);
             if (v == NULL)
                 return ERR_NONEXISTENT;
             else if (v->type == TYPE_REAL)
@@ -773,7 +773,7 @@ int docmd_xtoa(arg_struct *arg) {
         append_alpha_char(to_char(x));
     } else if (reg_x->type == TYPE_STRING) {
         vartype_string *s = (vartype_string *) reg_x;
-        append_alpha_string(s->text, s->length, 0);
+        append_alpha_string(TXT(s), s->length, 0);
     } else if (reg_x->type == TYPE_REALMATRIX) {
         vartype_realmatrix *m = (vartype_realmatrix *) reg_x;
         int4 size = m->rows * m->columns;
@@ -781,10 +781,12 @@ int docmd_xtoa(arg_struct *arg) {
         char buf[44];
         int buflen = 0;
         for (i = size - 1; i >= 0; i--) {
-            if (m->array->is_string[i]) {
-                int j;
-                for (j = phloat_length(m->array->data[i]) - 1; j >= 0; j--) {
-                    buf[buflen++] = phloat_text(m->array->data[i])[j];
+            if (is_string_at(m->array, i)) {
+                const char *text;
+                int4 len, j;
+                get_matrix_string(m->array, i, &text, &len);
+                for (j = len - 1; j >= 0; j--) {
+                    buf[buflen++] = text[j];
                     if (buflen == 44)
                         goto done;
                 }
@@ -1049,15 +1051,16 @@ int docmd_x_eq_y(arg_struct *arg) {
                 return ERR_NO;
             sz = x->rows * x->columns;
             for (i = 0; i < sz; i++) {
-                int xstr = x->array->is_string[i];
-                int ystr = y->array->is_string[i];
+                int xstr = is_string_at(x->array, i);
+                int ystr = is_string_at(y->array, i);
                 if (xstr != ystr)
                     return ERR_NO;
                 if (xstr) {
-                    if (!string_equals(phloat_text(x->array->data[i]),
-                                       phloat_length(x->array->data[i]),
-                                       phloat_text(y->array->data[i]),
-                                       phloat_length(y->array->data[i])))
+                    const char *xtext, *ytext;
+                    int4 xlen, ylen;
+                    get_matrix_string(x->array, i, &xtext, &xlen);
+                    get_matrix_string(y->array, i, &ytext, &ylen);
+                    if (!string_equals(xtext, xlen, ytext, ylen))
                         return ERR_NO;
                 } else {
                     if (x->array->data[i] != y->array->data[i])
@@ -1081,7 +1084,7 @@ int docmd_x_eq_y(arg_struct *arg) {
         case TYPE_STRING: {
             vartype_string *x = (vartype_string *) reg_x;
             vartype_string *y = (vartype_string *) reg_y;
-            if (string_equals(x->text, x->length, y->text, y->length))
+            if (string_equals(TXT(x), x->length, TXT(y), y->length))
                 return ERR_YES;
             else
                 return ERR_NO;
@@ -1228,11 +1231,13 @@ int docmd_prsigma(arg_struct *arg) {
     print_text(NULL, 0, 1);
     for (i = 0; i < nr; i++) {
         int4 j = i + mode_sigma_reg;
-        if (rm->array->is_string[j]) {
+        if (is_string_at(rm->array, j)) {
+            const char *text;
+            int4 len;
+            get_matrix_string(rm->array, j, &text, &len);
             bufptr = 0;
             char2buf(buf, 100, &bufptr, '"');
-            string2buf(buf, 100, &bufptr, phloat_text(rm->array->data[j]),
-                                          phloat_length(rm->array->data[j]));
+            string2buf(buf, 100, &bufptr, text, len);
             char2buf(buf, 100, &bufptr, '"');
         } else
             bufptr = easy_phloat2string(rm->array->data[j], buf, 100, 0);
@@ -1261,8 +1266,8 @@ int docmd_prp(arg_struct *arg) {
     return print_program(prgm_index, -1, -1, 0);
 }
 
-static vartype *prv_var;
-static int4 prv_index;
+static CORE_STATE vartype *prv_var;
+static CORE_STATE int4 prv_index;
 static int prv_worker(int interrupted);
 
 int docmd_prv(arg_struct *arg) {
@@ -1323,11 +1328,13 @@ static int prv_worker(int interrupted) {
         char2buf(lbuf, 32, &llen, ':');
         llen += int2string(j + 1, lbuf + llen, 32 - llen);
         char2buf(lbuf, 32, &llen, '=');
-        if (rm->array->is_string[prv_index]) {
+        if (is_string_at(rm->array, prv_index)) {
+            const char *text;
+            int4 len;
+            get_matrix_string(rm->array, prv_index, &text, &len);
             rlen = 0;
             char2buf(rbuf, 100, &rlen, '"');
-            string2buf(rbuf, 100, &rlen, phloat_text(rm->array->data[prv_index]),
-                                    phloat_length(rm->array->data[prv_index]));
+            string2buf(rbuf, 100, &rlen, text, len);
             char2buf(rbuf, 100, &rlen, '"');
         } else
             rlen = easy_phloat2string(rm->array->data[prv_index],
@@ -1448,8 +1455,8 @@ int docmd_prx(arg_struct *arg) {
     }
 }
 
-static int prusr_state;
-static int prusr_index;
+static CORE_STATE int prusr_state;
+static CORE_STATE int prusr_index;
 static int prusr_worker(int interrupted);
 
 int docmd_prusr(arg_struct *arg) {
@@ -1678,7 +1685,11 @@ int docmd_number(arg_struct *arg) {
     if (flags.f.stack_lift_disable)
         free_vartype(reg_x);
     else {
-        free_vartype(reg_t);
+        if (!ensure_stack_capacity(1)) {
+            free_vartype(new_x);
+            return ERR_INSUFFICIENT_MEMORY;
+        }
+        push_t();
         reg_t = reg_z;
         reg_z = reg_y;
         reg_y = reg_x;
@@ -1778,7 +1789,15 @@ int docmd_newmat(arg_struct *arg) {
 
 int docmd_rup(arg_struct *arg) {
     vartype *temp = reg_x;    
-    reg_x = reg_t;
+    if (bigstack_depth == 0)
+        reg_x = reg_t;
+    else {
+        /* Big stack: the bottom level comes up into X */
+        reg_x = bigstack[0];
+        memmove(bigstack, bigstack + 1,
+                (bigstack_depth - 1) * sizeof(vartype *));
+        bigstack[bigstack_depth - 1] = reg_t;
+    }
     reg_t = reg_z;
     reg_z = reg_y;
     reg_y = temp;
@@ -1817,14 +1836,14 @@ int docmd_dim_t(arg_struct *arg) {
         return ERR_INVALID_TYPE;
     vartype *new_y = new_real(rows);
     vartype *new_x = new_real(columns);
-    if (new_x == NULL || new_y == NULL) {
+    if (new_x == NULL || new_y == NULL || !ensure_stack_capacity(1)) {
         free_vartype(new_x);
         free_vartype(new_y);
         return ERR_INSUFFICIENT_MEMORY;
     }
     free_vartype(reg_lastx);
     reg_lastx = reg_x;
-    free_vartype(reg_t);
+    push_t();
     reg_t = reg_z;
     reg_z = reg_y;
     reg_y = new_y;
@@ -2081,8 +2100,7 @@ int docmd_sigma_reg_t(arg_struct *arg) {
     vartype *v = new_real(mode_sigma_reg);
     if (v == NULL)
         return ERR_INSUFFICIENT_MEMORY;
-    recall_result(v);
-    return ERR_NONE;
+    return recall_result(v);
 }
 
 int docmd_cld(arg_struct *arg) {
@@ -2092,3 +2110,10 @@ int docmd_cld(arg_struct *arg) {
     flags.f.two_line_message = 0;
     return ERR_NONE;
 }
+
+void visit_commands2_state(state_visitor visit, void *cd) {
+    VISIT_STATE(prv_var);
+    VISIT_STATE(prv_index);
+    VISIT_STATE(prusr_state);
+    VISIT_STATE(prusr_index);
+}
@@ -140,4 +140,6 @@ int docmd_sigma_reg(arg_struct *arg);
 int docmd_sigma_reg_t(arg_struct *arg);
 int docmd_cld(arg_struct *arg);
 
+void visit_commands2_state(state_visitor visit, void *cd);
+
 #endif
@@ -78,8 +78,7 @@ int docmd_aleng(arg_struct *arg) {
     vartype *v = new_real(reg_alpha_length);
     if (v == NULL)
         return ERR_INSUFFICIENT_MEMORY;
-    recall_result(v);
-    return ERR_NONE;
+    return recall_result(v);
 }
 
 int docmd_aoff(arg_struct *arg) {
@@ -215,8 +214,7 @@ int docmd_atox(arg_struct *arg) {
     }
     if (flags.f.trace_print && flags.f.printer_exists)
         docmd_pra(NULL);
-    recall_result(v);
-    return ERR_NONE;
+    return recall_result(v);
 }
 
 static int mappable_cosh_r(phloat x, phloat *y) {
@@ -312,10 +310,10 @@ int docmd_cross(arg_struct *arg) {
         if (ls > 3 || rs > 3)
             return ERR_DIMENSION_ERROR;
         for (i = 0; i < ls; i++)
-            if (left->array->is_string[i])
+            if (is_string_at(left->array, i))
                 return ERR_ALPHA_DATA_IS_INVALID;
         for (i = 0; i < rs; i++)
-            if (right->array->is_string[i])
+            if (is_string_at(right->array, i))
                 return ERR_ALPHA_DATA_IS_INVALID;
         switch (ls) {
             case 3: zl = left->array->data[2];
@@ -430,9 +428,8 @@ int docmd_delr(arg_struct *arg) {
     interactive = matedit_mode == 2 || matedit_mode == 3;
     if (interactive) {
         if (m->type == TYPE_REALMATRIX) {
-            if (rm->array->is_string[n])
-                newx = new_string(phloat_text(rm->array->data[n]),
-                                  phloat_length(rm->array->data[n]));
+            if (is_string_at(rm->array, n))
+                newx = recall_matrix_string(rm->array, n);
             else
                 newx = new_real(rm->array->data[n]);
         } else
@@ -451,17 +448,20 @@ int docmd_delr(arg_struct *arg) {
          * of all, no temporary memory allocations needed!
          */
         if (m->type == TYPE_REALMATRIX) {
+            bool strings = rm->array->is_string != NULL;
             for (j = 0; j < columns; j++) {
                 phloat tempd = rm->array->data[matedit_i * columns + j];
-                char tempc = rm->array->is_string[matedit_i * columns + j];
+                char tempc = strings ? rm->array->is_string[matedit_i * columns + j] : 0;
                 for (i = matedit_i; i < rows - 1; i++) {
                     rm->array->data[i * columns + j] =
                                 rm->array->data[(i + 1) * columns + j];
-                    rm->array->is_string[i * columns + j] =
+                    if (strings)
+                        rm->array->is_string[i * columns + j] =
                                 rm->array->is_string[(i + 1) * columns + j];
                 }
                 rm->array->data[(rows - 1) * columns + j] = tempd;
-                rm->array->is_string[(rows - 1) * columns + j] = tempc;
+                if (strings)
+                    rm->array->is_string[(rows - 1) * columns + j] = tempc;
             }
             err = dimension_array_ref(m, rows - 1, columns);
             if (err != ERR_NONE) {
@@ -469,15 +469,17 @@ int docmd_delr(arg_struct *arg) {
                  * it was before. */
                 for (j = 0; j < columns; j++) {
                     phloat tempd = rm->array->data[(rows - 1) * columns + j];
-                    char tempc = rm->array->is_string[(rows - 1) * columns + j];
+                    char tempc = strings ? rm->array->is_string[(rows - 1) * columns + j] : 0;
                     for (i = rows - 1; i > matedit_i; i--) {
                         rm->array->data[i * columns + j] =
                                     rm->array->data[(i - 1) * columns + j];
-                        rm->array->is_string[i * columns + j] =
+                        if (strings)
+                            rm->array->is_string[i * columns + j] =
                                     rm->array->is_string[(i - 1) * columns + j];
                     }
                     rm->array->data[matedit_i * columns + j] = tempd;
-                    rm->array->is_string[matedit_i * columns + j] = tempc;
+                    if (strings)
+                        rm->array->is_string[matedit_i * columns + j] = tempc;
                 }
                 if (interactive)
                     free_vartype(newx);
@@ -513,7 +515,7 @@ int docmd_delr(arg_struct *arg) {
         int4 newsize = (rows - 1) * columns;
         if (m->type == TYPE_REALMATRIX) {
             realmatrix_data *array = (realmatrix_data *)
-                                malloc(sizeof(realmatrix_data));
+                                               slab_alloc(SLAB_REALMATRIX_DATA);
             if (array == NULL) {
                 if (interactive)
                     free_vartype(newx);
@@ -523,32 +525,38 @@ int docmd_delr(arg_struct *arg) {
             if (array->data == NULL) {
                 if (interactive)
                     free_vartype(newx);
-                free(array);
+                slab_free(SLAB_REALMATRIX_DATA, array);
                 return ERR_INSUFFICIENT_MEMORY;
             }
-            array->is_string = (char *) malloc(newsize);
-            if (array->is_string == NULL) {
-                if (interactive)
-                    free_vartype(newx);
-                free(array->data);
-                free(array);
-                return ERR_INSUFFICIENT_MEMORY;
+            if (rm->array->is_string == NULL)
+                array->is_string = NULL;
+            else {
+                array->is_string = (char *) malloc(newsize);
+                if (array->is_string == NULL) {
+                    if (interactive)
+                        free_vartype(newx);
+                    free(array->data);
+                    slab_free(SLAB_REALMATRIX_DATA, array);
+                    return ERR_INSUFFICIENT_MEMORY;
+                }
+                for (i = 0; i < matedit_i * columns; i++)
+                    array->is_string[i] = is_string_at(rm->array, i);
+                for (i = matedit_i * columns; i < newsize; i++)
+                    array->is_string[i] = is_string_at(rm->array, i + columns);
             }
-            for (i = 0; i < matedit_i * columns; i++) {
-                array->is_string[i] = rm->array->is_string[i];
+            for (i = 0; i < matedit_i * columns; i++)
                 array->data[i] = rm->array->data[i];
-            }
-            for (i = matedit_i * columns; i < newsize; i++) {
-                array->is_string[i] = rm->array->is_string[i + columns];
+            for (i = matedit_i * columns; i < newsize; i++)
                 array->data[i] = rm->array->data[i + columns];
-            }
+            retain_long_strings(array, 0, newsize);
+            array->lu = NULL;
             array->refcount = 1;
             rm->array->refcount--;
             rm->array = array;
             rm->rows--;
         } else {
             complexmatrix_data *array = (complexmatrix_data *)
-                                malloc(sizeof(complexmatrix_data));
+                                            slab_alloc(SLAB_COMPLEXMATRIX_DATA);
             if (array == NULL) {
                 if (interactive)
                     free_vartype(newx);
@@ -558,13 +566,14 @@ int docmd_delr(arg_struct *arg) {
             if (array->data == NULL) {
                 if (interactive)
                     free_vartype(newx);
-                free(array);
+                slab_free(SLAB_COMPLEXMATRIX_DATA, array);
                 return ERR_INSUFFICIENT_MEMORY;
             }
             for (i = 0; i < 2 * matedit_i * columns; i++)
                 array->data[i] = cm->array->data[i];
             for (i = 2 * matedit_i * columns; i < 2 * newsize; i++)
                 array->data[i] = cm->array->data[i + 2 * columns];
+            array->lu = NULL;
             array->refcount = 1;
             cm->array->refcount--;
             cm->array = array;
@@ -632,12 +641,6 @@ int docmd_dim(arg_struct *arg) {
 }
 
 int docmd_dot(arg_struct *arg) {
-    /* TODO: look for range errors in intermediate results.
-     * Right now, 1e6000+1e6000i DOT 1e6000-1e6000i returns NaN
-     * in the Decimal build, because two infinities of opposite
-     * signs are added. 1e300+1e300i DOT 1e300-1e300i probably
-     * does the same in the Binary build.
-     */
     vartype *v;
     if (reg_x->type == TYPE_STRING || reg_y->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
@@ -646,15 +649,14 @@ int docmd_dot(arg_struct *arg) {
         vartype_realmatrix *rm2 = (vartype_realmatrix *) reg_y;
         int4 size = rm1->rows * rm1->columns;
         int4 i;
-        phloat dot = 0;
+        phloat dot;
         int inf;
         if (size != rm2->rows * rm2->columns)
             return ERR_DIMENSION_ERROR;
         for (i = 0; i < size; i++)
-            if (rm1->array->is_string[i] || rm2->array->is_string[i])
+            if (is_string_at(rm1->array, i) || is_string_at(rm2->array, i))
                 return ERR_ALPHA_DATA_IS_INVALID;
-        for (i = 0; i < size; i++)
-            dot += rm1->array->data[i] * rm2->array->data[i];
+        dot = compensated_dot(rm1->array->data, 1, rm2->array->data, 1, size);
         if ((inf = p_isinf(dot)) != 0) {
             if (flags.f.range_error_ignore)
                 dot = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
@@ -670,7 +672,7 @@ int docmd_dot(arg_struct *arg) {
         vartype_realmatrix *rm;
         vartype_complexmatrix *cm;
         int4 size, i;
-        phloat dot_re = 0, dot_im = 0;
+        phloat dot_re, dot_im;
         int inf;
         if (reg_x->type == TYPE_REALMATRIX) {
             rm = (vartype_realmatrix *) reg_x;
@@ -683,12 +685,12 @@ int docmd_dot(arg_struct *arg) {
         if (size != cm->rows * cm->columns)
             return ERR_DIMENSION_ERROR;
         for (i = 0; i < size; i++)
-            if (rm->array->is_string[i])
+            if (is_string_at(rm->array, i))
                 return ERR_ALPHA_DATA_IS_INVALID;
-        for (i = 0; i < size; i++) {
-            dot_re += rm->array->data[i] * cm->array->data[2 * i];
-            dot_im += rm->array->data[i] * cm->array->data[2 * i + 1];
-        }
+        dot_re = compensated_dot(rm->array->data, 1,
+                                 cm->array->data, 2, size);
+        dot_im = compensated_dot(rm->array->data, 1,
+                                 cm->array->data + 1, 2, size);
         if ((inf = p_isinf(dot_re)) != 0) {
             if (flags.f.range_error_ignore)
                 dot_re = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
@@ -707,20 +709,33 @@ int docmd_dot(arg_struct *arg) {
         vartype_complexmatrix *cm1 = (vartype_complexmatrix *) reg_x;
         vartype_complexmatrix *cm2 = (vartype_complexmatrix *) reg_y;
         int4 size, i;
-        phloat dot_re = 0, dot_im = 0;
+        phloat dot_re, dot_im;
+        phloat *y;
         int inf;
         size = cm1->rows * cm1->columns;
         if (size != cm2->rows * cm2->columns)
             return ERR_DIMENSION_ERROR;
         size *= 2;
+        /* Treating both matrices as real vectors, the real part of the
+         * result is X . Y with the signs of Y's imaginary parts flipped, and
+         * the imaginary part is X . Y with Y's real and imaginary parts
+         * swapped. Doing each as a single dot product, instead of combining
+         * separate sums, keeps overflow and cancellation under control.
+         */
+        y = new_phloat_array(size, false);
+        if (y == NULL)
+            return ERR_INSUFFICIENT_MEMORY;
+        for (i = 0; i < size; i += 2) {
+            y[i] = cm2->array->data[i];
+            y[i + 1] = -cm2->array->data[i + 1];
+        }
+        dot_re = compensated_dot(cm1->array->data, 1, y, 1, size);
         for (i = 0; i < size; i += 2) {
-            phloat re1 = cm1->array->data[i];
-            phloat im1 = cm1->array->data[i + 1];
-            phloat re2 = cm2->array->data[i];
-            phloat im2 = cm2->array->data[i + 1];
-            dot_re += re1 * re2 - im1 * im2;
-            dot_im += re1 * im2 + re2 * im1;
+            y[i] = cm2->array->data[i + 1];
+            y[i + 1] = cm2->array->data[i];
         }
+        dot_im = compensated_dot(cm1->array->data, 1, y, 1, size);
+        free(y);
         if ((inf = p_isinf(dot_re)) != 0) {
             if (flags.f.range_error_ignore)
                 dot_re = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
@@ -868,9 +883,8 @@ int docmd_edit(arg_struct *arg) {
         vartype *v;
         if (reg_x->type == TYPE_REALMATRIX) {
             vartype_realmatrix *rm = (vartype_realmatrix *) reg_x;
-            if (rm->array->is_string[0])
-                v = new_string(phloat_text(rm->array->data[0]),
-                               phloat_length(rm->array->data[0]));
+            if (is_string_at(rm->array, 0))
+                v = recall_matrix_string(rm->array, 0);
             else
                 v = new_real(rm->array->data[0]);
         } else {
@@ -925,9 +939,8 @@ int docmd_editn(arg_struct *arg) {
         int i;
         if (m->type == TYPE_REALMATRIX) {
             vartype_realmatrix *rm = (vartype_realmatrix *) m;
-            if (rm->array->is_string[0])
-                v = new_string(phloat_text(rm->array->data[0]),
-                               phloat_length(rm->array->data[0]));
+            if (is_string_at(rm->array, 0))
+                v = recall_matrix_string(rm->array, 0);
             else
                 v = new_real(rm->array->data[0]);
         } else {
@@ -994,41 +1007,29 @@ static int fnrm(vartype *m, phloat *norm) {
         vartype_realmatrix *rm = (vartype_realmatrix *) m;
         int4 size = rm->rows * rm->columns;
         int4 i;
-        phloat nrm = 0;
+        phloat nrm;
         for (i = 0; i < size; i++)
-            if (rm->array->is_string[i])
+            if (is_string_at(rm->array, i))
                 return ERR_ALPHA_DATA_IS_INVALID;
-        for (i = 0; i < size; i++) {
-            /* TODO -- overflows in intermediaries */
-            phloat x = rm->array->data[i];
-            nrm += x * x;
-        }
+        nrm = scaled_norm(rm->array->data, size);
         if (p_isinf(nrm)) {
             if (flags.f.range_error_ignore)
                 nrm = POS_HUGE_PHLOAT;
             else
                 return ERR_OUT_OF_RANGE;
-        } else
-            nrm = sqrt(nrm);
+        }
         *norm = nrm;
         return ERR_NONE;
     } else if (m->type == TYPE_COMPLEXMATRIX) {
         vartype_complexmatrix *cm = (vartype_complexmatrix *) m;
         int4 size = 2 * cm->rows * cm->columns;
-        int4 i;
-        phloat nrm = 0;
-        for (i = 0; i < size; i++) {
-            /* TODO -- overflows in intermediaries */
-            phloat x = cm->array->data[i];
-            nrm += x * x;
-        }
+        phloat nrm = scaled_norm(cm->array->data, size);
         if (p_isinf(nrm)) {
             if (flags.f.range_error_ignore)
                 nrm = POS_HUGE_PHLOAT;
             else
                 return ERR_OUT_OF_RANGE;
-        } else
-            nrm = sqrt(nrm);
+        }
         *norm = nrm;
         return ERR_NONE;
     } else if (m->type == TYPE_STRING)
@@ -1110,16 +1111,22 @@ int docmd_getm(arg_struct *arg) {
         src = (vartype_realmatrix *) m;
         if (src->rows < matedit_i + y || src->columns < matedit_j + x)
             return ERR_DIMENSION_ERROR;
-        dst = (vartype_realmatrix *) new_realmatrix(y, x);
+        dst = (vartype_realmatrix *) new_realmatrix(y, x, false);
         if (dst == NULL)
             return ERR_INSUFFICIENT_MEMORY;
+        if (src->array->is_string != NULL && !alloc_is_string(dst)) {
+            free_vartype((vartype *) dst);
+            return ERR_INSUFFICIENT_MEMORY;
+        }
         for (i = 0; i < y; i++)
             for (j = 0; j < x; j++) {
                 int4 n1 = (i + matedit_i) * src->columns + j + matedit_j;
                 int4 n2 = i * dst->columns + j;
-                dst->array->is_string[n2] = src->array->is_string[n1];
+                if (dst->array->is_string != NULL)
+                    dst->array->is_string[n2] = is_string_at(src->array, n1);
                 dst->array->data[n2] = src->array->data[n1];
             }
+        retain_long_strings(dst->array, 0, x * y);
         binary_result((vartype *) dst);
         return ERR_NONE;
     } else /* m->type == TYPE_COMPLEXMATRIX */ {
@@ -1128,7 +1135,7 @@ int docmd_getm(arg_struct *arg) {
         src = (vartype_complexmatrix *) m;
         if (src->rows < matedit_i + y || src->columns < matedit_j + x)
             return ERR_DIMENSION_ERROR;
-        dst = (vartype_complexmatrix *) new_complexmatrix(y, x);
+        dst = (vartype_complexmatrix *) new_complexmatrix(y, x, false);
         if (dst == NULL)
             return ERR_INSUFFICIENT_MEMORY;
         for (i = 0; i < y; i++)
@@ -1439,7 +1446,7 @@ int docmd_uvec(arg_struct *arg) {
         int4 columns = src->columns;
         int4 size = rows * columns;
         int4 i;
-        dst = (vartype_realmatrix *) new_realmatrix(rows, columns);
+        dst = (vartype_realmatrix *) new_realmatrix(rows, columns, false);
         if (dst == NULL)
             return ERR_INSUFFICIENT_MEMORY;
         for (i = 0; i < size; i++)
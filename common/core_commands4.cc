@@ -101,12 +101,15 @@ int docmd_insr(arg_struct *arg) {
         }
         rows++;
         if (m->type == TYPE_REALMATRIX) {
+            char *is_string = rm->array->is_string;
             for (i = rows * columns - 1; i >= (matedit_i + 1) * columns; i--) {
-                rm->array->is_string[i] = rm->array->is_string[i - columns];
+                if (is_string != NULL)
+                    is_string[i] = is_string[i - columns];
                 rm->array->data[i] = rm->array->data[i - columns];
             }
             for (i = matedit_i * columns; i < (matedit_i + 1) * columns; i++) {
-                rm->array->is_string[i] = 0;
+                if (is_string != NULL)
+                    is_string[i] = 0;
                 rm->array->data[i] = 0;
             }
         } else {
@@ -131,7 +134,7 @@ int docmd_insr(arg_struct *arg) {
         int4 newsize = (rows + 1) * columns;
         if (m->type == TYPE_REALMATRIX) {
             realmatrix_data *array = (realmatrix_data *)
-                                malloc(sizeof(realmatrix_data));
+                                               slab_alloc(SLAB_REALMATRIX_DATA);
             if (array == NULL) {
                 if (interactive)
                     free_vartype(newx);
@@ -141,36 +144,42 @@ int docmd_insr(arg_struct *arg) {
             if (array->data == NULL) {
                 if (interactive)
                     free_vartype(newx);
-                free(array);
+                slab_free(SLAB_REALMATRIX_DATA, array);
                 return ERR_INSUFFICIENT_MEMORY;
             }
-            array->is_string = (char *) malloc(newsize);
-            if (array->is_string == NULL) {
-                if (interactive)
-                    free_vartype(newx);
-                free(array->data);
-                free(array);
-                return ERR_INSUFFICIENT_MEMORY;
+            if (rm->array->is_string == NULL)
+                array->is_string = NULL;
+            else {
+                array->is_string = (char *) malloc(newsize);
+                if (array->is_string == NULL) {
+                    if (interactive)
+                        free_vartype(newx);
+                    free(array->data);
+                    slab_free(SLAB_REALMATRIX_DATA, array);
+                    return ERR_INSUFFICIENT_MEMORY;
+                }
+                for (i = 0; i < matedit_i * columns; i++)
+                    array->is_string[i] = is_string_at(rm->array, i);
+                for (i = matedit_i * columns; i < (matedit_i + 1) * columns; i++)
+                    array->is_string[i] = 0;
+                for (i = (matedit_i + 1) * columns; i < newsize; i++)
+                    array->is_string[i] = is_string_at(rm->array, i - columns);
             }
-            for (i = 0; i < matedit_i * columns; i++) {
-                array->is_string[i] = rm->array->is_string[i];
+            for (i = 0; i < matedit_i * columns; i++)
                 array->data[i] = rm->array->data[i];
-            }
-            for (i = matedit_i * columns; i < (matedit_i + 1) * columns; i++) {
-                array->is_string[i] = 0;
+            for (i = matedit_i * columns; i < (matedit_i + 1) * columns; i++)
                 array->data[i] = 0;
-            }
-            for (i = (matedit_i + 1) * columns; i < newsize; i++) {
-                array->is_string[i] = rm->array->is_string[i - columns];
+            for (i = (matedit_i + 1) * columns; i < newsize; i++)
                 array->data[i] = rm->array->data[i - columns];
-            }
+            retain_long_strings(array, 0, newsize);
+            array->lu = NULL;
             array->refcount = 1;
             rm->array->refcount--;
             rm->array = array;
             rm->rows++;
         } else {
             complexmatrix_data *array = (complexmatrix_data *)
-                                malloc(sizeof(complexmatrix_data));
+                                            slab_alloc(SLAB_COMPLEXMATRIX_DATA);
             if (array == NULL) {
                 if (interactive)
                     free_vartype(newx);
@@ -180,7 +189,7 @@ int docmd_insr(arg_struct *arg) {
             if (array->data == NULL) {
                 if (interactive)
                     free_vartype(newx);
-                free(array);
+                slab_free(SLAB_COMPLEXMATRIX_DATA, array);
                 return ERR_INSUFFICIENT_MEMORY;
             }
             for (i = 0; i < 2 * matedit_i * columns; i++)
@@ -190,6 +199,7 @@ int docmd_insr(arg_struct *arg) {
                 array->data[i] = 0;
             for (i = 2 * (matedit_i + 1) * columns; i < 2 * newsize; i++)
                 array->data[i] = cm->array->data[i - 2 * columns];
+            array->lu = NULL;
             array->refcount = 1;
             cm->array->refcount--;
             cm->array = array;
@@ -320,7 +330,7 @@ int docmd_posa(arg_struct *arg) {
             int i, j;
             for (i = 0; i < reg_alpha_length - s->length + 1; i++) {
                 for (j = 0; j < s->length; j++)
-                    if (reg_alpha[i + j] != s->text[j])
+                    if (reg_alpha[i + j] != TXT(s)[j])
                         goto notfound;
                 pos = i;
                 break;
@@ -379,11 +389,16 @@ int docmd_putm(arg_struct *arg) {
             return ERR_DIMENSION_ERROR;
         if (!disentangle(m))
             return ERR_INSUFFICIENT_MEMORY;
+        if (src->array->is_string != NULL && !alloc_is_string(dst))
+            return ERR_INSUFFICIENT_MEMORY;
         for (i = 0; i < src->rows; i++)
             for (j = 0; j < src->columns; j++) {
                 int4 n1 = i * src->columns + j;
                 int4 n2 = (i + matedit_i) * dst->columns + j + matedit_j;
-                dst->array->is_string[n2] = src->array->is_string[n1];
+                retain_long_strings(src->array, n1, n1 + 1);
+                release_long_strings(dst->array, n2, n2 + 1);
+                if (dst->array->is_string != NULL)
+                    dst->array->is_string[n2] = is_string_at(src->array, n1);
                 dst->array->data[n2] = src->array->data[n1];
             }
         return ERR_NONE;
@@ -393,9 +408,8 @@ int docmd_putm(arg_struct *arg) {
         if (src->rows + matedit_i > dst->rows
                 || src->columns + matedit_j > dst->columns)
             return ERR_DIMENSION_ERROR;
-        for (i = 0; i < src->rows * src->columns; i++)
-            if (src->array->is_string[i])
-                return ERR_ALPHA_DATA_IS_INVALID;
+        if (!contains_no_strings(src))
+            return ERR_ALPHA_DATA_IS_INVALID;
         if (!disentangle(m))
             return ERR_INSUFFICIENT_MEMORY;
         for (i = 0; i < src->rows; i++)
@@ -447,9 +461,8 @@ int docmd_rclel(arg_struct *arg) {
     if (m->type == TYPE_REALMATRIX) {
         vartype_realmatrix *rm = (vartype_realmatrix *) m;
         int4 n = matedit_i * rm->columns + matedit_j;
-        if (rm->array->is_string[n])
-            v = new_string(phloat_text(rm->array->data[n]),
-                           phloat_length(rm->array->data[n]));
+        if (is_string_at(rm->array, n))
+            v = recall_matrix_string(rm->array, n);
         else
             v = new_real(rm->array->data[n]);
     } else if (m->type == TYPE_COMPLEXMATRIX) {
@@ -461,8 +474,7 @@ int docmd_rclel(arg_struct *arg) {
         return ERR_INVALID_TYPE;
     if (v == NULL)
         return ERR_INSUFFICIENT_MEMORY;
-    recall_result(v);
-    return ERR_NONE;
+    return recall_result(v);
 }
 
 int docmd_rclij(arg_struct *arg) {
@@ -476,8 +488,7 @@ int docmd_rclij(arg_struct *arg) {
         free_vartype(j);
         return ERR_INSUFFICIENT_MEMORY;
     }
-    recall_two_results(j, i);
-    return ERR_NONE;
+    return recall_two_results(j, i);
 }
 
 int docmd_rnrm(arg_struct *arg) {
@@ -485,20 +496,14 @@ int docmd_rnrm(arg_struct *arg) {
         vartype *v;
         vartype_realmatrix *rm = (vartype_realmatrix *) reg_x;
         int4 size = rm->rows * rm->columns;
-        int4 i, j;
+        int4 i;
         phloat max = 0;
         for (i = 0; i < size; i++)
-            if (rm->array->is_string[i])
+            if (is_string_at(rm->array, i))
                 return ERR_ALPHA_DATA_IS_INVALID;
         for (i = 0; i < rm->rows; i++) {
-            phloat nrm = 0;
-            for (j = 0; j < rm->columns; j++) {
-                phloat x = rm->array->data[i * rm->columns + j];
-                if (x >= 0)
-                    nrm += x;
-                else
-                    nrm -= x;
-            }
+            phloat nrm = compensated_sum(rm->array->data + i * rm->columns, 1,
+                                         rm->columns, true);
             if (p_isinf(nrm)) {
                 if (flags.f.range_error_ignore)
                     max = POS_HUGE_PHLOAT;
@@ -520,12 +525,17 @@ int docmd_rnrm(arg_struct *arg) {
         int4 i, j;
         phloat max = 0;
         for (i = 0; i < cm->rows; i++) {
-            phloat nrm = 0;
+            phloat nrm = 0, err = 0;
             for (j = 0; j < cm->columns; j++) {
                 phloat re = cm->array->data[2 * (i * cm->columns + j)];
                 phloat im = cm->array->data[2 * (i * cm->columns + j) + 1];
-                nrm += hypot(re, im);
+                compensated_add(&nrm, &err, hypot(re, im));
             }
+            /* All the terms are positive, so if the sum overflowed, the
+             * row norm really is out of range, and 'err' is meaningless.
+             */
+            if (!p_isinf(nrm))
+                nrm += err;
             if (p_isinf(nrm)) {
                 if (flags.f.range_error_ignore)
                     max = POS_HUGE_PHLOAT;
@@ -552,18 +562,17 @@ int docmd_rsum(arg_struct *arg) {
         vartype_realmatrix *rm = (vartype_realmatrix *) reg_x;
         vartype_realmatrix *res;
         int4 size = rm->rows * rm->columns;
-        int4 i, j;
+        int4 i;
         for (i = 0; i < size; i++)
-            if (rm->array->is_string[i])
+            if (is_string_at(rm->array, i))
                 return ERR_ALPHA_DATA_IS_INVALID;
-        res = (vartype_realmatrix *) new_realmatrix(rm->rows, 1);
+        res = (vartype_realmatrix *) new_realmatrix(rm->rows, 1, false);
         if (res == NULL)
             return ERR_INSUFFICIENT_MEMORY;
         for (i = 0; i < rm->rows; i++) {
-            phloat sum = 0;
+            phloat sum = compensated_sum(rm->array->data + i * rm->columns, 1,
+                                         rm->columns);
             int inf;
-            for (j = 0; j < rm->columns; j++)
-                sum += rm->array->data[i * rm->columns + j];
             if ((inf = p_isinf(sum)) != 0) {
                 if (flags.f.range_error_ignore)
                     sum = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
@@ -579,17 +588,15 @@ int docmd_rsum(arg_struct *arg) {
     } else if (reg_x->type == TYPE_COMPLEXMATRIX) {
         vartype_complexmatrix *cm = (vartype_complexmatrix *) reg_x;
         vartype_complexmatrix *res;
-        int4 i, j;
-        res = (vartype_complexmatrix *) new_complexmatrix(cm->rows, 1);
+        int4 i;
+        res = (vartype_complexmatrix *) new_complexmatrix(cm->rows, 1, false);
         if (res == NULL)
             return ERR_INSUFFICIENT_MEMORY;
         for (i = 0; i < cm->rows; i++) {
-            phloat sum_re = 0, sum_im = 0;
+            phloat *row = cm->array->data + 2 * i * cm->columns;
+            phloat sum_re = compensated_sum(row, 2, cm->columns);
+            phloat sum_im = compensated_sum(row + 1, 2, cm->columns);
             int inf;
-            for (j = 0; j < cm->columns; j++) {
-                sum_re += cm->array->data[2 * (i * cm->columns + j)];
-                sum_im += cm->array->data[2 * (i * cm->columns + j) + 1];
-            }
             if ((inf = p_isinf(sum_re)) != 0) {
                 if (flags.f.range_error_ignore)
                     sum_re = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
@@ -681,15 +688,18 @@ int docmd_swap_r(arg_struct *arg) {
             return ERR_NONE;
         if (!disentangle(m))
             return ERR_INSUFFICIENT_MEMORY;
+        char *is_string = rm->array->is_string;
         for (i = 0; i < rm->columns; i++) {
             int4 n1 = x * rm->columns + i;
             int4 n2 = y * rm->columns + i;
-            char tempc = rm->array->is_string[n1];
             phloat tempds = rm->array->data[n1];
-            rm->array->is_string[n1] = rm->array->is_string[n2];
             rm->array->data[n1] = rm->array->data[n2];
-            rm->array->is_string[n2] = tempc;
             rm->array->data[n2] = tempds;
+            if (is_string != NULL) {
+                char tempc = is_string[n1];
+                is_string[n1] = is_string[n2];
+                is_string[n2] = tempc;
+            }
         }
         return ERR_NONE;
     } else /* m->type == TYPE_COMPLEXMATRIX */ {
@@ -799,16 +809,15 @@ int docmd_stoel(arg_struct *arg) {
         vartype_realmatrix *rm = (vartype_realmatrix *) m;
         int4 n = matedit_i * rm->columns + matedit_j;
         if (reg_x->type == TYPE_REAL) {
-            rm->array->is_string[n] = 0;
+            release_long_strings(rm->array, n, n + 1);
+            if (rm->array->is_string != NULL)
+                rm->array->is_string[n] = 0;
             rm->array->data[n] = ((vartype_real *) reg_x)->x;
             return ERR_NONE;
         } else if (reg_x->type == TYPE_STRING) {
             vartype_string *s = (vartype_string *) reg_x;
-            int i;
-            rm->array->is_string[n] = 1;
-            phloat_length(rm->array->data[n]) = s->length;
-            for (i = 0; i < s->length; i++)
-                phloat_text(rm->array->data[n])[i] = s->text[i];
+            if (!put_matrix_string(rm, n, TXT(s), s->length))
+                return ERR_INSUFFICIENT_MEMORY;
             return ERR_NONE;
         } else
             return ERR_INVALID_TYPE;
@@ -963,23 +972,75 @@ int docmd_tanh(arg_struct *arg) {
         return ERR_ALPHA_DATA_IS_INVALID;
 }
 
+/* Cache-oblivious transpose: copies the rows x columns block at 'src' to the
+ * columns x rows block at 'dst', halving the longer side until the pieces
+ * are small enough that both fit in the cache. Elements are 'w' phloats wide,
+ * 1 for real and 2 for complex matrices, and 'sstride' and 'dstride' are the
+ * row lengths of the two matrices, in elements. If 'src_s' is not NULL, the
+ * is_string bytes are transposed along with the data.
+ */
+#define TRANS_BLOCK 16
+
+static void transpose_block(const phloat *src, const char *src_s, int4 sstride,
+                            phloat *dst, char *dst_s, int4 dstride,
+                            int4 rows, int4 columns, int w) {
+    while (rows > TRANS_BLOCK || columns > TRANS_BLOCK) {
+        if (rows >= columns) {
+            int4 h = rows / 2;
+            transpose_block(src, src_s, sstride, dst, dst_s, dstride,
+                            h, columns, w);
+            src += h * sstride * w;
+            dst += h * w;
+            if (src_s != NULL) {
+                src_s += h * sstride;
+                dst_s += h;
+            }
+            rows -= h;
+        } else {
+            int4 h = columns / 2;
+            transpose_block(src, src_s, sstride, dst, dst_s, dstride,
+                            rows, h, w);
+            src += h * w;
+            dst += h * dstride * w;
+            if (src_s != NULL) {
+                src_s += h;
+                dst_s += h * dstride;
+            }
+            columns -= h;
+        }
+    }
+    for (int4 i = 0; i < rows; i++)
+        for (int4 j = 0; j < columns; j++) {
+            const phloat *s = src + (i * sstride + j) * w;
+            phloat *d = dst + (j * dstride + i) * w;
+            d[0] = s[0];
+            if (w == 2)
+                d[1] = s[1];
+            if (src_s != NULL)
+                dst_s[j * dstride + i] = src_s[i * sstride + j];
+        }
+}
+
 int docmd_trans(arg_struct *arg) {
+    /* Note that this can't transpose in place, not even a square matrix that
+     * no one else refers to: the original goes to LASTX.
+     */
     if (reg_x->type == TYPE_REALMATRIX) {
         vartype_realmatrix *src = (vartype_realmatrix *) reg_x;
         vartype_realmatrix *dst;
         int4 rows = src->rows;
         int4 columns = src->columns;
-        int4 i, j;
-        dst = (vartype_realmatrix *) new_realmatrix(columns, rows);
+        dst = (vartype_realmatrix *) new_realmatrix(columns, rows, false);
         if (dst == NULL)
             return ERR_INSUFFICIENT_MEMORY;
-        for (i = 0; i < rows; i++)
-            for (j = 0; j < columns; j++) {
-                int4 n1 = i * columns + j;
-                int4 n2 = j * rows + i;
-                dst->array->is_string[n2] = src->array->is_string[n1];
-                dst->array->data[n2] = src->array->data[n1];
-            }
+        if (src->array->is_string != NULL && !alloc_is_string(dst)) {
+            free_vartype((vartype *) dst);
+            return ERR_INSUFFICIENT_MEMORY;
+        }
+        transpose_block(src->array->data, src->array->is_string, columns,
+                        dst->array->data, dst->array->is_string, rows,
+                        rows, columns, 1);
+        retain_long_strings(dst->array, 0, rows * columns);
         unary_result((vartype *) dst);
         return ERR_NONE;
     } else if (reg_x->type == TYPE_COMPLEXMATRIX) {
@@ -987,17 +1048,12 @@ int docmd_trans(arg_struct *arg) {
         vartype_complexmatrix *dst;
         int4 rows = src->rows;
         int4 columns = src->columns;
-        int4 i, j;
-        dst = (vartype_complexmatrix *) new_complexmatrix(columns, rows);
+        dst = (vartype_complexmatrix *) new_complexmatrix(columns, rows, false);
         if (dst == NULL)
             return ERR_INSUFFICIENT_MEMORY;
-        for (i = 0; i < rows; i++)
-            for (j = 0; j < columns; j++) {
-                int4 n1 = 2 * (i * columns + j);
-                int4 n2 = 2 * (j * rows + i);
-                dst->array->data[n2] = src->array->data[n1];
-                dst->array->data[n2 + 1] = src->array->data[n1 + 1];
-            }
+        transpose_block(src->array->data, NULL, columns,
+                        dst->array->data, NULL, rows,
+                        rows, columns, 2);
         unary_result((vartype *) dst);
         return ERR_NONE;
     } else if (reg_x->type == TYPE_STRING)
@@ -1133,24 +1189,24 @@ static int matedit_move(int direction) {
 
     if (m->type == TYPE_REALMATRIX) {
         if (old_n != new_n) {
-            if (rm->array->is_string[new_n])
-                v = new_string(phloat_text(rm->array->data[new_n]),
-                            phloat_length(rm->array->data[new_n]));
+            if (is_string_at(rm->array, new_n))
+                v = recall_matrix_string(rm->array, new_n);
             else
                 v = new_real(rm->array->data[new_n]);
             if (v == NULL)
                 return ERR_INSUFFICIENT_MEMORY;
         }
         if (reg_x->type == TYPE_REAL) {
-            rm->array->is_string[old_n] = 0;
+            release_long_strings(rm->array, old_n, old_n + 1);
+            if (rm->array->is_string != NULL)
+                rm->array->is_string[old_n] = 0;
             rm->array->data[old_n] = ((vartype_real *) reg_x)->x;
         } else if (reg_x->type == TYPE_STRING) {
             vartype_string *s = (vartype_string *) reg_x;
-            int i;
-            rm->array->is_string[old_n] = 1;
-            phloat_length(rm->array->data[old_n]) = s->length;
-            for (i = 0; i < s->length; i++)
-                phloat_text(rm->array->data[old_n])[i] = s->text[i];
+            if (!put_matrix_string(rm, old_n, TXT(s), s->length)) {
+                free_vartype(v);
+                return ERR_INSUFFICIENT_MEMORY;
+            }
         } else {
             free_vartype(v);
             return ERR_INVALID_TYPE;
@@ -1236,7 +1292,7 @@ int docmd_percent_ch(arg_struct *arg) {
     return ERR_NONE;
 }
 
-static vartype *matx_v;
+static CORE_STATE vartype *matx_v;
 
 static void matx_completion(int error, vartype *res) {
     if (error != ERR_NONE) {
@@ -1326,9 +1382,8 @@ static int matabx(int which) {
 
     if (mat->type == TYPE_REALMATRIX) {
         vartype_realmatrix *rm = (vartype_realmatrix *) mat;
-        if (rm->array->is_string[0])
-            v = new_string(phloat_text(rm->array->data[0]),
-                            phloat_length(rm->array->data[0]));
+        if (is_string_at(rm->array, 0))
+            v = recall_matrix_string(rm->array, 0);
         else
             v = new_real(rm->array->data[0]);
     } else {
@@ -1500,7 +1555,7 @@ static int max_min_helper(int do_max) {
     for (i = matedit_i; i < rm->rows; i++) {
         int4 index = i * rm->columns + matedit_j;
         phloat e;
-        if (rm->array->is_string[index])
+        if (is_string_at(rm->array, index))
             return ERR_ALPHA_DATA_IS_INVALID;
         e = rm->array->data[index];
         if (do_max ? e >= max_or_min_value : e <= max_or_min_value) {
@@ -1516,8 +1571,7 @@ static int max_min_helper(int do_max) {
         free_vartype(new_x);
         return ERR_INSUFFICIENT_MEMORY;
     }
-    recall_two_results(new_x, new_y);
-    return ERR_NONE;
+    return recall_two_results(new_x, new_y);
 }
 
 int docmd_max(arg_struct *arg) {
@@ -1557,7 +1611,7 @@ int docmd_find(arg_struct *arg) {
             phloat d = ((vartype_real *) reg_x)->x;
             for (i = 0; i < rm->rows; i++)
                 for (j = 0; j < rm->columns; j++)
-                    if (!rm->array->is_string[p] && rm->array->data[p] == d) {
+                    if (!is_string_at(rm->array, p) && rm->array->data[p] == d) {
                         matedit_i = i;
                         matedit_j = j;
                         return ERR_YES;
@@ -1566,16 +1620,19 @@ int docmd_find(arg_struct *arg) {
         } else /* reg_x->type == TYPE_STRING */ {
             vartype_string *s = (vartype_string *) reg_x;
             for (i = 0; i < rm->rows; i++)
-                for (j = 0; j < rm->columns; j++)
-                    if (rm->array->is_string[p]
-                            && string_equals(s->text, s->length, 
-                                             phloat_text(rm->array->data[p]),
-                                             phloat_length(rm->array->data[p]))) {
-                        matedit_i = i;
-                        matedit_j = j;
-                        return ERR_YES;
-                    } else
-                        p++;
+                for (j = 0; j < rm->columns; j++) {
+                    if (is_string_at(rm->array, p)) {
+                        const char *text;
+                        int4 len;
+                        get_matrix_string(rm->array, p, &text, &len);
+                        if (string_equals(TXT(s), s->length, text, len)) {
+                            matedit_i = i;
+                            matedit_j = j;
+                            return ERR_YES;
+                        }
+                    }
+                    p++;
+                }
         }
     } else /* m->type == TYPE_COMPLEXMATRIX */ {
         vartype_complexmatrix *cm;
@@ -1601,3 +1658,7 @@ int docmd_find(arg_struct *arg) {
 int docmd_xrom(arg_struct *arg) {
     return ERR_NONEXISTENT;
 }
+
+void visit_commands4_state(state_visitor visit, void *cd) {
+    VISIT_STATE(matx_v);
+}
@@ -55,4 +55,6 @@ int docmd_min(arg_struct *arg);
 int docmd_find(arg_struct *arg);
 int docmd_xrom(arg_struct *arg);
 
+void visit_commands4_state(state_visitor visit, void *cd);
+
 #endif
@@ -376,7 +376,7 @@ int docmd_basechs(arg_struct *arg) {
     return ERR_NONE;
 }
 
-static struct sum_struct {
+static CORE_STATE struct sum_struct {
     phloat x;
     phloat x2;
     phloat y;
@@ -409,7 +409,7 @@ static int get_summation() {
     if (last > size)
         return ERR_SIZE_ERROR;
     for (i = first; i < last; i++)
-        if (r->array->is_string[i])
+        if (is_string_at(r->array, i))
             return ERR_ALPHA_DATA_IS_INVALID;
     sigmaregs = r->array->data + first;
     sum.x = sigmaregs[0];
@@ -430,7 +430,7 @@ static int get_summation() {
     return ERR_NONE;
 }
     
-static struct model_struct {
+static CORE_STATE struct model_struct {
     phloat x;
     phloat x2;
     phloat y;
@@ -615,8 +615,7 @@ int docmd_corr(arg_struct *arg) {
     rv = new_real(r);
     if (rv == NULL)
         return ERR_INSUFFICIENT_MEMORY;
-    recall_result(rv);
-    return ERR_NONE;
+    return recall_result(rv);
 }
 
 static int mappable_fcstx(phloat x, phloat *y) {
@@ -771,8 +770,7 @@ int docmd_slope(arg_struct *arg) {
     v = new_real(model.slope);
     if (v == NULL)
         return ERR_INSUFFICIENT_MEMORY;
-    recall_result(v);
-    return ERR_NONE;
+    return recall_result(v);
 }
 
 int docmd_sum(arg_struct *arg) {
@@ -812,8 +810,7 @@ int docmd_wmean(arg_struct *arg) {
     v = new_real(wm);
     if (v == NULL)
         return ERR_INSUFFICIENT_MEMORY;
-    recall_result(v);
-    return ERR_NONE;
+    return recall_result(v);
 }
 
 int docmd_yint(arg_struct *arg) {
@@ -834,8 +831,7 @@ int docmd_yint(arg_struct *arg) {
     v = new_real(yint);
     if (v == NULL)
         return ERR_INSUFFICIENT_MEMORY;
-    recall_result(v);
-    return ERR_NONE;
+    return recall_result(v);
 }
 
 int docmd_integ(arg_struct *arg) {
@@ -1208,50 +1204,103 @@ int docmd_to_oct(arg_struct *arg) {
         return ERR_INVALID_TYPE;
 }
 
-static void accum(phloat *sum, phloat term, int weight) {
+/* The summation registers are accumulated using compensated summation; these
+ * are the rounding errors left over after the last SIGMAADD or SIGMASUB. They
+ * only apply as long as the registers still hold the values accum() left in
+ * them, at the same SIGMAREG; if anything else changes a register, its sum
+ * simply starts over from the new value. They are saved in the state file, so
+ * a series of SIGMAADDs can be continued across sessions.
+ */
+static CORE_STATE struct sigma_err_struct {
+    int4 first;
+    phloat sum[13];
+    phloat err[13];
+} sigma_err;
+
+void clear_sigma_err() {
+    sigma_err.first = -1;
+}
+
+bool persist_sigma_err() {
+    if (!write_int4(sigma_err.first)) return false;
+    for (int i = 0; i < 13; i++) {
+        if (!write_phloat(sigma_err.sum[i])) return false;
+        if (!write_phloat(sigma_err.err[i])) return false;
+    }
+    return true;
+}
+
+bool unpersist_sigma_err(bool discard) {
+    if (!read_int4(&sigma_err.first)) goto fail;
+    for (int i = 0; i < 13; i++) {
+        if (!read_phloat(&sigma_err.sum[i])) goto fail;
+        if (!read_phloat(&sigma_err.err[i])) goto fail;
+    }
+    /* After a binary/decimal switch, the registers were converted, and the
+     * errors no longer mean anything.
+     */
+    if (discard)
+        sigma_err.first = -1;
+    return true;
+    fail:
+    sigma_err.first = -1;
+    return false;
+}
+
+static void accum(phloat *sigmaregs, int k, phloat term, int weight) {
     int inf;
-    phloat s;
-    if (weight == 1)
-        s = *sum + term;
-    else
-        s = *sum - term;
-    if ((inf = p_isinf(s)) != 0)
+    phloat s = sigmaregs[k];
+    phloat e = 0;
+    if (sigma_err.first == mode_sigma_reg && sigma_err.sum[k] == s)
+        e = sigma_err.err[k];
+    compensated_add(&s, &e, weight == 1 ? term : -term);
+    if (!p_isinf(s)) {
+        /* Keep the best estimate of the sum in the register itself */
+        phloat t = s + e;
+        e -= t - s;
+        s = t;
+    }
+    if ((inf = p_isinf(s)) != 0) {
         s = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
-    *sum = s;
+        e = 0;
+    }
+    sigmaregs[k] = s;
+    sigma_err.sum[k] = s;
+    sigma_err.err[k] = e;
 }
 
 static phloat sigma_helper_2(phloat *sigmaregs,
                              phloat x, phloat y, int weight) {
 
-    accum(&sigmaregs[0], x, weight);
-    accum(&sigmaregs[1], x * x, weight);
-    accum(&sigmaregs[2], y, weight);
-    accum(&sigmaregs[3], y * y, weight);
-    accum(&sigmaregs[4], x * y, weight);
-    accum(&sigmaregs[5], 1, weight);
+    accum(sigmaregs, 0, x, weight);
+    accum(sigmaregs, 1, x * x, weight);
+    accum(sigmaregs, 2, y, weight);
+    accum(sigmaregs, 3, y * y, weight);
+    accum(sigmaregs, 4, x * y, weight);
+    accum(sigmaregs, 5, 1, weight);
 
     if (flags.f.all_sigma) {
         if (x > 0) {
             phloat lnx = log(x);
             if (y > 0) {
                 phloat lny = log(y);
-                accum(&sigmaregs[8], lny, weight);
-                accum(&sigmaregs[9], lny * lny, weight);
-                accum(&sigmaregs[10], lnx * lny, weight);
-                accum(&sigmaregs[11], x * lny, weight);
+                accum(sigmaregs, 8, lny, weight);
+                accum(sigmaregs, 9, lny * lny, weight);
+                accum(sigmaregs, 10, lnx * lny, weight);
+                accum(sigmaregs, 11, x * lny, weight);
             } else {
                 flags.f.exp_fit_invalid = 1;
                 flags.f.pwr_fit_invalid = 1;
             }
-            accum(&sigmaregs[6], lnx, weight);
-            accum(&sigmaregs[7], lnx * lnx, weight);
-            accum(&sigmaregs[12], lnx * y, weight);
+            accum(sigmaregs, 6, lnx, weight);
+            accum(sigmaregs, 7, lnx * lnx, weight);
+            accum(sigmaregs, 12, lnx * y, weight);
         } else {
             if (y > 0) {
                 phloat lny = log(y);
-                accum(&sigmaregs[8], lny, weight);
-                accum(&sigmaregs[9], lny * lny, weight);
-                accum(&sigmaregs[11], x * lny, weight);
+                accum(sigmaregs, 8, lny, weight);
+                accum(sigmaregs, 9, lny * lny, weight);
+                accum(sigmaregs, 11, x * lny, weight);
             } else
                 flags.f.exp_fit_invalid = 1;
             flags.f.log_fit_invalid = 1;
@@ -1263,6 +1312,7 @@ static phloat sigma_helper_2(phloat *sigmaregs,
         flags.f.pwr_fit_invalid = 1;
     }
 
+    sigma_err.first = mode_sigma_reg;
     return sigmaregs[5];
 }
 
@@ -1283,8 +1333,9 @@ static int sigma_helper_1(int weight) {
     if (last > size)
         return ERR_SIZE_ERROR;
     for (i = first; i < last; i++)
-        if (r->array->is_string[i])
+        if (is_string_at(r->array, i))
             return ERR_ALPHA_DATA_IS_INVALID;
+    invalidate_lu(regs);
     sigmaregs = r->array->data + first;
 
     /* All summation registers present, real-valued, non-string. */
@@ -1315,7 +1366,7 @@ static int sigma_helper_1(int weight) {
             if (rm->columns != 2)
                 return ERR_DIMENSION_ERROR;
             for (i = 0; i < rm->rows * 2; i++)
-                if (rm->array->is_string[i])
+                if (is_string_at(rm->array, i))
                     return ERR_ALPHA_DATA_IS_INVALID;
             x = (vartype_real *) new_real(0);
             if (x == NULL)
@@ -1351,3 +1402,9 @@ int docmd_sigmasub(arg_struct *arg) {
         print_trace();
     return err;
 }
+
+void visit_commands5_state(state_visitor visit, void *cd) {
+    VISIT_STATE(sum);
+    VISIT_STATE(model);
+    VISIT_STATE(sigma_err);
+}
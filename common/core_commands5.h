@@ -65,4 +65,9 @@ int docmd_to_oct(arg_struct *arg);
 int docmd_sigmaadd(arg_struct *arg);
 int docmd_sigmasub(arg_struct *arg);
 
+void clear_sigma_err();
+bool persist_sigma_err();
+bool unpersist_sigma_err(bool discard);
+void visit_commands5_state(state_visitor visit, void *cd);
+
 #endif
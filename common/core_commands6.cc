@@ -1117,8 +1117,7 @@ int docmd_anum(arg_struct *arg) {
     if (v == NULL)
         return ERR_INSUFFICIENT_MEMORY;
     flags.f.numeric_data_input = 1;
-    recall_result(v);
-    return ERR_NONE;
+    return recall_result(v);
 }
 
 int docmd_x_swap_f(arg_struct *arg) {
@@ -1159,8 +1158,7 @@ int docmd_rclflag(arg_struct *arg) {
     vartype *v = new_complex(lfs, hfs);
     if (v == NULL)
         return ERR_INSUFFICIENT_MEMORY;
-    recall_result(v);
-    return ERR_NONE;
+    return recall_result(v);
 }
 
 int docmd_stoflag(arg_struct *arg) {
@@ -1233,3 +1231,13 @@ int docmd_stoflag(arg_struct *arg) {
 
     return ERR_NONE;
 }
+
+int docmd_astox(arg_struct *arg) {
+    /* Like ASTO ST X, but without the 6-character limit */
+    vartype *s = new_string(reg_alpha, reg_alpha_length);
+    if (s == NULL)
+        return ERR_INSUFFICIENT_MEMORY;
+    free_vartype(reg_x);
+    reg_x = s;
+    return ERR_NONE;
+}
@@ -39,5 +39,6 @@ int docmd_anum(arg_struct *arg);
 int docmd_x_swap_f(arg_struct *arg);
 int docmd_rclflag(arg_struct *arg);
 int docmd_stoflag(arg_struct *arg);
+int docmd_astox(arg_struct *arg);
 
 #endif
@@ -43,19 +43,22 @@ int docmd_accel(arg_struct *arg) {
     vartype *new_x = new_real(x);
     vartype *new_y = new_real(y);
     vartype *new_z = new_real(z);
-    if (new_x == NULL || new_y == NULL || new_z == NULL) {
+    if (new_x == NULL || new_y == NULL || new_z == NULL
+            || !ensure_stack_capacity(3)) {
         free_vartype(new_x);
         free_vartype(new_y);
         free_vartype(new_z);
         return ERR_INSUFFICIENT_MEMORY;
     }
-    free_vartype(reg_t);
-    free_vartype(reg_z);
+    push_t();
+    reg_t = reg_z;
+    push_t();
     if (flags.f.stack_lift_disable) {
         free_vartype(reg_x);
         reg_t = reg_y;
     } else {
-        free_vartype(reg_y);
+        reg_t = reg_y;
+        push_t();
         reg_t = reg_x;
     }
     reg_z = new_z;
@@ -501,8 +504,7 @@ int docmd_date(arg_struct *arg) {
         if (flags.f.trace_print && flags.f.printer_exists)
             print_text(buf, bufptr, 1);
     }
-    recall_result(new_x);
-    return ERR_NONE;
+    return recall_result(new_x);
 }
 
 int docmd_date_plus(arg_struct *arg) {
@@ -687,8 +689,7 @@ int docmd_time(arg_struct *arg) {
         if (flags.f.trace_print && flags.f.printer_exists)
             print_text(buf, bufptr, 1);
     }
-    recall_result(new_x);
-    return ERR_NONE;
+    return recall_result(new_x);
 }
 
 // The YMD function is not an original Time Module function, and in Free42,
@@ -718,7 +719,7 @@ int docmd_getkey1(arg_struct *arg) {
 
 #ifdef FREE42_FPTEST
 
-static int tests_lineno;
+static CORE_STATE int tests_lineno;
 extern const char *readtest_lines[];
 
 extern "C" {
@@ -755,8 +756,7 @@ int docmd_fptest(arg_struct *arg) {
     vartype *v = new_real(result);
     if (v == NULL)
         return ERR_INSUFFICIENT_MEMORY;
-    recall_result(v);
-    return ERR_NONE;
+    return recall_result(v);
 }
 
 #else
@@ -825,8 +825,7 @@ int docmd_wsize_t(arg_struct *arg) {
     vartype *new_x = new_real(effective_wsize());
     if (new_x == NULL)
         return ERR_INSUFFICIENT_MEMORY;
-    recall_result(new_x);
-    return ERR_NONE;
+    return recall_result(new_x);
 }
 
 int docmd_bsigned(arg_struct *arg) {
@@ -851,3 +850,188 @@ int docmd_breset(arg_struct *arg) {
     flags.f.base_wrap = 0;
     return ERR_NONE;
 }
+
+/////////////////////
+///// Big stack /////
+/////////////////////
+
+static int4 stack_depth() {
+    return 4 + bigstack_depth;
+}
+
+/* Returns the slot holding stack level n, 1 being X; n must be at least 1
+ * and at most stack_depth().
+ */
+static vartype **stack_level(int4 n) {
+    switch (n) {
+        case 1: return &reg_x;
+        case 2: return &reg_y;
+        case 3: return &reg_z;
+        case 4: return &reg_t;
+        default: return &bigstack[bigstack_depth + 4 - n];
+    }
+}
+
+static int get_level_arg(arg_struct *arg, int4 min, int4 *n) {
+    int err = arg_to_num(arg, n);
+    if (err != ERR_NONE)
+        return err;
+    if (*n < min || *n > stack_depth())
+        return ERR_STACK_DEPTH_ERROR;
+    return ERR_NONE;
+}
+
+static int drop_levels(int4 n) {
+    while (n-- > 0) {
+        vartype *z = drop_t();
+        if (z == NULL)
+            return ERR_INSUFFICIENT_MEMORY;
+        free_vartype(reg_x);
+        reg_x = reg_y;
+        reg_y = reg_z;
+        reg_z = z;
+    }
+    return ERR_NONE;
+}
+
+int docmd_4stk(arg_struct *arg) {
+    /* Anything above T is lost, as it would be on the HP-42S */
+    clear_bigstack();
+    mode_bigstack = false;
+    return ERR_NONE;
+}
+
+int docmd_nstk(arg_struct *arg) {
+    mode_bigstack = true;
+    return ERR_NONE;
+}
+
+int docmd_depth(arg_struct *arg) {
+    vartype *v = new_real(stack_depth());
+    if (v == NULL)
+        return ERR_INSUFFICIENT_MEMORY;
+    return recall_result(v);
+}
+
+int docmd_drop(arg_struct *arg) {
+    int err = drop_levels(1);
+    if (err == ERR_NONE)
+        print_trace();
+    return err;
+}
+
+int docmd_dropn(arg_struct *arg) {
+    int4 n;
+    int err = get_level_arg(arg, 0, &n);
+    if (err != ERR_NONE)
+        return err;
+    err = drop_levels(n);
+    if (err == ERR_NONE)
+        print_trace();
+    return err;
+}
+
+int docmd_dupn(arg_struct *arg) {
+    int4 n, i;
+    int err = get_level_arg(arg, 0, &n);
+    if (err != ERR_NONE)
+        return err;
+    if (n == 0)
+        return ERR_NONE;
+    /* Copy everything before lifting anything, so running out of
+     * memory leaves the stack as it was
+     */
+    vartype **copies = (vartype **) malloc(n * sizeof(vartype *));
+    if (copies == NULL)
+        return ERR_INSUFFICIENT_MEMORY;
+    for (i = 0; i < n; i++) {
+        copies[i] = dup_vartype(*stack_level(n - i));
+        if (copies[i] == NULL)
+            break;
+    }
+    if (i < n || !ensure_stack_capacity(n)) {
+        while (--i >= 0)
+            free_vartype(copies[i]);
+        free(copies);
+        return ERR_INSUFFICIENT_MEMORY;
+    }
+    for (i = 0; i < n; i++) {
+        push_t();
+        reg_t = reg_z;
+        reg_z = reg_y;
+        reg_y = reg_x;
+        reg_x = copies[i];
+    }
+    free(copies);
+    print_trace();
+    return ERR_NONE;
+}
+
+int docmd_pick(arg_struct *arg) {
+    int4 n;
+    int err = get_level_arg(arg, 1, &n);
+    if (err != ERR_NONE)
+        return err;
+    vartype *v = dup_vartype(*stack_level(n));
+    if (v == NULL)
+        return ERR_INSUFFICIENT_MEMORY;
+    return recall_result(v);
+}
+
+int docmd_unpick(arg_struct *arg) {
+    /* Pops X and stores it in level n of what remains, so that
+     * n PICK n UNPICK leaves the stack unchanged.
+     */
+    int4 n;
+    int err = get_level_arg(arg, 1, &n);
+    if (err != ERR_NONE)
+        return err;
+    if (n + 1 > stack_depth())
+        return ERR_STACK_DEPTH_ERROR;
+    vartype *v = dup_vartype(reg_x);
+    if (v == NULL)
+        return ERR_INSUFFICIENT_MEMORY;
+    vartype **dst = stack_level(n + 1);
+    free_vartype(*dst);
+    *dst = v;
+    err = drop_levels(1);
+    if (err == ERR_NONE)
+        print_trace();
+    return err;
+}
+
+int docmd_rdnn(arg_struct *arg) {
+    int4 n, i;
+    int err = get_level_arg(arg, 0, &n);
+    if (err != ERR_NONE)
+        return err;
+    if (n < 2)
+        return ERR_NONE;
+    vartype *temp = reg_x;
+    for (i = 1; i < n; i++)
+        *stack_level(i) = *stack_level(i + 1);
+    *stack_level(n) = temp;
+    print_trace();
+    return ERR_NONE;
+}
+
+int docmd_rupn(arg_struct *arg) {
+    int4 n, i;
+    int err = get_level_arg(arg, 0, &n);
+    if (err != ERR_NONE)
+        return err;
+    if (n < 2)
+        return ERR_NONE;
+    vartype *temp = *stack_level(n);
+    for (i = n; i > 1; i--)
+        *stack_level(i) = *stack_level(i - 1);
+    reg_x = temp;
+    print_trace();
+    return ERR_NONE;
+}
+
+void visit_commands7_state(state_visitor visit, void *cd) {
+#ifdef FREE42_FPTEST
+    VISIT_STATE(tests_lineno);
+#endif
+}
@@ -51,4 +51,17 @@ int docmd_bsigned(arg_struct *arg);
 int docmd_bwrap(arg_struct *arg);
 int docmd_breset(arg_struct *arg);
 
+int docmd_4stk(arg_struct *arg);
+int docmd_nstk(arg_struct *arg);
+int docmd_depth(arg_struct *arg);
+int docmd_drop(arg_struct *arg);
+int docmd_dropn(arg_struct *arg);
+int docmd_dupn(arg_struct *arg);
+int docmd_pick(arg_struct *arg);
+int docmd_unpick(arg_struct *arg);
+int docmd_rdnn(arg_struct *arg);
+int docmd_rupn(arg_struct *arg);
+
+void visit_commands7_state(state_visitor visit, void *cd);
+
 #endif
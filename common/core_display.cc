@@ -521,25 +521,25 @@ static char smallchars_map[128] =
 
 
 
-static char display[272];
+static CORE_STATE char display[272];
 
-static int is_dirty = 0;
-static int dirty_top, dirty_left, dirty_bottom, dirty_right;
+static CORE_STATE int is_dirty = 0;
+static CORE_STATE int dirty_top, dirty_left, dirty_bottom, dirty_right;
 
-static int catalogmenu_section[5];
-static int catalogmenu_rows[5];
-static int catalogmenu_row[5];
-static int catalogmenu_item[5][6];
+static CORE_STATE int catalogmenu_section[5];
+static CORE_STATE int catalogmenu_rows[5];
+static CORE_STATE int catalogmenu_row[5];
+static CORE_STATE int catalogmenu_item[5][6];
 
-static int custommenu_length[3][6];
-static char custommenu_label[3][6][7];
+static CORE_STATE int custommenu_length[3][6];
+static CORE_STATE char custommenu_label[3][6][7];
 
-static arg_struct progmenu_arg[9];
-static int progmenu_is_gto[9];
-static int progmenu_length[6];
-static char progmenu_label[6][7];
+static CORE_STATE arg_struct progmenu_arg[9];
+static CORE_STATE int progmenu_is_gto[9];
+static CORE_STATE int progmenu_length[6];
+static CORE_STATE char progmenu_label[6][7];
 
-static int appmenu_exitcallback;
+static CORE_STATE int appmenu_exitcallback;
 
 
 /*******************************/
@@ -780,8 +780,9 @@ void draw_pattern(phloat dx, phloat dy, const char *pattern, int pattern_width){
     mark_dirty(y + vmin, x + hmin, y + vmax, x + hmax);
 }
 
+static CORE_STATE uint4 lastgoosetime = 0;
+
 void fly_goose() {
-    static uint4 lastgoosetime = 0;
     uint4 goosetime = shell_milliseconds();
     if (goosetime < lastgoosetime)
         // shell_millisends() wrapped around
@@ -1480,6 +1481,9 @@ typedef struct {
 static extension_struct extensions[] = {
     { CMD_MAX,     CMD_FIND,    NULL                              },
     { CMD_ANUM,    CMD_STOFLAG, NULL                              },
+    { CMD_ASTOX,   CMD_ASTOX,   NULL                              },
+    { CMD_DROP,    CMD_DROP,    NULL                              },
+    { CMD_4STK,    CMD_RUPN,    NULL                              },
     { CMD_ACCEL,   CMD_ACCEL,   &core_settings.enable_ext_accel   },
     { CMD_LOCAT,   CMD_LOCAT,   &core_settings.enable_ext_locat   },
     { CMD_HEADING, CMD_HEADING, &core_settings.enable_ext_heading },
@@ -1496,7 +1500,9 @@ static extension_struct extensions[] = {
 // the list until the number after it.
 static int ext_fcn_cat[] = {
     CMD_FIND, CMD_MAX, CMD_MIN,
-    CMD_ANUM, CMD_RCLFLAG, CMD_STOFLAG, CMD_X_SWAP_F,
+    CMD_ANUM, CMD_ASTOX, CMD_RCLFLAG, CMD_STOFLAG, CMD_X_SWAP_F,
+    CMD_4STK, CMD_NSTK, CMD_DEPTH, CMD_DROP, CMD_DROPN, CMD_DUPN,
+    CMD_PICK, CMD_UNPICK, CMD_RDNN, CMD_RUPN,
     CMD_ADATE, -1, CMD_SWPT,
     CMD_YMD,
     CMD_BRESET, CMD_BSIGNED, CMD_BWRAP,
@@ -1747,7 +1753,13 @@ static void draw_catalog() {
 }
 
 void display_mem() {
+    /* Give back whatever the vartype pools can spare before asking, and count
+     * what they keep in reserve as available, since it is.
+     */
+    trim_vartype_pools();
     uint4 bytes = shell_get_mem();
+    uint4 pooled = vartype_pool_free_bytes();
+    bytes = bytes + pooled < bytes ? 0xffffffff : bytes + pooled;
     char buf[16];
     int buflen;
     clear_display();
@@ -1848,8 +1860,14 @@ void show() {
             case TYPE_STRING: {
                 vartype_string *s = (vartype_string *) reg_x;
                 draw_char(0, 0, '"');
-                draw_string(1, 0, s->text, s->length);
-                draw_char(s->length + 1, 0, '"');
+                if (s->length > 20) {
+                    draw_string(1, 0, TXT(s), 19);
+                    draw_char(20, 0, 26);
+                    draw_char(21, 0, '"');
+                } else {
+                    draw_string(1, 0, TXT(s), s->length);
+                    draw_char(s->length + 1, 0, '"');
+                }
                 break;
             }
             case TYPE_COMPLEX: {
@@ -1886,10 +1904,13 @@ void show() {
                 bufptr = vartype2string(reg_x, buf, 22);
                 draw_string(0, 0, buf, bufptr);
                 draw_string(0, 1, "1:1=", 4);
-                if (rm->array->is_string[0]) {
+                if (is_string_at(rm->array, 0)) {
+                    const char *text;
+                    int4 len;
+                    get_matrix_string(rm->array, 0, &text, &len);
                     draw_char(4, 1, '"');
-                    draw_string(5, 1, phloat_text(*d), phloat_length(*d));
-                    draw_char(5 + phloat_length(*d), 1, '"');
+                    draw_string(5, 1, text, len);
+                    draw_char(5 + len, 1, '"');
                 } else {
                     bufptr = phloat2string(*d, buf, 18,
                                            0, 0, 3,
@@ -2212,7 +2233,7 @@ typedef struct {
     int normal;
 } prp_data_struct;
 
-static prp_data_struct *prp_data;
+static CORE_STATE prp_data_struct *prp_data;
 static int print_program_worker(int interrupted);
 
 int print_program(int prgm_index, int4 pc, int4 lines, int normal) {
@@ -2342,7 +2363,11 @@ static int print_program_worker(int interrupted) {
         dat->line++;
         dat->lines--;
 
-    } while (!printed);
+        /* Keep going until we've printed something, and then until the
+         * time slice is used up.
+         */
+    } while (!printed || dat->lines != 0 && dat->cmd != CMD_END
+                                        && !interruptible_slice_done());
 
     if (dat->lines != 0 && dat->cmd != CMD_END)
         return ERR_INTERRUPTIBLE;
@@ -2857,3 +2882,25 @@ void do_prgm_menu_key(int keynum) {
         }
     }
 }
+
+void visit_display_state(state_visitor visit, void *cd) {
+    VISIT_STATE(display);
+    VISIT_STATE(is_dirty);
+    VISIT_STATE(dirty_top);
+    VISIT_STATE(dirty_left);
+    VISIT_STATE(dirty_bottom);
+    VISIT_STATE(dirty_right);
+    VISIT_STATE(catalogmenu_section);
+    VISIT_STATE(catalogmenu_rows);
+    VISIT_STATE(catalogmenu_row);
+    VISIT_STATE(catalogmenu_item);
+    VISIT_STATE(custommenu_length);
+    VISIT_STATE(custommenu_label);
+    VISIT_STATE(progmenu_arg);
+    VISIT_STATE(progmenu_is_gto);
+    VISIT_STATE(progmenu_length);
+    VISIT_STATE(progmenu_label);
+    VISIT_STATE(appmenu_exitcallback);
+    VISIT_STATE(lastgoosetime);
+    VISIT_STATE(prp_data);
+}
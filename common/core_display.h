@@ -99,4 +99,6 @@ void clear_prgm_menu();
 void assign_prgm_key(int keynum, int is_gto, const arg_struct *arg);
 void do_prgm_menu_key(int keynum);
 
+void visit_display_state(state_visitor visit, void *cd);
+
 #endif
@@ -21,6 +21,7 @@
 #include "core_globals.h"
 #include "core_commands2.h"
 #include "core_commands4.h"
+#include "core_commands5.h"
 #include "core_display.h"
 #include "core_helpers.h"
 #include "core_main.h"
@@ -38,7 +39,7 @@
 // File used for reading and writing the state file, and for importing and
 // exporting programs. Since only one of these operations can be active at one
 // time, having one FILE pointer for all of them is sufficient.
-FILE *gfile = NULL;
+CORE_STATE FILE *gfile = NULL;
 
 error_spec errors[] = {
     { /* NONE */                   NULL,                       0 },
@@ -74,7 +75,8 @@ error_spec errors[] = {
     { /* INTERRUPTIBLE */          NULL,                       0 },
     { /* NO_VARIABLES */           "No Variables",            12 },
     { /* SUSPICIOUS_OFF */         "Suspicious OFF",          14 },
-    { /* RTN_STACK_FULL */         "RTN Stack Full",          14 }
+    { /* RTN_STACK_FULL */         "RTN Stack Full",          14 },
+    { /* STACK_DEPTH_ERROR */      "Stack Depth Error",       17 }
 };
 
 
@@ -545,130 +547,135 @@ menu_spec menus[] = {
 #define LABELS_INCREMENT 10
 
 /* Registers */
-vartype *reg_x = NULL;
-vartype *reg_y = NULL;
-vartype *reg_z = NULL;
-vartype *reg_t = NULL;
-vartype *reg_lastx = NULL;
-int reg_alpha_length = 0;
-char reg_alpha[44];
+CORE_STATE vartype *reg_x = NULL;
+CORE_STATE vartype *reg_y = NULL;
+CORE_STATE vartype *reg_z = NULL;
+CORE_STATE vartype *reg_t = NULL;
+CORE_STATE vartype *reg_lastx = NULL;
+CORE_STATE vartype **bigstack = NULL;
+CORE_STATE int4 bigstack_depth = 0;
+CORE_STATE int4 bigstack_capacity = 0;
+CORE_STATE int reg_alpha_length = 0;
+CORE_STATE char reg_alpha[44];
 
 /* Flags */
-flags_struct flags;
+CORE_STATE flags_struct flags;
 const char *virtual_flags =
     /* 00-49 */ "00000000000000000000000000010000000000000000111111"
     /* 50-99 */ "00010000000000010000000001000000000000000000000000";
 
 /* Variables */
-int vars_capacity = 0;
-int vars_count = 0;
-var_struct *vars = NULL;
+CORE_STATE int vars_capacity = 0;
+CORE_STATE int vars_count = 0;
+CORE_STATE var_struct *vars = NULL;
+CORE_STATE int4 vars_generation = 0;
 
 /* Programs */
-int prgms_capacity = 0;
-int prgms_count = 0;
-prgm_struct *prgms = NULL;
-int labels_capacity = 0;
-int labels_count = 0;
-label_struct *labels = NULL;
-
-int current_prgm = -1;
-int4 pc;
-int prgm_highlight_row = 0;
-
-int varmenu_length;
-char varmenu[7];
-int varmenu_rows;
-int varmenu_row;
-int varmenu_labellength[6];
-char varmenu_labeltext[6][7];
-int varmenu_role;
-
-bool mode_clall;
-int (*mode_interruptible)(int) = NULL;
-bool mode_stoppable;
-bool mode_command_entry;
-bool mode_number_entry;
-bool mode_alpha_entry;
-bool mode_shift;
-int mode_appmenu;
-int mode_plainmenu;
-bool mode_plainmenu_sticky;
-int mode_transientmenu;
-int mode_alphamenu;
-int mode_commandmenu;
-bool mode_running;
-bool mode_getkey;
-bool mode_getkey1;
-bool mode_pause = false;
-bool mode_disable_stack_lift; /* transient */
-bool mode_varmenu;
-bool mode_updown;
-int4 mode_sigma_reg;
-int mode_goose;
-bool mode_time_clktd;
-bool mode_time_clk24;
-int mode_wsize;
-
-phloat entered_number;
-int entered_string_length;
-char entered_string[15];
-
-int pending_command;
-arg_struct pending_command_arg;
-int xeq_invisible;
+CORE_STATE int prgms_capacity = 0;
+CORE_STATE int prgms_count = 0;
+CORE_STATE prgm_struct *prgms = NULL;
+CORE_STATE int labels_capacity = 0;
+CORE_STATE int labels_count = 0;
+CORE_STATE label_struct *labels = NULL;
+
+CORE_STATE int current_prgm = -1;
+CORE_STATE int4 pc;
+CORE_STATE int prgm_highlight_row = 0;
+
+CORE_STATE int varmenu_length;
+CORE_STATE char varmenu[7];
+CORE_STATE int varmenu_rows;
+CORE_STATE int varmenu_row;
+CORE_STATE int varmenu_labellength[6];
+CORE_STATE char varmenu_labeltext[6][7];
+CORE_STATE int varmenu_role;
+
+CORE_STATE bool mode_clall;
+CORE_STATE int (*mode_interruptible)(int) = NULL;
+CORE_STATE bool mode_stoppable;
+CORE_STATE bool mode_command_entry;
+CORE_STATE bool mode_number_entry;
+CORE_STATE bool mode_alpha_entry;
+CORE_STATE bool mode_shift;
+CORE_STATE int mode_appmenu;
+CORE_STATE int mode_plainmenu;
+CORE_STATE bool mode_plainmenu_sticky;
+CORE_STATE int mode_transientmenu;
+CORE_STATE int mode_alphamenu;
+CORE_STATE int mode_commandmenu;
+CORE_STATE bool mode_running;
+CORE_STATE bool mode_getkey;
+CORE_STATE bool mode_getkey1;
+CORE_STATE bool mode_pause = false;
+CORE_STATE bool mode_disable_stack_lift; /* transient */
+CORE_STATE bool mode_varmenu;
+CORE_STATE bool mode_updown;
+CORE_STATE int4 mode_sigma_reg;
+CORE_STATE int mode_goose;
+CORE_STATE bool mode_time_clktd;
+CORE_STATE bool mode_time_clk24;
+CORE_STATE int mode_wsize;
+CORE_STATE bool mode_bigstack;
+
+CORE_STATE phloat entered_number;
+CORE_STATE int entered_string_length;
+CORE_STATE char entered_string[15];
+
+CORE_STATE int pending_command;
+CORE_STATE arg_struct pending_command_arg;
+CORE_STATE int xeq_invisible;
 
 /* Multi-keystroke commands -- edit state */
 /* Relevant when mode_command_entry != 0 */
-int incomplete_command;
-int incomplete_ind;
-int incomplete_alpha;
-int incomplete_length;
-int incomplete_maxdigits;
-int incomplete_argtype;
-int incomplete_num;
-char incomplete_str[7];
-int4 incomplete_saved_pc;
-int4 incomplete_saved_highlight_row;
+CORE_STATE int incomplete_command;
+CORE_STATE int incomplete_ind;
+CORE_STATE int incomplete_alpha;
+CORE_STATE int incomplete_length;
+CORE_STATE int incomplete_maxdigits;
+CORE_STATE int incomplete_argtype;
+CORE_STATE int incomplete_num;
+CORE_STATE char incomplete_str[7];
+CORE_STATE int4 incomplete_saved_pc;
+CORE_STATE int4 incomplete_saved_highlight_row;
 
 /* Command line handling temporaries */
-char cmdline[100];
-int cmdline_length;
-int cmdline_row;
+CORE_STATE char cmdline[100];
+CORE_STATE int cmdline_length;
+CORE_STATE int cmdline_row;
 
 /* Matrix editor / matrix indexing */
-int matedit_mode; /* 0=off, 1=index, 2=edit, 3=editn */
-char matedit_name[7];
-int matedit_length;
-vartype *matedit_x;
-int4 matedit_i;
-int4 matedit_j;
-int matedit_prev_appmenu;
+CORE_STATE int matedit_mode; /* 0=off, 1=index, 2=edit, 3=editn */
+CORE_STATE char matedit_name[7];
+CORE_STATE int matedit_length;
+CORE_STATE vartype *matedit_x;
+CORE_STATE int4 matedit_i;
+CORE_STATE int4 matedit_j;
+CORE_STATE int matedit_prev_appmenu;
 
 /* INPUT */
-char input_name[11];
-int input_length;
-arg_struct input_arg;
+CORE_STATE char input_name[11];
+CORE_STATE int input_length;
+CORE_STATE arg_struct input_arg;
 
 /* BASE application */
-int baseapp = 0;
+CORE_STATE int baseapp = 0;
 
 /* Random number generator */
-int8 random_number_low, random_number_high;
+CORE_STATE int8 random_number_low, random_number_high;
 
 /* NORM & TRACE mode: number waiting to be printed */
-int deferred_print = 0;
+CORE_STATE int deferred_print = 0;
 
 /* Keystroke buffer - holds keystrokes received while
  * there is a program running.
  */
-int keybuf_head = 0;
-int keybuf_tail = 0;
-int keybuf[16];
+CORE_STATE int keybuf_head = 0;
+CORE_STATE int keybuf_tail = 0;
+CORE_STATE int keybuf[16];
 
-int remove_program_catalog = 0;
+CORE_STATE int remove_program_catalog = 0;
 
-int state_file_number_format;
+CORE_STATE int state_file_number_format;
 
 /* No user interaction: we keep track of whether or not the user
  * has pressed any keys since powering up, and we don't allow
@@ -679,7 +686,7 @@ int state_file_number_format;
  *
  * from locking the user out.
  */
-bool no_keystrokes_yet;
+CORE_STATE bool no_keystrokes_yet;
 
 
 /* Version number for the state file.
@@ -746,16 +753,19 @@ bool no_keystrokes_yet;
  * Version 29: 2.5.7  SOLVE: Tracking second best guess in order to be able to
  *                    report it accurately in Y, and to provide additional data
  *                    points for distinguishing between zeroes and poles.
+ * Version 30: 2.5.22 Long strings
+ * Version 31: 2.5.22 Big stack; SIGMAADD rounding errors
  */
-#define FREE42_VERSION 29
+#define FREE42_VERSION 31
 
 
 /*******************/
 /* Private globals */
 /*******************/
 
-static bool state_bool_is_int;
-bool state_is_portable;
+static CORE_STATE bool state_bool_is_int;
+CORE_STATE bool state_is_portable;
+static CORE_STATE bool state_long_strings;
 
 typedef struct {
     int4 prgm;
@@ -785,21 +795,21 @@ typedef struct {
  * be in sync, hence the need to track them separately.
  */
 #define MAX_RTN_LEVEL 1024
-static int rtn_sp = 0;
-static int rtn_stack_capacity = 0;
-static rtn_stack_entry *rtn_stack = NULL;
-static int rtn_level = 0;
-static bool rtn_level_0_has_matrix_entry;
-static int rtn_stop_level = -1;
-static bool rtn_solve_active = false;
-static bool rtn_integ_active = false;
+static CORE_STATE int rtn_sp = 0;
+static CORE_STATE int rtn_stack_capacity = 0;
+static CORE_STATE rtn_stack_entry *rtn_stack = NULL;
+static CORE_STATE int rtn_level = 0;
+static CORE_STATE bool rtn_level_0_has_matrix_entry;
+static CORE_STATE int rtn_stop_level = -1;
+static CORE_STATE bool rtn_solve_active = false;
+static CORE_STATE bool rtn_integ_active = false;
 
 #ifdef IPHONE
 /* For iPhone, we disable OFF by default, to satisfy App Store
  * policy, but we allow users to enable it using a magic value
  * in the X register. This flag determines OFF behavior.
  */
-bool off_enable_flag = false;
+CORE_STATE bool off_enable_flag = false;
 #endif
 
 typedef struct {
@@ -808,9 +818,9 @@ typedef struct {
     int4 columns;
 } matrix_persister;
 
-static int array_count;
-static int array_list_capacity;
-static void **array_list;
+static CORE_STATE int array_count;
+static CORE_STATE int array_list_capacity;
+static CORE_STATE void **array_list;
 
 
 static bool array_list_grow();
@@ -818,7 +828,24 @@ static int array_list_search(void *array);
 static bool persist_vartype(vartype *v);
 static bool unpersist_vartype(vartype **v, bool padded);
 static void update_label_table(int prgm, int4 pc, int inserted);
-static void invalidate_lclbls(int prgm_index, bool force);
+static int find_label_index(int prgm, int4 pc);
+static void insert_label(int index, int prgm, int4 pc, const char *name, int length);
+static void remove_label(int index);
+static void rebuild_label_hash();
+static void grow_labels();
+static void label_hash_insert(int index);
+static bool label_hash_remove(int index);
+static int find_global_label_index(const char *name, int namelen);
+static void decode_command(int4 *pc, int *command, arg_struct *arg, int find_target);
+static bool build_decoded_commands(prgm_struct *prgm);
+static void free_decoded_commands(prgm_struct *prgm);
+static void init_prgm_caches(prgm_struct *prgm);
+static void free_prgm_caches(prgm_struct *prgm);
+static void update_lclbl_table(prgm_struct *prgm, int4 pc, int4 delta);
+static void line_index_insert(prgm_struct *prgm, int4 pc, int4 length);
+static void line_index_delete(prgm_struct *prgm, int4 pc, int4 length);
+static void add_lclbl(prgm_struct *prgm, int4 pc);
+static int4 scan_for_local_label(const arg_struct *arg);
 static int pc_line_convert(int4 loc, int loc_is_pc);
 static bool convert_programs(bool *clear_stack);
 #ifdef BCD_MATH
@@ -867,8 +894,8 @@ static bool persist_vartype(vartype *v) {
         }
         case TYPE_STRING: {
             vartype_string *s = (vartype_string *) v;
-            return write_char(s->length)
-                && fwrite(s->text, 1, s->length, gfile) == s->length;
+            return write_int4(s->length)
+                && fwrite(TXT(s), 1, s->length, gfile) == s->length;
         }
         case TYPE_REALMATRIX: {
             vartype_realmatrix *rm = (vartype_realmatrix *) v;
@@ -895,13 +922,27 @@ static bool persist_vartype(vartype *v) {
             write_int4(columns);
             if (must_write) {
                 int size = rm->rows * rm->columns;
-                if (fwrite(rm->array->is_string, 1, size, gfile) != size)
-                    return false;
+                if (rm->array->is_string != NULL) {
+                    if (fwrite(rm->array->is_string, 1, size, gfile) != size)
+                        return false;
+                } else {
+                    for (int i = 0; i < size; i++)
+                        if (fputc(0, gfile) == EOF)
+                            return false;
+                }
                 for (int i = 0; i < size; i++) {
-                    if (rm->array->is_string[i]) {
+                    int t = is_string_at(rm->array, i);
+                    if (t == 1) {
                         char *str = (char *) &rm->array->data[i];
                         if (fwrite(str, 1, 7, gfile) != 7)
                             return false;
+                    } else if (t == 2) {
+                        const char *text;
+                        int4 len;
+                        get_matrix_string(rm->array, i, &text, &len);
+                        if (!write_int4(len)
+                                || fwrite(text, 1, len, gfile) != len)
+                            return false;
                     } else {
                         if (!write_phloat(rm->array->data[i]))
                             return false;
@@ -963,7 +1004,7 @@ struct fake_bcd {
 // should then clean up what has already been read, rewind the state file,
 // and try again in mode 2.
 
-int bug_mode;
+CORE_STATE int bug_mode;
 
 static bool unpersist_vartype(vartype **v, bool padded) {
     if (state_is_portable) {
@@ -998,17 +1039,26 @@ static bool unpersist_vartype(vartype **v, bool padded) {
                 return true;
             }
             case TYPE_STRING: {
-                vartype_string *s = (vartype_string *) new_string("", 0);
-                if (s == NULL)
+                int4 len;
+                if (state_long_strings) {
+                    if (!read_int4(&len) || len < 0)
+                        return false;
+                } else {
+                    char c;
+                    if (!read_char(&c))
+                        return false;
+                    len = c;
+                }
+                char *text = (char *) malloc(len + 1);
+                if (text == NULL)
                     return false;
-                char len;
-                if (!read_char(&len) || fread(s->text, 1, len, gfile) != len) {
-                    free_vartype((vartype *) s);
+                if (fread(text, 1, len, gfile) != len) {
+                    free(text);
                     return false;
                 }
-                s->length = len;
-                *v = (vartype *) s;
-                return true;
+                *v = new_string(text, len);
+                free(text);
+                return *v != NULL;
             }
             case TYPE_REALMATRIX: {
                 int4 rows, columns;
@@ -1031,13 +1081,33 @@ static bool unpersist_vartype(vartype **v, bool padded) {
                 if (rm == NULL)
                     return false;
                 int4 size = rows * columns;
-                if (fread(rm->array->is_string, 1, size, gfile) != size) {
+                if (!alloc_is_string(rm)
+                        || fread(rm->array->is_string, 1, size, gfile) != size) {
                     free_vartype((vartype *) rm);
                     return false;
                 }
                 bool success = true;
                 for (int4 i = 0; i < size; i++) {
-                    if (rm->array->is_string[i]) {
+                    if (rm->array->is_string[i] == 2) {
+                        /* Long string; data[i] is not a valid pointer
+                         * until put_matrix_string() has stored it
+                         */
+                        rm->array->is_string[i] = 0;
+                        int4 len;
+                        char *text = NULL;
+                        if (!state_long_strings || !read_int4(&len) || len < 0
+                                || (text = (char *) malloc(len + 1)) == NULL
+                                || fread(text, 1, len, gfile) != len
+                                || !put_matrix_string(rm, i, text, len)) {
+                            free(text);
+                            for (int4 j = i + 1; j < size; j++)
+                                if (rm->array->is_string[j] == 2)
+                                    rm->array->is_string[j] = 0;
+                            success = false;
+                            break;
+                        }
+                        free(text);
+                    } else if (rm->array->is_string[i]) {
                         char *dst = (char *) &rm->array->data[i];
                         if (bug_mode == 0) {
                             // 6 bytes of text followed by length byte
@@ -1093,6 +1163,8 @@ static bool unpersist_vartype(vartype **v, bool padded) {
                     free_vartype((vartype *) rm);
                     return false;
                 }
+                /* Drops 'is_string' again if there are no strings */
+                contains_no_strings(rm);
                 if (shared) {
                     if (!array_list_grow()) {
                         free_vartype((vartype *) rm);
@@ -1120,7 +1192,8 @@ static bool unpersist_vartype(vartype **v, bool padded) {
                 bool shared = rows < 0;
                 if (shared)
                     rows = -rows;
-                vartype_complexmatrix *cm = (vartype_complexmatrix *) new_complexmatrix(rows, columns);
+                vartype_complexmatrix *cm = (vartype_complexmatrix *)
+                        new_complexmatrix(rows, columns, false);
                 if (cm == NULL)
                     return false;
                 int4 size = 2 * rows * columns;
@@ -1256,17 +1329,15 @@ static bool unpersist_vartype(vartype **v, bool padded) {
             return true;
         }
         case TYPE_STRING: {
-            vartype_string *s = (vartype_string *) new_string("", 0);
-            int n = sizeof(vartype_string) - sizeof(int);
-            if (s == NULL)
-                return false;
-            if (fread(&s->type + 1, 1, n, gfile) != n) {
-                free_vartype((vartype *) s);
+            /* The layout of vartype_string, minus 'type', before version 30 */
+            struct {
+                int length;
+                char text[6];
+            } s;
+            if (fread(&s, 1, sizeof(s), gfile) != sizeof(s))
                 return false;
-            } else {
-                *v = (vartype *) s;
-                return true;
-            }
+            *v = new_string(s.text, s.length);
+            return *v != NULL;
         }
         case TYPE_REALMATRIX: {
             matrix_persister mp;
@@ -1286,7 +1357,9 @@ static bool unpersist_vartype(vartype **v, bool padded) {
             bool shared = mp.rows < 0;
             if (shared)
                 mp.rows = -mp.rows;
-            vartype_realmatrix *rm = (vartype_realmatrix *) new_realmatrix(mp.rows, mp.columns);
+            /* In the mode-switch case, only 7 bytes of each string are read */
+            vartype_realmatrix *rm = (vartype_realmatrix *)
+                    new_realmatrix(mp.rows, mp.columns, bin_dec_mode_switch());
             if (rm == NULL)
                 return false;
             if (bin_dec_mode_switch()) {
@@ -1307,7 +1380,8 @@ static bool unpersist_vartype(vartype **v, bool padded) {
                     free_vartype((vartype *) rm);
                     return false;
                 }
-                if (fread(rm->array->is_string, 1, size, gfile) != size) {
+                if (!alloc_is_string(rm)
+                        || fread(rm->array->is_string, 1, size, gfile) != size) {
                     free(temp);
                     free_vartype((vartype *) rm);
                     return false;
@@ -1343,7 +1417,8 @@ static bool unpersist_vartype(vartype **v, bool padded) {
                     return false;
                 }
                 size = mp.rows * mp.columns;
-                if (fread(rm->array->is_string, 1, size, gfile) != size) {
+                if (!alloc_is_string(rm)
+                        || fread(rm->array->is_string, 1, size, gfile) != size) {
                     free_vartype((vartype *) rm);
                     return false;
                 }
@@ -1354,6 +1429,8 @@ static bool unpersist_vartype(vartype **v, bool padded) {
                                 update_decimal(&rm->array->data[i].val);
                 #endif
             }
+            /* Drops 'is_string' again if there are no strings */
+            contains_no_strings(rm);
             if (shared) {
                 if (!array_list_grow()) {
                     free_vartype((vartype *) rm);
@@ -1383,7 +1460,7 @@ static bool unpersist_vartype(vartype **v, bool padded) {
             if (shared)
                 mp.rows = -mp.rows;
             vartype_complexmatrix *cm = (vartype_complexmatrix *)
-                                        new_complexmatrix(mp.rows, mp.columns);
+                                  new_complexmatrix(mp.rows, mp.columns, false);
             if (cm == NULL)
                 return false;
             if (bin_dec_mode_switch()) {
@@ -1453,6 +1530,15 @@ static bool persist_globals() {
         goto done;
     if (!write_int(mode_wsize))
         goto done;
+    if (!write_bool(mode_bigstack))
+        goto done;
+    if (!write_int4(bigstack_depth))
+        goto done;
+    for (i = 0; i < bigstack_depth; i++)
+        if (!persist_vartype(bigstack[i]))
+            goto done;
+    if (!persist_sigma_err())
+        goto done;
     if (fwrite(&flags, 1, sizeof(flags_struct), gfile) != sizeof(flags_struct))
         goto done;
     if (!write_int(prgms_count))
@@ -1538,7 +1624,7 @@ static bool persist_globals() {
     return ret;
 }
 
-static bool suppress_varmenu_update = false;
+static CORE_STATE bool suppress_varmenu_update = false;
 
 static bool unpersist_globals(int4 ver) {
     int i;
@@ -1624,6 +1710,27 @@ static bool unpersist_globals(int4 ver) {
         }
     } else
         mode_wsize = 36;
+    clear_bigstack();
+    mode_bigstack = false;
+    if (ver >= 31) {
+        int4 depth;
+        if (!read_bool(&mode_bigstack)) {
+            mode_bigstack = false;
+            goto done;
+        }
+        if (!read_int4(&depth) || depth < 0 || depth > 0 && !mode_bigstack
+                || !ensure_stack_capacity(depth))
+            goto done;
+        while (bigstack_depth < depth) {
+            vartype *v;
+            if (!unpersist_vartype(&v, padded) || v == NULL)
+                goto done;
+            bigstack[bigstack_depth++] = v;
+        }
+        if (!unpersist_sigma_err(bin_dec_mode_switch()))
+            goto done;
+    } else
+        clear_sigma_err();
     if (fread(&flags, 1, sizeof(flags_struct), gfile)
             != sizeof(flags_struct))
         goto done;
@@ -1672,6 +1779,7 @@ static bool unpersist_globals(int4 ver) {
                 goto done;
             }
         vars_capacity = vars_count;
+        rebuild_var_index();
 
         // Purging zero-length var that may have been created by buggy INTEG
         purge_var("", 0);
@@ -1710,6 +1818,7 @@ static bool unpersist_globals(int4 ver) {
             prgms[i].capacity = prgms[i].size;
             prgms[i].text = (unsigned char *) malloc(prgms[i].size);
             // TODO - handle memory allocation failure
+            init_prgm_caches(prgms + i);
         }
         for (i = 0; i < prgms_count; i++) {
             if (fread(prgms[i].text, 1, prgms[i].size, gfile)
@@ -1767,6 +1876,7 @@ static bool unpersist_globals(int4 ver) {
             }
         }
         vars_capacity = vars_count;
+        rebuild_var_index();
     }
     
     if (!read_int(&varmenu_length)) {
@@ -1890,10 +2000,6 @@ static bool unpersist_globals(int4 ver) {
             }
             if (clear_stack)
                 clear_all_rtns();
-        } else {
-            if (ver < 22)
-                for (i = 0; i < prgms_count; i++)
-                    invalidate_lclbls(i, true);
         }
         #ifdef BCD_MATH
             if (state_file_number_format == NUMBER_FORMAT_BCD20_OLD
@@ -1906,6 +2012,7 @@ static bool unpersist_globals(int4 ver) {
     ret = true;
 
     done:
+    rebuild_var_index();
     free(array_list);
     return ret;
 }
@@ -1913,9 +2020,11 @@ static bool unpersist_globals(int4 ver) {
 void clear_all_prgms() {
     if (prgms != NULL) {
         int i;
-        for (i = 0; i < prgms_count; i++)
+        for (i = 0; i < prgms_count; i++) {
             if (prgms[i].text != NULL)
                 free(prgms[i].text);
+            free_prgm_caches(prgms + i);
+        }
         free(prgms);
     }
     prgms = NULL;
@@ -1926,6 +2035,7 @@ void clear_all_prgms() {
     labels = NULL;
     labels_capacity = 0;
     labels_count = 0;
+    rebuild_label_hash();
 }
 
 int clear_prgm(const arg_struct *arg) {
@@ -1938,13 +2048,9 @@ int clear_prgm(const arg_struct *arg) {
                 return ERR_INTERNAL_ERROR;
             prgm_index = current_prgm;
         } else {
-            int i;
-            for (i = labels_count - 1; i >= 0; i--)
-                if (string_equals(arg->val.text, arg->length,
-                                 labels[i].name, labels[i].length))
-                    goto found;
-            return ERR_LABEL_NOT_FOUND;
-            found:
+            int i = find_global_label_index(arg->val.text, arg->length);
+            if (i == -1)
+                return ERR_LABEL_NOT_FOUND;
             prgm_index = labels[i].prgm;
         }
     }
@@ -1961,6 +2067,7 @@ int clear_prgm_by_index(int prgm_index) {
     else if (current_prgm > prgm_index)
         current_prgm--;
     free(prgms[prgm_index].text);
+    free_prgm_caches(prgms + prgm_index);
     for (i = prgm_index; i < prgms_count - 1; i++)
         prgms[i] = prgms[i + 1];
     prgms_count--;
@@ -1976,6 +2083,7 @@ int clear_prgm_by_index(int prgm_index) {
             i++;
     }
     labels_count = i;
+    rebuild_label_hash();
     if (prgms_count == 0 || prgm_index == prgms_count) {
         int saved_prgm = current_prgm;
         int saved_pc = pc;
@@ -2025,8 +2133,11 @@ void clear_prgm_lines(int4 count) {
             i++;
     }
     labels_count = i;
+    rebuild_label_hash();
 
-    invalidate_lclbls(current_prgm, false);
+    update_lclbl_table(prgms + current_prgm, frompc, -deleted);
+    line_index_delete(prgms + current_prgm, frompc, deleted);
+    free_decoded_commands(prgms + current_prgm);
     clear_all_rtns();
 }
 
@@ -2058,8 +2169,8 @@ void goto_dot_dot(bool force_new) {
     current_prgm = prgms_count++;
     prgms[current_prgm].capacity = 0;
     prgms[current_prgm].size = 0;
-    prgms[current_prgm].lclbl_invalid = 1;
     prgms[current_prgm].text = NULL;
+    init_prgm_caches(prgms + current_prgm);
     command = CMD_END;
     arg.type = ARGTYPE_NONE;
     store_command(0, command, &arg);
@@ -2128,34 +2239,73 @@ int get_command_length(int prgm_index, int4 pc) {
 }
 
 void get_next_command(int4 *pc, int *command, arg_struct *arg, int find_target){
+    /* find_target is only set when we're about to execute the command, so
+     * that's when we use, and if necessary build, the decoded-command cache.
+     * Callers that are just listing or scanning the program go straight to
+     * the bytes, so they don't pay for building a cache they'll never use.
+     */
+    if (find_target) {
+        prgm_struct *prgm = prgms + current_prgm;
+        if (prgm->decoded != NULL || build_decoded_commands(prgm)) {
+            int4 index = *pc < prgm->size ? prgm->decoded_index[*pc] : -1;
+            if (index != -1) {
+                decoded_command *dc = prgm->decoded + index;
+                if (dc->arg.target == -1
+                        && (dc->cmd == CMD_GTO || dc->cmd == CMD_XEQ)
+                        && (dc->arg.type == ARGTYPE_NUM
+                            || dc->arg.type == ARGTYPE_LCLBL
+                            || dc->arg.type == ARGTYPE_STK)) {
+                    /* Target not known yet; let decode_command() find it,
+                     * and remember what it found.
+                     */
+                    decode_command(pc, command, arg, 1);
+                    dc->arg.target = arg->target;
+                    return;
+                }
+                *command = dc->cmd;
+                *arg = dc->arg;
+                *pc = dc->next_pc;
+                if (dc->var_index != -2) {
+                    /* Named variable argument: pass on its index, looking
+                     * it up again if the variable directory has changed
+                     * since the last time. Command implementations use
+                     * arg->target only while a program is running; see
+                     * lookup_arg_var().
+                     */
+                    if (dc->var_generation != vars_generation) {
+                        dc->var_index = lookup_var(dc->arg.val.text, dc->arg.length);
+                        dc->var_generation = vars_generation;
+                    }
+                    arg->target = dc->var_index;
+                }
+                return;
+            }
+        }
+    }
+    decode_command(pc, command, arg, find_target);
+}
+
+static void decode_command(int4 *pc, int *command, arg_struct *arg, int find_target) {
     prgm_struct *prgm = prgms + current_prgm;
     int i;
-    int4 target_pc;
-    int4 orig_pc = *pc;
 
     *command = prgm->text[(*pc)++];
     arg->type = prgm->text[(*pc)++];
     *command |= (arg->type & 240) << 4;
     arg->type &= 15;
+    arg->target = -1;
 
     if ((*command == CMD_GTO || *command == CMD_XEQ)
             && (arg->type == ARGTYPE_NUM
                 || arg->type == ARGTYPE_LCLBL
                 || arg->type == ARGTYPE_STK)) {
-        if (find_target) {
-            target_pc = 0;
-            for (i = 0; i < 4; i++)
-                target_pc = (target_pc << 8) | prgm->text[(*pc)++];
-            if (target_pc != -1) {
-                arg->target = target_pc;
-                find_target = 0;
-            }
-        } else
-            (*pc) += 4;
-    } else {
+        /* These four bytes used to hold the cached target pc. That is
+         * now looked up in the local label table instead, but the bytes
+         * are still there, to keep the program format unchanged.
+         */
+        (*pc) += 4;
+    } else
         find_target = 0;
-        arg->target = -1;
-    }
 
     switch (arg->type) {
         case ARGTYPE_NUM:
@@ -2205,22 +2355,237 @@ void get_next_command(int4 *pc, int *command, arg_struct *arg, int find_target){
         arg->type = ARGTYPE_DOUBLE;
     }
     
-    if (find_target) {
-        target_pc = find_local_label(arg);
-        arg->target = target_pc;
-        for (i = 5; i >= 2; i--) {
-            prgm->text[orig_pc + i] = target_pc;
-            target_pc >>= 8;
+    if (find_target)
+        arg->target = find_local_label(arg);
+}
+
+static bool build_decoded_commands(prgm_struct *prgm) {
+    int4 count = 0;
+    int4 pc2 = 0;
+    while (pc2 < prgm->size) {
+        pc2 += get_command_length(current_prgm, pc2);
+        count++;
+    }
+    prgm->decoded = (decoded_command *) malloc(count * sizeof(decoded_command));
+    prgm->decoded_index = (int4 *) malloc(prgm->size * sizeof(int4));
+    if (prgm->decoded == NULL || prgm->decoded_index == NULL) {
+        free_decoded_commands(prgm);
+        return false;
+    }
+    for (pc2 = 0; pc2 < prgm->size; pc2++)
+        prgm->decoded_index[pc2] = -1;
+    pc2 = 0;
+    count = 0;
+    while (pc2 < prgm->size) {
+        decoded_command *dc = prgm->decoded + count;
+        prgm->decoded_index[pc2] = count++;
+        decode_command(&pc2, &dc->cmd, &dc->arg, 0);
+        dc->next_pc = pc2;
+        /* Local GTO/XEQ targets are resolved on first execution */
+        dc->arg.target = -1;
+        /* Same for named variables; -2 means no variable argument */
+        int argtype = cmdlist(dc->cmd)->argtype;
+        if ((argtype == ARG_VAR || argtype == ARG_REAL || argtype == ARG_NAMED)
+                && (dc->arg.type == ARGTYPE_STR
+                    || dc->arg.type == ARGTYPE_IND_STR)) {
+            dc->var_index = -1;
+            dc->var_generation = vars_generation - 1;
+        } else
+            dc->var_index = -2;
+    }
+    return true;
+}
+
+static void free_decoded_commands(prgm_struct *prgm) {
+    free(prgm->decoded);
+    prgm->decoded = NULL;
+    free(prgm->decoded_index);
+    prgm->decoded_index = NULL;
+}
+
+static void init_prgm_caches(prgm_struct *prgm) {
+    prgm->decoded = NULL;
+    prgm->decoded_index = NULL;
+    prgm->lclbl_start = NULL;
+    prgm->lclbl_pc = NULL;
+    prgm->lclbl_capacity = 0;
+    prgm->line_pc = NULL;
+    prgm->line_count = 0;
+    prgm->line_capacity = 0;
+}
+
+static void free_prgm_caches(prgm_struct *prgm) {
+    free_decoded_commands(prgm);
+    free(prgm->lclbl_start);
+    free(prgm->lclbl_pc);
+    free(prgm->line_pc);
+    init_prgm_caches(prgm);
+}
+
+/* Local labels are grouped in the local label table by key: LBL 00-99 map
+ * to 0-99, the synthetic LBL ST T/Z/Y/X/L map to 112-116, and LBL A-J and
+ * a-e map to 128 plus their character code. Anything else, including
+ * GTO 112-116, which can match either LBL 112 or LBL ST T, returns -1, and
+ * is handled by scanning the program instead.
+ */
+#define LCLBL_KEYS 256
+
+static int lclbl_key(int argtype, int4 num, char c) {
+    switch (argtype) {
+        case ARGTYPE_NUM:
+            return num >= 0 && num < 100 ? num : -1;
+        case ARGTYPE_STK:
+            switch (c) {
+                case 'T': return 112;
+                case 'Z': return 113;
+                case 'Y': return 114;
+                case 'X': return 115;
+                case 'L': return 116;
+                default: return -1;
+            }
+        case ARGTYPE_LCLBL:
+            return 128 + (c & 127);
+        default:
+            return -1;
+    }
+}
+
+/* Returns the key of the local label at the given pc, or -1 if the
+ * command there isn't a local label that the table keeps track of.
+ */
+static int lclbl_key_at(prgm_struct *prgm, int4 pc) {
+    int command = prgm->text[pc];
+    int argtype = prgm->text[pc + 1];
+    command |= (argtype & 240) << 4;
+    argtype &= 15;
+    if (command != CMD_LBL)
+        return -1;
+    if (argtype == ARGTYPE_NUM) {
+        int4 num = 0;
+        unsigned char c;
+        pc += 2;
+        do {
+            c = prgm->text[pc++];
+            num = (num << 7) | (c & 127);
+        } while ((c & 128) == 0);
+        return lclbl_key(argtype, num, 0);
+    } else
+        return lclbl_key(argtype, 0, prgm->text[pc + 2]);
+}
+
+static bool build_lclbl_table(int prgm_index) {
+    prgm_struct *prgm = prgms + prgm_index;
+    int4 fill[LCLBL_KEYS];
+    int4 pc2, count;
+    int key;
+    prgm->lclbl_start = (int4 *) malloc((LCLBL_KEYS + 1) * sizeof(int4));
+    if (prgm->lclbl_start == NULL)
+        return false;
+    for (key = 0; key <= LCLBL_KEYS; key++)
+        prgm->lclbl_start[key] = 0;
+    /* First pass: count the labels for each key... */
+    for (pc2 = 0; pc2 < prgm->size; pc2 += get_command_length(prgm_index, pc2)) {
+        key = lclbl_key_at(prgm, pc2);
+        if (key != -1)
+            prgm->lclbl_start[key + 1]++;
+    }
+    for (key = 0; key < LCLBL_KEYS; key++)
+        prgm->lclbl_start[key + 1] += prgm->lclbl_start[key];
+    count = prgm->lclbl_start[LCLBL_KEYS];
+    prgm->lclbl_capacity = count + 8;
+    prgm->lclbl_pc = (int4 *) malloc(prgm->lclbl_capacity * sizeof(int4));
+    if (prgm->lclbl_pc == NULL) {
+        free(prgm->lclbl_start);
+        prgm->lclbl_start = NULL;
+        prgm->lclbl_capacity = 0;
+        return false;
+    }
+    /* ...second pass: put them in their places */
+    for (key = 0; key < LCLBL_KEYS; key++)
+        fill[key] = prgm->lclbl_start[key];
+    for (pc2 = 0; pc2 < prgm->size; pc2 += get_command_length(prgm_index, pc2)) {
+        key = lclbl_key_at(prgm, pc2);
+        if (key != -1)
+            prgm->lclbl_pc[fill[key]++] = pc2;
+    }
+    return true;
+}
+
+/* Called after 'delta' bytes have been inserted at 'pc', or, if 'delta' is
+ * negative, after -delta bytes have been deleted from there. Labels in the
+ * deleted range are removed from the table; a local LBL in an inserted
+ * range must be added separately, using add_lclbl().
+ */
+static void update_lclbl_table(prgm_struct *prgm, int4 pc, int4 delta) {
+    int4 *lpc = prgm->lclbl_pc;
+    int4 i, j, end;
+    int key;
+    if (prgm->lclbl_start == NULL)
+        return;
+    if (delta >= 0) {
+        for (i = 0; i < prgm->lclbl_start[LCLBL_KEYS]; i++)
+            if (lpc[i] >= pc)
+                lpc[i] += delta;
+        return;
+    }
+    end = pc - delta;
+    j = 0;
+    for (key = 0; key < LCLBL_KEYS; key++) {
+        int4 group_end = prgm->lclbl_start[key + 1];
+        i = prgm->lclbl_start[key];
+        prgm->lclbl_start[key] = j;
+        for (; i < group_end; i++) {
+            if (lpc[i] < pc)
+                lpc[j++] = lpc[i];
+            else if (lpc[i] >= end)
+                lpc[j++] = lpc[i] + delta;
         }
-        prgm->lclbl_invalid = 0;
     }
+    prgm->lclbl_start[LCLBL_KEYS] = j;
+}
+
+/* Called after a line has been inserted at 'pc'; if that line is a local
+ * LBL, it is added to the table.
+ */
+static void add_lclbl(prgm_struct *prgm, int4 pc) {
+    int4 i, count;
+    int key;
+    if (prgm->lclbl_start == NULL)
+        return;
+    key = lclbl_key_at(prgm, pc);
+    if (key == -1)
+        return;
+    count = prgm->lclbl_start[LCLBL_KEYS];
+    if (count == prgm->lclbl_capacity) {
+        int4 newcapacity = prgm->lclbl_capacity + 16;
+        int4 *newpc = (int4 *) realloc(prgm->lclbl_pc, newcapacity * sizeof(int4));
+        if (newpc == NULL) {
+            /* Drop the table; find_local_label() will try to build
+             * a new one next time it's needed.
+             */
+            free(prgm->lclbl_start);
+            free(prgm->lclbl_pc);
+            prgm->lclbl_start = NULL;
+            prgm->lclbl_pc = NULL;
+            prgm->lclbl_capacity = 0;
+            return;
+        }
+        prgm->lclbl_pc = newpc;
+        prgm->lclbl_capacity = newcapacity;
+    }
+    i = prgm->lclbl_start[key];
+    while (i < prgm->lclbl_start[key + 1] && prgm->lclbl_pc[i] < pc)
+        i++;
+    memmove(prgm->lclbl_pc + i + 1, prgm->lclbl_pc + i, (count - i) * sizeof(int4));
+    prgm->lclbl_pc[i] = pc;
+    for (key++; key <= LCLBL_KEYS; key++)
+        prgm->lclbl_start[key]++;
 }
 
 void rebuild_label_table() {
-    /* TODO -- this is *not* efficient; inserting and deleting ENDs and
-     * global LBLs should not cause every single program to get rescanned!
-     * But, I don't feel like dealing with that at the moment, so just
-     * this ugly brute force approach for now.
+    /* Scans all programs and rebuilds the label table from scratch. This is
+     * only needed after loading programs; store_command(), delete_command(),
+     * and friends update the table incrementally.
      */
     int prgm_index;
     int4 pc;
@@ -2237,19 +2602,8 @@ void rebuild_label_table() {
             if (command == CMD_END
                         || (command == CMD_LBL && argtype == ARGTYPE_STR)) {
                 label_struct *newlabel;
-                if (labels_count == labels_capacity) {
-                    label_struct *newlabels;
-                    int i;
-                    labels_capacity += 50;
-                    newlabels = (label_struct *)
-                                malloc(labels_capacity * sizeof(label_struct));
-                    // TODO - handle memory allocation failure
-                    for (i = 0; i < labels_count; i++)
-                        newlabels[i] = labels[i];
-                    if (labels != NULL)
-                        free(labels);
-                    labels = newlabels;
-                }
+                if (labels_count == labels_capacity)
+                    grow_labels();
                 newlabel = labels + labels_count++;
                 if (command == CMD_END)
                     newlabel->length = 0;
@@ -2265,6 +2619,153 @@ void rebuild_label_table() {
             pc += get_command_length(prgm_index, pc);
         }
     }
+    rebuild_label_hash();
+}
+
+static void grow_labels() {
+    label_struct *newlabels;
+    int i;
+    labels_capacity += 50;
+    newlabels = (label_struct *) malloc(labels_capacity * sizeof(label_struct));
+    // TODO - handle memory allocation failure
+    for (i = 0; i < labels_count; i++)
+        newlabels[i] = labels[i];
+    if (labels != NULL)
+        free(labels);
+    labels = newlabels;
+}
+
+/* Returns the index of the first entry in labels[] that is at or after the
+ * given position; labels[] is always sorted by program, and by pc within
+ * each program.
+ */
+static int find_label_index(int prgm, int4 pc) {
+    int lo = 0, hi = labels_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (labels[mid].prgm < prgm
+                || labels[mid].prgm == prgm && labels[mid].pc < pc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void insert_label(int index, int prgm, int4 pc, const char *name, int length) {
+    int i;
+    if (labels_count == labels_capacity)
+        grow_labels();
+    for (i = labels_count; i > index; i--)
+        labels[i] = labels[i - 1];
+    labels_count++;
+    labels[index].length = length;
+    for (i = 0; i < length; i++)
+        labels[index].name[i] = name[i];
+    labels[index].prgm = prgm;
+    labels[index].pc = pc;
+    label_hash_insert(index);
+}
+
+static void remove_label(int index) {
+    bool rehash = !label_hash_remove(index);
+    int i;
+    for (i = index; i < labels_count - 1; i++)
+        labels[i] = labels[i + 1];
+    labels_count--;
+    if (rehash)
+        rebuild_label_hash();
+}
+
+/* Global label hash table
+ * find_global_label() is called for every XEQ "NAME" and GTO "NAME", and
+ * with many programs loaded, scanning all of labels[] gets expensive. So,
+ * we keep a hash table (see name_table_slot()) that maps each global label
+ * name to the index in labels[] of the *last* label with that name, since
+ * that's the one that XEQ and GTO have to find. ENDs are not included.
+ * If the table can't be allocated, label_hash_capacity is 0, and
+ * find_global_label() falls back on searching labels[].
+ */
+static CORE_STATE int *label_hash = NULL;
+static CORE_STATE int label_hash_capacity = 0;
+static CORE_STATE int label_hash_count = 0;
+
+static const char *label_name_at(int index, int *length) {
+    *length = labels[index].length;
+    return labels[index].name;
+}
+
+static int *label_hash_slot(const char *name, int length) {
+    return name_table_slot(label_hash, label_hash_capacity, name, length,
+                           label_name_at);
+}
+
+static void rebuild_label_hash() {
+    int i;
+    label_hash_count = 0;
+    if (!name_table_reset(&label_hash, &label_hash_capacity, labels_count))
+        return;
+    for (i = 0; i < labels_count; i++) {
+        int *slot;
+        if (labels[i].length == 0)
+            continue;
+        slot = label_hash_slot(labels[i].name, labels[i].length);
+        if (*slot == -1)
+            label_hash_count++;
+        *slot = i;
+    }
+}
+
+/* Called after a label has been inserted into labels[] at 'index'. */
+static void label_hash_insert(int index) {
+    int i;
+    int *slot;
+    if (label_hash_capacity == 0
+            || (label_hash_count + 1) * 2 > label_hash_capacity) {
+        rebuild_label_hash();
+        return;
+    }
+    for (i = 0; i < label_hash_capacity; i++)
+        if (label_hash[i] >= index)
+            label_hash[i]++;
+    if (labels[index].length == 0)
+        return;
+    slot = label_hash_slot(labels[index].name, labels[index].length);
+    if (*slot == -1) {
+        label_hash_count++;
+        *slot = index;
+    } else if (*slot < index)
+        *slot = index;
+}
+
+/* Called before the label at 'index' is removed from labels[]. Returns
+ * false if the hash table can't be updated in place, because a name is
+ * disappearing from it altogether; the caller must then rebuild the
+ * table once the label has been removed.
+ */
+static bool label_hash_remove(int index) {
+    int i;
+    if (label_hash_capacity == 0)
+        return false;
+    if (labels[index].length > 0) {
+        int *slot = label_hash_slot(labels[index].name, labels[index].length);
+        if (*slot == index) {
+            /* This was the visible definition; the previous one with the
+             * same name, if any, takes its place.
+             */
+            for (i = index - 1; i >= 0; i--)
+                if (string_equals(labels[i].name, labels[i].length,
+                                  labels[index].name, labels[index].length))
+                    break;
+            if (i == -1)
+                return false;
+            *slot = i;
+        }
+    }
+    for (i = 0; i < label_hash_capacity; i++)
+        if (label_hash[i] > index)
+            label_hash[i]--;
+    return true;
 }
 
 static void update_label_table(int prgm, int4 pc, int inserted) {
@@ -2277,32 +2778,6 @@ static void update_label_table(int prgm, int4 pc, int inserted) {
     }
 }
 
-static void invalidate_lclbls(int prgm_index, bool force) {
-    prgm_struct *prgm = prgms + prgm_index;
-    if (force || !prgm->lclbl_invalid) {
-        int4 pc2 = 0;
-        while (pc2 < prgm->size) {
-            int command = prgm->text[pc2];
-            int argtype = prgm->text[pc2 + 1];
-            command |= (argtype & 240) << 4;
-            argtype &= 15;
-            if ((command == CMD_GTO || command == CMD_XEQ)
-                    && (argtype == ARGTYPE_NUM || argtype == ARGTYPE_STK
-                                               || argtype == ARGTYPE_LCLBL)) {
-                /* A dest_pc value of -1 signals 'unknown',
-                 * -2 means 'nonexistent', and anything else is
-                 * the pc where the destination label is found.
-                 */
-                int4 pos;
-                for (pos = pc2 + 2; pos < pc2 + 6; pos++)
-                    prgm->text[pos] = 255;
-            }
-            pc2 += get_command_length(prgm_index, pc2);
-        }
-        prgm->lclbl_invalid = 1;
-    }
-}
-
 void delete_command(int4 pc) {
     prgm_struct *prgm = prgms + current_prgm;
     int command = prgm->text[pc];
@@ -2321,6 +2796,14 @@ void delete_command(int4 pc) {
             return;
         nextprgm = prgm + 1;
         prgm->size -= 2;
+        remove_label(find_label_index(current_prgm, prgm->size));
+        for (int i = 0; i < labels_count; i++) {
+            if (labels[i].prgm == current_prgm + 1) {
+                labels[i].prgm = current_prgm;
+                labels[i].pc += prgm->size;
+            } else if (labels[i].prgm > current_prgm + 1)
+                labels[i].prgm--;
+        }
         newsize = prgm->size + nextprgm->size;
         if (newsize > prgm->capacity) {
             int4 newcapacity = (newsize + 511) & ~511;
@@ -2335,11 +2818,11 @@ void delete_command(int4 pc) {
         for (pos = 0; pos < nextprgm->size; pos++)
             prgm->text[prgm->size++] = nextprgm->text[pos];
         free(nextprgm->text);
+        free_prgm_caches(nextprgm);
         for (pos = current_prgm + 1; pos < prgms_count - 1; pos++)
             prgms[pos] = prgms[pos + 1];
         prgms_count--;
-        rebuild_label_table();
-        invalidate_lclbls(current_prgm, true);
+        free_prgm_caches(prgm);
         clear_all_rtns();
         draw_varmenu();
         return;
@@ -2349,10 +2832,11 @@ void delete_command(int4 pc) {
         prgm->text[pos] = prgm->text[pos + length];
     prgm->size -= length;
     if (command == CMD_LBL && argtype == ARGTYPE_STR)
-        rebuild_label_table();
-    else
-        update_label_table(current_prgm, pc, -length);
-    invalidate_lclbls(current_prgm, false);
+        remove_label(find_label_index(current_prgm, pc));
+    update_label_table(current_prgm, pc, -length);
+    update_lclbl_table(prgm, pc, -length);
+    line_index_delete(prgm, pc, length);
+    free_decoded_commands(prgm);
     clear_all_rtns();
     draw_varmenu();
 }
@@ -2427,6 +2911,7 @@ void store_command(int4 pc, int command, arg_struct *arg) {
         new_prgm->capacity = (new_prgm->size + 511) & ~511;
         new_prgm->text = (unsigned char *) malloc(new_prgm->capacity);
         // TODO - handle memory allocation failure
+        init_prgm_caches(new_prgm);
         for (i = pc; i < prgm->size; i++)
             new_prgm->text[i - pc] = prgm->text[i];
         current_prgm++;
@@ -2442,9 +2927,18 @@ void store_command(int4 pc, int command, arg_struct *arg) {
         if (flags.f.printer_exists && (flags.f.trace_print || flags.f.normal_print))
             print_program_line(current_prgm - 1, pc);
 
-        rebuild_label_table();
-        invalidate_lclbls(current_prgm, true);
-        invalidate_lclbls(current_prgm - 1, true);
+        /* Labels from the split point onward now belong to the new program */
+        for (i = 0; i < labels_count; i++) {
+            if (labels[i].prgm >= current_prgm)
+                labels[i].prgm++;
+            else if (labels[i].prgm == current_prgm - 1 && labels[i].pc >= pc) {
+                labels[i].prgm = current_prgm;
+                labels[i].pc -= pc;
+            }
+        }
+        insert_label(find_label_index(current_prgm - 1, pc),
+                     current_prgm - 1, pc, NULL, 0);
+        free_prgm_caches(prgm);
         clear_all_rtns();
         draw_varmenu();
         return;
@@ -2513,15 +3007,20 @@ void store_command(int4 pc, int command, arg_struct *arg) {
     for (pos = 0; pos < bufptr; pos++)
         prgm->text[pc + pos] = buf[pos];
     prgm->size += bufptr;
+    line_index_insert(prgm, pc, bufptr);
     if (command != CMD_END && flags.f.printer_exists && (flags.f.trace_print || flags.f.normal_print))
         print_program_line(current_prgm, pc);
     
-    if (command == CMD_END ||
-            (command == CMD_LBL && arg->type == ARGTYPE_STR))
-        rebuild_label_table();
-    else
-        update_label_table(current_prgm, pc, bufptr);
-    invalidate_lclbls(current_prgm, false);
+    update_label_table(current_prgm, pc, bufptr);
+    if (command == CMD_END)
+        insert_label(find_label_index(current_prgm, pc),
+                     current_prgm, pc, NULL, 0);
+    else if (command == CMD_LBL && arg->type == ARGTYPE_STR)
+        insert_label(find_label_index(current_prgm, pc),
+                     current_prgm, pc, arg->val.text, arg->length);
+    update_lclbl_table(prgm, pc, bufptr);
+    add_lclbl(prgm, pc);
+    free_decoded_commands(prgm);
     clear_all_rtns();
     if (!suppress_varmenu_update)
         draw_varmenu();
@@ -2535,11 +3034,100 @@ void store_command_after(int4 *pc, int command, arg_struct *arg) {
     store_command(*pc, command, arg);
 }
 
+static bool build_line_index(int prgm_index) {
+    prgm_struct *prgm = prgms + prgm_index;
+    int4 pc2, count = 0;
+    for (pc2 = 0; pc2 < prgm->size; pc2 += get_command_length(prgm_index, pc2))
+        count++;
+    prgm->line_capacity = count + 64;
+    prgm->line_pc = (int4 *) malloc(prgm->line_capacity * sizeof(int4));
+    if (prgm->line_pc == NULL) {
+        prgm->line_capacity = 0;
+        return false;
+    }
+    count = 0;
+    for (pc2 = 0; pc2 < prgm->size; pc2 += get_command_length(prgm_index, pc2))
+        prgm->line_pc[count++] = pc2;
+    prgm->line_count = count;
+    return true;
+}
+
+/* Returns the index of the first line whose pc is greater than or equal
+ * to the given pc, or line_count if there is no such line.
+ */
+static int4 line_index_search(prgm_struct *prgm, int4 pc) {
+    int4 lo = 0, hi = prgm->line_count;
+    while (lo < hi) {
+        int4 mid = (lo + hi) / 2;
+        if (prgm->line_pc[mid] < pc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Called after a line of 'length' bytes has been inserted at 'pc' */
+static void line_index_insert(prgm_struct *prgm, int4 pc, int4 length) {
+    int4 i, n;
+    if (prgm->line_pc == NULL)
+        return;
+    if (prgm->line_count == prgm->line_capacity) {
+        int4 newcapacity = prgm->line_capacity + 64;
+        int4 *newpc = (int4 *) realloc(prgm->line_pc, newcapacity * sizeof(int4));
+        if (newpc == NULL) {
+            /* Drop the index; pc_line_convert() will try to build
+             * a new one next time it's needed.
+             */
+            free(prgm->line_pc);
+            prgm->line_pc = NULL;
+            prgm->line_count = 0;
+            prgm->line_capacity = 0;
+            return;
+        }
+        prgm->line_pc = newpc;
+        prgm->line_capacity = newcapacity;
+    }
+    n = line_index_search(prgm, pc);
+    for (i = prgm->line_count; i > n; i--)
+        prgm->line_pc[i] = prgm->line_pc[i - 1] + length;
+    prgm->line_pc[n] = pc;
+    prgm->line_count++;
+}
+
+/* Called after 'length' bytes, making up one or more complete lines,
+ * have been deleted at 'pc'
+ */
+static void line_index_delete(prgm_struct *prgm, int4 pc, int4 length) {
+    int4 from, to, i;
+    if (prgm->line_pc == NULL || length == 0)
+        return;
+    from = line_index_search(prgm, pc);
+    to = line_index_search(prgm, pc + length);
+    for (i = to; i < prgm->line_count; i++)
+        prgm->line_pc[i - (to - from)] = prgm->line_pc[i] - length;
+    prgm->line_count -= to - from;
+}
+
 static int pc_line_convert(int4 loc, int loc_is_pc) {
     int4 pc = 0;
     int4 line = 1;
     prgm_struct *prgm = prgms + current_prgm;
 
+    if (prgm->line_pc != NULL || build_line_index(current_prgm)) {
+        if (loc_is_pc) {
+            line = line_index_search(prgm, loc);
+            return line < prgm->line_count ? line + 1 : prgm->line_count;
+        } else {
+            if (loc < 1)
+                return 0;
+            if (loc > prgm->line_count)
+                loc = prgm->line_count;
+            return prgm->line_pc[loc - 1];
+        }
+    }
+
+    /* No memory for the line index; do it the slow way */
     while (1) {
         if (loc_is_pc) {
             if (pc >= loc)
@@ -2570,6 +3158,47 @@ int4 line2pc(int4 line) {
 }
 
 int4 find_local_label(const arg_struct *arg) {
+    /* We search from the current line to the end of the program, and then
+     * wrap around to the beginning, so the label we want is the first one
+     * at or after pc, or else the first one in the program.
+     */
+    prgm_struct *prgm = prgms + current_prgm;
+    int4 orig_pc = pc;
+    int4 first, lo, hi;
+    int key;
+    if (arg->type == ARGTYPE_NUM)
+        key = lclbl_key(arg->type, arg->val.num, 0);
+    else if (arg->type == ARGTYPE_STK)
+        key = lclbl_key(arg->type, 0, arg->val.stk);
+    else if (arg->type == ARGTYPE_LCLBL)
+        key = lclbl_key(arg->type, 0, arg->val.lclbl);
+    else
+        key = -1;
+    if (key == -1
+            || prgm->lclbl_start == NULL && !build_lclbl_table(current_prgm))
+        return scan_for_local_label(arg);
+
+    first = lo = prgm->lclbl_start[key];
+    hi = prgm->lclbl_start[key + 1];
+    if (lo == hi)
+        return -2;
+    if (hi - lo == 1)
+        return prgm->lclbl_pc[lo];
+    if (orig_pc == -1)
+        orig_pc = 0;
+    while (lo < hi) {
+        int4 mid = (lo + hi) / 2;
+        if (prgm->lclbl_pc[mid] < orig_pc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == prgm->lclbl_start[key + 1])
+        lo = first;
+    return prgm->lclbl_pc[lo];
+}
+
+static int4 scan_for_local_label(const arg_struct *arg) {
     int4 orig_pc = pc;
     int4 search_pc;
     int wrapped = 0;
@@ -2608,7 +3237,7 @@ int4 find_local_label(const arg_struct *arg) {
                 // Allow GTO ST T and GTO 112
                 char stk = prgm->text[search_pc + 2];
                 if (arg->type == ARGTYPE_STK) {
-                    if (stk = arg->val.stk)
+                    if (stk == arg->val.stk)
                         return search_pc;
                 } else if (arg->type == ARGTYPE_NUM) {
                     int num = 0;
@@ -2634,10 +3263,10 @@ int4 find_local_label(const arg_struct *arg) {
     return -2;
 }
 
-int find_global_label(const arg_struct *arg, int *prgm, int4 *pc) {
+static int find_global_label_index(const char *name, int namelen) {
     int i;
-    const char *name = arg->val.text;
-    int namelen = arg->length;
+    if (namelen > 0 && label_hash_capacity > 0)
+        return *label_hash_slot(name, namelen);
     for (i = labels_count - 1; i >= 0; i--) {
         int j;
         char *labelname;
@@ -2647,12 +3276,19 @@ int find_global_label(const arg_struct *arg, int *prgm, int4 *pc) {
         for (j = 0; j < namelen; j++)
             if (labelname[j] != name[j])
                 goto nomatch;
-        *prgm = labels[i].prgm;
-        *pc = labels[i].pc;
-        return 1;
+        return i;
         nomatch:;
     }
-    return 0;
+    return -1;
+}
+
+int find_global_label(const arg_struct *arg, int *prgm, int4 *pc) {
+    int i = find_global_label_index(arg->val.text, arg->length);
+    if (i == -1)
+        return 0;
+    *prgm = labels[i].prgm;
+    *pc = labels[i].pc;
+    return 1;
 }
 
 int push_rtn_addr(int prgm, int4 pc) {
@@ -2788,6 +3424,7 @@ static void remove_locals() {
         from++;
     }
     vars_count -= from - to;
+    rebuild_var_index();
     update_catalog();
 }
 
@@ -2881,6 +3518,21 @@ int get_rtn_level() {
     return rtn_level;
 }
 
+/* Frees the RTN stack and the label hash table. Only for use by
+ * core_cleanup(); core_init() allocates them again.
+ */
+void free_rtn_stack_and_label_hash() {
+    free(rtn_stack);
+    rtn_stack = NULL;
+    rtn_stack_capacity = 0;
+    rtn_sp = 0;
+    rtn_level = 0;
+    free(label_hash);
+    label_hash = NULL;
+    label_hash_capacity = 0;
+    label_hash_count = 0;
+}
+
 bool solve_active() {
     return rtn_solve_active;
 }
@@ -3299,6 +3951,7 @@ static bool load_state2(int4 ver, bool *clear, bool *too_new) {
 
     state_bool_is_int = ver < 9;
     state_is_portable = ver >= 26;
+    state_long_strings = ver >= 30;
 
     if (state_is_portable) {
         int4 magic;
@@ -3666,6 +4319,9 @@ void hard_reset(int reason) {
     reg_z = new_real(0);
     reg_t = new_real(0);
     reg_lastx = new_real(0);
+    clear_bigstack();
+    mode_bigstack = false;
+    clear_sigma_err();
 
     /* Clear alpha */
     reg_alpha_length = 0;
@@ -3699,6 +4355,9 @@ void hard_reset(int reason) {
         labels_capacity = 0;
         labels_count = 0;
     }
+    /* A failed load_state() may have left the hash pointing into the
+     * labels we just freed */
+    rebuild_label_hash();
     goto_dot_dot(false);
 
     pending_command = CMD_NONE;
@@ -3905,7 +4564,7 @@ static bool convert_programs(bool *clear_stack) {
         pc = 0;
         int4 oldpc = 0;
         prgm_struct *prgm = prgms + i;
-        prgm->lclbl_invalid = 1;
+        free_prgm_caches(prgm);
         while (true) {
             while (mod_count >= 0 && current_prgm == mod_prgm[mod_count]
                                   && oldpc >= mod_pc[mod_count]) {
@@ -4097,12 +4756,134 @@ bool off_enabled() {
         return false;
     vartype_string *str = (vartype_string *) reg_x;
     off_enable_flag = str->length == 6
-                      && str->text[0] == 'Y'
-                      && str->text[1] == 'E'
-                      && str->text[2] == 'S'
-                      && str->text[3] == 'O'
-                      && str->text[4] == 'F'
-                      && str->text[5] == 'F';
+                      && str->t.buf[0] == 'Y'
+                      && str->t.buf[1] == 'E'
+                      && str->t.buf[2] == 'S'
+                      && str->t.buf[3] == 'O'
+                      && str->t.buf[4] == 'F'
+                      && str->t.buf[5] == 'F';
     return off_enable_flag;
 }
 #endif
+
+void visit_globals_state(state_visitor visit, void *cd) {
+    VISIT_STATE(gfile);
+    VISIT_STATE(reg_x);
+    VISIT_STATE(reg_y);
+    VISIT_STATE(reg_z);
+    VISIT_STATE(reg_t);
+    VISIT_STATE(reg_lastx);
+    VISIT_STATE(bigstack);
+    VISIT_STATE(bigstack_depth);
+    VISIT_STATE(bigstack_capacity);
+    VISIT_STATE(reg_alpha_length);
+    VISIT_STATE(reg_alpha);
+    VISIT_STATE(flags);
+    VISIT_STATE(vars_capacity);
+    VISIT_STATE(vars_count);
+    VISIT_STATE(vars);
+    VISIT_STATE(vars_generation);
+    VISIT_STATE(prgms_capacity);
+    VISIT_STATE(prgms_count);
+    VISIT_STATE(prgms);
+    VISIT_STATE(labels_capacity);
+    VISIT_STATE(labels_count);
+    VISIT_STATE(labels);
+    VISIT_STATE(current_prgm);
+    VISIT_STATE(pc);
+    VISIT_STATE(prgm_highlight_row);
+    VISIT_STATE(varmenu_length);
+    VISIT_STATE(varmenu);
+    VISIT_STATE(varmenu_rows);
+    VISIT_STATE(varmenu_row);
+    VISIT_STATE(varmenu_labellength);
+    VISIT_STATE(varmenu_labeltext);
+    VISIT_STATE(varmenu_role);
+    VISIT_STATE(mode_clall);
+    VISIT_STATE(mode_interruptible);
+    VISIT_STATE(mode_stoppable);
+    VISIT_STATE(mode_command_entry);
+    VISIT_STATE(mode_number_entry);
+    VISIT_STATE(mode_alpha_entry);
+    VISIT_STATE(mode_shift);
+    VISIT_STATE(mode_appmenu);
+    VISIT_STATE(mode_plainmenu);
+    VISIT_STATE(mode_plainmenu_sticky);
+    VISIT_STATE(mode_transientmenu);
+    VISIT_STATE(mode_alphamenu);
+    VISIT_STATE(mode_commandmenu);
+    VISIT_STATE(mode_running);
+    VISIT_STATE(mode_getkey);
+    VISIT_STATE(mode_getkey1);
+    VISIT_STATE(mode_pause);
+    VISIT_STATE(mode_disable_stack_lift);
+    VISIT_STATE(mode_varmenu);
+    VISIT_STATE(mode_updown);
+    VISIT_STATE(mode_sigma_reg);
+    VISIT_STATE(mode_goose);
+    VISIT_STATE(mode_time_clktd);
+    VISIT_STATE(mode_time_clk24);
+    VISIT_STATE(mode_wsize);
+    VISIT_STATE(mode_bigstack);
+    VISIT_STATE(entered_number);
+    VISIT_STATE(entered_string_length);
+    VISIT_STATE(entered_string);
+    VISIT_STATE(pending_command);
+    VISIT_STATE(pending_command_arg);
+    VISIT_STATE(xeq_invisible);
+    VISIT_STATE(incomplete_command);
+    VISIT_STATE(incomplete_ind);
+    VISIT_STATE(incomplete_alpha);
+    VISIT_STATE(incomplete_length);
+    VISIT_STATE(incomplete_maxdigits);
+    VISIT_STATE(incomplete_argtype);
+    VISIT_STATE(incomplete_num);
+    VISIT_STATE(incomplete_str);
+    VISIT_STATE(incomplete_saved_pc);
+    VISIT_STATE(incomplete_saved_highlight_row);
+    VISIT_STATE(cmdline);
+    VISIT_STATE(cmdline_length);
+    VISIT_STATE(cmdline_row);
+    VISIT_STATE(matedit_mode);
+    VISIT_STATE(matedit_name);
+    VISIT_STATE(matedit_length);
+    VISIT_STATE(matedit_x);
+    VISIT_STATE(matedit_i);
+    VISIT_STATE(matedit_j);
+    VISIT_STATE(matedit_prev_appmenu);
+    VISIT_STATE(input_name);
+    VISIT_STATE(input_length);
+    VISIT_STATE(input_arg);
+    VISIT_STATE(baseapp);
+    VISIT_STATE(random_number_low);
+    VISIT_STATE(random_number_high);
+    VISIT_STATE(deferred_print);
+    VISIT_STATE(keybuf_head);
+    VISIT_STATE(keybuf_tail);
+    VISIT_STATE(keybuf);
+    VISIT_STATE(remove_program_catalog);
+    VISIT_STATE(state_file_number_format);
+    VISIT_STATE(no_keystrokes_yet);
+    VISIT_STATE(state_bool_is_int);
+    VISIT_STATE(state_is_portable);
+    VISIT_STATE(state_long_strings);
+    VISIT_STATE(rtn_sp);
+    VISIT_STATE(rtn_stack_capacity);
+    VISIT_STATE(rtn_stack);
+    VISIT_STATE(rtn_level);
+    VISIT_STATE(rtn_level_0_has_matrix_entry);
+    VISIT_STATE(rtn_stop_level);
+    VISIT_STATE(rtn_solve_active);
+    VISIT_STATE(rtn_integ_active);
+#ifdef IPHONE
+    VISIT_STATE(off_enable_flag);
+#endif
+    VISIT_STATE(array_count);
+    VISIT_STATE(array_list_capacity);
+    VISIT_STATE(array_list);
+    VISIT_STATE(bug_mode);
+    VISIT_STATE(suppress_varmenu_update);
+    VISIT_STATE(label_hash);
+    VISIT_STATE(label_hash_capacity);
+    VISIT_STATE(label_hash_count);
+}
@@ -25,7 +25,7 @@
 #include "core_phloat.h"
 #include "core_tables.h"
 
-extern FILE *gfile;
+extern CORE_STATE FILE *gfile;
 
 /**********/
 /* Errors */
@@ -65,6 +65,7 @@ extern FILE *gfile;
 #define ERR_NO_VARIABLES           31
 #define ERR_SUSPICIOUS_OFF         32
 #define ERR_RTN_STACK_FULL         33
+#define ERR_STACK_DEPTH_ERROR      34
 
 typedef struct {
     const char *text;
@@ -234,12 +235,43 @@ typedef struct {
 } vartype_complex;
 
 
+/* The LU decomposition of a square matrix, as computed by lu_decomp_r() or
+ * lu_decomp_c(), kept with the matrix data so that dividing by, inverting, or
+ * taking the determinant of the same matrix again can skip the decomposition.
+ * singularmatrix is the matrix_singularmatrix setting it was computed with;
+ * see core_linalg1.cc. Anything that modifies matrix data in place must call
+ * invalidate_lu() first; disentangle() and dimension_array_ref() do this.
+ * Only the most recent decomposition is kept (see attach_lu()), so a program
+ * that works with many matrices doesn't end up with a second copy of each;
+ * owner points to the lu field of the matrix data that holds it.
+ */
+typedef struct lu_cache {
+    struct lu_cache **owner;
+    vartype *lu;
+    int4 *perm;
+    phloat det_re, det_im;
+    bool singularmatrix;
+} lu_cache;
+
 typedef struct {
     int refcount;
     phloat *data;
+    /* is_string[i] is nonzero if data[i] holds a string. Most matrices never
+     * contain any strings, so this is only allocated when the first string is
+     * stored in the matrix; NULL means there are none. Use is_string_at() to
+     * read it, and alloc_is_string() before setting any element to nonzero.
+     * Strings of up to 6 characters are stored in data[i] itself, and have
+     * is_string[i] == 1; longer ones are stored in a separate, reference-
+     * counted block, which data[i] points to, and have is_string[i] == 2.
+     * See get_matrix_string() and friends in core_variables.h.
+     */
     char *is_string;
+    lu_cache *lu;
 } realmatrix_data;
 
+#define is_string_at(array, i) \
+        ((array)->is_string == NULL ? 0 : (array)->is_string[i])
+
 typedef struct {
     int type;
     int4 rows;
@@ -251,6 +283,7 @@ typedef struct {
 typedef struct {
     int refcount;
     phloat *data;
+    lu_cache *lu;
 } complexmatrix_data;
 
 typedef struct {
@@ -261,24 +294,39 @@ typedef struct {
 } vartype_complexmatrix;
 
 
+/* Strings of up to SSLENV characters are stored in the vartype itself; longer
+ * ones are stored in a separate block, which t.ptr points to. Use TXT() to get
+ * at the text either way.
+ */
+#define SSLENV 8
+
 typedef struct {
     int type;
-    int length;
-    char text[6];
+    int4 length;
+    union {
+        char buf[SSLENV];
+        char *ptr;
+    } t;
 } vartype_string;
 
+#define TXT(s) ((s)->length > SSLENV ? (s)->t.ptr : (s)->t.buf)
+
 /******************/
 /* Emulator state */
 /******************/
 
 /* Registers */
-extern vartype *reg_x;
-extern vartype *reg_y;
-extern vartype *reg_z;
-extern vartype *reg_t;
-extern vartype *reg_lastx;
-extern int reg_alpha_length;
-extern char reg_alpha[44];
+extern CORE_STATE vartype *reg_x;
+extern CORE_STATE vartype *reg_y;
+extern CORE_STATE vartype *reg_z;
+extern CORE_STATE vartype *reg_t;
+extern CORE_STATE vartype *reg_lastx;
+/* Levels 5 and up, in big-stack mode; see push_t() in core_helpers.cc */
+extern CORE_STATE vartype **bigstack;
+extern CORE_STATE int4 bigstack_depth;
+extern CORE_STATE int4 bigstack_capacity;
+extern CORE_STATE int reg_alpha_length;
+extern CORE_STATE char reg_alpha[44];
 
 /* FLAGS
  * Note: flags whose names start with VIRTUAL_ are named here for reference
@@ -365,7 +413,7 @@ typedef union {
         char f95; char f96; char f97; char f98; char f99;
     } f;
 } flags_struct;
-extern flags_struct flags;
+extern CORE_STATE flags_struct flags;
 extern const char *virtual_flags;
 
 /* Variables */
@@ -377,16 +425,52 @@ typedef struct {
     bool hiding;
     vartype *value;
 } var_struct;
-extern int vars_capacity;
-extern int vars_count;
-extern var_struct *vars;
+extern CORE_STATE int vars_capacity;
+extern CORE_STATE int vars_count;
+extern CORE_STATE var_struct *vars;
+/* Incremented whenever entries in vars[] are created, removed, moved, or
+ * hidden; used to tell when cached variable indexes have gone stale. */
+extern CORE_STATE int4 vars_generation;
 
 /* Programs */
+typedef struct {
+    int cmd;
+    int4 next_pc;
+    arg_struct arg;
+    /* For commands taking a named variable: index of that variable in
+     * vars[], as of var_generation; see get_next_command(). */
+    int var_index;
+    int4 var_generation;
+} decoded_command;
 typedef struct {
     int4 capacity;
     int4 size;
-    int lclbl_invalid;
     unsigned char *text;
+    /* Pre-decoded instructions, used by get_next_command() when running.
+     * Built the first time the program is executed, and thrown away
+     * whenever the program is edited. 'decoded_index' maps a pc to its
+     * entry in 'decoded', or -1 for offsets that aren't the start of a line.
+     */
+    decoded_command *decoded;
+    int4 *decoded_index;
+    /* Local label table, used by find_local_label(). Built the first time
+     * a local label is searched for, and kept up to date when lines are
+     * inserted or deleted. The pcs of all local labels are in 'lclbl_pc',
+     * grouped by label (see lclbl_key()), and in ascending order within
+     * each group; the group for key k starts at lclbl_pc[lclbl_start[k]]
+     * and ends just before lclbl_pc[lclbl_start[k + 1]].
+     */
+    int4 *lclbl_start;
+    int4 *lclbl_pc;
+    int4 lclbl_capacity;
+    /* Line index, used by pc2line() and line2pc(). Built the first time
+     * either is called, and kept up to date when lines are inserted or
+     * deleted. line_pc[n] is the pc of line n + 1; the last entry is the
+     * program's END.
+     */
+    int4 *line_pc;
+    int4 line_count;
+    int4 line_capacity;
 } prgm_struct;
 typedef struct {
     int4 capacity;
@@ -394,82 +478,83 @@ typedef struct {
     int lclbl_invalid;
     int4 text;
 } prgm_struct_32bit;
-extern int prgms_capacity;
-extern int prgms_count;
-extern prgm_struct *prgms;
+extern CORE_STATE int prgms_capacity;
+extern CORE_STATE int prgms_count;
+extern CORE_STATE prgm_struct *prgms;
 typedef struct {
     unsigned char length;
     char name[7];
     int prgm;
     int4 pc;
 } label_struct;
-extern int labels_capacity;
-extern int labels_count;
-extern label_struct *labels;
+extern CORE_STATE int labels_capacity;
+extern CORE_STATE int labels_count;
+extern CORE_STATE label_struct *labels;
 
-extern int current_prgm;
-extern int4 pc;
-extern int prgm_highlight_row;
+extern CORE_STATE int current_prgm;
+extern CORE_STATE int4 pc;
+extern CORE_STATE int prgm_highlight_row;
 
-extern int varmenu_length;
-extern char varmenu[7];
-extern int varmenu_rows;
-extern int varmenu_row;
-extern int varmenu_labellength[6];
-extern char varmenu_labeltext[6][7];
-extern int varmenu_role;
+extern CORE_STATE int varmenu_length;
+extern CORE_STATE char varmenu[7];
+extern CORE_STATE int varmenu_rows;
+extern CORE_STATE int varmenu_row;
+extern CORE_STATE int varmenu_labellength[6];
+extern CORE_STATE char varmenu_labeltext[6][7];
+extern CORE_STATE int varmenu_role;
 
 
 /****************/
 /* More globals */
 /****************/
 
-extern bool mode_clall;
-extern int (*mode_interruptible)(int);
-extern bool mode_stoppable;
-extern bool mode_command_entry;
-extern bool mode_number_entry;
-extern bool mode_alpha_entry;
-extern bool mode_shift;
-extern int mode_appmenu;
-extern int mode_plainmenu;
-extern bool mode_plainmenu_sticky;
-extern int mode_transientmenu;
-extern int mode_alphamenu;
-extern int mode_commandmenu;
-extern bool mode_running;
-extern bool mode_getkey;
-extern bool mode_getkey1;
-extern bool mode_pause;
-extern bool mode_disable_stack_lift;
-extern bool mode_varmenu;
-extern bool mode_updown;
-extern int4 mode_sigma_reg;
-extern int mode_goose;
-extern bool mode_time_clktd;
-extern bool mode_time_clk24;
-extern int mode_wsize;
-
-extern phloat entered_number;
-extern int entered_string_length;
-extern char entered_string[15];
-
-extern int pending_command;
-extern arg_struct pending_command_arg;
-extern int xeq_invisible;
+extern CORE_STATE bool mode_clall;
+extern CORE_STATE int (*mode_interruptible)(int);
+extern CORE_STATE bool mode_stoppable;
+extern CORE_STATE bool mode_command_entry;
+extern CORE_STATE bool mode_number_entry;
+extern CORE_STATE bool mode_alpha_entry;
+extern CORE_STATE bool mode_shift;
+extern CORE_STATE int mode_appmenu;
+extern CORE_STATE int mode_plainmenu;
+extern CORE_STATE bool mode_plainmenu_sticky;
+extern CORE_STATE int mode_transientmenu;
+extern CORE_STATE int mode_alphamenu;
+extern CORE_STATE int mode_commandmenu;
+extern CORE_STATE bool mode_running;
+extern CORE_STATE bool mode_getkey;
+extern CORE_STATE bool mode_getkey1;
+extern CORE_STATE bool mode_pause;
+extern CORE_STATE bool mode_disable_stack_lift;
+extern CORE_STATE bool mode_varmenu;
+extern CORE_STATE bool mode_updown;
+extern CORE_STATE int4 mode_sigma_reg;
+extern CORE_STATE int mode_goose;
+extern CORE_STATE bool mode_time_clktd;
+extern CORE_STATE bool mode_time_clk24;
+extern CORE_STATE int mode_wsize;
+extern CORE_STATE bool mode_bigstack;
+
+extern CORE_STATE phloat entered_number;
+extern CORE_STATE int entered_string_length;
+extern CORE_STATE char entered_string[15];
+
+extern CORE_STATE int pending_command;
+extern CORE_STATE arg_struct pending_command_arg;
+extern CORE_STATE int xeq_invisible;
 
 /* Multi-keystroke commands -- edit state */
 /* Relevant when mode_command_entry != 0 */
-extern int incomplete_command;
-extern int incomplete_ind;
-extern int incomplete_alpha;
-extern int incomplete_length;
-extern int incomplete_maxdigits;
-extern int incomplete_argtype;
-extern int incomplete_num;
-extern char incomplete_str[7];
-extern int4 incomplete_saved_pc;
-extern int4 incomplete_saved_highlight_row;
+extern CORE_STATE int incomplete_command;
+extern CORE_STATE int incomplete_ind;
+extern CORE_STATE int incomplete_alpha;
+extern CORE_STATE int incomplete_length;
+extern CORE_STATE int incomplete_maxdigits;
+extern CORE_STATE int incomplete_argtype;
+extern CORE_STATE int incomplete_num;
+extern CORE_STATE char incomplete_str[7];
+extern CORE_STATE int4 incomplete_saved_pc;
+extern CORE_STATE int4 incomplete_saved_highlight_row;
 
 #define CATSECT_TOP 0
 #define CATSECT_FCN 1
@@ -485,49 +570,68 @@ extern int4 incomplete_saved_highlight_row;
 #define CATSECT_PGM_INTEG 11
 
 /* Command line handling temporaries */
-extern char cmdline[100];
-extern int cmdline_length;
-extern int cmdline_row;
+extern CORE_STATE char cmdline[100];
+extern CORE_STATE int cmdline_length;
+extern CORE_STATE int cmdline_row;
 
 /* Matrix editor / matrix indexing */
-extern int matedit_mode; /* 0=off, 1=index, 2=edit, 3=editn */
-extern char matedit_name[7];
-extern int matedit_length;
-extern vartype *matedit_x;
-extern int4 matedit_i;
-extern int4 matedit_j;
-extern int matedit_prev_appmenu;
+extern CORE_STATE int matedit_mode; /* 0=off, 1=index, 2=edit, 3=editn */
+extern CORE_STATE char matedit_name[7];
+extern CORE_STATE int matedit_length;
+extern CORE_STATE vartype *matedit_x;
+extern CORE_STATE int4 matedit_i;
+extern CORE_STATE int4 matedit_j;
+extern CORE_STATE int matedit_prev_appmenu;
 
 /* INPUT */
-extern char input_name[11];
-extern int input_length;
-extern arg_struct input_arg;
+extern CORE_STATE char input_name[11];
+extern CORE_STATE int input_length;
+extern CORE_STATE arg_struct input_arg;
 
 /* BASE application */
-extern int baseapp;
+extern CORE_STATE int baseapp;
 
 /* Random number generator */
-extern int8 random_number_low, random_number_high;
+extern CORE_STATE int8 random_number_low, random_number_high;
 
 /* NORM & TRACE mode: number waiting to be printed */
-extern int deferred_print;
+extern CORE_STATE int deferred_print;
 
 /* Keystroke buffer - holds keystrokes received while
  * there is a program running.
  */
-extern int keybuf_head;
-extern int keybuf_tail;
-extern int keybuf[16];
+extern CORE_STATE int keybuf_head;
+extern CORE_STATE int keybuf_tail;
+extern CORE_STATE int keybuf[16];
 
-extern int remove_program_catalog;
+extern CORE_STATE int remove_program_catalog;
 
 #define NUMBER_FORMAT_BINARY 0
 #define NUMBER_FORMAT_BCD20_OLD 1
 #define NUMBER_FORMAT_BCD20_NEW 2
 #define NUMBER_FORMAT_BID128 3
-extern int state_file_number_format;
+extern CORE_STATE int state_file_number_format;
+
+extern CORE_STATE bool no_keystrokes_yet;
+
+
+/*********************/
+/* Calculator state  */
+/*********************/
+
+/* Everything above, and the file-scope state of the other core modules,
+ * belongs to one calculator. Each module that has such state provides a
+ * visit_*_state() function that passes the address and size of each of its
+ * variables to a state_visitor; core_main.cc uses these to swap calculators
+ * in and out when the shell switches between core contexts.
+ * When adding a global or static variable that is part of the calculator's
+ * state, remember to add it to its module's visit function as well; constant
+ * tables and scratch buffers don't need to be visited.
+ */
+typedef void (*state_visitor)(void *addr, size_t size, void *cd);
+#define VISIT_STATE(x) visit(&(x), sizeof(x), cd)
 
-extern bool no_keystrokes_yet;
+void visit_globals_state(state_visitor visit, void *cd);
 
 
 /*********************/
@@ -560,11 +664,12 @@ void pop_rtn_addr(int *prgm, int4 *pc, bool *stop);
 void pop_indexed_matrix(const char *name, int namelen);
 void clear_all_rtns();
 int get_rtn_level();
+void free_rtn_stack_and_label_hash();
 bool solve_active();
 bool integ_active();
 bool unwind_stack_until_solve();
 
-extern bool state_is_portable;
+extern CORE_STATE bool state_is_portable;
 
 bool read_bool(bool *b);
 bool write_bool(bool b);
@@ -17,6 +17,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "core_helpers.h"
 #include "core_commands2.h"
@@ -42,15 +43,16 @@ int resolve_ind_arg(arg_struct *arg) {
                 int4 num = arg->val.num;
                 if (num >= size)
                     return ERR_SIZE_ERROR;
-                if (rm->array->is_string[num]) {
-                    phloat *d = &rm->array->data[num];
-                    int len = phloat_length(*d);
-                    if (len == 0)
+                if (is_string_at(rm->array, num)) {
+                    const char *text;
+                    int4 len;
+                    get_matrix_string(rm->array, num, &text, &len);
+                    if (len == 0 || len > 7)
                         return ERR_RESTRICTED_OPERATION;
                     arg->type = ARGTYPE_STR;
                     arg->length = len;
                     for (int i = 0; i < len; i++)
-                        arg->val.text[i] = phloat_text(*d)[i];
+                        arg->val.text[i] = text[i];
                 } else {
                     phloat x = rm->array->data[num];
                     if (x < 0)
@@ -75,7 +77,10 @@ int resolve_ind_arg(arg_struct *arg) {
             goto finish_resolve;
         }
         case ARGTYPE_IND_STR: {
-            v = recall_var(arg->val.text, arg->length);
+            v = recall_arg_var(arg);
+            /* The cached index, if any, is for the variable we just
+             * recalled, not for the one the resolved argument names */
+            arg->target = -1;
             if (v == NULL)
                 return ERR_NONEXISTENT;
             finish_resolve:
@@ -91,12 +96,12 @@ int resolve_ind_arg(arg_struct *arg) {
                 return ERR_NONE;
             } else if (v->type == TYPE_STRING) {
                 vartype_string *s = (vartype_string *) v;
-                if (s->length == 0)
+                if (s->length == 0 || s->length > 7)
                     return ERR_RESTRICTED_OPERATION;
                 arg->type = ARGTYPE_STR;
                 arg->length = s->length;
                 for (int i = 0; i < s->length; i++)
-                    arg->val.text[i] = s->text[i];
+                    arg->val.text[i] = TXT(s)[i];
                 return ERR_NONE;
             } else
                 return ERR_INVALID_TYPE;
@@ -132,39 +137,101 @@ int is_pure_real(const vartype *matrix) {
     rm = (vartype_realmatrix *) matrix;
     size = rm->rows * rm->columns;
     for (i = 0; i < size; i++)
-        if (rm->array->is_string[i])
+        if (is_string_at(rm->array, i))
             return 0;
     return 1;
 }
 
-void recall_result(vartype *v) {
+/* In big-stack mode, the levels above T live in bigstack[], with the
+ * deepest level at index 0, so lifting the stack pushes T onto the end of
+ * that array, and dropping it pops T back off; both are O(1).
+ * Commands that lift the stack should call ensure_stack_capacity() before
+ * they change anything, so that running out of memory leaves the stack
+ * intact; push_t() will still try to grow the array itself, and only
+ * discards T if that fails.
+ */
+bool ensure_stack_capacity(int4 n) {
+    if (!mode_bigstack || bigstack_depth + n <= bigstack_capacity)
+        return true;
+    int4 newcap = bigstack_capacity == 0 ? 16 : bigstack_capacity * 2;
+    while (newcap < bigstack_depth + n)
+        newcap *= 2;
+    vartype **newstack = (vartype **)
+                        realloc(bigstack, newcap * sizeof(vartype *));
+    if (newstack == NULL)
+        return false;
+    bigstack = newstack;
+    bigstack_capacity = newcap;
+    return true;
+}
+
+void push_t() {
+    if (mode_bigstack && ensure_stack_capacity(1))
+        bigstack[bigstack_depth++] = reg_t;
+    else
+        free_vartype(reg_t);
+}
+
+vartype *drop_t() {
+    /* Returns the value that should move down from T into Z. With nothing
+     * above T, that is a copy of T, like on the HP-42S; otherwise, it is T
+     * itself, and T is refilled from level 5.
+     */
+    if (bigstack_depth == 0)
+        return dup_vartype(reg_t);
+    vartype *v = reg_t;
+    reg_t = bigstack[--bigstack_depth];
+    return v;
+}
+
+void clear_bigstack() {
+    while (bigstack_depth > 0)
+        free_vartype(bigstack[--bigstack_depth]);
+    free(bigstack);
+    bigstack = NULL;
+    bigstack_capacity = 0;
+}
+
+int recall_result(vartype *v) {
     if (flags.f.stack_lift_disable)
         free_vartype(reg_x);
     else {
-        free_vartype(reg_t);
+        if (!ensure_stack_capacity(1)) {
+            free_vartype(v);
+            return ERR_INSUFFICIENT_MEMORY;
+        }
+        push_t();
         reg_t = reg_z;
         reg_z = reg_y;
         reg_y = reg_x;
     }
     reg_x = v;
     print_trace();
+    return ERR_NONE;
 }
 
-void recall_two_results(vartype *x, vartype *y) {
+int recall_two_results(vartype *x, vartype *y) {
+    if (!ensure_stack_capacity(2)) {
+        free_vartype(x);
+        free_vartype(y);
+        return ERR_INSUFFICIENT_MEMORY;
+    }
     if (flags.f.stack_lift_disable) {
-        free_vartype(reg_t);
+        push_t();
         free_vartype(reg_x);
         reg_t = reg_z;
         reg_z = reg_y;
     } else {
-        free_vartype(reg_t);
-        free_vartype(reg_z);
+        push_t();
+        reg_t = reg_z;
+        push_t();
         reg_t = reg_y;
         reg_z = reg_x;
     }
     reg_y = y;
     reg_x = x;
     print_trace();
+    return ERR_NONE;
 }
 
 void unary_result(vartype *x) {
@@ -180,7 +247,7 @@ void binary_result(vartype *x) {
     reg_x = x;
     free_vartype(reg_y);
     reg_y = reg_z;
-    reg_z = dup_vartype(reg_t);
+    reg_z = drop_t();
     print_trace();
 }
 
@@ -249,8 +316,61 @@ bool string_equals(const char *s1, int s1len, const char *s2, int s2len) {
     return true;
 }
 
+static uint4 name_hash(const char *name, int length) {
+    /* FNV-1a */
+    uint4 h = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        h ^= (unsigned char) name[i];
+        h *= 16777619;
+    }
+    return h;
+}
+
+/* Makes *table big enough for 'entries' names, at most half full, and
+ * empties it. Returns false, with *capacity set to 0, if the table can't be
+ * allocated.
+ */
+bool name_table_reset(int **table, int *capacity, int entries) {
+    int newcap = 64;
+    int i;
+    while (newcap < entries * 2)
+        newcap <<= 1;
+    if (newcap != *capacity) {
+        free(*table);
+        *table = (int *) malloc(newcap * sizeof(int));
+        if (*table == NULL) {
+            *capacity = 0;
+            return false;
+        }
+        *capacity = newcap;
+    }
+    for (i = 0; i < newcap; i++)
+        (*table)[i] = -1;
+    return true;
+}
+
+/* Returns the slot containing the given name, or the empty slot where it
+ * would go if the name isn't in the table.
+ */
+int *name_table_slot(int *table, int capacity, const char *name, int length,
+                     name_at_func name_at) {
+    int mask = capacity - 1;
+    int h = name_hash(name, length) & mask;
+    while (true) {
+        int *slot = table + h;
+        int len;
+        const char *n;
+        if (*slot == -1)
+            return slot;
+        n = name_at(*slot, &len);
+        if (string_equals(n, len, name, length))
+            return slot;
+        h = (h + 1) & mask;
+    }
+}
+
 #if (!defined(ANDROID) && !defined(IPHONE))
-static bool always_on = false;
+static CORE_STATE bool always_on = false;
 int shell_always_on(int ao) {
     int ret = always_on ? 1 : 0;
     if (ao != -1)
@@ -893,6 +1013,126 @@ phloat cos_grad(phloat x) {
     return sin_or_cos_grad(x, false);
 }
 
+/* Compensated summation: *sum + *err is the exact sum of everything added so
+ * far, give or take a rounding error or two in *err. This is Knuth's TwoSum,
+ * which, unlike Kahan's original, doesn't care which operand is larger.
+ */
+void compensated_add(phloat *sum, phloat *err, phloat x) {
+    phloat s = *sum + x;
+    phloat z = s - *sum;
+    *err += (*sum - (s - z)) + (x - z);
+    *sum = s;
+}
+
+/* An exact power of the radix close to 1 / m */
+static phloat unit_scale(phloat m) {
+#ifdef BCD_MATH
+    return pow(phloat(10), -floor(log10(m)));
+#else
+    return ldexp(1.0, -ilogb(m));
+#endif
+}
+
+static phloat max_abs(const phloat *x, int inc, int4 n) {
+    phloat m = 0;
+    for (int4 i = 0; i < n; i++) {
+        phloat a = fabs(x[i * inc]);
+        if (a > m)
+            m = a;
+    }
+    return m;
+}
+
+static phloat csum_loop(const phloat *x, int inc, int4 n, bool absolute,
+                        phloat scale) {
+    phloat s = 0, e = 0;
+    for (int4 i = 0; i < n; i++) {
+        phloat t = x[i * inc];
+        if (absolute)
+            t = fabs(t);
+        compensated_add(&s, &e, t * scale);
+    }
+    return s + e;
+}
+
+static phloat cdot_loop(const phloat *x, int xinc, const phloat *y, int yinc,
+                        int4 n, phloat xscale, phloat yscale) {
+    phloat s = 0, e = 0;
+    for (int4 i = 0; i < n; i++) {
+        phloat a = x[i * xinc] * xscale, b = y[i * yinc] * yscale;
+        phloat p = a * b;
+        compensated_add(&s, &e, p);
+#ifndef BCD_MATH
+        /* The rounding error of the product, which vec_cdot() keeps too */
+        e += fma(a, b, -p);
+#endif
+    }
+    return s + e;
+}
+
+/* Sum of x[0], x[inc], ..., x[(n - 1) * inc], or of their absolute values.
+ * If an intermediate result overflows, the sum is done again with all the
+ * terms scaled down, so the result is only infinite if the sum really is out
+ * of range.
+ */
+phloat compensated_sum(const phloat *x, int inc, int4 n, bool absolute) {
+    phloat s;
+#ifdef BCD_MATH
+    s = csum_loop(x, inc, n, absolute, 1);
+#else
+    s = inc == 1 ? vec_csum(x, n, absolute) : csum_loop(x, inc, n, absolute, 1);
+#endif
+    if (!p_isinf(s) && !p_isnan(s))
+        return s;
+    phloat scale = unit_scale(max_abs(x, inc, n));
+    return csum_loop(x, inc, n, absolute, scale) / scale;
+}
+
+/* Dot product of two strided vectors, handling overflow like
+ * compensated_sum().
+ */
+phloat compensated_dot(const phloat *x, int xinc, const phloat *y, int yinc,
+                       int4 n) {
+    phloat d;
+#ifdef BCD_MATH
+    d = cdot_loop(x, xinc, y, yinc, n, 1, 1);
+#else
+    d = xinc == 1 && yinc == 1 ? vec_cdot(x, y, n)
+                               : cdot_loop(x, xinc, y, yinc, n, 1, 1);
+#endif
+    if (!p_isinf(d) && !p_isnan(d))
+        return d;
+    phloat xscale = unit_scale(max_abs(x, xinc, n));
+    phloat yscale = unit_scale(max_abs(y, yinc, n));
+    d = cdot_loop(x, xinc, y, yinc, n, xscale, yscale);
+    return d / xscale / yscale;
+}
+
+/* Euclidean norm of x[0] ... x[n - 1], computed without overflow or underflow
+ * in the intermediate results, like LAPACK's dnrm2.
+ */
+phloat scaled_norm(const phloat *x, int4 n) {
+#ifdef BCD_MATH
+    phloat scale = 0, ssq = 1;
+    for (int4 i = 0; i < n; i++) {
+        phloat ax = fabs(x[i]);
+        if (ax == 0)
+            continue;
+        if (scale < ax) {
+            phloat r = scale / ax;
+            ssq = 1 + ssq * r * r;
+            scale = ax;
+        } else {
+            phloat r = ax / scale;
+            ssq += r * r;
+        }
+    }
+    return scale * sqrt(ssq);
+#else
+    return vec_nrm2(x, n);
+#endif
+}
+
 int dimension_array(const char *name, int namelen, int4 rows, int4 columns, bool check_matedit) {
     if (check_matedit
             && (matedit_mode == 1 || matedit_mode == 3)
@@ -942,26 +1182,42 @@ int dimension_array_ref(vartype *matrix, int4 rows, int4 columns) {
              * So, playing safe -- shouldn't be too big a handicap since
              * 'is_string' is a lot smaller than 'data', so the transient
              * memory overhead is only about 12.5%.
+             * Matrices without strings don't have an 'is_string' array,
+             * and don't need one after resizing, either.
              */
-            char *new_is_string = (char *) malloc(size);
-            if (new_is_string == NULL)
-                return ERR_INSUFFICIENT_MEMORY;
+            char *new_is_string = NULL;
+            invalidate_lu(matrix);
+            if (oldmatrix->array->is_string != NULL) {
+                new_is_string = (char *) malloc(size);
+                if (new_is_string == NULL)
+                    return ERR_INSUFFICIENT_MEMORY;
+            }
             int4 i, s, oldsize;
+            oldsize = oldmatrix->rows * oldmatrix->columns;
+            s = oldsize < size ? oldsize : size;
+            /* When shrinking, let go of any long strings that are about to
+             * be cut off. A realloc() that shrinks can't really fail, but if
+             * it does, the old block is still good enough.
+             */
+            release_long_strings(oldmatrix->array, s, oldsize);
             phloat *new_data = (phloat *)
                                     realloc(oldmatrix->array->data,
                                             size * sizeof(phloat));
             if (new_data == NULL) {
-                free(new_is_string);
-                return ERR_INSUFFICIENT_MEMORY;
+                if (size <= oldsize)
+                    new_data = oldmatrix->array->data;
+                else {
+                    free(new_is_string);
+                    return ERR_INSUFFICIENT_MEMORY;
+                }
             }
-            oldsize = oldmatrix->rows * oldmatrix->columns;
-            s = oldsize < size ? oldsize : size;
-            for (i = 0; i < s; i++)
-                new_is_string[i] = oldmatrix->array->is_string[i];
-            for (i = s; i < size; i++) {
-                new_is_string[i] = 0;
-                new_data[i] = 0;
+            if (new_is_string != NULL) {
+                for (i = 0; i < s; i++)
+                    new_is_string[i] = is_string_at(oldmatrix->array, i);
+                for (i = s; i < size; i++)
+                    new_is_string[i] = 0;
             }
+            zero_phloat_array(new_data + s, size - s);
             free(oldmatrix->array->is_string);
             oldmatrix->array->is_string = new_is_string;
             oldmatrix->array->data = new_data;
@@ -977,30 +1233,35 @@ int dimension_array_ref(vartype *matrix, int4 rows, int4 columns) {
              */
             realmatrix_data *new_array;
             int4 i, s, oldsize;
-            new_array = (realmatrix_data *) malloc(sizeof(realmatrix_data));
+            new_array = (realmatrix_data *) slab_alloc(SLAB_REALMATRIX_DATA);
             if (new_array == NULL)
                 return ERR_INSUFFICIENT_MEMORY;
             new_array->data = (phloat *) malloc(size * sizeof(phloat));
             if (new_array->data == NULL) {
-                free(new_array);
-                return ERR_INSUFFICIENT_MEMORY;
-            }
-            new_array->is_string = (char *) malloc(size);
-            if (new_array->is_string == NULL) {
-                free(new_array->data);
-                free(new_array);
+                slab_free(SLAB_REALMATRIX_DATA, new_array);
                 return ERR_INSUFFICIENT_MEMORY;
             }
             oldsize = oldmatrix->rows * oldmatrix->columns;
             s = oldsize < size ? oldsize : size;
-            for (i = 0; i < s; i++) {
-                new_array->is_string[i] = oldmatrix->array->is_string[i];
-                new_array->data[i] = oldmatrix->array->data[i];
-            }
-            for (i = s; i < size; i++) {
-                new_array->is_string[i] = 0;
-                new_array->data[i] = 0;
+            if (oldmatrix->array->is_string == NULL)
+                new_array->is_string = NULL;
+            else {
+                new_array->is_string = (char *) malloc(size);
+                if (new_array->is_string == NULL) {
+                    free(new_array->data);
+                    slab_free(SLAB_REALMATRIX_DATA, new_array);
+                    return ERR_INSUFFICIENT_MEMORY;
+                }
+                for (i = 0; i < s; i++)
+                    new_array->is_string[i] = is_string_at(oldmatrix->array, i);
+                for (i = s; i < size; i++)
+                    new_array->is_string[i] = 0;
             }
+            memcpy(new_array->data, oldmatrix->array->data,
+                                                    s * sizeof(phloat));
+            zero_phloat_array(new_array->data + s, size - s);
+            retain_long_strings(new_array, 0, s);
+            new_array->lu = NULL;
             new_array->refcount = 1;
             oldmatrix->array->refcount--;
             oldmatrix->array = new_array;
@@ -1016,14 +1277,14 @@ int dimension_array_ref(vartype *matrix, int4 rows, int4 columns) {
             /* Since there are no shared references to this array,
              * I can modify it in place using a realloc().
              */
-            int4 i, oldsize;
+            int4 oldsize;
+            invalidate_lu(matrix);
             phloat *new_data = (phloat *)
                     realloc(oldmatrix->array->data, 2 * size * sizeof(phloat));
             if (new_data == NULL)
                 return ERR_INSUFFICIENT_MEMORY;
             oldsize = oldmatrix->rows * oldmatrix->columns;
-            for (i = 2 * oldsize; i < 2 * size; i++)
-                new_data[i] = 0;
+            zero_phloat_array(new_data + 2 * oldsize, 2 * (size - oldsize));
             oldmatrix->array->data = new_data;
             oldmatrix->rows = rows;
             oldmatrix->columns = columns;
@@ -1036,22 +1297,22 @@ int dimension_array_ref(vartype *matrix, int4 rows, int4 columns) {
              * shared references without resizing.
              */
             complexmatrix_data *new_array;
-            int4 i, s, oldsize;
+            int4 s, oldsize;
             new_array = (complexmatrix_data *)
-                                        malloc(sizeof(complexmatrix_data));
+                                            slab_alloc(SLAB_COMPLEXMATRIX_DATA);
             if (new_array == NULL)
                 return ERR_INSUFFICIENT_MEMORY;
             new_array->data = (phloat *) malloc(2 * size * sizeof(phloat));
             if (new_array->data == NULL) {
-                free(new_array);
+                slab_free(SLAB_COMPLEXMATRIX_DATA, new_array);
                 return ERR_INSUFFICIENT_MEMORY;
             }
             oldsize = oldmatrix->rows * oldmatrix->columns;
             s = oldsize < size ? oldsize : size;
-            for (i = 0; i < 2 * s; i++)
-                new_array->data[i] = oldmatrix->array->data[i];
-            for (i = 2 * s; i < 2 * size; i++)
-                new_array->data[i] = 0;
+            memcpy(new_array->data, oldmatrix->array->data,
+                                                    2 * s * sizeof(phloat));
+            zero_phloat_array(new_array->data + 2 * s, 2 * (size - s));
+            new_array->lu = NULL;
             new_array->refcount = 1;
             oldmatrix->array->refcount--;
             oldmatrix->array = new_array;
@@ -1256,8 +1517,9 @@ int vartype2string(const vartype *v, char *buf, int buflen, int max_mant_digits)
             int i;
             int chars_so_far = 0;
             char2buf(buf, buflen, &chars_so_far, '"');
+            const char *text = TXT(s);
             for (i = 0; i < s->length; i++)
-                char2buf(buf, buflen, &chars_so_far, s->text[i]);
+                char2buf(buf, buflen, &chars_so_far, text[i]);
             char2buf(buf, buflen, &chars_so_far, '"');
             return chars_so_far;
         }
@@ -1277,8 +1539,8 @@ char *phloat2program(phloat d) {
     /* Converts a phloat to its most compact representation;
      * used for generating HP-42S style number literals in programs.
      */
-    static char allbuf[50];
-    static char scibuf[50];
+    static CORE_PER_THREAD char allbuf[50];
+    static CORE_PER_THREAD char scibuf[50];
     int alllen;
     int scilen;
     char dot = flags.f.decimal_point ? '.' : ',';
@@ -1406,3 +1668,7 @@ int ip2revstring(phloat d, char *buf, int buflen) {
         buf[bufpos++] = '-';
     return bufpos;
 }
+
+void visit_helpers_state(state_visitor visit, void *cd) {
+    VISIT_STATE(always_on);
+}
@@ -31,8 +31,12 @@
 int resolve_ind_arg(arg_struct *arg);
 int arg_to_num(arg_struct *arg, int4 *num);
 int is_pure_real(const vartype *matrix);
-void recall_result(vartype *v);
-void recall_two_results(vartype *x, vartype *y);
+bool ensure_stack_capacity(int4 n);
+void push_t();
+vartype *drop_t();
+void clear_bigstack();
+int recall_result(vartype *v);
+int recall_two_results(vartype *x, vartype *y);
 void unary_result(vartype *x);
 void binary_result(vartype *x);
 phloat rad_to_angle(phloat x);
@@ -44,6 +48,15 @@ void append_alpha_string(const char *buf, int buflen, int reverse);
 void string_copy(char *dst, int *dstlen, const char *src, int srclen);
 bool string_equals(const char *s1, int s1len, const char *s2, int s2len);
 
+/* Open-addressed hash tables, using linear probing, that map names to indexes
+ * in an array of named entries, like labels[] and vars[]. Empty slots contain
+ * -1. 'name_at' returns the name, and its length, of the entry at an index.
+ */
+typedef const char *(*name_at_func)(int index, int *length);
+bool name_table_reset(int **table, int *capacity, int entries);
+int *name_table_slot(int *table, int capacity, const char *name, int length,
+                     name_at_func name_at);
+
 #define FLAGOP_SF 0
 #define FLAGOP_CF 1
 #define FLAGOP_FS_T 2
@@ -78,6 +91,12 @@ phloat sin_grad(phloat x);
 phloat cos_deg(phloat x);
 phloat cos_grad(phloat x);
 
+void compensated_add(phloat *sum, phloat *err, phloat x);
+phloat compensated_sum(const phloat *x, int inc, int4 n, bool absolute = false);
+phloat compensated_dot(const phloat *x, int xinc, const phloat *y, int yinc,
+                       int4 n);
+phloat scaled_norm(const phloat *x, int4 n);
+
 /***********************/
 /* Miscellaneous stuff */
 /***********************/
@@ -96,5 +115,6 @@ char *phloat2program(phloat d);
 int easy_phloat2string(phloat d, char *buf, int buflen, int base_mode);
 int ip2revstring(phloat d, char *buf, int buflen);
 
+void visit_helpers_state(state_visitor visit, void *cd);
 
 #endif
@@ -192,8 +192,7 @@ void keydown(int shift, int key) {
                 key += 37;
         }
         vartype *result = new_real(key);
-        if (result != NULL) {
-            recall_result(result);
+        if (result != NULL && recall_result(result) == ERR_NONE) {
             flags.f.stack_lift_disable = 0;
         } else {
             display_error(ERR_INSUFFICIENT_MEMORY, 1);
@@ -1890,7 +1889,7 @@ void keydown_normal_mode(int shift, int key) {
                 display_prgm_line(0, -1);
         } else {
             if (!flags.f.stack_lift_disable) {
-                free_vartype(reg_t);
+                push_t();
                 reg_t = reg_z;
                 reg_z = reg_y;
                 reg_y = dup_vartype(reg_x);
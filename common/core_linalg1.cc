@@ -23,13 +23,61 @@
 #include "core_variables.h"
 
 
+/************************************/
+/***** Cached LU decompositions *****/
+/************************************/
+
+/* Returns the decomposition cached with m's data, if it has one that can be
+ * used with the given matrix_singularmatrix setting. One that was computed
+ * with the setting on had no zero pivots, so it is the same as it would have
+ * been with the setting off; one that was computed with the setting off may
+ * have had zero pivots replaced, so it can't be used with the setting on.
+ */
+static lu_cache *get_lu(const vartype *m, bool singularmatrix) {
+    lu_cache *c;
+    if (m->type == TYPE_REALMATRIX)
+        c = ((vartype_realmatrix *) m)->array->lu;
+    else
+        c = ((vartype_complexmatrix *) m)->array->lu;
+    if (c != NULL && singularmatrix && !c->singularmatrix)
+        return NULL;
+    return c;
+}
+
+/* Attaches a decomposition of m to m's data. Returns true if it did, in which
+ * case lu and perm now belong to the cache; if it returns false, they still
+ * belong to the caller. With the 'singular matrix' error mode on, the complex
+ * decomposition gives up at the first zero pivot and reports a determinant of
+ * zero, and what it leaves behind is only good for the determinant, so
+ * those are not kept.
+ */
+static bool keep_lu(const vartype *m, vartype *lu, int4 *perm,
+                    phloat det_re, phloat det_im, bool singularmatrix) {
+    lu_cache *c;
+    if (singularmatrix && det_re == 0 && det_im == 0)
+        return false;
+    c = (lu_cache *) malloc(sizeof(lu_cache));
+    if (c == NULL)
+        return false;
+    c->lu = lu;
+    c->perm = perm;
+    c->det_re = det_re;
+    c->det_im = det_im;
+    c->singularmatrix = singularmatrix;
+    attach_lu((vartype *) m, c);
+    return true;
+}
+
+
 /**********************************/
 /***** Matrix-matrix division *****/
 /**********************************/
 
-static void (*linalg_div_completion)(int, vartype *);
-static const vartype *linalg_div_left;
-static vartype *linalg_div_result;
+static CORE_STATE void (*linalg_div_completion)(int, vartype *);
+static CORE_STATE const vartype *linalg_div_left;
+static CORE_STATE const vartype *linalg_div_right;
+static CORE_STATE vartype *linalg_div_result;
+static CORE_STATE bool linalg_div_cached;
 
 static int div_rr_completion1(int error, vartype_realmatrix *a, int4 *perm,
                                     phloat det);
@@ -48,8 +96,16 @@ static int div_cc_completion1(int error, vartype_complexmatrix *a, int4 *perm,
 static void div_cc_completion2(int error, vartype_complexmatrix *a, int4 *perm,
                                     vartype_complexmatrix *b);
 
+static int div_cached(const vartype *left, const vartype *right,
+                       lu_cache *c, void (*completion)(int, vartype *));
+
 int linalg_div(const vartype *left, const vartype *right,
                                     void (*completion)(int, vartype *)) {
+    lu_cache *c = get_lu(right, core_settings.matrix_singularmatrix);
+    if (c != NULL)
+        return div_cached(left, right, c, completion);
+    linalg_div_right = right;
+    linalg_div_cached = false;
     if (left->type == TYPE_REALMATRIX) {
         if (right->type == TYPE_REALMATRIX) {
             vartype_realmatrix *num = (vartype_realmatrix *) left;
@@ -67,13 +123,13 @@ int linalg_div(const vartype *left, const vartype *right,
                 completion(ERR_INSUFFICIENT_MEMORY, NULL);
                 return ERR_INSUFFICIENT_MEMORY;
             }
-            lu = new_realmatrix(rows, rows);
+            lu = new_realmatrix(rows, rows, false);
             if (lu == NULL) {
                 free(perm);
                 completion(ERR_INSUFFICIENT_MEMORY, NULL);
                 return ERR_INSUFFICIENT_MEMORY;
             }
-            res = new_realmatrix(rows, columns);
+            res = new_realmatrix(rows, columns, false);
             if (res == NULL) {
                 free(perm);
                 free_vartype(lu);
@@ -102,13 +158,13 @@ int linalg_div(const vartype *left, const vartype *right,
                 completion(ERR_INSUFFICIENT_MEMORY, NULL);
                 return ERR_INSUFFICIENT_MEMORY;
             }
-            lu = new_complexmatrix(rows, rows);
+            lu = new_complexmatrix(rows, rows, false);
             if (lu == NULL) {
                 free(perm);
                 completion(ERR_INSUFFICIENT_MEMORY, NULL);
                 return ERR_INSUFFICIENT_MEMORY;
             }
-            res = new_complexmatrix(rows, columns);
+            res = new_complexmatrix(rows, columns, false);
             if (res == NULL) {
                 free(perm);
                 free_vartype(lu);
@@ -139,13 +195,13 @@ int linalg_div(const vartype *left, const vartype *right,
                 completion(ERR_INSUFFICIENT_MEMORY, NULL);
                 return ERR_INSUFFICIENT_MEMORY;
             }
-            lu = new_realmatrix(rows, rows);
+            lu = new_realmatrix(rows, rows, false);
             if (lu == NULL) {
                 free(perm);
                 completion(ERR_INSUFFICIENT_MEMORY, NULL);
                 return ERR_INSUFFICIENT_MEMORY;
             }
-            res = new_complexmatrix(rows, columns);
+            res = new_complexmatrix(rows, columns, false);
             if (res == NULL) {
                 free(perm);
                 free_vartype(lu);
@@ -174,13 +230,13 @@ int linalg_div(const vartype *left, const vartype *right,
                 completion(ERR_INSUFFICIENT_MEMORY, NULL);
                 return ERR_INSUFFICIENT_MEMORY;
             }
-            lu = new_complexmatrix(rows, rows);
+            lu = new_complexmatrix(rows, rows, false);
             if (lu == NULL) {
                 free(perm);
                 completion(ERR_INSUFFICIENT_MEMORY, NULL);
                 return ERR_INSUFFICIENT_MEMORY;
             }
-            res = new_complexmatrix(rows, columns);
+            res = new_complexmatrix(rows, columns, false);
             if (res == NULL) {
                 free(perm);
                 free_vartype(lu);
@@ -205,6 +261,8 @@ static int div_rr_completion1(int error, vartype_realmatrix *a, int4 *perm,
         free_vartype(linalg_div_result);
         return error;
     } else {
+        linalg_div_cached = keep_lu(linalg_div_right, (vartype *) a, perm,
+                        det, 0, core_settings.matrix_singularmatrix);
         matrix_copy(linalg_div_result, linalg_div_left);
         return lu_backsubst_rr(a, perm,
                                 (vartype_realmatrix *) linalg_div_result,
@@ -216,8 +274,10 @@ static void div_rr_completion2(int error, vartype_realmatrix *a, int4 *perm,
                                           vartype_realmatrix *b) {
     if (error != ERR_NONE)
         free_vartype(linalg_div_result); /* Note: linalg_div_result == b */
-    free_vartype((vartype *) a);
-    free(perm);
+    if (!linalg_div_cached) {
+        free_vartype((vartype *) a);
+        free(perm);
+    }
     linalg_div_completion(error, linalg_div_result);
 }
 
@@ -229,6 +289,8 @@ static int div_rc_completion1(int error, vartype_complexmatrix *a, int4 *perm,
         free_vartype(linalg_div_result);
         return error;
     } else {
+        linalg_div_cached = keep_lu(linalg_div_right, (vartype *) a, perm,
+                        det_re, det_im, core_settings.matrix_singularmatrix);
         matrix_copy(linalg_div_result, linalg_div_left);
         return lu_backsubst_cc(a, perm,
                                 (vartype_complexmatrix *) linalg_div_result,
@@ -240,8 +302,10 @@ static void div_rc_completion2(int error, vartype_complexmatrix *a, int4 *perm,
                                           vartype_complexmatrix *b) {
     if (error != ERR_NONE)
         free_vartype(linalg_div_result); /* Note: linalg_div_result == b */
-    free_vartype((vartype *) a);
-    free(perm);
+    if (!linalg_div_cached) {
+        free_vartype((vartype *) a);
+        free(perm);
+    }
     linalg_div_completion(error, linalg_div_result);
 }
 
@@ -253,6 +317,8 @@ static int div_cr_completion1(int error, vartype_realmatrix *a, int4 *perm,
         free_vartype(linalg_div_result);
         return error;
     } else {
+        linalg_div_cached = keep_lu(linalg_div_right, (vartype *) a, perm,
+                        det, 0, core_settings.matrix_singularmatrix);
         matrix_copy(linalg_div_result, linalg_div_left);
         return lu_backsubst_rc(a, perm,
                                 (vartype_complexmatrix *) linalg_div_result,
@@ -264,8 +330,10 @@ static void div_cr_completion2(int error, vartype_realmatrix *a, int4 *perm,
                                     vartype_complexmatrix *b) {
     if (error != ERR_NONE)
         free_vartype(linalg_div_result); /* Note: linalg_div_result == b */
-    free_vartype((vartype *) a);
-    free(perm);
+    if (!linalg_div_cached) {
+        free_vartype((vartype *) a);
+        free(perm);
+    }
     linalg_div_completion(error, linalg_div_result);
 }
 
@@ -277,6 +345,8 @@ static int div_cc_completion1(int error, vartype_complexmatrix *a, int4 *perm,
         free_vartype(linalg_div_result);
         return error;
     } else {
+        linalg_div_cached = keep_lu(linalg_div_right, (vartype *) a, perm,
+                        det_re, det_im, core_settings.matrix_singularmatrix);
         matrix_copy(linalg_div_result, linalg_div_left);
         return lu_backsubst_cc(a, perm,
                                 (vartype_complexmatrix *) linalg_div_result,
@@ -288,440 +358,235 @@ static void div_cc_completion2(int error, vartype_complexmatrix *a, int4 *perm,
                                     vartype_complexmatrix *b) {
     if (error != ERR_NONE)
         free_vartype(linalg_div_result); /* Note: linalg_div_result == b */
-    free_vartype((vartype *) a);
-    free(perm);
+    if (!linalg_div_cached) {
+        free_vartype((vartype *) a);
+        free(perm);
+    }
     linalg_div_completion(error, linalg_div_result);
 }
 
-
-/****************************************/
-/***** Matrix-matrix multiplication *****/
-/****************************************/
-
-typedef struct {
-    vartype_realmatrix *left;
-    vartype_realmatrix *right;
-    vartype *result;
-    int4 i, j, k;
-    phloat sum;
-    void (*completion)(int error, vartype *result);
-} mul_rr_data_struct;
-
-static mul_rr_data_struct *mul_rr_data;
-
-static int matrix_mul_rr_worker(int interrupted);
-
-static int matrix_mul_rr(vartype_realmatrix *left, vartype_realmatrix *right,
-                         void (*completion)(int, vartype *)) {
-
-    mul_rr_data_struct *dat;
-    int error;
-
-    if (left->columns != right->rows) {
-        error = ERR_DIMENSION_ERROR;
-        goto finished;
+/* The denominator has been decomposed before, so all that's left to do is
+ * the back-substitution.
+ */
+static int div_cached(const vartype *left, const vartype *right,
+                      lu_cache *c, void (*completion)(int, vartype *)) {
+    vartype *res;
+    int4 n, rows, columns;
+    if (right->type == TYPE_REALMATRIX)
+        n = ((vartype_realmatrix *) right)->rows;
+    else
+        n = ((vartype_complexmatrix *) right)->rows;
+    if (left->type == TYPE_REALMATRIX) {
+        rows = ((vartype_realmatrix *) left)->rows;
+        columns = ((vartype_realmatrix *) left)->columns;
+    } else {
+        rows = ((vartype_complexmatrix *) left)->rows;
+        columns = ((vartype_complexmatrix *) left)->columns;
     }
-
-    if (!contains_no_strings(left) || !contains_no_strings(right)) {
-        error = ERR_ALPHA_DATA_IS_INVALID;
-        goto finished;
+    if (rows != n) {
+        completion(ERR_DIMENSION_ERROR, NULL);
+        return ERR_DIMENSION_ERROR;
     }
-
-    dat = (mul_rr_data_struct *) malloc(sizeof(mul_rr_data_struct));
-    if (dat == NULL) {
-        error = ERR_INSUFFICIENT_MEMORY;
-        goto finished;
+    if (left->type == TYPE_REALMATRIX && right->type == TYPE_REALMATRIX)
+        res = new_realmatrix(rows, columns, false);
+    else
+        res = new_complexmatrix(rows, columns, false);
+    if (res == NULL) {
+        completion(ERR_INSUFFICIENT_MEMORY, NULL);
+        return ERR_INSUFFICIENT_MEMORY;
     }
-
-    dat->result = new_realmatrix(left->rows, right->columns);
-    if (dat->result == NULL) {
-        free(dat);
-        error = ERR_INSUFFICIENT_MEMORY;
-        goto finished;
+    matrix_copy(res, left);
+    linalg_div_completion = completion;
+    linalg_div_left = left;
+    linalg_div_right = right;
+    linalg_div_result = res;
+    linalg_div_cached = true;
+    if (right->type == TYPE_REALMATRIX) {
+        if (left->type == TYPE_REALMATRIX)
+            return lu_backsubst_rr((vartype_realmatrix *) c->lu, c->perm,
+                                (vartype_realmatrix *) res,
+                                div_rr_completion2);
+        else
+            return lu_backsubst_rc((vartype_realmatrix *) c->lu, c->perm,
+                                (vartype_complexmatrix *) res,
+                                div_cr_completion2);
+    } else {
+        if (left->type == TYPE_REALMATRIX)
+            return lu_backsubst_cc((vartype_complexmatrix *) c->lu, c->perm,
+                                (vartype_complexmatrix *) res,
+                                div_rc_completion2);
+        else
+            return lu_backsubst_cc((vartype_complexmatrix *) c->lu, c->perm,
+                                (vartype_complexmatrix *) res,
+                                div_cc_completion2);
     }
-
-    dat->left = left;
-    dat->right = right;
-    dat->i = 0;
-    dat->j = 0;
-    dat->k = 0;
-    dat->sum = 0;
-    dat->completion = completion;
-
-    mul_rr_data = dat;
-    mode_interruptible = matrix_mul_rr_worker;
-    mode_stoppable = false;
-    return ERR_INTERRUPTIBLE;
-
-    finished:
-    completion(error, NULL);
-    return error;
 }
 
-static int matrix_mul_rr_worker(int interrupted) {
-    mul_rr_data_struct *dat = mul_rr_data;
-    int count = 0;
-    int inf;
-    phloat *l = dat->left->array->data;
-    phloat *r = dat->right->array->data;
-    phloat *p = ((vartype_realmatrix *) dat->result)->array->data;
-    int4 i = dat->i;
-    int4 j = dat->j;
-    int4 k = dat->k;
-    int4 m = dat->left->rows;
-    int4 n = dat->right->columns;
-    int4 q = dat->left->columns;
-    phloat sum = dat->sum;
-
-    if (interrupted) {
-        dat->completion(ERR_INTERRUPTED, NULL);
-        free_vartype(dat->result);
-        free(dat);
-        return ERR_INTERRUPTED;
-    }
-
-    while (count++ < 1000) {
-        sum += l[i * q + k] * r[k * n + j];
-        if (++k < q)
-            continue;
-        k = 0;
-        if ((inf = p_isinf(sum)) != 0) {
-            if (core_settings.matrix_outofrange && !flags.f.range_error_ignore){
-                dat->completion(ERR_OUT_OF_RANGE, NULL);
-                free_vartype(dat->result);
-                free(dat);
-                return ERR_OUT_OF_RANGE;
-            } else
-                sum = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
-        }
-        p[i * n + j] = sum;
-        sum = 0;
-        if (++j < n)
-            continue;
-        j = 0;
-        if (++i < m)
-            continue;
-        else {
-            dat->completion(ERR_NONE, dat->result);
-            free(dat);
-            return ERR_NONE;
-        }
-    }
 
-    dat->i = i;
-    dat->j = j;
-    dat->k = k;
-    dat->sum = sum;
-    return ERR_INTERRUPTIBLE;
-}
+/****************************************/
+/***** Matrix-matrix multiplication *****/
+/****************************************/
 
-#if 0
-/* TODO: Blocked matrix multiplication
- * This commented-out function implements a working blocked matrix
- * multiplication algorithm. It works by breaking up the multiplication into
- * multiplications of submatrices of the multiplicands. If the submatrices are
- * sufficiently small, they can be made to fit entirely in the CPU's L1 cache.
- * With block sizes of around 45, I have observed a speed-up factor of circa
- * 1.7 on a Pentium MMX, and with block sizes of about 90, I have observed a
- * speed-up factor of circa 3 on a Duron. (Those were the optimum block sizes
- * observed for each processor.) These numbers suggest the Pentium MMX has a 32
- * kilobyte L1 cache, and the Duron has a 128 kilobyte L1 cache.
- * For production use, the block size should be a user-configurable parameter,
- * with a built-in tool to automatically determine the optimum value. Since the
- * UI for this kind of advanced configuration does not exist yet, and sice the
- * determination of optimum block size is a very slow process, and since I
- * expect most HP-42S users will not be very interested in using a calculator
- * to work with order-100+ matrices, and since even in the optimum case the
- * speed-up is not staggering, I'm putting full implementation of this feature
- * off until some later date.
+/* The product is computed in blocks: for each block of rows of the left
+ * multiplicand and block of columns of the right one, the corresponding
+ * submatrices are copied into a small cache, the right one transposed, so
+ * that the inner loops run over consecutive memory and stay within the CPU's
+ * L1 cache. The k blocks are visited in order and each element's partial sum
+ * is kept in the result matrix between blocks, so the additions happen in the
+ * same order as in the naive i,j,k algorithm, and the results are identical.
+ * Real and complex operands are handled by the same code, using 'lw' and 'rw'
+ * (1 for real, 2 for complex) as the element widths.
+ * In the binary build, the real case works on four columns at a time, using
+ * vec_dot4(); for that, the right block is stored as panels of four columns,
+ * interleaved, padded with zeros to a multiple of four. Each of the four sums
+ * is still accumulated in order, so this doesn't change the results either.
+ * Large products are computed using the worker pool (see core_linalg2.cc),
+ * with the rows of the result divided between the threads. Each task goes
+ * through the same blocks as the serial code, just for fewer rows, using a
+ * cache of its own, so that doesn't change the results either.
  */
-static int matrix_mul_rr(vartype_realmatrix *left, vartype_realmatrix *right,
-                         vartype **result) {
-    phloat *cache = NULL;
-    phloat *leftcache, *rightcache;
-
-    phloat *l = left->array->data;
-    phloat *r = right->array->data;
-    phloat *p;
-    int inf;
-    int4 m, n, q;
-    int4 i, j, k;
-
-    q = left->columns;
-    if (q != right->rows)
-        return ERR_DIMENSION_ERROR;
-    m = left->rows;
-    n = right->columns;
-
-    if (!contains_no_strings(left) || !contains_no_strings(right))
-        return ERR_ALPHA_DATA_IS_INVALID;
 
-    *result = new_realmatrix(m, n);
-    if (*result == NULL)
-        return ERR_INSUFFICIENT_MEMORY;
-    p = ((vartype_realmatrix *) *result)->array->data;
-
-    if (BLOCK_SIZE > 0) {
-        int4 cachesize = 2 * BLOCK_SIZE * BLOCK_SIZE;
-        int4 alignment = CACHE_ALIGNMENT;
-        int4 misalgn;
-        if (alignment == 0)
-            alignment = 1;
-        misalgn = alignment % sizeof(phloat);
-        if (misalgn != 0)
-            alignment += sizeof(phloat) - misalgn;
-
-        cache = (phloat *) malloc(cachesize * sizeof(phloat) + alignment);
-        if (cache != NULL) {
-            misalgn = ((unsigned long) cache) % alignment;
-            if (misalgn == 0)
-                leftcache = cache;
-            else
-                leftcache = cache + (alignment - misalgn) / sizeof(phloat);
-            rightcache = leftcache + BLOCK_SIZE * BLOCK_SIZE;
-        }
-    }
-
-    if (cache == NULL) {
-
-        /* Falling back on basic i,j,k algorithm */
-        for (i = 0; i < m; i++)
-            for (j = 0; j < n; j++) {
-                phloat sum = 0;
-                for (k = 0; k < q; k++)
-                    sum += l[i * q + k] * r[k * n + j];
-                if ((inf = p_isinf(sum)) != 0) {
-                    if (core_settings.matrix_outofrange
-                                            && !flags.f.range_error_ignore)
-                        return ERR_OUT_OF_RANGE;
-                    else
-                        sum = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
-                }
-                p[i * n + j] = sum;
-            }
-        return ERR_NONE;
-
-    } else {
-
-        /* Blocked i,j,k algorithm for optimal cache utilization */
-        int4 i, j, k, ii, jj, kk;
-        for (i = 0; i < m; i += BLOCK_SIZE) {
-            int4 iimax = m - i;
-            if (iimax > BLOCK_SIZE)
-                iimax = BLOCK_SIZE;
-            for (j = 0; j < n; j += BLOCK_SIZE) {
-                int4 jjmax = n - j;
-                if (jjmax > BLOCK_SIZE)
-                    jjmax = BLOCK_SIZE;
-                for (k = 0; k < q; k += BLOCK_SIZE) {
-                    int4 kkmax = q - k;
-                    if (kkmax > BLOCK_SIZE)
-                        kkmax = BLOCK_SIZE;
-                    for (ii = 0; ii < iimax; ii++)
-                        for (kk = 0; kk < kkmax; kk++)
-                            leftcache[ii * BLOCK_SIZE + kk]
-                                = l[(ii + i) * q + (kk + k)];
-                    for (kk = 0; kk < kkmax; kk++)
-                        for (jj = 0; jj < jjmax; jj++)
-                            rightcache[kk * BLOCK_SIZE + jj]
-                                = r[(kk + k) * n + (jj + j)];
-                    for (ii = 0; ii < iimax; ii++)
-                        for (jj = 0; jj < jjmax; jj++) {
-                            phloat sum = p[(ii + i) * n + (jj + j)];
-                            for (kk = 0; kk < kkmax; kk++)
-                                sum += leftcache[ii * BLOCK_SIZE + kk]
-                                        * rightcache[kk * BLOCK_SIZE + jj];
-                            if ((inf = p_isinf(sum)) != 0) {
-                                if (core_settings.matrix_outofrange
-                                            && !flags.f.range_error_ignore) {
-                                    free(cache);
-                                    return ERR_OUT_OF_RANGE;
-                                } else
-                                    sum = inf < 0 ? NEG_HUGE_PHLOAT
-                                                  : POS_HUGE_PHLOAT;
-                            }
-                            p[(ii + i) * n + (jj + j)] = sum;
-                        }
-                }
-            }
-        }
-        free(cache);
-        return ERR_NONE;
-
-    }
-}
+/* Products that take at least this many multiplications use the pool */
+#ifdef BCD_MATH
+#define MUL_POOL_MIN 32768
+#else
+#define MUL_POOL_MIN 2097152
 #endif
 
 typedef struct {
-    vartype_realmatrix *left;
-    vartype_complexmatrix *right;
+    const vartype *left;
+    const vartype *right;
     vartype *result;
+    int lw, rw;
+    int4 m, n, q;
+    int4 bs;
     int4 i, j, k;
-    phloat sum_re, sum_im;
+    int4 ii, jj;
+    bool packed;
+    phloat *cache;
+    int4 lsize, csize;
+    bool parallel;
+    int4 task_rows;
+    bool range_error;
+    phloat pos_huge, neg_huge;
     void (*completion)(int error, vartype *result);
-} mul_rc_data_struct;
-
-static mul_rc_data_struct *mul_rc_data;
+} mul_data_struct;
 
-static int matrix_mul_rc_worker(int interrupted);
+static CORE_STATE mul_data_struct *mul_data;
 
-static int matrix_mul_rc(vartype_realmatrix *left, vartype_complexmatrix *right,
-                         void (*completion)(int, vartype *)) {
+static int matrix_mul_worker(int interrupted);
+static int matrix_mul_task(void *data, int4 t);
 
-    mul_rc_data_struct *dat;
-    int error;
-
-    if (left->columns != right->rows) {
-        error = ERR_DIMENSION_ERROR;
-        goto finished;
-    }
-
-    if (!contains_no_strings(left)) {
-        error = ERR_ALPHA_DATA_IS_INVALID;
-        goto finished;
-    }
-
-    dat = (mul_rc_data_struct *) malloc(sizeof(mul_rc_data_struct));
-    if (dat == NULL) {
-        error = ERR_INSUFFICIENT_MEMORY;
-        goto finished;
-    }
+static phloat *matrix_data(const vartype *m) {
+    if (m->type == TYPE_REALMATRIX)
+        return ((vartype_realmatrix *) m)->array->data;
+    else
+        return ((vartype_complexmatrix *) m)->array->data;
+}
 
-    dat->result = new_complexmatrix(left->rows, right->columns);
-    if (dat->result == NULL) {
-        free(dat);
-        error = ERR_INSUFFICIENT_MEMORY;
-        goto finished;
+/* The automatic block size is chosen so that the left and right blocks
+ * together take up about 24 kilobytes, which leaves some room in a typical
+ * 32 kilobyte L1 data cache for the result rows and the stack.
+ */
+static int4 mul_block_size(int lw, int rw) {
+    int4 bs = core_settings.matrix_block_size;
+    if (bs <= 0) {
+        int4 elems = 24576 / ((lw + rw) * (int4) sizeof(phloat));
+        bs = 1;
+        while ((bs + 1) * (bs + 1) <= elems)
+            bs++;
     }
-
-    dat->left = left;
-    dat->right = right;
-    dat->i = 0;
-    dat->j = 0;
-    dat->k = 0;
-    dat->sum_re = 0;
-    dat->sum_im = 0;
-    dat->completion = completion;
-
-    mul_rc_data = dat;
-    mode_interruptible = matrix_mul_rc_worker;
-    mode_stoppable = false;
-    return ERR_INTERRUPTIBLE;
-
-    finished:
-    completion(error, NULL);
-    return error;
+    if (bs < 4)
+        bs = 4;
+    else if (bs > 256)
+        bs = 256;
+    return bs;
 }
 
-static int matrix_mul_rc_worker(int interrupted) {
-    mul_rc_data_struct *dat = mul_rc_data;
-    int count = 0;
-    int inf;
-    phloat *l = dat->left->array->data;
-    phloat *r = dat->right->array->data;
-    phloat *p = ((vartype_complexmatrix *) dat->result)->array->data;
-    int4 i = dat->i;
-    int4 j = dat->j;
-    int4 k = dat->k;
-    int4 m = dat->left->rows;
-    int4 n = dat->right->columns;
-    int4 q = dat->left->columns;
-    phloat sum_re = dat->sum_re;
-    phloat sum_im = dat->sum_im;
-
-    if (interrupted) {
-        dat->completion(ERR_INTERRUPTED, NULL);
-        free_vartype(dat->result);
-        free(dat);
-        return ERR_INTERRUPTED;
-    }
+static int matrix_mul(const vartype *left, const vartype *right,
+                      void (*completion)(int, vartype *)) {
 
-    while (count++ < 1000) {
-        phloat tmp = l[i * q + k];
-        sum_re += tmp * r[2 * (k * n + j)];
-        sum_im += tmp * r[2 * (k * n + j) + 1];
-        if (++k < q)
-            continue;
-        k = 0;
-        if ((inf = p_isinf(sum_re)) != 0) {
-            if (core_settings.matrix_outofrange && !flags.f.range_error_ignore){
-                dat->completion(ERR_OUT_OF_RANGE, NULL);
-                free_vartype(dat->result);
-                free(dat);
-                return ERR_OUT_OF_RANGE;
-            } else
-                sum_re = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
+    mul_data_struct *dat;
+    int error;
+    int4 m, n, q, bs, mb, nb, kb;
+    int lw = left->type == TYPE_REALMATRIX ? 1 : 2;
+    int rw = right->type == TYPE_REALMATRIX ? 1 : 2;
+
+    if (lw == 1) {
+        vartype_realmatrix *l = (vartype_realmatrix *) left;
+        vartype_realmatrix *r = (vartype_realmatrix *) right;
+        m = l->rows;
+        q = l->columns;
+        if (rw == 1) {
+            if (q != r->rows) {
+                error = ERR_DIMENSION_ERROR;
+                goto finished;
+            }
+            n = r->columns;
+        } else {
+            vartype_complexmatrix *rc = (vartype_complexmatrix *) right;
+            if (q != rc->rows) {
+                error = ERR_DIMENSION_ERROR;
+                goto finished;
+            }
+            n = rc->columns;
         }
-        if ((inf = p_isinf(sum_im)) != 0) {
-            if (core_settings.matrix_outofrange && !flags.f.range_error_ignore){
-                dat->completion(ERR_OUT_OF_RANGE, NULL);
-                free_vartype(dat->result);
-                free(dat);
-                return ERR_OUT_OF_RANGE;
-            } else
-                sum_im = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
+        if (!contains_no_strings(l)
+                || (rw == 1 && !contains_no_strings(r))) {
+            error = ERR_ALPHA_DATA_IS_INVALID;
+            goto finished;
         }
-        p[2 * (i * n + j)] = sum_re;
-        p[2 * (i * n + j) + 1] = sum_im;
-        sum_re = 0;
-        sum_im = 0;
-        if (++j < n)
-            continue;
-        j = 0;
-        if (++i < m)
-            continue;
-        else {
-            dat->completion(ERR_NONE, dat->result);
-            free(dat);
-            return ERR_NONE;
+    } else {
+        vartype_complexmatrix *l = (vartype_complexmatrix *) left;
+        m = l->rows;
+        q = l->columns;
+        if (rw == 1) {
+            vartype_realmatrix *r = (vartype_realmatrix *) right;
+            if (q != r->rows) {
+                error = ERR_DIMENSION_ERROR;
+                goto finished;
+            }
+            if (!contains_no_strings(r)) {
+                error = ERR_ALPHA_DATA_IS_INVALID;
+                goto finished;
+            }
+            n = r->columns;
+        } else {
+            vartype_complexmatrix *r = (vartype_complexmatrix *) right;
+            if (q != r->rows) {
+                error = ERR_DIMENSION_ERROR;
+                goto finished;
+            }
+            n = r->columns;
         }
     }
 
-    dat->i = i;
-    dat->j = j;
-    dat->k = k;
-    dat->sum_re = sum_re;
-    dat->sum_im = sum_im;
-    return ERR_INTERRUPTIBLE;
-}
-
-typedef struct {
-    vartype_complexmatrix *left;
-    vartype_realmatrix *right;
-    vartype *result;
-    int4 i, j, k;
-    phloat sum_re, sum_im;
-    void (*completion)(int error, vartype *result);
-} mul_cr_data_struct;
-
-static mul_cr_data_struct *mul_cr_data;
-
-static int matrix_mul_cr_worker(int interrupted);
-
-static int matrix_mul_cr(vartype_complexmatrix *left, vartype_realmatrix *right,
-                         void (*completion)(int, vartype *)) {
-
-    mul_cr_data_struct *dat;
-    int error;
-
-    if (left->columns != right->rows) {
-        error = ERR_DIMENSION_ERROR;
-        goto finished;
-    }
-
-    if (!contains_no_strings(right)) {
-        error = ERR_ALPHA_DATA_IS_INVALID;
+    dat = (mul_data_struct *) malloc(sizeof(mul_data_struct));
+    if (dat == NULL) {
+        error = ERR_INSUFFICIENT_MEMORY;
         goto finished;
     }
 
-    dat = (mul_cr_data_struct *) malloc(sizeof(mul_cr_data_struct));
-    if (dat == NULL) {
+    bs = mul_block_size(lw, rw);
+    mb = m < bs ? m : bs;
+    nb = n < bs ? n : bs;
+    nb = (nb + 3) & ~3;
+    kb = q < bs ? q : bs;
+    dat->lsize = mb * lw * kb;
+    dat->csize = dat->lsize + nb * rw * kb;
+    dat->cache = (phloat *) malloc(dat->csize * sizeof(phloat));
+    if (dat->cache == NULL) {
+        free(dat);
         error = ERR_INSUFFICIENT_MEMORY;
         goto finished;
     }
 
-    dat->result = new_complexmatrix(left->rows, right->columns);
+    if (lw == 1 && rw == 1)
+        dat->result = new_realmatrix(m, n, false);
+    else
+        dat->result = new_complexmatrix(m, n, false);
     if (dat->result == NULL) {
+        free(dat->cache);
         free(dat);
         error = ERR_INSUFFICIENT_MEMORY;
         goto finished;
@@ -729,15 +594,41 @@ static int matrix_mul_cr(vartype_complexmatrix *left, vartype_realmatrix *right,
 
     dat->left = left;
     dat->right = right;
+    dat->lw = lw;
+    dat->rw = rw;
+    dat->m = m;
+    dat->n = n;
+    dat->q = q;
+    dat->bs = bs;
     dat->i = 0;
     dat->j = 0;
     dat->k = 0;
-    dat->sum_re = 0;
-    dat->sum_im = 0;
+    dat->ii = 0;
+    dat->jj = 0;
+    dat->packed = false;
     dat->completion = completion;
 
-    mul_cr_data = dat;
-    mode_interruptible = matrix_mul_cr_worker;
+    /* The range error setting and the HUGE constants are captured here,
+     * because the pool's threads can't use the core's global state.
+     */
+    dat->range_error = core_settings.matrix_outofrange
+                            && !flags.f.range_error_ignore;
+    dat->pos_huge = POS_HUGE_PHLOAT;
+    dat->neg_huge = NEG_HUGE_PHLOAT;
+
+    dat->parallel = false;
+    if ((int8) m * n * q >= MUL_POOL_MIN) {
+        int threads = linalg_pool_threads();
+        if (threads > 0) {
+            int4 tr = (m + threads - 1) / threads;
+            dat->task_rows = tr < bs ? tr : bs;
+            dat->parallel = linalg_pool_start(matrix_mul_task, dat,
+                            (m + dat->task_rows - 1) / dat->task_rows);
+        }
+    }
+
+    mul_data = dat;
+    mode_interruptible = matrix_mul_worker;
     mode_stoppable = false;
     return ERR_INTERRUPTIBLE;
 
@@ -746,230 +637,277 @@ static int matrix_mul_cr(vartype_complexmatrix *left, vartype_realmatrix *right,
     return error;
 }
 
-static int matrix_mul_cr_worker(int interrupted) {
-    mul_cr_data_struct *dat = mul_cr_data;
-    int count = 0;
-    int inf;
-    phloat *l = dat->left->array->data;
-    phloat *r = dat->right->array->data;
-    phloat *p = ((vartype_complexmatrix *) dat->result)->array->data;
-    int4 i = dat->i;
-    int4 j = dat->j;
-    int4 k = dat->k;
-    int4 m = dat->left->rows;
-    int4 n = dat->right->columns;
-    int4 q = dat->left->columns;
-    phloat sum_re = dat->sum_re;
-    phloat sum_im = dat->sum_im;
-
-    if (interrupted) {
-        dat->completion(ERR_INTERRUPTED, NULL);
+static void matrix_mul_finish(mul_data_struct *dat, int error) {
+    if (error == ERR_NONE)
+        dat->completion(ERR_NONE, dat->result);
+    else {
+        dat->completion(error, NULL);
         free_vartype(dat->result);
-        free(dat);
-        return ERR_INTERRUPTED;
     }
-
-    while (count++ < 1000) {
-        phloat tmp = r[k * n + j];
-        sum_re += tmp * l[2 * (i * q + k)];
-        sum_im += tmp * l[2 * (i * q + k) + 1];
-        if (++k < q)
-            continue;
-        k = 0;
-        if ((inf = p_isinf(sum_re)) != 0) {
-            if (core_settings.matrix_outofrange && !flags.f.range_error_ignore){
-                dat->completion(ERR_OUT_OF_RANGE, NULL);
-                free_vartype(dat->result);
-                free(dat);
-                return ERR_OUT_OF_RANGE;
-            } else
-                sum_re = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
-        }
-        if ((inf = p_isinf(sum_im)) != 0) {
-            if (core_settings.matrix_outofrange && !flags.f.range_error_ignore){
-                dat->completion(ERR_OUT_OF_RANGE, NULL);
-                free_vartype(dat->result);
-                free(dat);
-                return ERR_OUT_OF_RANGE;
-            } else
-                sum_im = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
-        }
-        p[2 * (i * n + j)] = sum_re;
-        p[2 * (i * n + j) + 1] = sum_im;
-        sum_re = 0;
-        sum_im = 0;
-        if (++j < n)
-            continue;
-        j = 0;
-        if (++i < m)
-            continue;
-        else {
-            dat->completion(ERR_NONE, dat->result);
-            free(dat);
-            return ERR_NONE;
-        }
-    }
-
-    dat->i = i;
-    dat->j = j;
-    dat->k = k;
-    dat->sum_re = sum_re;
-    dat->sum_im = sum_im;
-    return ERR_INTERRUPTIBLE;
+    free(dat->cache);
+    free(dat);
 }
 
-typedef struct {
-    vartype_complexmatrix *left;
-    vartype_complexmatrix *right;
-    vartype *result;
-    int4 i, j, k;
-    phloat sum_re, sum_im;
-    void (*completion)(int error, vartype *result);
-} mul_cc_data_struct;
-
-static mul_cc_data_struct *mul_cc_data;
-
-static int matrix_mul_cc_worker(int interrupted);
-
-static int matrix_mul_cc(vartype_complexmatrix *left, vartype_complexmatrix *right,
-                         void (*completion)(int, vartype *)) {
-
-    mul_cc_data_struct *dat;
-    int error;
+static bool mul_clamp(const mul_data_struct *dat, phloat *x) {
+    int inf = p_isinf(*x);
+    if (inf == 0)
+        return true;
+    if (dat->range_error)
+        return false;
+    *x = inf < 0 ? dat->neg_huge : dat->pos_huge;
+    return true;
+}
 
-    if (left->columns != right->rows) {
-        error = ERR_DIMENSION_ERROR;
-        goto finished;
+/* Copies block (k, j) of the right multiplicand into the cache, and block
+ * (i, k) of the left one as well if j == 0; the left block is used for all
+ * the j blocks in this row of blocks, so it only needs to be copied at the
+ * start of the row. Returns the number of elements copied.
+ */
+static int4 mul_pack(const mul_data_struct *dat, phloat *lc, phloat *rc,
+                     int4 i, int4 iimax, int4 j, int4 k) {
+    phloat *l = matrix_data(dat->left);
+    phloat *r = matrix_data(dat->right);
+    int lw = dat->lw;
+    int rw = dat->rw;
+    int4 n = dat->n;
+    int4 q = dat->q;
+    int4 bs = dat->bs;
+    int4 kb = q < bs ? q : bs;
+    int4 jjmax = n - j < bs ? n - j : bs;
+    int4 kkmax = q - k < bs ? q - k : bs;
+    int4 ii, jj, kk, c;
+    int4 count = 0;
+
+    if (j == 0) {
+        for (ii = 0; ii < iimax; ii++)
+            for (kk = 0; kk < kkmax; kk++)
+                for (c = 0; c < lw; c++)
+                    lc[(ii * kb + kk) * lw + c]
+                            = l[((i + ii) * q + k + kk) * lw + c];
+        count += iimax * kkmax;
     }
+#ifndef BCD_MATH
+    if (lw == 1 && rw == 1)
+        for (jj = 0; jj < ((jjmax + 3) & ~3); jj++)
+            for (kk = 0; kk < kkmax; kk++)
+                rc[(jj & ~3) * kb + kk * 4 + (jj & 3)]
+                        = jj < jjmax ? r[(k + kk) * n + j + jj] : 0;
+    else
+#endif
+    for (jj = 0; jj < jjmax; jj++)
+        for (kk = 0; kk < kkmax; kk++)
+            for (c = 0; c < rw; c++)
+                rc[(jj * kb + kk) * rw + c]
+                        = r[((k + kk) * n + j + jj) * rw + c];
+    count += jjmax * kkmax;
+    return count;
+}
 
-    dat = (mul_cc_data_struct *) malloc(sizeof(mul_cc_data_struct));
-    if (dat == NULL) {
-        error = ERR_INSUFFICIENT_MEMORY;
-        goto finished;
+/* Adds the products for block k to element (i + ii, j + jj) of the result,
+ * or, in the binary real case, to up to four elements starting there.
+ * Returns the number of elements done, or 0 if a result is out of range.
+ */
+static int4 mul_elements(const mul_data_struct *dat,
+                         const phloat *lc, const phloat *rc,
+                         int4 i, int4 j, int4 k, int4 ii, int4 jj) {
+    int lw = dat->lw;
+    int rw = dat->rw;
+    int pw = lw == 2 || rw == 2 ? 2 : 1;
+    int4 n = dat->n;
+    int4 q = dat->q;
+    int4 bs = dat->bs;
+    int4 kb = q < bs ? q : bs;
+    int4 kkmax = q - k < bs ? q - k : bs;
+    bool last = k + kkmax == q;
+    const phloat *a = lc + ii * kb * lw;
+    const phloat *b = rc + jj * kb * rw;
+    phloat *s = matrix_data(dat->result) + ((i + ii) * n + j + jj) * pw;
+    int4 kk;
+
+#ifndef BCD_MATH
+    if (pw == 1) {
+        phloat sum[4];
+        int4 t;
+        int4 jjmax = n - j < bs ? n - j : bs;
+        int4 step = jjmax - jj < 4 ? jjmax - jj : 4;
+        for (t = 0; t < 4; t++)
+            sum[t] = k == 0 || t >= step ? 0 : s[t];
+        vec_dot4(a, b, kkmax, sum);
+        for (t = 0; t < step; t++) {
+            if (last && !mul_clamp(dat, &sum[t]))
+                return 0;
+            s[t] = sum[t];
+        }
+        return step;
     }
-
-    dat->result = new_complexmatrix(left->rows, right->columns);
-    if (dat->result == NULL) {
-        free(dat);
-        error = ERR_INSUFFICIENT_MEMORY;
-        goto finished;
+#endif
+    if (pw == 1) {
+        phloat sum = k == 0 ? 0 : s[0];
+        for (kk = 0; kk < kkmax; kk++)
+            sum += a[kk] * b[kk];
+        if (last && !mul_clamp(dat, &sum))
+            return 0;
+        s[0] = sum;
+    } else {
+        phloat sum_re = k == 0 ? 0 : s[0];
+        phloat sum_im = k == 0 ? 0 : s[1];
+        if (lw == 1)
+            for (kk = 0; kk < kkmax; kk++) {
+                phloat tmp = a[kk];
+                sum_re += tmp * b[2 * kk];
+                sum_im += tmp * b[2 * kk + 1];
+            }
+        else if (rw == 1)
+            for (kk = 0; kk < kkmax; kk++) {
+                phloat tmp = b[kk];
+                sum_re += tmp * a[2 * kk];
+                sum_im += tmp * a[2 * kk + 1];
+            }
+        else
+            for (kk = 0; kk < kkmax; kk++) {
+                phloat l_re = a[2 * kk];
+                phloat l_im = a[2 * kk + 1];
+                phloat r_re = b[2 * kk];
+                phloat r_im = b[2 * kk + 1];
+                sum_re += l_re * r_re - l_im * r_im;
+                sum_im += l_im * r_re + l_re * r_im;
+            }
+        if (last && (!mul_clamp(dat, &sum_re) || !mul_clamp(dat, &sum_im)))
+            return 0;
+        s[0] = sum_re;
+        s[1] = sum_im;
     }
+    return 1;
+}
 
-    dat->left = left;
-    dat->right = right;
-    dat->i = 0;
-    dat->j = 0;
-    dat->k = 0;
-    dat->sum_re = 0;
-    dat->sum_im = 0;
-    dat->completion = completion;
+/* One task of a parallel multiplication: rows t * task_rows up to
+ * (t + 1) * task_rows of the result. */
+static int matrix_mul_task(void *data, int4 t) {
+    mul_data_struct *dat = (mul_data_struct *) data;
+    int4 n = dat->n;
+    int4 q = dat->q;
+    int4 bs = dat->bs;
+    int4 i = t * dat->task_rows;
+    int4 iimax = dat->m - i < dat->task_rows ? dat->m - i : dat->task_rows;
+    int4 j, k, ii, jj, jjmax, step;
+    phloat *lc = (phloat *) malloc(dat->csize * sizeof(phloat));
+    phloat *rc = lc + dat->lsize;
+
+    if (lc == NULL)
+        return ERR_INSUFFICIENT_MEMORY;
 
-    mul_cc_data = dat;
-    mode_interruptible = matrix_mul_cc_worker;
-    mode_stoppable = false;
-    return ERR_INTERRUPTIBLE;
+    for (k = 0; k < q; k += bs)
+        for (j = 0; j < n; j += bs) {
+            if (linalg_pool_stopped()) {
+                free(lc);
+                return ERR_INTERRUPTED;
+            }
+            mul_pack(dat, lc, rc, i, iimax, j, k);
+            jjmax = n - j < bs ? n - j : bs;
+            for (ii = 0; ii < iimax; ii++)
+                for (jj = 0; jj < jjmax; jj += step) {
+                    step = mul_elements(dat, lc, rc, i, j, k, ii, jj);
+                    if (step == 0) {
+                        free(lc);
+                        return ERR_OUT_OF_RANGE;
+                    }
+                }
+        }
 
-    finished:
-    completion(error, NULL);
-    return error;
+    free(lc);
+    return ERR_NONE;
 }
 
-static int matrix_mul_cc_worker(int interrupted) {
-    mul_cc_data_struct *dat = mul_cc_data;
-    int count = 0;
-    int inf;
-    phloat *l = dat->left->array->data;
-    phloat *r = dat->right->array->data;
-    phloat *p = ((vartype_complexmatrix *) dat->result)->array->data;
+static int matrix_mul_worker(int interrupted) {
+    mul_data_struct *dat = mul_data;
+    int4 count = 0;
+    int4 m = dat->m;
+    int4 n = dat->n;
+    int4 q = dat->q;
+    int4 bs = dat->bs;
     int4 i = dat->i;
     int4 j = dat->j;
     int4 k = dat->k;
-    int4 m = dat->left->rows;
-    int4 n = dat->right->columns;
-    int4 q = dat->left->columns;
-    phloat sum_re = dat->sum_re;
-    phloat sum_im = dat->sum_im;
+    int4 ii = dat->ii;
+    int4 jj = dat->jj;
+    phloat *lc = dat->cache;
+    phloat *rc = lc + dat->lsize;
 
     if (interrupted) {
-        dat->completion(ERR_INTERRUPTED, NULL);
-        free_vartype(dat->result);
-        free(dat);
+        if (dat->parallel)
+            linalg_pool_cancel();
+        matrix_mul_finish(dat, ERR_INTERRUPTED);
         return ERR_INTERRUPTED;
     }
 
-    while (count++ < 1000) {
-        phloat l_re = l[2 * (i * q + k)];
-        phloat l_im = l[2 * (i * q + k) + 1];
-        phloat r_re = r[2 * (k * n + j)];
-        phloat r_im = r[2 * (k * n + j) + 1];
-        sum_re += l_re * r_re - l_im * r_im;
-        sum_im += l_im * r_re + l_re * r_im;
-        if (++k < q)
-            continue;
-        k = 0;
-        if ((inf = p_isinf(sum_re)) != 0) {
-            if (core_settings.matrix_outofrange && !flags.f.range_error_ignore){
-                dat->completion(ERR_OUT_OF_RANGE, NULL);
-                free_vartype(dat->result);
-                free(dat);
-                return ERR_OUT_OF_RANGE;
-            } else
-                sum_re = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
+    if (dat->parallel) {
+        int err = linalg_pool_wait(interruptible_slice_left());
+        if (err != ERR_INTERRUPTIBLE)
+            matrix_mul_finish(dat, err);
+        return err;
+    }
+
+    while (true) {
+        int4 iimax = m - i < bs ? m - i : bs;
+        int4 jjmax = n - j < bs ? n - j : bs;
+        int4 kkmax = q - k < bs ? q - k : bs;
+
+        if (count >= SLICE_CHECK) {
+            if (interruptible_slice_done())
+                break;
+            count = 0;
+        }
+
+        if (!dat->packed) {
+            count += mul_pack(dat, lc, rc, i, iimax, j, k);
+            ii = 0;
+            jj = 0;
+            dat->packed = true;
         }
-        if ((inf = p_isinf(sum_im)) != 0) {
-            if (core_settings.matrix_outofrange && !flags.f.range_error_ignore){
-                dat->completion(ERR_OUT_OF_RANGE, NULL);
-                free_vartype(dat->result);
-                free(dat);
+
+        while (count < SLICE_CHECK) {
+            int4 step = mul_elements(dat, lc, rc, i, j, k, ii, jj);
+            if (step == 0) {
+                matrix_mul_finish(dat, ERR_OUT_OF_RANGE);
                 return ERR_OUT_OF_RANGE;
-            } else
-                sum_im = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
+            }
+            count += kkmax * step;
+            if ((jj += step) < jjmax)
+                continue;
+            jj = 0;
+            if (++ii < iimax)
+                continue;
+            ii = 0;
+            dat->packed = false;
+            break;
         }
-        p[2 * (i * n + j)] = sum_re;
-        p[2 * (i * n + j) + 1] = sum_im;
-        sum_re = 0;
-        sum_im = 0;
-        if (++j < n)
+
+        if (dat->packed)
+            continue;
+        /* Block finished; move on to the next one, in i,k,j order */
+        if ((j += bs) < n)
             continue;
         j = 0;
-        if (++i < m)
+        if ((k += bs) < q)
             continue;
-        else {
-            dat->completion(ERR_NONE, dat->result);
-            free(dat);
-            return ERR_NONE;
-        }
+        k = 0;
+        if ((i += bs) < m)
+            continue;
+        matrix_mul_finish(dat, ERR_NONE);
+        return ERR_NONE;
     }
 
     dat->i = i;
     dat->j = j;
     dat->k = k;
-    dat->sum_re = sum_re;
-    dat->sum_im = sum_im;
+    dat->ii = ii;
+    dat->jj = jj;
     return ERR_INTERRUPTIBLE;
 }
 
 int linalg_mul(const vartype *left, const vartype *right,
                                     void (*completion)(int, vartype *)) {
-    if (left->type == TYPE_REALMATRIX) {
-        if (right->type == TYPE_REALMATRIX)
-            return matrix_mul_rr((vartype_realmatrix *) left,
-                                 (vartype_realmatrix *) right,
-                                 completion);
-        else
-            return matrix_mul_rc((vartype_realmatrix *) left,
-                                 (vartype_complexmatrix *) right,
-                                 completion);
-    } else {
-        if (right->type == TYPE_REALMATRIX)
-            return matrix_mul_cr((vartype_complexmatrix *) left,
-                                 (vartype_realmatrix *) right,
-                                 completion);
-        else
-            return matrix_mul_cc((vartype_complexmatrix *) left,
-                                 (vartype_complexmatrix *) right,
-                                 completion);
-    }
+    return matrix_mul(left, right, completion);
 }
 
 
@@ -977,8 +915,10 @@ int linalg_mul(const vartype *left, const vartype *right,
 /***** Matrix inverse *****/
 /**************************/
 
-static void (*linalg_inv_completion)(int error, vartype *det);
-static vartype *linalg_inv_result;
+static CORE_STATE void (*linalg_inv_completion)(int error, vartype *det);
+static CORE_STATE const vartype *linalg_inv_src;
+static CORE_STATE vartype *linalg_inv_result;
+static CORE_STATE bool linalg_inv_cached;
 
 static int inv_r_completion1(int error, vartype_realmatrix *a, int4 *perm,
                                 phloat det);
@@ -992,6 +932,9 @@ static void inv_c_completion2(int error, vartype_complexmatrix *a, int4 *perm,
 int linalg_inv(const vartype *src, void (*completion)(int, vartype *)) {
     int4 n;
     int4 *perm;
+    lu_cache *c;
+    linalg_inv_src = src;
+    linalg_inv_cached = false;
     if (src->type == TYPE_REALMATRIX) {
         vartype_realmatrix *ma = (vartype_realmatrix *) src;
         vartype *lu, *inv;
@@ -1000,7 +943,19 @@ int linalg_inv(const vartype *src, void (*completion)(int, vartype *)) {
             return ERR_DIMENSION_ERROR;
         if (!contains_no_strings(ma))
             return ERR_ALPHA_DATA_IS_INVALID;
-        lu = new_realmatrix(n, n);
+        c = get_lu(src, core_settings.matrix_singularmatrix);
+        if (c != NULL) {
+            /* Decomposed before; go straight to the back-substitution */
+            inv = new_realmatrix(n, n);
+            if (inv == NULL)
+                return ERR_INSUFFICIENT_MEMORY;
+            linalg_inv_completion = completion;
+            linalg_inv_result = inv;
+            linalg_inv_cached = true;
+            return inv_r_completion1(ERR_NONE,
+                            (vartype_realmatrix *) c->lu, c->perm, c->det_re);
+        }
+        lu = new_realmatrix(n, n, false);
         if (lu == NULL)
             return ERR_INSUFFICIENT_MEMORY;
         inv = new_realmatrix(n, n);
@@ -1024,7 +979,20 @@ int linalg_inv(const vartype *src, void (*completion)(int, vartype *)) {
         n = ma->rows;
         if (n != ma->columns)
             return ERR_DIMENSION_ERROR;
-        lu = new_complexmatrix(n, n);
+        c = get_lu(src, core_settings.matrix_singularmatrix);
+        if (c != NULL) {
+            /* Decomposed before; go straight to the back-substitution */
+            inv = new_complexmatrix(n, n);
+            if (inv == NULL)
+                return ERR_INSUFFICIENT_MEMORY;
+            linalg_inv_completion = completion;
+            linalg_inv_result = inv;
+            linalg_inv_cached = true;
+            return inv_c_completion1(ERR_NONE,
+                            (vartype_complexmatrix *) c->lu, c->perm,
+                            c->det_re, c->det_im);
+        }
+        lu = new_complexmatrix(n, n, false);
         if (lu == NULL)
             return ERR_INSUFFICIENT_MEMORY;
         inv = new_complexmatrix(n, n);
@@ -1057,6 +1025,9 @@ static int inv_r_completion1(int error, vartype_realmatrix *a, int4 *perm,
     } else {
         int4 i, n = a->rows;
         vartype_realmatrix *inv = (vartype_realmatrix *) linalg_inv_result;
+        if (!linalg_inv_cached)
+            linalg_inv_cached = keep_lu(linalg_inv_src, (vartype *) a, perm,
+                        det, 0, core_settings.matrix_singularmatrix);
         for (i = 0; i < n; i++)
             inv->array->data[i * (n + 1)] = 1;
         return lu_backsubst_rr(a, perm, inv, inv_r_completion2);
@@ -1067,8 +1038,10 @@ static void inv_r_completion2(int error, vartype_realmatrix *a, int4 *perm,
                                 vartype_realmatrix *b) {
     if (error != ERR_NONE)
         free_vartype(linalg_inv_result); /* Note: linalg_inv_result == b */
-    free_vartype((vartype *) a);
-    free(perm);
+    if (!linalg_inv_cached) {
+        free_vartype((vartype *) a);
+        free(perm);
+    }
     linalg_inv_completion(error, linalg_inv_result);
 }
 
@@ -1084,6 +1057,9 @@ static int inv_c_completion1(int error, vartype_complexmatrix *a, int4 *perm,
         int4 i, n = a->rows;
         vartype_complexmatrix *inv =
                             (vartype_complexmatrix *) linalg_inv_result;
+        if (!linalg_inv_cached)
+            linalg_inv_cached = keep_lu(linalg_inv_src, (vartype *) a, perm,
+                        det_re, det_im, core_settings.matrix_singularmatrix);
         for (i = 0; i < n; i++)
             inv->array->data[2 * (i * (n + 1))] = 1;
         return lu_backsubst_cc(a, perm, inv, inv_c_completion2);
@@ -1094,8 +1070,10 @@ static void inv_c_completion2(int error, vartype_complexmatrix *a, int4 *perm,
                                 vartype_complexmatrix *b) {
     if (error != ERR_NONE)
         free_vartype(linalg_inv_result); /* Note: linalg_inv_result == b */
-    free_vartype((vartype *) a);
-    free(perm);
+    if (!linalg_inv_cached) {
+        free_vartype((vartype *) a);
+        free(perm);
+    }
     linalg_inv_completion(error, linalg_inv_result);
 }
 
@@ -1104,17 +1082,24 @@ static void inv_c_completion2(int error, vartype_complexmatrix *a, int4 *perm,
 /***** Matrix determinant *****/
 /******************************/
 
-static void (*linalg_det_completion)(int error, vartype *det);
-static bool linalg_det_prev_sm_err;
+static CORE_STATE void (*linalg_det_completion)(int error, vartype *det);
+static CORE_STATE const vartype *linalg_det_src;
+static CORE_STATE bool linalg_det_prev_sm_err;
 
 static int det_r_completion(int error, vartype_realmatrix *a, int4 *perm,
                                     phloat det);
 static int det_c_completion(int error, vartype_complexmatrix *a, int4 *perm,
                                     phloat det_re, phloat det_im);
+static int det_r_result(int error, phloat det);
+static int det_c_result(int error, phloat det_re, phloat det_im);
 
 int linalg_det(const vartype *src, void (*completion)(int, vartype *)) {
     int4 n;
     int4 *perm;
+    /* The determinant is computed with the 'singular matrix' error mode on;
+     * see below. */
+    lu_cache *c = get_lu(src, true);
+    linalg_det_src = src;
     if (src->type == TYPE_REALMATRIX) {
         vartype_realmatrix *ma = (vartype_realmatrix *) src;
         n = ma->rows;
@@ -1126,6 +1111,10 @@ int linalg_det(const vartype *src, void (*completion)(int, vartype *)) {
             completion(ERR_ALPHA_DATA_IS_INVALID, 0);
             return ERR_ALPHA_DATA_IS_INVALID;
         }
+        if (c != NULL) {
+            linalg_det_completion = completion;
+            return det_r_result(ERR_NONE, c->det_re);
+        }
         ma = (vartype_realmatrix *) dup_vartype(src);
         if (ma == NULL) {
             completion(ERR_INSUFFICIENT_MEMORY, 0);
@@ -1160,6 +1149,10 @@ int linalg_det(const vartype *src, void (*completion)(int, vartype *)) {
         n = ma->rows;
         if (n != ma->columns)
             return ERR_DIMENSION_ERROR;
+        if (c != NULL) {
+            linalg_det_completion = completion;
+            return det_c_result(ERR_NONE, c->det_re, c->det_im);
+        }
         ma = (vartype_complexmatrix *) dup_vartype(src);
         if (ma == NULL)
             return ERR_INSUFFICIENT_MEMORY;
@@ -1191,12 +1184,19 @@ int linalg_det(const vartype *src, void (*completion)(int, vartype *)) {
 
 static int det_r_completion(int error, vartype_realmatrix *a, int4 *perm,
                                          phloat det) {
-    vartype *det_v;
-
     core_settings.matrix_singularmatrix = linalg_det_prev_sm_err;
 
-    free_vartype((vartype *) a);
-    free(perm);
+    if (error != ERR_NONE
+            || !keep_lu(linalg_det_src, (vartype *) a, perm, det, 0, true)) {
+        free_vartype((vartype *) a);
+        free(perm);
+    }
+    return det_r_result(error, det);
+}
+
+static int det_r_result(int error, phloat det) {
+    vartype *det_v;
+
     if (error == ERR_SINGULAR_MATRIX) {
         det = 0;
         error = ERR_NONE;
@@ -1222,12 +1222,20 @@ static int det_r_completion(int error, vartype_realmatrix *a, int4 *perm,
 
 static int det_c_completion(int error, vartype_complexmatrix *a, int4 *perm,
                                     phloat det_re, phloat det_im) {
-    vartype *det_v;
-
     core_settings.matrix_singularmatrix = linalg_det_prev_sm_err;
 
-    free_vartype((vartype *) a);
-    free(perm);
+    if (error != ERR_NONE
+            || !keep_lu(linalg_det_src, (vartype *) a, perm,
+                        det_re, det_im, true)) {
+        free_vartype((vartype *) a);
+        free(perm);
+    }
+    return det_c_result(error, det_re, det_im);
+}
+
+static int det_c_result(int error, phloat det_re, phloat det_im) {
+    vartype *det_v;
+
     if (error == ERR_SINGULAR_MATRIX) {
         det_re = 0;
         det_im = 0;
@@ -1257,3 +1265,19 @@ static int det_c_completion(int error, vartype_complexmatrix *a, int4 *perm,
     linalg_det_completion(error, det_v);
     return error;
 }
+
+void visit_linalg1_state(state_visitor visit, void *cd) {
+    VISIT_STATE(linalg_div_completion);
+    VISIT_STATE(linalg_div_left);
+    VISIT_STATE(linalg_div_right);
+    VISIT_STATE(linalg_div_result);
+    VISIT_STATE(linalg_div_cached);
+    VISIT_STATE(mul_data);
+    VISIT_STATE(linalg_inv_completion);
+    VISIT_STATE(linalg_inv_src);
+    VISIT_STATE(linalg_inv_result);
+    VISIT_STATE(linalg_inv_cached);
+    VISIT_STATE(linalg_det_completion);
+    VISIT_STATE(linalg_det_src);
+    VISIT_STATE(linalg_det_prev_sm_err);
+}
@@ -27,4 +27,6 @@ int linalg_mul(const vartype *left, const vartype *right,
 int linalg_inv(const vartype *src, void (*completion)(int, vartype *));
 int linalg_det(const vartype *src, void (*completion)(int, vartype *));
 
+void visit_linalg1_state(state_visitor visit, void *cd);
+
 #endif
@@ -21,20 +21,281 @@
 #include "core_globals.h"
 #include "core_main.h"
 
-
-#define STATE(s)             \
-        if (--count <= 0) {  \
-            dat->state = s;  \
-            goto suspend;    \
-        }                    \
-        state##s:            \
+#ifdef FREE42_WORKERS
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+
+#define STATE(s)                                \
+        if (--count <= 0) {                     \
+            if (interruptible_slice_done()) {   \
+                dat->state = s;                 \
+                goto suspend;                   \
+            }                                   \
+            count = SLICE_CHECK;                \
+        }                                       \
+        state##s:                               \
         ;
 
 
+/***********************/
+/***** Worker pool *****/
+/***********************/
+
+/* Large matrix multiplications and LU decompositions are split into tasks,
+ * which are run by a small pool of worker threads. The pool is shared by all
+ * calculator contexts, and runs one job at a time; a job consists of a task
+ * function, which is called once for each task number from 0 to ntasks - 1,
+ * in no particular order and on no particular thread. Tasks must not use any
+ * of the core's global state, since that may be thread-local, and may be in
+ * use by the calculator thread in the mean time; everything they need has to
+ * be reachable through their data pointer.
+ * The calculator thread doesn't block while a job is running: the
+ * interruptible worker that started it polls it using linalg_pool_wait(),
+ * and returns ERR_INTERRUPTIBLE while it is still busy, so EXIT still works.
+ * Long-running tasks should check linalg_pool_stopped() now and then, and
+ * return early when it returns true.
+ */
+
+#ifdef FREE42_WORKERS
+
+#define POOL_MAX_THREADS 8
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static int pool_threads = -1;
+static bool pool_busy = false;
+static int (*pool_task)(void *data, int4 t);
+static void *pool_data;
+static int4 pool_ntasks = 0;
+static int4 pool_next = 0;
+static int4 pool_active = 0;
+static int pool_error;
+
+static void *pool_thread(void *arg) {
+    pthread_mutex_lock(&pool_mutex);
+    while (true) {
+        while (pool_next >= pool_ntasks)
+            pthread_cond_wait(&pool_work, &pool_mutex);
+        int (*task)(void *, int4) = pool_task;
+        void *data = pool_data;
+        int4 t = pool_next++;
+        pool_active++;
+        pthread_mutex_unlock(&pool_mutex);
+        int err = task(data, t);
+        pthread_mutex_lock(&pool_mutex);
+        if (err != ERR_NONE && pool_error == ERR_NONE) {
+            /* The first error ends the job; tasks that haven't been
+             * started yet are skipped.
+             */
+            pool_error = err;
+            pool_next = pool_ntasks;
+        }
+        if (--pool_active == 0 && pool_next >= pool_ntasks)
+            pthread_cond_broadcast(&pool_done);
+    }
+    return NULL;
+}
+
+int linalg_pool_threads() {
+    pthread_mutex_lock(&pool_mutex);
+    if (pool_threads == -1) {
+        /* Start the threads the first time we need them. With only one
+         * CPU, there is no point in having any.
+         */
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int n = cpus < 2 ? 0 : cpus > POOL_MAX_THREADS ? POOL_MAX_THREADS
+                                                       : (int) cpus;
+        pool_threads = 0;
+        while (pool_threads < n) {
+            pthread_t t;
+            if (pthread_create(&t, NULL, pool_thread, NULL) != 0)
+                break;
+            pthread_detach(t);
+            pool_threads++;
+        }
+    }
+    int n = pool_threads < 2 ? 0 : pool_threads;
+    pthread_mutex_unlock(&pool_mutex);
+    return n;
+}
+
+bool linalg_pool_start(int (*task)(void *data, int4 t), void *data,
+                                                                int4 ntasks) {
+    if (linalg_pool_threads() == 0)
+        return false;
+    pthread_mutex_lock(&pool_mutex);
+    bool ok = !pool_busy;
+    if (ok) {
+        pool_busy = true;
+        pool_task = task;
+        pool_data = data;
+        pool_error = ERR_NONE;
+        pool_next = 0;
+        pool_ntasks = ntasks;
+        pthread_cond_broadcast(&pool_work);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    return ok;
+}
+
+int linalg_pool_wait(int ms) {
+    struct timeval now;
+    struct timespec until;
+    gettimeofday(&now, NULL);
+    until.tv_sec = now.tv_sec + ms / 1000;
+    until.tv_nsec = (now.tv_usec + ms % 1000 * 1000) * 1000;
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&pool_mutex);
+    while (pool_next < pool_ntasks || pool_active > 0)
+        if (pthread_cond_timedwait(&pool_done, &pool_mutex, &until)
+                                                            == ETIMEDOUT)
+            break;
+    int err;
+    if (pool_next < pool_ntasks || pool_active > 0)
+        err = ERR_INTERRUPTIBLE;
+    else {
+        err = pool_error;
+        pool_busy = false;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    return err;
+}
+
+bool linalg_pool_stopped() {
+    pthread_mutex_lock(&pool_mutex);
+    bool stopped = pool_error != ERR_NONE;
+    pthread_mutex_unlock(&pool_mutex);
+    return stopped;
+}
+
+void linalg_pool_cancel() {
+    pthread_mutex_lock(&pool_mutex);
+    if (pool_error == ERR_NONE)
+        pool_error = ERR_INTERRUPTED;
+    pool_next = pool_ntasks;
+    while (pool_active > 0)
+        pthread_cond_wait(&pool_done, &pool_mutex);
+    pool_busy = false;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+#else
+
+int linalg_pool_threads() {
+    return 0;
+}
+
+bool linalg_pool_start(int (*task)(void *data, int4 t), void *data,
+                                                                int4 ntasks) {
+    return false;
+}
+
+int linalg_pool_wait(int ms) {
+    return ERR_NONE;
+}
+
+bool linalg_pool_stopped() {
+    return false;
+}
+
+void linalg_pool_cancel() {
+    // Nothing to do
+}
+
+#endif
+
+
 /****************************/
 /***** LU decomposition *****/
 /****************************/
 
+/* The decomposition is done right-looking, in panels of LU_PANEL columns:
+ * each column in the panel gets its pivot and its column of L, and the rest
+ * of the panel is updated right away; then the pivot rows are finished to the
+ * right of the panel, and finally the whole submatrix below and to the right
+ * of the panel is updated with all the panel's columns at once. That last
+ * step does most of the work, and it goes through the matrix in tiles of
+ * columns, so that the part of the pivot rows being used stays in the cache
+ * while going down the rows. Each element still gets the same updates, in the
+ * same order, as in Crout's method, so the results are identical; the
+ * updates within the trailing submatrix are independent of each other, so for
+ * matrices of at least LU_POOL_MIN rows, they are split over the worker
+ * pool's threads, a range of rows each.
+ * Crout's method stops searching for a pivot when it gets to a row that was
+ * all zeros to begin with, leaving the rows below it partially updated; the
+ * right-looking order can't reproduce that, so matrices with rows of zeros
+ * are left to the Crout code.
+ */
+#define LU_PANEL 16
+#define LU_TILE (16384 / (LU_PANEL * (int4) sizeof(phloat)))
+#ifdef BCD_MATH
+#define LU_POOL_MIN 32
+#else
+#define LU_POOL_MIN 128
+#endif
+
+/* For a zero pivot, substitute a small positive number.
+ * I use a number that's about 10^-20 times the size of
+ * the maximum of the original column, with a minimum of
+ * 10^20 / POS_HUGE_PHLOAT.
+ */
+static phloat lu_tiny_pivot(phloat scale) {
+    phloat tiniest = 1e20 / POS_HUGE_PHLOAT;
+    phloat tiny;
+    if (scale == 0)
+        return tiniest;
+    tiny = pow(10, floor(log10(scale)) - 20);
+    return tiny < tiniest ? tiniest : tiny;
+}
+
+/* Apply the updates from pivot rows k0 through k1 - 1 to columns c0 through
+ * c1 - 1 of rows i through iend - 1.
+ */
+static void lu_update_r(phloat *a, int4 n, int4 k0, int4 k1,
+                        int4 c0, int4 c1, int4 i, int4 iend) {
+    for (int4 t = c0; t < c1; t += LU_TILE) {
+        int4 tend = t + LU_TILE < c1 ? t + LU_TILE : c1;
+        for (int4 ii = i; ii < iend; ii++) {
+            phloat *r = a + ii * n;
+            for (int4 k = k0; k < k1; k++) {
+                phloat *u = a + k * n;
+                phloat l = r[k];
+                for (int4 c = t; c < tend; c++)
+                    r[c] -= l * u[c];
+            }
+        }
+    }
+}
+
+static void lu_update_c(phloat *a, int4 n, int4 k0, int4 k1,
+                        int4 c0, int4 c1, int4 i, int4 iend) {
+    for (int4 t = c0; t < c1; t += LU_TILE / 2) {
+        int4 tend = t + LU_TILE / 2 < c1 ? t + LU_TILE / 2 : c1;
+        for (int4 ii = i; ii < iend; ii++) {
+            phloat *r = a + 2 * ii * n;
+            for (int4 k = k0; k < k1; k++) {
+                phloat *u = a + 2 * k * n;
+                phloat xre = r[2 * k];
+                phloat xim = r[2 * k + 1];
+                for (int4 c = t; c < tend; c++) {
+                    phloat yre = u[2 * c];
+                    phloat yim = u[2 * c + 1];
+                    r[2 * c] -= xre * yre - xim * yim;
+                    r[2 * c + 1] -= xim * yre + xre * yim;
+                }
+            }
+        }
+    }
+}
+
 typedef struct {
     vartype_realmatrix *a;
     int4 *perm;
@@ -42,12 +303,14 @@ typedef struct {
     int4 i, imax, j, k;
     phloat max, tmp, sum, *scale;
     int state;
+    int4 ntasks;
     int (*completion)(int, vartype_realmatrix *, int4 *, phloat);
 } lu_r_data_struct;
 
-lu_r_data_struct *lu_r_data;
+CORE_STATE lu_r_data_struct *lu_r_data;
 
 static int lu_decomp_r_worker(int interrupted);
+static int lu_decomp_r_blocked_worker(int interrupted);
 
 int lu_decomp_r(vartype_realmatrix *a, int4 *perm,
                 int (*completion)(int, vartype_realmatrix *, int4 *, phloat)) {
@@ -70,7 +333,9 @@ int lu_decomp_r(vartype_realmatrix *a, int4 *perm,
     dat->state = 0;
 
     lu_r_data = dat;
-    mode_interruptible = lu_decomp_r_worker;
+    dat->i = 0;
+    dat->ntasks = a->rows >= LU_POOL_MIN ? linalg_pool_threads() : 0;
+    mode_interruptible = lu_decomp_r_blocked_worker;
     mode_stoppable = false;
     return ERR_INTERRUPTIBLE;
 }
@@ -83,7 +348,7 @@ static int lu_decomp_r_worker(int interrupted) {
     int4 n = dat->a->rows;
     phloat *scale = dat->scale;
     int4 *perm = dat->perm;
-    int count = 1000;
+    int count = SLICE_CHECK;
     int err;
 
     int4 i = dat->i;
@@ -173,23 +438,8 @@ static int lu_decomp_r_worker(int interrupted) {
                 err = dat->completion(ERR_SINGULAR_MATRIX, dat->a, perm, 0);
                 free(dat);
                 return err;
-            } else {
-                /* For a zero pivot, substitute a small positive number.
-                 * I use a number that's about 10^-20 times the size of
-                 * the maximum of the original column, with a minimum of
-                 * 10^20 / POS_HUGE_PHLOAT.
-                 */
-                phloat tiniest = 1e20 / POS_HUGE_PHLOAT;
-                phloat tiny;
-                if (scale[j] == 0)
-                    tiny = tiniest;
-                else {
-                    tiny = pow(10, floor(log10(scale[j])) - 20);
-                    if (tiny < tiniest)
-                        tiny = tiniest;
-                }
-                a[j * n + j] = tiny;
-            }
+            } else
+                a[j * n + j] = lu_tiny_pivot(scale[j]);
         }
         dat->det *= a[j * n + j];
         if (j != n - 1) {
@@ -217,6 +467,191 @@ static int lu_decomp_r_worker(int interrupted) {
     return ERR_INTERRUPTIBLE;
 }
 
+static int lu_update_r_task(void *data, int4 t) {
+    lu_r_data_struct *dat = (lu_r_data_struct *) data;
+    phloat *a = dat->a->array->data;
+    int4 n = dat->a->rows;
+    int4 j = dat->j;
+    int4 pend = j + LU_PANEL < n ? j + LU_PANEL : n;
+    int4 rows = n - pend;
+    int4 i = pend + rows * t / dat->ntasks;
+    int4 iend = pend + rows * (t + 1) / dat->ntasks;
+    for (; i < iend; i += LU_PANEL) {
+        if (linalg_pool_stopped())
+            return ERR_INTERRUPTED;
+        lu_update_r(a, n, j, pend, pend, n,
+                    i, i + LU_PANEL < iend ? i + LU_PANEL : iend);
+    }
+    return ERR_NONE;
+}
+
+static int lu_decomp_r_blocked_worker(int interrupted) {
+
+    lu_r_data_struct *dat = lu_r_data;
+
+    phloat *a = dat->a->array->data;
+    int4 n = dat->a->rows;
+    phloat *scale = dat->scale;
+    int4 *perm = dat->perm;
+    int count = SLICE_CHECK;
+    int err;
+
+    int4 i, iend, imax, j, k, pend;
+    phloat max, tmp, sum;
+
+    if (interrupted) {
+        if (dat->state == 4)
+            linalg_pool_cancel();
+        free(scale);
+        err = dat->completion(ERR_INTERRUPTED, dat->a, perm, 0);
+        free(dat);
+        return err;
+    }
+
+    if (dat->state == 0) {
+        for (i = dat->i; i < n; i++) {
+            if (count <= 0) {
+                if (interruptible_slice_done()) {
+                    dat->i = i;
+                    return ERR_INTERRUPTIBLE;
+                }
+                count = SLICE_CHECK;
+            }
+            max = 0;
+            for (j = 0; j < n; j++) {
+                tmp = a[i * n + j];
+                if (tmp < 0)
+                    tmp = -tmp;
+                if (tmp > max)
+                    max = tmp;
+            }
+            if (max == 0) {
+                /* A row of zeros; leave it to Crout's method */
+                mode_interruptible = lu_decomp_r_worker;
+                return ERR_INTERRUPTIBLE;
+            }
+            scale[i] = max;
+            count -= n;
+        }
+        dat->det = 1;
+        dat->j = 0;
+        dat->k = 0;
+        dat->state = 1;
+    }
+
+    while (true) {
+        if (count <= 0) {
+            if (interruptible_slice_done())
+                return ERR_INTERRUPTIBLE;
+            count = SLICE_CHECK;
+        }
+        j = dat->j;
+        pend = j + LU_PANEL < n ? j + LU_PANEL : n;
+
+        switch (dat->state) {
+        case 1:
+            /* Column k is complete from row k down, so we can pick the pivot */
+            k = dat->k;
+            max = 0;
+            imax = k;
+            for (i = k; i < n; i++) {
+                sum = a[i * n + k];
+                tmp = (sum < 0 ? -sum : sum) / scale[i];
+                if (tmp > max) {
+                    imax = i;
+                    max = tmp;
+                }
+            }
+
+            if (k != imax) {
+                for (i = 0; i < n; i++) {
+                    tmp = a[imax * n + i];
+                    a[imax * n + i] = a[k * n + i];
+                    a[k * n + i] = tmp;
+                }
+                dat->det = -dat->det;
+                scale[imax] = scale[k];
+            }
+
+            perm[k] = imax;
+            if (a[k * n + k] == 0) {
+                if (core_settings.matrix_singularmatrix) {
+                    free(scale);
+                    err = dat->completion(ERR_SINGULAR_MATRIX, dat->a, perm, 0);
+                    free(dat);
+                    return err;
+                } else
+                    a[k * n + k] = lu_tiny_pivot(scale[k]);
+            }
+            dat->det *= a[k * n + k];
+            if (k != n - 1) {
+                tmp = 1 / a[k * n + k];
+                for (i = k + 1; i < n; i++)
+                    a[i * n + k] *= tmp;
+            }
+
+            /* Update the rest of the panel */
+            lu_update_r(a, n, k, k + 1, k + 1, pend, k + 1, n);
+            count -= (n - k) * (pend - k + 1);
+            if (++dat->k < pend)
+                break;
+            if (pend == n)
+                goto done;
+            dat->i = j + 1;
+            dat->state = 2;
+            break;
+
+        case 2:
+            /* Finish the pivot rows to the right of the panel */
+            for (i = dat->i; i < pend; i++)
+                lu_update_r(a, n, j, i, pend, n, i, i + 1);
+            count -= (pend - j) * (pend - j) * (n - pend) / 2;
+            dat->i = pend;
+            if (dat->ntasks > 0 && n - pend >= LU_POOL_MIN
+                    && linalg_pool_start(lu_update_r_task, dat, dat->ntasks)) {
+                dat->state = 4;
+                break;
+            }
+            dat->state = 3;
+            break;
+
+        case 3:
+            /* Update the trailing submatrix */
+            i = dat->i;
+            iend = i + LU_PANEL < n ? i + LU_PANEL : n;
+            lu_update_r(a, n, j, pend, pend, n, i, iend);
+            count -= (iend - i) * (pend - j) * (n - pend);
+            dat->i = iend;
+            if (iend < n)
+                break;
+            dat->j = pend;
+            dat->state = 1;
+            break;
+
+        case 4:
+            err = linalg_pool_wait(interruptible_slice_left());
+            if (err == ERR_INTERRUPTIBLE)
+                return err;
+            if (err != ERR_NONE) {
+                free(scale);
+                err = dat->completion(err, dat->a, perm, 0);
+                free(dat);
+                return err;
+            }
+            count = 0;
+            dat->j = pend;
+            dat->state = 1;
+            break;
+        }
+    }
+
+    done:
+    free(scale);
+    err = dat->completion(ERR_NONE, dat->a, perm, dat->det);
+    free(dat);
+    return err;
+}
+
 
 typedef struct {
     vartype_complexmatrix *a;
@@ -225,12 +660,14 @@ typedef struct {
     int4 i, imax, j, k;
     phloat max, tmp, tmp_re, tmp_im, sum_re, sum_im, s_re, s_im, *scale;
     int state;
+    int4 ntasks;
     int (*completion)(int, vartype_complexmatrix *, int4 *, phloat, phloat);
 } lu_c_data_struct;
 
-lu_c_data_struct *lu_c_data;
+CORE_STATE lu_c_data_struct *lu_c_data;
 
 static int lu_decomp_c_worker(int interrupted);
+static int lu_decomp_c_blocked_worker(int interrupted);
 
 int lu_decomp_c(vartype_complexmatrix *a, int4 *perm,
                 int (*completion)(int, vartype_complexmatrix *,
@@ -254,7 +691,9 @@ int lu_decomp_c(vartype_complexmatrix *a, int4 *perm,
     dat->state = 0;
 
     lu_c_data = dat;
-    mode_interruptible = lu_decomp_c_worker;
+    dat->i = 0;
+    dat->ntasks = a->rows >= LU_POOL_MIN ? linalg_pool_threads() : 0;
+    mode_interruptible = lu_decomp_c_blocked_worker;
     mode_stoppable = false;
     return ERR_INTERRUPTIBLE;
 }
@@ -267,7 +706,7 @@ static int lu_decomp_c_worker(int interrupted) {
     int4 n = dat->a->rows;
     phloat *scale = dat->scale;
     int4 *perm = dat->perm;
-    int count = 1000;
+    int count = SLICE_CHECK;
     int err;
 
     int4 i = dat->i;
@@ -284,8 +723,6 @@ static int lu_decomp_c_worker(int interrupted) {
     phloat s_im = dat->s_im;
 
     phloat xre, xim, yre, yim;
-    phloat tiniest = 1e20 / POS_HUGE_PHLOAT;
-    phloat tiny;
 
     if (interrupted) {
         free(scale);
@@ -335,6 +772,7 @@ static int lu_decomp_c_worker(int interrupted) {
         }
 
         max = 0;
+        imax = j;
         for (i = j; i < n; i++) {
             sum_re = a[2 * (i * n + j)];
             sum_im = a[2 * (i * n + j) + 1];
@@ -385,19 +823,7 @@ static int lu_decomp_c_worker(int interrupted) {
                 free(dat);
                 return err;
             } else {
-                /* For a zero pivot, substitute a small positive number.
-                 * I use a number that's about 10^-20 times the size of
-                 * the maximum of the original column, with a minimum of
-                 * 10^20 / POS_HUGE_PHLOAT.
-                 */
-                if (scale[j] == 0)
-                    tiny = tiniest;
-                else {
-                    tiny = pow(10, floor(log10(scale[j])) - 20);
-                    if (tiny < tiniest)
-                        tiny = tiniest;
-                }
-                a[2 * (j * n + j)] = tmp_re = tiny;
+                a[2 * (j * n + j)] = tmp_re = lu_tiny_pivot(scale[j]);
                 a[2 * (j * n + j) + 1] = tmp_im = 0;
             }
         }
@@ -439,6 +865,205 @@ static int lu_decomp_c_worker(int interrupted) {
     return ERR_INTERRUPTIBLE;
 }
 
+static int lu_update_c_task(void *data, int4 t) {
+    lu_c_data_struct *dat = (lu_c_data_struct *) data;
+    phloat *a = dat->a->array->data;
+    int4 n = dat->a->rows;
+    int4 j = dat->j;
+    int4 pend = j + LU_PANEL < n ? j + LU_PANEL : n;
+    int4 rows = n - pend;
+    int4 i = pend + rows * t / dat->ntasks;
+    int4 iend = pend + rows * (t + 1) / dat->ntasks;
+    for (; i < iend; i += LU_PANEL) {
+        if (linalg_pool_stopped())
+            return ERR_INTERRUPTED;
+        lu_update_c(a, n, j, pend, pend, n,
+                    i, i + LU_PANEL < iend ? i + LU_PANEL : iend);
+    }
+    return ERR_NONE;
+}
+
+static int lu_decomp_c_blocked_worker(int interrupted) {
+
+    lu_c_data_struct *dat = lu_c_data;
+
+    phloat *a = dat->a->array->data;
+    int4 n = dat->a->rows;
+    phloat *scale = dat->scale;
+    int4 *perm = dat->perm;
+    int count = SLICE_CHECK;
+    int err;
+
+    int4 i, iend, imax, j, k, pend;
+    phloat max, tmp, tmp_re, tmp_im, s_re, s_im;
+
+    if (interrupted) {
+        if (dat->state == 4)
+            linalg_pool_cancel();
+        free(scale);
+        err = dat->completion(ERR_INTERRUPTED, dat->a, perm, 0, 0);
+        free(dat);
+        return err;
+    }
+
+    if (dat->state == 0) {
+        for (i = dat->i; i < n; i++) {
+            if (count <= 0) {
+                if (interruptible_slice_done()) {
+                    dat->i = i;
+                    return ERR_INTERRUPTIBLE;
+                }
+                count = SLICE_CHECK;
+            }
+            max = 0;
+            for (j = 0; j < n; j++) {
+                tmp = hypot(a[2 * (i * n + j)], a[2 * (i * n + j) + 1]);
+                if (tmp > max)
+                    max = tmp;
+            }
+            if (max == 0) {
+                /* A row of zeros; leave it to Crout's method */
+                mode_interruptible = lu_decomp_c_worker;
+                return ERR_INTERRUPTIBLE;
+            }
+            scale[i] = max;
+            count -= n;
+        }
+        dat->det_re = 1;
+        dat->det_im = 0;
+        dat->j = 0;
+        dat->k = 0;
+        dat->state = 1;
+    }
+
+    while (true) {
+        if (count <= 0) {
+            if (interruptible_slice_done())
+                return ERR_INTERRUPTIBLE;
+            count = SLICE_CHECK;
+        }
+        j = dat->j;
+        pend = j + LU_PANEL < n ? j + LU_PANEL : n;
+
+        switch (dat->state) {
+        case 1:
+            /* Column k is complete from row k down, so we can pick the pivot */
+            k = dat->k;
+            max = 0;
+            imax = k;
+            for (i = k; i < n; i++) {
+                tmp = hypot(a[2 * (i * n + k)], a[2 * (i * n + k) + 1]) / scale[i];
+                if (tmp > max) {
+                    imax = i;
+                    max = tmp;
+                }
+            }
+
+            if (k != imax) {
+                for (i = 0; i < n; i++) {
+                    tmp = a[2 * (imax * n + i)];
+                    a[2 * (imax * n + i)] = a[2 * (k * n + i)];
+                    a[2 * (k * n + i)] = tmp;
+                    tmp = a[2 * (imax * n + i) + 1];
+                    a[2 * (imax * n + i) + 1] = a[2 * (k * n + i) + 1];
+                    a[2 * (k * n + i) + 1] = tmp;
+                }
+                dat->det_re = -dat->det_re;
+                dat->det_im = -dat->det_im;
+                scale[imax] = scale[k];
+            }
+
+            perm[k] = imax;
+            tmp_re = a[2 * (k * n + k)];
+            tmp_im = a[2 * (k * n + k) + 1];
+            if (tmp_re == 0 && tmp_im == 0) {
+                if (core_settings.matrix_singularmatrix) {
+                    free(scale);
+                    err = dat->completion(ERR_NONE, dat->a, perm, 0, 0);
+                    free(dat);
+                    return err;
+                } else {
+                    a[2 * (k * n + k)] = tmp_re = lu_tiny_pivot(scale[k]);
+                    a[2 * (k * n + k) + 1] = tmp_im = 0;
+                }
+            }
+            tmp = dat->det_re * tmp_re - dat->det_im * tmp_im;
+            dat->det_im = dat->det_im * tmp_re + dat->det_re * tmp_im;
+            dat->det_re = tmp;
+            if (k != n - 1) {
+                tmp = hypot(tmp_re, tmp_im);
+                s_re = tmp_re / tmp / tmp;
+                s_im = -tmp_im / tmp / tmp;
+                for (i = k + 1; i < n; i++) {
+                    tmp_re = a[2 * (i * n + k)];
+                    tmp_im = a[2 * (i * n + k) + 1];
+                    a[2 * (i * n + k)] = tmp_re * s_re - tmp_im * s_im;
+                    a[2 * (i * n + k) + 1] = tmp_im * s_re + tmp_re * s_im;
+                }
+            }
+
+            /* Update the rest of the panel */
+            lu_update_c(a, n, k, k + 1, k + 1, pend, k + 1, n);
+            count -= (n - k) * (pend - k + 1);
+            if (++dat->k < pend)
+                break;
+            if (pend == n)
+                goto done;
+            dat->i = j + 1;
+            dat->state = 2;
+            break;
+
+        case 2:
+            /* Finish the pivot rows to the right of the panel */
+            for (i = dat->i; i < pend; i++)
+                lu_update_c(a, n, j, i, pend, n, i, i + 1);
+            count -= (pend - j) * (pend - j) * (n - pend) / 2;
+            dat->i = pend;
+            if (dat->ntasks > 0 && n - pend >= LU_POOL_MIN
+                    && linalg_pool_start(lu_update_c_task, dat, dat->ntasks)) {
+                dat->state = 4;
+                break;
+            }
+            dat->state = 3;
+            break;
+
+        case 3:
+            /* Update the trailing submatrix */
+            i = dat->i;
+            iend = i + LU_PANEL < n ? i + LU_PANEL : n;
+            lu_update_c(a, n, j, pend, pend, n, i, iend);
+            count -= (iend - i) * (pend - j) * (n - pend);
+            dat->i = iend;
+            if (iend < n)
+                break;
+            dat->j = pend;
+            dat->state = 1;
+            break;
+
+        case 4:
+            err = linalg_pool_wait(interruptible_slice_left());
+            if (err == ERR_INTERRUPTIBLE)
+                return err;
+            if (err != ERR_NONE) {
+                free(scale);
+                err = dat->completion(err, dat->a, perm, 0, 0);
+                free(dat);
+                return err;
+            }
+            count = 0;
+            dat->j = pend;
+            dat->state = 1;
+            break;
+        }
+    }
+
+    done:
+    free(scale);
+    err = dat->completion(ERR_NONE, dat->a, perm, dat->det_re, dat->det_im);
+    free(dat);
+    return err;
+}
+
 
 /*****************************/
 /***** Back-substitution *****/
@@ -454,7 +1079,7 @@ typedef struct {
     void (*completion)(int, vartype_realmatrix *, int4 *, vartype_realmatrix *);
 } backsub_rr_data_struct;
 
-static backsub_rr_data_struct *backsub_rr_data;
+static CORE_STATE backsub_rr_data_struct *backsub_rr_data;
 
 static int lu_backsubst_rr_worker(int interrupted);
 
@@ -489,7 +1114,7 @@ static int lu_backsubst_rr_worker(int interrupted) {
     phloat *b = dat->b->array->data;
     int4 q = dat->b->columns;
     int4 *perm = dat->perm;
-    int count = 1000;
+    int count = SLICE_CHECK;
 
     int4 i = dat->i;
     int4 ii = dat->ii;
@@ -570,7 +1195,7 @@ typedef struct {
                                             vartype_complexmatrix *);
 } backsub_rc_data_struct;
 
-static backsub_rc_data_struct *backsub_rc_data;
+static CORE_STATE backsub_rc_data_struct *backsub_rc_data;
 
 static int lu_backsubst_rc_worker(int interrupted);
 
@@ -605,7 +1230,7 @@ static int lu_backsubst_rc_worker(int interrupted) {
     phloat *b = dat->b->array->data;
     int4 q = dat->b->columns;
     int4 *perm = dat->perm;
-    int count = 1000;
+    int count = SLICE_CHECK;
 
     int4 i = dat->i;
     int4 ii = dat->ii;
@@ -707,7 +1332,7 @@ typedef struct {
                                             vartype_complexmatrix *);
 } backsub_cc_data_struct;
 
-static backsub_cc_data_struct *backsub_cc_data;
+static CORE_STATE backsub_cc_data_struct *backsub_cc_data;
 
 static int lu_backsubst_cc_worker(int interrupted);
 
@@ -742,7 +1367,7 @@ static int lu_backsubst_cc_worker(int interrupted) {
     phloat *b = dat->b->array->data;
     int4 q = dat->b->columns;
     int4 *perm = dat->perm;
-    int count = 1000;
+    int count = SLICE_CHECK;
 
     int4 i = dat->i;
     int4 ii = dat->ii;
@@ -843,3 +1468,11 @@ static int lu_backsubst_cc_worker(int interrupted) {
     dat->sum_im = sum_im;
     return ERR_INTERRUPTIBLE;
 }
+
+void visit_linalg2_state(state_visitor visit, void *cd) {
+    VISIT_STATE(lu_r_data);
+    VISIT_STATE(lu_c_data);
+    VISIT_STATE(backsub_rr_data);
+    VISIT_STATE(backsub_rc_data);
+    VISIT_STATE(backsub_cc_data);
+}
@@ -20,6 +20,19 @@
 
 #include "core_globals.h"
 
+/* Worker pool for large matrix operations; see core_linalg2.cc.
+ * linalg_pool_start() returns false if the pool is not available, in which
+ * case the caller should do the work itself; linalg_pool_wait() returns
+ * ERR_INTERRUPTIBLE if the job is still running after 'ms' milliseconds,
+ * and otherwise the job's error code.
+ */
+int linalg_pool_threads();
+bool linalg_pool_start(int (*task)(void *data, int4 t), void *data,
+                                                                int4 ntasks);
+int linalg_pool_wait(int ms);
+bool linalg_pool_stopped();
+void linalg_pool_cancel();
+
 int lu_decomp_r(vartype_realmatrix *a, int4 *perm,
                        int (*completion)(int, vartype_realmatrix *,
                                           int4 *, phloat));
@@ -46,4 +59,6 @@ int lu_backsubst_cc(vartype_complexmatrix *a,
                             void (*completion)(int, vartype_complexmatrix *,
                                 int4 *, vartype_complexmatrix *));
 
+void visit_linalg2_state(state_visitor visit, void *cd);
+
 #endif
@@ -22,12 +22,17 @@
 #include <errno.h>
 
 #include "core_main.h"
+#include "core_commands1.h"
 #include "core_commands2.h"
 #include "core_commands4.h"
+#include "core_commands5.h"
+#include "core_commands7.h"
 #include "core_display.h"
 #include "core_display.h"
 #include "core_helpers.h"
 #include "core_keydown.h"
+#include "core_linalg1.h"
+#include "core_linalg2.h"
 #include "core_math1.h"
 #include "core_sto_rcl.h"
 #include "core_tables.h"
@@ -50,18 +55,36 @@ static void set_shift(bool state) {
 }
 
 static void continue_running();
+static void start_interruptible_slice();
 static void stop_interruptible();
 static int handle_error(int error);
 
-int repeating = 0;
-int repeating_shift;
-int repeating_key;
+CORE_STATE int repeating = 0;
+CORE_STATE int repeating_shift;
+CORE_STATE int repeating_key;
 
-static int4 oldpc;
+static CORE_STATE int4 oldpc;
 
-core_settings_struct core_settings;
+CORE_STATE core_settings_struct core_settings;
 
-void core_init(int read_saved_state, int4 version, const char *state_file_name, int offset) {
+struct core_context {
+    char *state;
+};
+
+static CORE_PER_THREAD core_context default_context = { NULL };
+static CORE_PER_THREAD core_context *current_context = &default_context;
+
+/* The state of the core before core_init() is first called; new contexts
+ * start out as copies of this.
+ */
+static CORE_PER_THREAD char *pristine_state = NULL;
+static CORE_PER_THREAD bool pristine_state_taken = false;
+static CORE_PER_THREAD size_t state_size = 0;
+
+static void take_pristine_state();
+static void visit_main_state(state_visitor visit, void *cd);
+
+bool core_init(int read_saved_state, int4 version, const char *state_file_name, int offset) {
 
     /* Possible values for read_saved_state:
      * 0: state file not present (Memory Clear)
@@ -69,6 +92,9 @@ void core_init(int read_saved_state, int4 version, const char *state_file_name,
      * 2: state file present but not OK (State File Corrupt)
      */
 
+    if (!pristine_state_taken)
+        take_pristine_state();
+
     phloat_init();
 
     #if defined(ANDROID) || defined(IPHONE)
@@ -88,6 +114,7 @@ void core_init(int read_saved_state, int4 version, const char *state_file_name,
     core_settings.enable_ext_time = true;
     core_settings.enable_ext_prog = true;
 
+    bool requested = read_saved_state == 1;
     char *state_file_name_crash = NULL;
     if (read_saved_state == 1) {
         // Before loading state, rename the state file by appending .crash
@@ -148,6 +175,7 @@ void core_init(int read_saved_state, int4 version, const char *state_file_name,
                        mode_running,
                        !flags.f.rad && flags.f.grad,
                        flags.f.rad || flags.f.grad);
+    return !requested || (read_saved_state == 1 && reason == 0);
 }
 
 void core_save_state(const char *state_file_name) {
@@ -172,6 +200,7 @@ void core_cleanup() {
     reg_t = NULL;
     free_vartype(reg_lastx);
     reg_lastx = NULL;
+    clear_bigstack();
     purge_all_vars();
     clear_all_prgms();
     if (vars != NULL) {
@@ -179,6 +208,8 @@ void core_cleanup() {
         vars = NULL;
         vars_capacity = 0;
     }
+    free_var_index();
+    free_rtn_stack_and_label_hash();
     clean_vartype_pools();
 }
 
@@ -263,6 +294,7 @@ int core_keydown(int key, int *enqueued, int *repeat) {
             }
             set_shift(false);
         }
+        start_interruptible_slice();
         error = mode_interruptible(0);
         if (error == ERR_INTERRUPTIBLE)
             /* Still not done */
@@ -632,8 +664,7 @@ int core_powercycle() {
          * user had done OFF twice on a real 42S.
          */
         vartype *seventy = new_real(70);
-        if (seventy != NULL) {
-            recall_result(seventy);
+        if (seventy != NULL && recall_result(seventy) == ERR_NONE) {
             flags.f.stack_lift_disable = 0;
         } else {
             display_error(ERR_INSUFFICIENT_MEMORY, 1);
@@ -754,9 +785,9 @@ char *core_list_programs() {
 // This would have been a lot cleaner using fmemopen(), but that's only supported
 // in iOS 11 and later, and I'm not ready to give up on iOS 8 through 10 yet.
 
-static char *raw_buf;
-static size_t raw_size;
-static size_t raw_pos;
+static CORE_STATE char *raw_buf;
+static CORE_STATE size_t raw_size;
+static CORE_STATE size_t raw_pos;
 
 static int raw_getc() {
     if (raw_buf == NULL)
@@ -993,6 +1024,14 @@ static void export_hp42s(int index) {
                 } else if (cmd == CMD_XROM) {
                     cmdbuf[cmdlen++] = (char) (0xA0 + ((arg.val.num >> 8) & 7));
                     cmdbuf[cmdlen++] = (char) arg.val.num;
+                } else if (cmd >= CMD_DROPN && cmd <= CMD_RUPN) {
+                    /* The big-stack commands only have numeric-suffix
+                     * codes; there is no room left for IND "name" forms,
+                     * so those can't be exported.
+                     */
+                    if (arg.type == ARGTYPE_IND_STR)
+                        continue;
+                    goto normal;
                 } else {
                     /* Shouldn't happen */
                     continue;
@@ -1583,22 +1622,22 @@ static int hp42ext[] = {
     CMD_DSE     | 0x1000,
 
     /* A0-AF */
-    CMD_NULL  | 0x4000,
-    CMD_NULL  | 0x4000,
-    CMD_NULL  | 0x4000,
-    CMD_NULL  | 0x4000,
-    CMD_NULL  | 0x4000,
-    CMD_NULL  | 0x4000,
-    CMD_NULL  | 0x4000,
-    CMD_NULL  | 0x4000,
-    CMD_SF    | 0x1000,
-    CMD_CF    | 0x1000,
-    CMD_FSC_T | 0x1000,
-    CMD_FCC_T | 0x1000,
-    CMD_FS_T  | 0x1000,
-    CMD_FC_T  | 0x1000,
-    CMD_GTO   | 0x1000,
-    CMD_XEQ   | 0x1000,
+    CMD_DROPN  | 0x2000,
+    CMD_DUPN   | 0x2000,
+    CMD_PICK   | 0x2000,
+    CMD_UNPICK | 0x2000,
+    CMD_RDNN   | 0x2000,
+    CMD_RUPN   | 0x2000,
+    CMD_NULL   | 0x4000,
+    CMD_NULL   | 0x4000,
+    CMD_SF     | 0x1000,
+    CMD_CF     | 0x1000,
+    CMD_FSC_T  | 0x1000,
+    CMD_FCC_T  | 0x1000,
+    CMD_FS_T   | 0x1000,
+    CMD_FC_T   | 0x1000,
+    CMD_GTO    | 0x1000,
+    CMD_XEQ    | 0x1000,
 
     /* B0-BF */
     CMD_CLV    | 0x0000,
@@ -2250,7 +2289,7 @@ char *core_copy() {
     } else if (reg_x->type == TYPE_STRING) {
         vartype_string *s = (vartype_string *) reg_x;
         char *buf = (char *) malloc(5 * s->length + 1);
-        int bufptr = hp2ascii(buf, s->text, s->length);
+        int bufptr = hp2ascii(buf, TXT(s), s->length);
         buf[bufptr] = 0;
         return buf;
     } else if (reg_x->type == TYPE_REALMATRIX) {
@@ -2267,9 +2306,19 @@ char *core_copy() {
         for (int r = 0; r < rm->rows; r++) {
             for (int c = 0; c < rm->columns; c++) {
                 int bufptr;
-                if (is_string[n])
-                    bufptr = hp2ascii(buf, phloat_text(data[n]), phloat_length(data[n]));
-                else
+                if (is_string != NULL && is_string[n]) {
+                    const char *text;
+                    int4 len;
+                    get_matrix_string(rm->array, n, &text, &len);
+                    /* Long strings don't fit in buf; convert them in pieces */
+                    while (len > 8) {
+                        bufptr = hp2ascii(buf, text, 8);
+                        tb_write(&tb, buf, bufptr);
+                        text += 8;
+                        len -= 8;
+                    }
+                    bufptr = hp2ascii(buf, text, len);
+                } else
                     bufptr = real2buf(buf, data[n]);
                 if (c < rm->columns - 1)
                     buf[bufptr++] = '\t';
@@ -2797,7 +2846,7 @@ static vartype *parse_base(const char *buf, int len) {
     return new_real((phloat) n);
 }
 
-static int parse_scalar(const char *buf, int len, bool strict, phloat *re, phloat *im, char *s, int *slen) {
+static int parse_scalar(const char *buf, int len, bool strict, phloat *re, phloat *im, const char **s, int *slen) {
     int i, s1, e1, s2, e2;
     bool polar = false;
     bool empty_im = false;
@@ -2944,9 +2993,7 @@ static int parse_scalar(const char *buf, int len, bool strict, phloat *re, phloa
         return TYPE_REAL;
 
     finish_string:
-    if (len > 6)
-        len = 6;
-    memcpy(s, buf, len);
+    *s = buf;
     *slen = len;
     return TYPE_STRING;
 }
@@ -3564,9 +3611,9 @@ void core_paste(const char *buf) {
             v = parse_base(hpbuf, len);
             if (v == NULL) {
                 phloat re, im;
-                char s[6];
+                const char *s;
                 int slen;
-                int type = parse_scalar(hpbuf, len, false, &re, &im, s, &slen);
+                int type = parse_scalar(hpbuf, len, false, &re, &im, &s, &slen);
                 switch (type) {
                     case TYPE_REAL:
                         v = new_real(re);
@@ -3630,9 +3677,9 @@ void core_paste(const char *buf) {
                     asciibuf[cellsize] = 0;
                     int hplen = ascii2hp(hpbuf, asciibuf, cellsize);
                     phloat re, im;
-                    char s[6];
+                    const char *s;
                     int slen;
-                    int type = parse_scalar(hpbuf, hplen, true, &re, &im, s, &slen);
+                    int type = parse_scalar(hpbuf, hplen, true, &re, &im, &s, &slen);
                     if (is_string != NULL) {
                         switch (type) {
                             case TYPE_REAL:
@@ -3669,6 +3716,12 @@ void core_paste(const char *buf) {
                                     data[p] = 0;
                                     is_string[p] = 0;
                                 } else {
+                                    /* The cells are collected in bare
+                                     * arrays, which can't hold long strings,
+                                     * so truncate them, the way ASTO does
+                                     */
+                                    if (slen > 6)
+                                        slen = 6;
                                     memcpy(phloat_text(data[p]), s, slen);
                                     phloat_length(data[p]) = slen;
                                     is_string[p] = 1;
@@ -3723,7 +3776,7 @@ void core_paste(const char *buf) {
             free(hpbuf);
             if (is_string != NULL) {
                 vartype_realmatrix *rm = (vartype_realmatrix *)
-                                malloc(sizeof(vartype_realmatrix));
+                                                    slab_alloc(SLAB_REALMATRIX);
                 if (rm == NULL) {
                     free(data);
                     free(is_string);
@@ -3732,9 +3785,9 @@ void core_paste(const char *buf) {
                     return;
                 }
                 rm->array = (realmatrix_data *)
-                                malloc(sizeof(realmatrix_data));
+                                               slab_alloc(SLAB_REALMATRIX_DATA);
                 if (rm->array == NULL) {
-                    free(rm);
+                    slab_free(SLAB_REALMATRIX, rm);
                     free(data);
                     free(is_string);
                     display_error(ERR_INSUFFICIENT_MEMORY, 0);
@@ -3746,11 +3799,14 @@ void core_paste(const char *buf) {
                 rm->columns = cols;
                 rm->array->data = data;
                 rm->array->is_string = is_string;
+                rm->array->lu = NULL;
                 rm->array->refcount = 1;
+                /* Drops 'is_string' again if there were no strings */
+                contains_no_strings(rm);
                 v = (vartype *) rm;
             } else {
                 vartype_complexmatrix *cm = (vartype_complexmatrix *)
-                                malloc(sizeof(vartype_complexmatrix));
+                                                 slab_alloc(SLAB_COMPLEXMATRIX);
                 if (cm == NULL) {
                     free(data);
                     display_error(ERR_INSUFFICIENT_MEMORY, 0);
@@ -3758,9 +3814,9 @@ void core_paste(const char *buf) {
                     return;
                 }
                 cm->array = (complexmatrix_data *)
-                                malloc(sizeof(complexmatrix_data));
+                                            slab_alloc(SLAB_COMPLEXMATRIX_DATA);
                 if (cm->array == NULL) {
-                    free(cm);
+                    slab_free(SLAB_COMPLEXMATRIX, cm);
                     free(data);
                     display_error(ERR_INSUFFICIENT_MEMORY, 0);
                     redisplay();
@@ -3770,12 +3826,17 @@ void core_paste(const char *buf) {
                 cm->rows = rows;
                 cm->columns = cols;
                 cm->array->data = data;
+                cm->array->lu = NULL;
                 cm->array->refcount = 1;
                 v = (vartype *) cm;
             }
         }
         mode_number_entry = false;
-        recall_result(v);
+        if (recall_result(v) != ERR_NONE) {
+            display_error(ERR_INSUFFICIENT_MEMORY, 0);
+            redisplay();
+            return;
+        }
         flags.f.stack_lift_disable = 0;
         flags.f.message = 0;
         flags.f.two_line_message = 0;
@@ -3783,6 +3844,130 @@ void core_paste(const char *buf) {
     redisplay();
 }
 
+int core_run_label(const char *name) {
+    arg_struct arg;
+    int len = strlen(name);
+    if (len == 0 || len > 7)
+        return 0;
+    if (mode_interruptible != NULL)
+        stop_interruptible();
+    set_running(false);
+    flags.f.prgm_mode = 0;
+    pending_command = CMD_NONE;
+    arg.type = ARGTYPE_STR;
+    arg.length = len;
+    for (int i = 0; i < len; i++)
+        arg.val.text[i] = name[i];
+    arg.target = -1;
+    if (docmd_xeq(&arg) != ERR_RUN)
+        return 0;
+    set_running(true);
+    return 1;
+}
+
+static void visit_all_state(state_visitor visit, void *cd) {
+    visit_globals_state(visit, cd);
+    visit_main_state(visit, cd);
+    visit_display_state(visit, cd);
+    visit_variables_state(visit, cd);
+    visit_helpers_state(visit, cd);
+    visit_commands1_state(visit, cd);
+    visit_commands2_state(visit, cd);
+    visit_commands4_state(visit, cd);
+    visit_commands5_state(visit, cd);
+    visit_commands7_state(visit, cd);
+    visit_linalg1_state(visit, cd);
+    visit_linalg2_state(visit, cd);
+    visit_math1_state(visit, cd);
+    visit_sto_rcl_state(visit, cd);
+}
+
+static void state_size_visitor(void *addr, size_t size, void *cd) {
+    *(size_t *) cd += size;
+}
+
+static void state_save_visitor(void *addr, size_t size, void *cd) {
+    char **p = (char **) cd;
+    memcpy(*p, addr, size);
+    *p += size;
+}
+
+static void state_load_visitor(void *addr, size_t size, void *cd) {
+    char **p = (char **) cd;
+    memcpy(addr, *p, size);
+    *p += size;
+}
+
+static void save_context_state(char *state) {
+    visit_all_state(state_save_visitor, &state);
+}
+
+static void load_context_state(char *state) {
+    visit_all_state(state_load_visitor, &state);
+}
+
+static void take_pristine_state() {
+    pristine_state_taken = true;
+    state_size = 0;
+    visit_all_state(state_size_visitor, &state_size);
+    pristine_state = (char *) malloc(state_size);
+    if (pristine_state != NULL)
+        save_context_state(pristine_state);
+}
+
+core_context *core_new_context() {
+    if (!pristine_state_taken)
+        take_pristine_state();
+    if (pristine_state == NULL)
+        return NULL;
+    core_context *ctx = (core_context *) malloc(sizeof(core_context));
+    if (ctx == NULL)
+        return NULL;
+    ctx->state = (char *) malloc(state_size);
+    if (ctx->state == NULL) {
+        free(ctx);
+        return NULL;
+    }
+    memcpy(ctx->state, pristine_state, state_size);
+    return ctx;
+}
+
+core_context *core_select_context(core_context *ctx) {
+    core_context *prev = current_context;
+    if (ctx == NULL)
+        ctx = &default_context;
+    if (ctx == current_context)
+        return prev;
+    if (prev->state == NULL) {
+        /* Only the default context starts out without a buffer; it gets
+         * one the first time we switch away from it.
+         */
+        if (!pristine_state_taken)
+            take_pristine_state();
+        prev->state = (char *) malloc(state_size);
+        if (prev->state == NULL)
+            return NULL;
+    }
+    save_context_state(prev->state);
+    load_context_state(ctx->state);
+    current_context = ctx;
+    return prev;
+}
+
+void core_delete_context(core_context *ctx) {
+    if (ctx == NULL || ctx == &default_context || ctx == current_context)
+        return;
+    core_context *prev = core_select_context(ctx);
+    if (prev == NULL)
+        return;
+    if (mode_interruptible != NULL)
+        stop_interruptible();
+    core_cleanup();
+    core_select_context(prev);
+    free(ctx->state);
+    free(ctx);
+}
+
 void set_alpha_entry(bool state) {
     mode_alpha_entry = state;
 }
@@ -3791,6 +3976,11 @@ void set_running(bool state) {
     if (mode_running != state) {
         mode_running = state;
         shell_annunciators(-1, -1, -1, state, -1, -1);
+        if (!state)
+            /* The program has stopped, and we're going idle; a good time
+             * to release whatever its temporaries left behind.
+             */
+            trim_vartype_pools();
     }
     if (state) {
         /* Cancel any pending INPUT command */
@@ -3892,9 +4082,60 @@ void do_interactive(int command) {
     }
 }
 
+/* Interruptible functions get the same time slices as running programs,
+ * with every SLICE_CHECK units of work counting as one program step.
+ */
+static CORE_STATE uint4 islice_start;
+static CORE_STATE int islice_ms;
+static CORE_STATE int islice_checks_left;
+
+static void start_interruptible_slice() {
+    shell_cpu_slice(&islice_checks_left, &islice_ms);
+    islice_start = shell_milliseconds();
+}
+
+bool interruptible_slice_done() {
+    if (--islice_checks_left <= 0)
+        return true;
+    return islice_ms > 0
+            && shell_milliseconds() - islice_start >= (uint4) islice_ms;
+}
+
+int interruptible_slice_left() {
+    if (islice_ms <= 0)
+        return 10;
+    int4 left = islice_ms - (int4) (shell_milliseconds() - islice_start);
+    return left < 1 ? 1 : left;
+}
+
+/* How many program steps to execute between looking at the clock, when
+ * the shell has asked for a time limit in shell_cpu_slice().
+ */
+#define CLOCK_CHECK_STEPS 16
+
 static void continue_running() {
     int error;
-    while (!shell_wants_cpu()) {
+    int slice_steps, slice_ms;
+    shell_cpu_slice(&slice_steps, &slice_ms);
+    if (slice_steps < 1)
+        slice_steps = 1;
+    int steps_left = 1;
+    int clock_steps_left = CLOCK_CHECK_STEPS;
+    uint4 slice_start = 0;
+    while (true) {
+        bool check = --steps_left == 0;
+        if (!check && slice_ms > 0 && --clock_steps_left == 0) {
+            clock_steps_left = CLOCK_CHECK_STEPS;
+            check = shell_milliseconds() - slice_start >= (uint4) slice_ms;
+        }
+        if (check) {
+            if (shell_wants_cpu())
+                return;
+            steps_left = slice_steps;
+            clock_steps_left = CLOCK_CHECK_STEPS;
+            if (slice_ms > 0)
+                slice_start = shell_milliseconds();
+        }
         int cmd;
         arg_struct arg;
         oldpc = pc;
@@ -3955,6 +4196,8 @@ static synonym_spec hp41_synonyms[] =
     { "RCL/",   false, 4, CMD_RCL_DIV },
     { "RDN",    true,  3, CMD_RDN     },
     { "Rv",     false, 2, CMD_RDN     },
+    { "RDNN",   false, 4, CMD_RDNN    },
+    { "RvN",    false, 3, CMD_RDNN    },
     { "R-P",    true,  3, CMD_TO_POL  },
     { "ST+",    true,  3, CMD_STO_ADD },
     { "ST-",    true,  3, CMD_STO_SUB },
@@ -3989,7 +4232,7 @@ int find_builtin(const char *name, int namelen, bool strict) {
     }
 
     for (i = 0; true; i++) {
-        if (i == CMD_OPENF) i += 15; // Skip COPAN and BIGSTACK
+        if (i == CMD_OPENF) i += 14; // Skip COPAN
         if (i == CMD_ACCEL && !core_settings.enable_ext_accel) i++;
         if (i == CMD_LOCAT && !core_settings.enable_ext_locat) i++;
         if (i == CMD_HEADING && !core_settings.enable_ext_heading) i++;
@@ -4432,3 +4675,19 @@ static int handle_error(int error) {
         return 0;
     }
 }
+
+static void visit_main_state(state_visitor visit, void *cd) {
+    VISIT_STATE(repeating);
+    VISIT_STATE(repeating_shift);
+    VISIT_STATE(repeating_key);
+    VISIT_STATE(oldpc);
+    VISIT_STATE(core_settings);
+    VISIT_STATE(islice_start);
+    VISIT_STATE(islice_ms);
+    VISIT_STATE(islice_checks_left);
+#ifdef IPHONE
+    VISIT_STATE(raw_buf);
+    VISIT_STATE(raw_size);
+    VISIT_STATE(raw_pos);
+#endif
+}
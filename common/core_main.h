@@ -34,9 +34,12 @@
  * state, it should perform a hard reset.
  * If the read_state parameter is 1, the 'version' parameter should contain the
  * state file version number; otherwise its value is not used.
+ * Returns false if read_state was 1 but the state file could not be opened
+ * or loaded, in which case the core has been hard reset. Interactive shells
+ * can ignore this, since the core reports the reset on the display.
  * This is guaranteed to be the first function called on the emulator core.
  */
-void core_init(int read_state, int4 version, const char *state_file_name, int offset);
+bool core_init(int read_state, int4 version, const char *state_file_name, int offset);
 
 /* core_save_state()
  *
@@ -291,6 +294,50 @@ char *core_copy();
  */
 void core_paste(const char *s);
 
+/* core_run_label()
+ *
+ * Starts running the program at the given global label, like XEQ "name"
+ * does when invoked from the keyboard. Returns 1 if the label was found and
+ * the program has been started; the shell should then keep calling
+ * core_keydown() with key 0 for as long as it returns 1. Returns 0 if there is
+ * no such label.
+ * Used by shells that run programs without user interaction.
+ */
+int core_run_label(const char *name);
+
+/* core_new_context()
+ * core_select_context()
+ * core_delete_context()
+ *
+ * A core context holds the complete state of one calculator: stack,
+ * variables, programs, display, and so on. All the other core_*() functions
+ * operate on the currently selected context, which is the default context
+ * unless the shell selects another one, so shells that host only one
+ * calculator never need to use any of this.
+ * core_new_context() creates a context in the state the core is in before
+ * core_init() is first called; select it and call core_init() to get it
+ * going, just like the default context. Returns NULL if there is not
+ * enough memory.
+ * core_select_context() makes the given context the current one, or the
+ * default context if 'ctx' is NULL, and returns the one that was current
+ * before, so the caller can switch back afterwards. Returns NULL, without
+ * switching, if there is not enough memory. Switching copies the state of
+ * both calculators in and out of the core, so it should be done between
+ * operations, not for every keystroke.
+ * core_delete_context() does core_cleanup() on the given context and frees
+ * it. The default context and the current context can't be deleted.
+ * All contexts share the same shell callbacks, and only one of them can be
+ * current at a time, so all of this must be done from a single thread --
+ * unless the core is built with FREE42_THREADS; in that case, every thread
+ * has its own current and default contexts, and can run its own calculators
+ * independently of the other threads.
+ */
+typedef struct core_context core_context;
+
+core_context *core_new_context();
+core_context *core_select_context(core_context *ctx);
+void core_delete_context(core_context *ctx);
+
 /* core_settings
  *
  * This is a struct that stores user-configurable core settings. The shell
@@ -307,18 +354,21 @@ typedef struct {
     bool enable_ext_time;
     bool enable_ext_fptest;
     bool enable_ext_prog;
+    /* Block size for matrix multiplication; 0 means the core picks one
+     * based on a typical L1 cache size. */
+    int matrix_block_size;
 } core_settings_struct;
 
-extern core_settings_struct core_settings;
+extern CORE_STATE core_settings_struct core_settings;
 
 
 /*******************/
 /* Keyboard repeat */
 /*******************/
 
-extern int repeating;
-extern int repeating_shift;
-extern int repeating_key;
+extern CORE_STATE int repeating;
+extern CORE_STATE int repeating_shift;
+extern CORE_STATE int repeating_key;
 
 
 /*******************/
@@ -346,5 +396,21 @@ void start_alpha_prgm_line();
 void finish_alpha_prgm_line();
 int shiftcharacter(char c);
 
+/* Interruptible functions (see mode_interruptible) should call
+ * interruptible_slice_done() after every SLICE_CHECK units of work, and
+ * return ERR_INTERRUPTIBLE once it returns true. The length of the slice is
+ * set by the shell; see shell_cpu_slice(). Functions that are waiting for
+ * something else, like the worker pool, can use interruptible_slice_left()
+ * to find out how many milliseconds they have left.
+ */
+#ifdef BCD_MATH
+#define SLICE_CHECK 1000
+#else
+#define SLICE_CHECK 20000
+#endif
+
+bool interruptible_slice_done();
+int interruptible_slice_left();
+
 
 #endif
@@ -65,7 +65,7 @@ typedef struct {
     uint4 last_disp_time;
 } solve_state;
 
-static solve_state solve;
+static CORE_STATE solve_state solve;
 
 #define ROMB_K 5
 // 1/2 million evals max!
@@ -97,7 +97,7 @@ typedef struct {
     phloat prev_res;
 } integ_state;
 
-static integ_state integ;
+static CORE_STATE integ_state integ;
 
 
 static void reset_solve();
@@ -1124,8 +1124,10 @@ static int finish_integ() {
         return ERR_INSUFFICIENT_MEMORY;
     }
     flags.f.trace_print = 0;
-    recall_two_results(x, y);
+    int err = recall_two_results(x, y);
     flags.f.trace_print = saved_trace;
+    if (err != ERR_NONE)
+        return err;
 
     current_prgm = integ.prev_prgm;
     pc = integ.prev_pc;
@@ -1226,3 +1228,8 @@ int return_to_integ(bool stop) {
         return ERR_INTERNAL_ERROR;
     }
 }
+
+void visit_math1_state(state_visitor visit, void *cd) {
+    VISIT_STATE(solve);
+    VISIT_STATE(integ);
+}
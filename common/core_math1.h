@@ -19,6 +19,7 @@
 #define CORE_MATH1_H 1
 
 #include "free42.h"
+#include "core_globals.h"
 #include "core_phloat.h"
 
 bool persist_math();
@@ -39,4 +40,6 @@ void get_integ_var(char *name, int *length);
 int start_integ(const char *name, int length);
 int return_to_integ(bool stop);
 
+void visit_math1_state(state_visitor visit, void *cd);
+
 #endif
@@ -29,14 +29,23 @@
 // We need these locally for BID128->double conversion
 #include "bid_conf.h"
 #include "bid_functions.h"
+#ifdef __GNUC__
+#define ALWAYS_INLINE __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VEC_X86 1
+#include <immintrin.h>
+#endif
 #endif
 
 
-phloat POS_HUGE_PHLOAT;
-phloat NEG_HUGE_PHLOAT;
-phloat POS_TINY_PHLOAT;
-phloat NEG_TINY_PHLOAT;
-phloat NAN_PHLOAT;
+CORE_PER_THREAD phloat POS_HUGE_PHLOAT;
+CORE_PER_THREAD phloat NEG_HUGE_PHLOAT;
+CORE_PER_THREAD phloat POS_TINY_PHLOAT;
+CORE_PER_THREAD phloat NEG_TINY_PHLOAT;
+CORE_PER_THREAD phloat NAN_PHLOAT;
 
 
 /* Note: this function does not handle infinities or NaN */
@@ -981,6 +990,617 @@ double decimal2double(void *data, bool pin_magnitude /* = false */) {
         return res;
 }
 
+/* Vector kernels for the binary build
+ *
+ * These do the inner loops of matrix arithmetic on plain arrays of doubles.
+ * There are three versions of each: plain C, SSE2, and AVX2; the best one
+ * the CPU supports is picked once, at startup. All three give identical
+ * results: element-wise operations are exact anyway, and the reductions all
+ * use four partial sums, for elements 4k, 4k+1, 4k+2, and 4k+3, combined in
+ * the same order, with any leftover elements added at the end. No
+ * fused multiply-adds are used, so products are rounded the same way as in
+ * the scalar code.
+ *
+ * The compensated reductions keep the rounding error of each partial sum in
+ * a second accumulator, using Knuth's TwoSum, and vec_cdot() also keeps the
+ * error of each product, using Dekker's TwoProduct; on CPUs with FMA, it
+ * uses that to find the same errors faster (see vec_cdot_fma()). The one
+ * exception to the results being identical is when a product underflows:
+ * then Dekker's method may lose some bits of its error. Very large operands
+ * are scaled before they are split, so the two methods agree all the way up
+ * to overflow; see two_prod(). vec_nrm2()
+ * uses Blue's algorithm, like the reference BLAS dnrm2: squares of very large
+ * and very small elements are scaled and summed separately, and the three
+ * sums are combined at the end. The sum of the squares that need no scaling,
+ * which is usually all of them, is compensated as well.
+ */
+
+#define NRM2_TSML 1.4916681462400413e-154   // 2^-511
+#define NRM2_TBIG 1.997919072202235e+146    // 2^486
+#define NRM2_SSML 4.4989137945431964e+161   // 2^537
+#define NRM2_SBIG 1.1113793747425387e-162   // 2^-538
+#define SPLITTER 134217729.0                // 2^27 + 1
+#define SPLIT_MAX 3.3484643974570854e+299   // 2^995
+#define SPLIT_DOWN 3.725290298461914e-09    // 2^-28
+#define SPLIT_UP 268435456.0                // 2^28
+
+static inline double two_sum(double *s, double x) {
+    double t = *s + x;
+    double z = t - *s;
+    double e = (*s - (t - z)) + (x - z);
+    *s = t;
+    return e;
+}
+
+/* Dekker's TwoProduct. Splitting x overflows if x is above about 2^996, and
+ * so does xh * yh if the product is close to overflowing; with 'scaled' set,
+ * the operands are scaled down by 2^28 in those cases, and the error scaled
+ * back up. All the scalings are exact, so the error is the same as when
+ * there's no need for them. Checking for this is expensive, so the dot
+ * products only do it if a first try gives a result that isn't finite; see
+ * vec_cdot().
+ */
+static inline double two_prod(double x, double y, double *e, bool scaled) {
+    double p = x * y, u = 1;
+    if (scaled) {
+        if (fabs(x) > SPLIT_MAX || fabs(p) > SPLIT_MAX) {
+            x *= SPLIT_DOWN;
+            u = SPLIT_UP;
+        }
+        if (fabs(y) > SPLIT_MAX) {
+            y *= SPLIT_DOWN;
+            u *= SPLIT_UP;
+        }
+    }
+    double t = SPLITTER * x;
+    double xh = t - (t - x), xl = x - xh;
+    t = SPLITTER * y;
+    double yh = t - (t - y), yl = y - yh;
+    double q = scaled ? x * y : p;
+    *e = xl * yl - (((q - xh * yh) - xl * yh) - xh * yl);
+    if (scaled)
+        *e *= u;
+    return p;
+}
+
+static inline void nrm2_accum(double *big, double *med, double *medc,
+                              double *sml, double x) {
+    double ax = fabs(x);
+    if (ax > NRM2_TBIG) {
+        ax *= NRM2_SBIG;
+        *big += ax * ax;
+    } else if (ax < NRM2_TSML) {
+        ax *= NRM2_SSML;
+        *sml += ax * ax;
+    } else
+        *medc += two_sum(med, ax * ax);
+}
+
+/* These combine the four lanes of the vector versions, and add the leftover
+ * elements.
+ */
+
+static double csum_finish(const double *s, const double *c, const double *x,
+                          int4 n, bool absolute) {
+    double r = 0, e = 0;
+    for (int t = 0; t < 4; t++)
+        e += two_sum(&r, s[t]) + c[t];
+    for (int4 i = 0; i < n; i++)
+        e += two_sum(&r, absolute ? fabs(x[i]) : x[i]);
+    return r + e;
+}
+
+static double cdot_finish(const double *s, const double *c, const double *x,
+                          const double *y, int4 n, bool scaled) {
+    double r = 0, e = 0;
+    for (int t = 0; t < 4; t++)
+        e += two_sum(&r, s[t]) + c[t];
+    for (int4 i = 0; i < n; i++) {
+        double pe;
+        double p = two_prod(x[i], y[i], &pe, scaled);
+        e += two_sum(&r, p) + pe;
+    }
+    return r + e;
+}
+
+static double nrm2_finish(const double *b, const double *m, const double *mc,
+                          const double *s, const double *x, int4 n) {
+    double big = (b[0] + b[1]) + (b[2] + b[3]);
+    double med = 0, medc = 0;
+    for (int t = 0; t < 4; t++)
+        medc += two_sum(&med, m[t]) + mc[t];
+    double sml = (s[0] + s[1]) + (s[2] + s[3]);
+    for (int4 i = 0; i < n; i++)
+        nrm2_accum(&big, &med, &medc, &sml, x[i]);
+    med += medc;
+    double scl, sumsq;
+    if (big > 0) {
+        if (med > 0 || med != med)
+            big += (med * NRM2_SBIG) * NRM2_SBIG;
+        scl = 1 / NRM2_SBIG;
+        sumsq = big;
+    } else if (sml > 0) {
+        if (med > 0 || med != med) {
+            double ymin, ymax;
+            med = sqrt(med);
+            sml = sqrt(sml) / NRM2_SSML;
+            if (sml > med) {
+                ymin = med;
+                ymax = sml;
+            } else {
+                ymin = sml;
+                ymax = med;
+            }
+            scl = 1;
+            sumsq = ymax * ymax * (1 + (ymin / ymax) * (ymin / ymax));
+        } else {
+            scl = 1 / NRM2_SSML;
+            sumsq = sml;
+        }
+    } else {
+        scl = 1;
+        sumsq = med;
+    }
+    return scl * sqrt(sumsq);
+}
+
+static bool vec_map_c(int op, const double *x, int xinc, const double *y,
+                      int yinc, double *z, int4 n) {
+    bool ok = true;
+    for (int4 i = 0; i < n; i++) {
+        double a = x[i * xinc];
+        double b = y[i * yinc];
+        double r;
+        switch (op) {
+            case VEC_ADD: r = b + a; break;
+            case VEC_SUB: r = b - a; break;
+            case VEC_MUL: r = b * a; break;
+            default: r = b / a; break;
+        }
+        if (!(fabs(r) <= DBL_MAX))
+            ok = false;
+        z[i] = r;
+    }
+    return ok;
+}
+
+static void vec_dot4_c(const double *a, const double *b, int4 n,
+                       double *sum) {
+    double s0 = sum[0], s1 = sum[1], s2 = sum[2], s3 = sum[3];
+    for (int4 i = 0; i < n; i++) {
+        double t = a[i];
+        s0 += t * b[4 * i];
+        s1 += t * b[4 * i + 1];
+        s2 += t * b[4 * i + 2];
+        s3 += t * b[4 * i + 3];
+    }
+    sum[0] = s0;
+    sum[1] = s1;
+    sum[2] = s2;
+    sum[3] = s3;
+}
+
+static double vec_csum_c(const double *x, int4 n, bool absolute) {
+    double s[4] = { 0, 0, 0, 0 }, c[4] = { 0, 0, 0, 0 };
+    int4 i;
+    for (i = 0; i + 4 <= n; i += 4)
+        for (int t = 0; t < 4; t++)
+            c[t] += two_sum(s + t, absolute ? fabs(x[i + t]) : x[i + t]);
+    return csum_finish(s, c, x + i, n - i, absolute);
+}
+
+ALWAYS_INLINE
+static inline double cdot_c(const double *x, const double *y, int4 n,
+                            bool scaled) {
+    double s[4] = { 0, 0, 0, 0 }, c[4] = { 0, 0, 0, 0 };
+    int4 i;
+    for (i = 0; i + 4 <= n; i += 4)
+        for (int t = 0; t < 4; t++) {
+            double e;
+            double p = two_prod(x[i + t], y[i + t], &e, scaled);
+            c[t] += two_sum(s + t, p) + e;
+        }
+    return cdot_finish(s, c, x + i, y + i, n - i, scaled);
+}
+
+/* Calling cdot_c() with constant arguments gets us separate versions for the
+ * two cases, so the usual one doesn't test 'scaled' for every element.
+ */
+static double vec_cdot_c(const double *x, const double *y, int4 n,
+                         bool scaled) {
+    return scaled ? cdot_c(x, y, n, true) : cdot_c(x, y, n, false);
+}
+
+static double vec_nrm2_c(const double *x, int4 n) {
+    double b[4] = { 0, 0, 0, 0 }, m[4] = { 0, 0, 0, 0 };
+    double mc[4] = { 0, 0, 0, 0 }, s[4] = { 0, 0, 0, 0 };
+    int4 i;
+    for (i = 0; i + 4 <= n; i += 4)
+        for (int t = 0; t < 4; t++)
+            nrm2_accum(b + t, m + t, mc + t, s + t, x[i + t]);
+    return nrm2_finish(b, m, mc, s, x + i, n - i);
+}
+
+#ifdef VEC_X86
+
+/* Lane-wise TwoSum and TwoProduct, and one step of vec_nrm2(), for the SSE2
+ * and AVX2 versions; they do the same operations as the scalar versions above.
+ * VEC_NRM2_STEP masks the elements before squaring them, rather than the
+ * squares, since squaring the wrong elements could underflow, and denormals
+ * are very slow on some CPUs.
+ */
+#define VEC_TWO_SUM(T, ADD, SUB, s, x, e) \
+    { \
+        T t_ = ADD(s, x); \
+        T z_ = SUB(t_, s); \
+        e = ADD(SUB(s, SUB(t_, z_)), SUB(x, z_)); \
+        s = t_; \
+    }
+
+#define VEC_TWO_PROD(T, ADD, SUB, MUL, AND, ANDNOT, OR, CMPGT, SET1, \
+                     scaled, x, y, p, e) \
+    { \
+        T one_ = SET1(1.0), xs_ = x, ys_ = y, u_ = one_; \
+        p = MUL(x, y); \
+        T q_ = p; \
+        if (scaled) { \
+            T max_ = SET1(SPLIT_MAX), abs_ = SET1(-0.0); \
+            T bx_ = OR(CMPGT(ANDNOT(abs_, x), max_), \
+                       CMPGT(ANDNOT(abs_, p), max_)); \
+            T by_ = CMPGT(ANDNOT(abs_, y), max_); \
+            xs_ = MUL(x, SUB(one_, AND(bx_, SET1(1 - SPLIT_DOWN)))); \
+            ys_ = MUL(y, SUB(one_, AND(by_, SET1(1 - SPLIT_DOWN)))); \
+            u_ = MUL(ADD(one_, AND(bx_, SET1(SPLIT_UP - 1))), \
+                     ADD(one_, AND(by_, SET1(SPLIT_UP - 1)))); \
+            q_ = MUL(xs_, ys_); \
+        } \
+        T k_ = SET1(SPLITTER); \
+        T t_ = MUL(k_, xs_); \
+        T xh_ = SUB(t_, SUB(t_, xs_)), xl_ = SUB(xs_, xh_); \
+        t_ = MUL(k_, ys_); \
+        T yh_ = SUB(t_, SUB(t_, ys_)), yl_ = SUB(ys_, yh_); \
+        e = SUB(MUL(xl_, yl_), SUB(SUB(SUB(q_, MUL(xh_, yh_)), \
+                                           MUL(xl_, yh_)), MUL(xh_, yl_))); \
+        if (scaled) \
+            e = MUL(e, u_); \
+    }
+
+#define VEC_NRM2_STEP(T, ADD, SUB, MUL, AND, ANDNOT, OR, CMPGT, CMPLT, \
+                      SET1, big, med, medc, sml, x) \
+    { \
+        T ax_ = ANDNOT(SET1(-0.0), x); \
+        T isbig_ = CMPGT(ax_, SET1(NRM2_TBIG)); \
+        T issml_ = CMPLT(ax_, SET1(NRM2_TSML)); \
+        T b_ = MUL(AND(isbig_, ax_), SET1(NRM2_SBIG)); \
+        T s_ = MUL(AND(issml_, ax_), SET1(NRM2_SSML)); \
+        T m_ = ANDNOT(OR(isbig_, issml_), ax_); \
+        T m2_ = MUL(m_, m_), q_; \
+        big = ADD(big, MUL(b_, b_)); \
+        sml = ADD(sml, MUL(s_, s_)); \
+        VEC_TWO_SUM(T, ADD, SUB, med, m2_, q_); \
+        medc = ADD(medc, q_); \
+    }
+
+#define VEC_MAP_LOOP(W, LOAD, SET1, STORE, OP, AND, CMPLE, ANDNOT, T) \
+    { \
+        T ax = SET1(*x), by = SET1(*y); \
+        for (; i + W <= n; i += W) { \
+            T a = xinc ? LOAD(x + i) : ax; \
+            T b = yinc ? LOAD(y + i) : by; \
+            T r = OP(b, a); \
+            ok = AND(ok, CMPLE(ANDNOT(sign, r), huge)); \
+            STORE(z + i, r); \
+        } \
+    }
+
+__attribute__((target("sse2")))
+static bool vec_map_sse2(int op, const double *x, int xinc, const double *y,
+                         int yinc, double *z, int4 n) {
+    __m128d sign = _mm_set1_pd(-0.0);
+    __m128d huge = _mm_set1_pd(DBL_MAX);
+    __m128d ok = _mm_cmpeq_pd(huge, huge);
+    int4 i = 0;
+#define SSE2_LOOP(OP) VEC_MAP_LOOP(2, _mm_loadu_pd, _mm_set1_pd, \
+            _mm_storeu_pd, OP, _mm_and_pd, _mm_cmple_pd, _mm_andnot_pd, __m128d)
+    switch (op) {
+        case VEC_ADD: SSE2_LOOP(_mm_add_pd); break;
+        case VEC_SUB: SSE2_LOOP(_mm_sub_pd); break;
+        case VEC_MUL: SSE2_LOOP(_mm_mul_pd); break;
+        default: SSE2_LOOP(_mm_div_pd); break;
+    }
+#undef SSE2_LOOP
+    bool res = _mm_movemask_pd(ok) == 3;
+    if (i < n && !vec_map_c(op, x + i * xinc, xinc, y + i * yinc, yinc,
+                            z + i, n - i))
+        res = false;
+    return res;
+}
+
+__attribute__((target("sse2")))
+static void vec_dot4_sse2(const double *a, const double *b, int4 n,
+                          double *sum) {
+    __m128d s01 = _mm_loadu_pd(sum), s23 = _mm_loadu_pd(sum + 2);
+    for (int4 i = 0; i < n; i++) {
+        __m128d t = _mm_set1_pd(a[i]);
+        s01 = _mm_add_pd(s01, _mm_mul_pd(t, _mm_loadu_pd(b + 4 * i)));
+        s23 = _mm_add_pd(s23, _mm_mul_pd(t, _mm_loadu_pd(b + 4 * i + 2)));
+    }
+    _mm_storeu_pd(sum, s01);
+    _mm_storeu_pd(sum + 2, s23);
+}
+
+__attribute__((target("sse2")))
+static double vec_csum_sse2(const double *x, int4 n, bool absolute) {
+    __m128d mask = absolute ? _mm_set1_pd(-0.0) : _mm_setzero_pd();
+    __m128d s01 = _mm_setzero_pd(), s23 = _mm_setzero_pd();
+    __m128d c01 = _mm_setzero_pd(), c23 = _mm_setzero_pd();
+    int4 i;
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m128d x01 = _mm_andnot_pd(mask, _mm_loadu_pd(x + i));
+        __m128d x23 = _mm_andnot_pd(mask, _mm_loadu_pd(x + i + 2));
+        __m128d q01, q23;
+        VEC_TWO_SUM(__m128d, _mm_add_pd, _mm_sub_pd, s01, x01, q01);
+        VEC_TWO_SUM(__m128d, _mm_add_pd, _mm_sub_pd, s23, x23, q23);
+        c01 = _mm_add_pd(c01, q01);
+        c23 = _mm_add_pd(c23, q23);
+    }
+    double s[4], c[4];
+    _mm_storeu_pd(s, s01);
+    _mm_storeu_pd(s + 2, s23);
+    _mm_storeu_pd(c, c01);
+    _mm_storeu_pd(c + 2, c23);
+    return csum_finish(s, c, x + i, n - i, absolute);
+}
+
+__attribute__((target("sse2")))
+static double vec_cdot_sse2(const double *x, const double *y, int4 n,
+                            bool scaled) {
+    __m128d s01 = _mm_setzero_pd(), s23 = _mm_setzero_pd();
+    __m128d c01 = _mm_setzero_pd(), c23 = _mm_setzero_pd();
+    int4 i;
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m128d p01, e01, q01, p23, e23, q23;
+        __m128d x01 = _mm_loadu_pd(x + i), x23 = _mm_loadu_pd(x + i + 2);
+        __m128d y01 = _mm_loadu_pd(y + i), y23 = _mm_loadu_pd(y + i + 2);
+        VEC_TWO_PROD(__m128d, _mm_add_pd, _mm_sub_pd, _mm_mul_pd,
+                     _mm_and_pd, _mm_andnot_pd, _mm_or_pd, _mm_cmpgt_pd,
+                     _mm_set1_pd, scaled, x01, y01, p01, e01);
+        VEC_TWO_PROD(__m128d, _mm_add_pd, _mm_sub_pd, _mm_mul_pd,
+                     _mm_and_pd, _mm_andnot_pd, _mm_or_pd, _mm_cmpgt_pd,
+                     _mm_set1_pd, scaled, x23, y23, p23, e23);
+        VEC_TWO_SUM(__m128d, _mm_add_pd, _mm_sub_pd, s01, p01, q01);
+        VEC_TWO_SUM(__m128d, _mm_add_pd, _mm_sub_pd, s23, p23, q23);
+        c01 = _mm_add_pd(c01, _mm_add_pd(q01, e01));
+        c23 = _mm_add_pd(c23, _mm_add_pd(q23, e23));
+    }
+    double s[4], c[4];
+    _mm_storeu_pd(s, s01);
+    _mm_storeu_pd(s + 2, s23);
+    _mm_storeu_pd(c, c01);
+    _mm_storeu_pd(c + 2, c23);
+    return cdot_finish(s, c, x + i, y + i, n - i, scaled);
+}
+
+__attribute__((target("sse2")))
+static double vec_nrm2_sse2(const double *x, int4 n) {
+    __m128d b01 = _mm_setzero_pd(), b23 = _mm_setzero_pd();
+    __m128d m01 = _mm_setzero_pd(), m23 = _mm_setzero_pd();
+    __m128d mc01 = _mm_setzero_pd(), mc23 = _mm_setzero_pd();
+    __m128d s01 = _mm_setzero_pd(), s23 = _mm_setzero_pd();
+    int4 i;
+#define SSE2_STEP(b, m, mc, s, x) VEC_NRM2_STEP(__m128d, _mm_add_pd, \
+            _mm_sub_pd, _mm_mul_pd, _mm_and_pd, _mm_andnot_pd, _mm_or_pd, \
+            _mm_cmpgt_pd, _mm_cmplt_pd, _mm_set1_pd, b, m, mc, s, x)
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m128d x01 = _mm_loadu_pd(x + i), x23 = _mm_loadu_pd(x + i + 2);
+        SSE2_STEP(b01, m01, mc01, s01, x01);
+        SSE2_STEP(b23, m23, mc23, s23, x23);
+    }
+#undef SSE2_STEP
+    double b[4], m[4], mc[4], s[4];
+    _mm_storeu_pd(b, b01);
+    _mm_storeu_pd(b + 2, b23);
+    _mm_storeu_pd(m, m01);
+    _mm_storeu_pd(m + 2, m23);
+    _mm_storeu_pd(mc, mc01);
+    _mm_storeu_pd(mc + 2, mc23);
+    _mm_storeu_pd(s, s01);
+    _mm_storeu_pd(s + 2, s23);
+    return nrm2_finish(b, m, mc, s, x + i, n - i);
+}
+
+/* Note: target("avx2") does not enable FMA, so the compiler won't contract
+ * the multiplies and adds below.
+ */
+__attribute__((target("avx2")))
+static bool vec_map_avx2(int op, const double *x, int xinc, const double *y,
+                         int yinc, double *z, int4 n) {
+    __m256d sign = _mm256_set1_pd(-0.0);
+    __m256d huge = _mm256_set1_pd(DBL_MAX);
+    __m256d ok = _mm256_cmp_pd(huge, huge, _CMP_EQ_OQ);
+    int4 i = 0;
+#define AVX2_CMPLE(a, b) _mm256_cmp_pd(a, b, _CMP_LE_OQ)
+#define AVX2_LOOP(OP) VEC_MAP_LOOP(4, _mm256_loadu_pd, _mm256_set1_pd, \
+            _mm256_storeu_pd, OP, _mm256_and_pd, AVX2_CMPLE, \
+            _mm256_andnot_pd, __m256d)
+    switch (op) {
+        case VEC_ADD: AVX2_LOOP(_mm256_add_pd); break;
+        case VEC_SUB: AVX2_LOOP(_mm256_sub_pd); break;
+        case VEC_MUL: AVX2_LOOP(_mm256_mul_pd); break;
+        default: AVX2_LOOP(_mm256_div_pd); break;
+    }
+#undef AVX2_LOOP
+#undef AVX2_CMPLE
+    bool res = _mm256_movemask_pd(ok) == 15;
+    if (i < n && !vec_map_c(op, x + i * xinc, xinc, y + i * yinc, yinc,
+                            z + i, n - i))
+        res = false;
+    return res;
+}
+
+__attribute__((target("avx2")))
+static void vec_dot4_avx2(const double *a, const double *b, int4 n,
+                          double *sum) {
+    __m256d s = _mm256_loadu_pd(sum);
+    for (int4 i = 0; i < n; i++)
+        s = _mm256_add_pd(s, _mm256_mul_pd(_mm256_set1_pd(a[i]),
+                                           _mm256_loadu_pd(b + 4 * i)));
+    _mm256_storeu_pd(sum, s);
+}
+
+__attribute__((target("avx2")))
+static double vec_csum_avx2(const double *x, int4 n, bool absolute) {
+    __m256d mask = absolute ? _mm256_set1_pd(-0.0) : _mm256_setzero_pd();
+    __m256d sv = _mm256_setzero_pd(), cv = _mm256_setzero_pd();
+    int4 i;
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256d q, xv = _mm256_andnot_pd(mask, _mm256_loadu_pd(x + i));
+        VEC_TWO_SUM(__m256d, _mm256_add_pd, _mm256_sub_pd, sv, xv, q);
+        cv = _mm256_add_pd(cv, q);
+    }
+    double s[4], c[4];
+    _mm256_storeu_pd(s, sv);
+    _mm256_storeu_pd(c, cv);
+    return csum_finish(s, c, x + i, n - i, absolute);
+}
+
+__attribute__((target("avx2")))
+static double vec_cdot_avx2(const double *x, const double *y, int4 n,
+                            bool scaled) {
+    __m256d sv = _mm256_setzero_pd(), cv = _mm256_setzero_pd();
+    int4 i;
+#define AVX2_CMPGT(a, b) _mm256_cmp_pd(a, b, _CMP_GT_OQ)
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256d p, e, q;
+        __m256d xv = _mm256_loadu_pd(x + i), yv = _mm256_loadu_pd(y + i);
+        VEC_TWO_PROD(__m256d, _mm256_add_pd, _mm256_sub_pd, _mm256_mul_pd,
+                     _mm256_and_pd, _mm256_andnot_pd, _mm256_or_pd,
+                     AVX2_CMPGT, _mm256_set1_pd, scaled, xv, yv, p, e);
+        VEC_TWO_SUM(__m256d, _mm256_add_pd, _mm256_sub_pd, sv, p, q);
+        cv = _mm256_add_pd(cv, _mm256_add_pd(q, e));
+    }
+#undef AVX2_CMPGT
+    double s[4], c[4];
+    _mm256_storeu_pd(s, sv);
+    _mm256_storeu_pd(c, cv);
+    return cdot_finish(s, c, x + i, y + i, n - i, scaled);
+}
+
+/* With FMA, the error of the product p = x * y is simply fma(x, y, -p); as
+ * long as the product doesn't underflow, that is exactly the error Dekker's
+ * method finds, so this gives the same results as the other versions, only
+ * faster. The product itself is computed as fma(x, y, 0), rather than with a
+ * multiply, so that the compiler can't fuse it with the addition that follows.
+ * This can't overflow unless the product does, so 'scaled' only matters for
+ * the leftover elements.
+ */
+__attribute__((target("avx2,fma")))
+static double vec_cdot_fma(const double *x, const double *y, int4 n,
+                           bool scaled) {
+    __m256d sv = _mm256_setzero_pd(), cv = _mm256_setzero_pd();
+    __m256d zero = _mm256_setzero_pd();
+    int4 i;
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256d q;
+        __m256d xv = _mm256_loadu_pd(x + i), yv = _mm256_loadu_pd(y + i);
+        __m256d p = _mm256_fmadd_pd(xv, yv, zero);
+        __m256d e = _mm256_fmsub_pd(xv, yv, p);
+        VEC_TWO_SUM(__m256d, _mm256_add_pd, _mm256_sub_pd, sv, p, q);
+        cv = _mm256_add_pd(cv, _mm256_add_pd(q, e));
+    }
+    double s[4], c[4];
+    _mm256_storeu_pd(s, sv);
+    _mm256_storeu_pd(c, cv);
+    return cdot_finish(s, c, x + i, y + i, n - i, scaled);
+}
+
+__attribute__((target("avx2")))
+static double vec_nrm2_avx2(const double *x, int4 n) {
+    __m256d bv = _mm256_setzero_pd();
+    __m256d mv = _mm256_setzero_pd();
+    __m256d mcv = _mm256_setzero_pd();
+    __m256d sv = _mm256_setzero_pd();
+    int4 i;
+#define AVX2_CMPGT(a, b) _mm256_cmp_pd(a, b, _CMP_GT_OQ)
+#define AVX2_CMPLT(a, b) _mm256_cmp_pd(a, b, _CMP_LT_OQ)
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256d xv = _mm256_loadu_pd(x + i);
+        VEC_NRM2_STEP(__m256d, _mm256_add_pd, _mm256_sub_pd, _mm256_mul_pd,
+                      _mm256_and_pd, _mm256_andnot_pd, _mm256_or_pd,
+                      AVX2_CMPGT, AVX2_CMPLT, _mm256_set1_pd,
+                      bv, mv, mcv, sv, xv);
+    }
+#undef AVX2_CMPGT
+#undef AVX2_CMPLT
+    double b[4], m[4], mc[4], s[4];
+    _mm256_storeu_pd(b, bv);
+    _mm256_storeu_pd(m, mv);
+    _mm256_storeu_pd(mc, mcv);
+    _mm256_storeu_pd(s, sv);
+    return nrm2_finish(b, m, mc, s, x + i, n - i);
+}
+
+#endif // VEC_X86
+
+struct vec_impl {
+    bool (*map)(int, const double *, int, const double *, int, double *, int4);
+    void (*dot4)(const double *, const double *, int4, double *);
+    double (*csum)(const double *, int4, bool);
+    double (*cdot)(const double *, const double *, int4, bool);
+    double (*nrm2)(const double *, int4);
+};
+
+static vec_impl vec_pick() {
+    vec_impl v = { vec_map_c, vec_dot4_c, vec_csum_c, vec_cdot_c, vec_nrm2_c };
+#ifdef VEC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        v.map = vec_map_avx2;
+        v.dot4 = vec_dot4_avx2;
+        v.csum = vec_csum_avx2;
+        v.cdot = __builtin_cpu_supports("fma") ? vec_cdot_fma : vec_cdot_avx2;
+        v.nrm2 = vec_nrm2_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        v.map = vec_map_sse2;
+        v.dot4 = vec_dot4_sse2;
+        v.csum = vec_csum_sse2;
+        v.cdot = vec_cdot_sse2;
+        v.nrm2 = vec_nrm2_sse2;
+    }
+#endif
+    return v;
+}
+
+/* This is a property of the machine, not of any one calculator, so it isn't
+ * CORE_STATE; it is set during static initialization, before any threads
+ * could be started.
+ */
+static const vec_impl vec = vec_pick();
+
+bool vec_map(int op, const double *x, int xinc, const double *y, int yinc,
+             double *z, int4 n) {
+    return vec.map(op, x, xinc, y, yinc, z, n);
+}
+
+void vec_dot4(const double *a, const double *b, int4 n, double *sum) {
+    vec.dot4(a, b, n, sum);
+}
+
+double vec_csum(const double *x, int4 n, bool absolute) {
+    return vec.csum(x, n, absolute);
+}
+
+double vec_cdot(const double *x, const double *y, int4 n) {
+    double d = vec.cdot(x, y, n, false);
+    if (isfinite(d))
+        return d;
+    return vec.cdot(x, y, n, true);
+}
+
+double vec_nrm2(const double *x, int4 n) {
+    return vec.nrm2(x, n);
+}
+
 
 #endif // BCD_MATH
 
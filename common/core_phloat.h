@@ -61,6 +61,31 @@ struct hp_string {
 
 double decimal2double(void *data, bool pin_magnitude = false);
 
+/* Vector kernels for matrix arithmetic; see core_phloat.cc.
+ * vec_map() sets z[i] = y[i] op x[i], for i = 0 .. n - 1, where an
+ * increment of 0 for x or y means that operand is a scalar. It returns false
+ * if any result is infinite or NaN, in which case the caller should redo the
+ * operation with its scalar code, which knows how to report or clamp those.
+ * vec_dot4() adds a[i] * b[4 * i + t] to sum[t], for t = 0 .. 3, with each
+ * of the four sums accumulated in order.
+ * vec_csum() and vec_cdot() return the sum of x[i] (or of |x[i]|, if
+ * 'absolute' is set) and of x[i] * y[i], using compensated summation, so they
+ * are accurate to about twice the working precision. They return infinity or
+ * NaN if an intermediate result overflows. vec_nrm2() returns the Euclidean
+ * norm of x, scaling the squares where needed so that only the result itself
+ * can overflow.
+ */
+#define VEC_ADD 0
+#define VEC_SUB 1
+#define VEC_MUL 2
+#define VEC_DIV 3
+bool vec_map(int op, const double *x, int xinc, const double *y, int yinc,
+             double *z, int4 n);
+void vec_dot4(const double *a, const double *b, int4 n, double *sum);
+double vec_csum(const double *x, int4 n, bool absolute);
+double vec_cdot(const double *x, const double *y, int4 n);
+double vec_nrm2(const double *x, int4 n);
+
 
 #else // BCD_MATH
 
@@ -169,11 +194,11 @@ void update_decimal(BID_UINT128 *val);
 #endif // BCD_MATH
 
 
-extern phloat POS_HUGE_PHLOAT;
-extern phloat NEG_HUGE_PHLOAT;
-extern phloat POS_TINY_PHLOAT;
-extern phloat NEG_TINY_PHLOAT;
-extern phloat NAN_PHLOAT;
+extern CORE_PER_THREAD phloat POS_HUGE_PHLOAT;
+extern CORE_PER_THREAD phloat NEG_HUGE_PHLOAT;
+extern CORE_PER_THREAD phloat POS_TINY_PHLOAT;
+extern CORE_PER_THREAD phloat NEG_TINY_PHLOAT;
+extern CORE_PER_THREAD phloat NAN_PHLOAT;
 
 void phloat_init();
 int phloat2string(phloat d, char *buf, int buflen,
@@ -27,8 +27,8 @@
 static int apply_sto_operation(char operation, vartype *oldval, bool trace_stk);
 static void generic_sto_completion(int error, vartype *res);
 
-static bool preserve_ij;
-static bool trace_stack;
+static CORE_STATE bool preserve_ij;
+static CORE_STATE bool trace_stack;
 
 
 static int apply_sto_operation(char operation, vartype *oldval, bool trace_stk) {
@@ -270,14 +270,12 @@ int generic_rcl(arg_struct *arg, vartype **dst) {
                 vartype_realmatrix *rm = (vartype_realmatrix *) regs;
                 int4 size = rm->rows * rm->columns;
                 int4 index = arg->val.num;
-                phloat ds;
                 if (index >= size)
                     return ERR_SIZE_ERROR;
-                ds = rm->array->data[index];
-                if (rm->array->is_string[index])
-                    *dst = new_string(phloat_text(ds), phloat_length(ds));
+                if (is_string_at(rm->array, index))
+                    *dst = recall_matrix_string(rm->array, index);
                 else
-                    *dst = new_real(ds);
+                    *dst = new_real(rm->array->data[index]);
                 if (*dst == NULL)
                     return ERR_INSUFFICIENT_MEMORY;
                 return ERR_NONE;
@@ -313,7 +311,7 @@ int generic_rcl(arg_struct *arg, vartype **dst) {
             return ERR_NONE;
         }
         case ARGTYPE_STR: {
-            *dst = recall_var(arg->val.text, arg->length);
+            *dst = recall_arg_var(arg);
             if (*dst == NULL)
                 return ERR_NONEXISTENT;
             *dst = dup_vartype(*dst);
@@ -326,7 +324,7 @@ int generic_rcl(arg_struct *arg, vartype **dst) {
     }
 }
 
-static arg_struct temp_arg;
+static CORE_STATE arg_struct temp_arg;
 
 static void generic_sto_completion(int error, vartype *res) {
     if (error != ERR_NONE)
@@ -361,7 +359,7 @@ static void generic_sto_completion(int error, vartype *res) {
         // destination's dimensions to change.)
         int4 i = matedit_i;
         int4 j = matedit_j;
-        store_var(temp_arg.val.text, temp_arg.length, res);
+        store_arg_var(&temp_arg, res);
         if (preserve_ij) {
             matedit_i = i;
             matedit_j = j;
@@ -395,27 +393,23 @@ int generic_sto(arg_struct *arg, char operation) {
                 if (num >= size)
                     return ERR_SIZE_ERROR;
                 if (reg_x->type == TYPE_STRING) {
-                    if (!disentangle((vartype *) rm))
-                        return ERR_INSUFFICIENT_MEMORY;
                     vartype_string *vs = (vartype_string *) reg_x;
-                    phloat *ds = rm->array->data + num;
-                    int len, i;
-                    len = vs->length;
-                    phloat_length(*ds) = len;
-                    for (i = 0; i < len; i++)
-                        phloat_text(*ds)[i] = vs->text[i];
-                    rm->array->is_string[num] = 1;
+                    if (!disentangle((vartype *) rm)
+                            || !put_matrix_string(rm, num, TXT(vs), vs->length))
+                        return ERR_INSUFFICIENT_MEMORY;
                     return ERR_NONE;
                 } else if (reg_x->type == TYPE_REAL) {
                     if (!disentangle((vartype *) rm))
                         return ERR_INSUFFICIENT_MEMORY;
                     if (operation == 0) {
+                        release_long_strings(rm->array, num, num + 1);
                         rm->array->data[num] = ((vartype_real *) reg_x)->x;
-                        rm->array->is_string[num] = 0;
+                        if (rm->array->is_string != NULL)
+                            rm->array->is_string[num] = 0;
                     } else {
                         phloat x, n;
                         int inf;
-                        if (rm->array->is_string[num])
+                        if (is_string_at(rm->array, num))
                             return ERR_ALPHA_DATA_IS_INVALID;
                         x = ((vartype_real *) reg_x)->x;
                         n = rm->array->data[num];
@@ -595,7 +589,7 @@ int generic_sto(arg_struct *arg, char operation) {
                 newval = dup_vartype(reg_x);
                 if (newval == NULL)
                     return ERR_INSUFFICIENT_MEMORY;
-                int err = store_var(arg->val.text, arg->length, newval);
+                int err = store_arg_var(arg, newval);
                 if (err != ERR_NONE)
                     free_vartype(newval);
                 return err;
@@ -612,10 +606,14 @@ int generic_sto(arg_struct *arg, char operation) {
                         && string_equals(arg->val.text,
                                 arg->length, matedit_name, matedit_length))
                     return ERR_RESTRICTED_OPERATION;
-                vartype *oldval = recall_var(arg->val.text, arg->length);
+                vartype *oldval = recall_arg_var(arg);
                 if (oldval == NULL)
                     return ERR_NONEXISTENT;
                 temp_arg = *arg;
+                if (operation == '*' || operation == '/')
+                    /* Matrix multiplication and division may finish
+                     * later, so look the variable up again at that point */
+                    temp_arg.target = -1;
                 return apply_sto_operation(operation, oldval, false);
             }
         }
@@ -653,12 +651,13 @@ int map_unary(const vartype *src, vartype **dst, mappable_r mr, mappable_c mc) {
             vartype_realmatrix *dm;
             int4 size, i;
             int error;
-            dm = (vartype_realmatrix *) new_realmatrix(sm->rows, sm->columns);
+            dm = (vartype_realmatrix *)
+                                   new_realmatrix(sm->rows, sm->columns, false);
             if (dm == NULL)
                 return ERR_INSUFFICIENT_MEMORY;
             size = sm->rows * sm->columns;
             for (i = 0; i < size; i++) {
-                if (sm->array->is_string[i]) {
+                if (is_string_at(sm->array, i)) {
                     free_vartype((vartype *) dm);
                     return ERR_ALPHA_DATA_IS_INVALID;
                 }
@@ -681,7 +680,8 @@ int map_unary(const vartype *src, vartype **dst, mappable_r mr, mappable_c mc) {
             int4 size = 2 * rows * columns;
             int4 i;
             int error;
-            dm = (vartype_complexmatrix *) new_complexmatrix(rows, columns);
+            dm = (vartype_complexmatrix *)
+                                        new_complexmatrix(rows, columns, false);
             if (dm == NULL)
                 return ERR_INSUFFICIENT_MEMORY;
             for (i = 0; i < size; i += 2) {
@@ -700,6 +700,32 @@ int map_unary(const vartype *src, vartype **dst, mappable_r mr, mappable_c mc) {
     }
 }
 
+#ifndef BCD_MATH
+/* In the binary build, the element-wise cases of the four arithmetic
+ * operators are handed to the vector kernels first. They only do the common
+ * case, where every result is finite; if they report otherwise, the scalar
+ * loops run as before, and take care of division by zero, Out of Range, and
+ * range_error_ignore.
+ */
+static int vec_op(mappable_rr mrr) {
+    if (mrr == add_rr)
+        return VEC_ADD;
+    else if (mrr == sub_rr)
+        return VEC_SUB;
+    else if (mrr == mul_rr)
+        return VEC_MUL;
+    else if (mrr == div_rr)
+        return VEC_DIV;
+    else
+        return -1;
+}
+
+static bool vec_apply(int op, const phloat *x, int xinc, const phloat *y,
+                      int yinc, phloat *z, int4 n) {
+    return op != -1 && vec_map(op, x, xinc, y, yinc, z, n);
+}
+#endif
+
 int map_binary(const vartype *src1, const vartype *src2, vartype **dst,
         mappable_rr mrr, mappable_rc mrc, mappable_cr mcr, mappable_cc mcc) {
     int error;
@@ -736,15 +762,22 @@ int map_binary(const vartype *src1, const vartype *src2, vartype **dst,
                     int4 size, i;
                     int error;
                     dm = (vartype_realmatrix *)
-                                        new_realmatrix(sm->rows, sm->columns);
+                                   new_realmatrix(sm->rows, sm->columns, false);
                     if (dm == NULL)
                         return ERR_INSUFFICIENT_MEMORY;
                     size = sm->rows * sm->columns;
                     for (i = 0; i < size; i++)
-                        if (sm->array->is_string[i]) {
+                        if (is_string_at(sm->array, i)) {
                             free_vartype((vartype *) dm);
                             return ERR_ALPHA_DATA_IS_INVALID;
                         }
+#ifndef BCD_MATH
+                    if (vec_apply(vec_op(mrr), &((vartype_real *) src1)->x, 0,
+                                  sm->array->data, 1, dm->array->data, size)) {
+                        *dst = (vartype *) dm;
+                        return ERR_NONE;
+                    }
+#endif
                     for (i = 0; i < size; i++) {
                         error = mrr(((vartype_real *) src1)->x,
                                     sm->array->data[i],
@@ -763,10 +796,22 @@ int map_binary(const vartype *src1, const vartype *src2, vartype **dst,
                     int4 size, i;
                     int error;
                     dm = (vartype_complexmatrix *)
-                                    new_complexmatrix(sm->rows, sm->columns);
+                                new_complexmatrix(sm->rows, sm->columns, false);
                     if (dm == NULL)
                         return ERR_INSUFFICIENT_MEMORY;
                     size = 2 * sm->rows * sm->columns;
+#ifndef BCD_MATH
+                    /* Multiplying or dividing by a real scales the real and
+                     * imaginary parts alike, so that's element-wise, too. */
+                    if ((mrr == mul_rr || mrr == div_rr)
+                            && vec_apply(vec_op(mrr),
+                                         &((vartype_real *) src1)->x, 0,
+                                         sm->array->data, 1, dm->array->data,
+                                         size)) {
+                        *dst = (vartype *) dm;
+                        return ERR_NONE;
+                    }
+#endif
                     for (i = 0; i < size; i += 2) {
                         error = mrc(((vartype_real *) src1)->x,
                                     sm->array->data[i],
@@ -819,12 +864,12 @@ int map_binary(const vartype *src1, const vartype *src2, vartype **dst,
                     int4 size, i;
                     int error;
                     dm = (vartype_complexmatrix *)
-                                    new_complexmatrix(sm->rows, sm->columns);
+                                new_complexmatrix(sm->rows, sm->columns, false);
                     if (dm == NULL)
                         return ERR_INSUFFICIENT_MEMORY;
                     size = sm->rows * sm->columns;
                     for (i = 0; i < size; i++)
-                        if (sm->array->is_string[i]) {
+                        if (is_string_at(sm->array, i)) {
                             free_vartype((vartype *) dm);
                             return ERR_ALPHA_DATA_IS_INVALID;
                         }
@@ -848,7 +893,7 @@ int map_binary(const vartype *src1, const vartype *src2, vartype **dst,
                     int4 size, i;
                     int error;
                     dm = (vartype_complexmatrix *)
-                                    new_complexmatrix(sm->rows, sm->columns);
+                                new_complexmatrix(sm->rows, sm->columns, false);
                     if (dm == NULL)
                         return ERR_INSUFFICIENT_MEMORY;
                     size = 2 * sm->rows * sm->columns;
@@ -878,15 +923,23 @@ int map_binary(const vartype *src1, const vartype *src2, vartype **dst,
                     int4 size, i;
                     int error;
                     dm = (vartype_realmatrix *)
-                                        new_realmatrix(sm->rows, sm->columns);
+                                   new_realmatrix(sm->rows, sm->columns, false);
                     if (dm == NULL)
                         return ERR_INSUFFICIENT_MEMORY;
                     size = sm->rows * sm->columns;
                     for (i = 0; i < size; i++)
-                        if (sm->array->is_string[i]) {
+                        if (is_string_at(sm->array, i)) {
                             free_vartype((vartype *) dm);
                             return ERR_ALPHA_DATA_IS_INVALID;
                         }
+#ifndef BCD_MATH
+                    if (vec_apply(vec_op(mrr), sm->array->data, 1,
+                                  &((vartype_real *) src2)->x, 0,
+                                  dm->array->data, size)) {
+                        *dst = (vartype *) dm;
+                        return ERR_NONE;
+                    }
+#endif
                     for (i = 0; i < size; i++) {
                         error = mrr(sm->array->data[i],
                                     ((vartype_real *) src2)->x,
@@ -905,12 +958,12 @@ int map_binary(const vartype *src1, const vartype *src2, vartype **dst,
                     int4 size, i;
                     int error;
                     dm = (vartype_complexmatrix *)
-                                    new_complexmatrix(sm->rows, sm->columns);
+                                new_complexmatrix(sm->rows, sm->columns, false);
                     if (dm == NULL)
                         return ERR_INSUFFICIENT_MEMORY;
                     size = sm->rows * sm->columns;
                     for (i = 0; i < size; i++)
-                        if (sm->array->is_string[i]) {
+                        if (is_string_at(sm->array, i)) {
                             free_vartype((vartype *) dm);
                             return ERR_ALPHA_DATA_IS_INVALID;
                         }
@@ -937,16 +990,23 @@ int map_binary(const vartype *src1, const vartype *src2, vartype **dst,
                     if (sm1->rows != sm2->rows || sm1->columns != sm2->columns)
                         return ERR_DIMENSION_ERROR;
                     dm = (vartype_realmatrix *)
-                                    new_realmatrix(sm1->rows, sm1->columns);
+                                 new_realmatrix(sm1->rows, sm1->columns, false);
                     if (dm == NULL)
                         return ERR_INSUFFICIENT_MEMORY;
                     size = sm1->rows * sm1->columns;
                     for (i = 0; i < size; i++)
-                        if (sm1->array->is_string[i]
-                                    || sm2->array->is_string[i]) {
+                        if (is_string_at(sm1->array, i)
+                                    || is_string_at(sm2->array, i)) {
                             free_vartype((vartype *) dm);
                             return ERR_ALPHA_DATA_IS_INVALID;
                         }
+#ifndef BCD_MATH
+                    if (vec_apply(vec_op(mrr), sm1->array->data, 1,
+                                  sm2->array->data, 1, dm->array->data, size)) {
+                        *dst = (vartype *) dm;
+                        return ERR_NONE;
+                    }
+#endif
                     for (i = 0; i < size; i++) {
                         error = mrr(sm1->array->data[i],
                                     sm2->array->data[i],
@@ -968,12 +1028,12 @@ int map_binary(const vartype *src1, const vartype *src2, vartype **dst,
                     if (sm1->rows != sm2->rows || sm1->columns != sm2->columns)
                         return ERR_DIMENSION_ERROR;
                     dm = (vartype_complexmatrix *)
-                                    new_complexmatrix(sm1->rows, sm1->columns);
+                              new_complexmatrix(sm1->rows, sm1->columns, false);
                     if (dm == NULL)
                         return ERR_INSUFFICIENT_MEMORY;
                     size = sm1->rows * sm1->columns;
                     for (i = 0; i < size; i++)
-                        if (sm1->array->is_string[i]) {
+                        if (is_string_at(sm1->array, i)) {
                             free_vartype((vartype *) dm);
                             return ERR_ALPHA_DATA_IS_INVALID;
                         }
@@ -1002,7 +1062,7 @@ int map_binary(const vartype *src1, const vartype *src2, vartype **dst,
                     int4 size, i;
                     int error;
                     dm = (vartype_complexmatrix *)
-                                    new_complexmatrix(sm->rows, sm->columns);
+                                new_complexmatrix(sm->rows, sm->columns, false);
                     if (dm == NULL)
                         return ERR_INSUFFICIENT_MEMORY;
                     size = 2 * sm->rows * sm->columns;
@@ -1026,7 +1086,7 @@ int map_binary(const vartype *src1, const vartype *src2, vartype **dst,
                     int4 size, i;
                     int error;
                     dm = (vartype_complexmatrix *)
-                                    new_complexmatrix(sm->rows, sm->columns);
+                                new_complexmatrix(sm->rows, sm->columns, false);
                     if (dm == NULL)
                         return ERR_INSUFFICIENT_MEMORY;
                     size = 2 * sm->rows * sm->columns;
@@ -1054,12 +1114,12 @@ int map_binary(const vartype *src1, const vartype *src2, vartype **dst,
                     if (sm1->rows != sm2->rows || sm1->columns != sm2->columns)
                         return ERR_DIMENSION_ERROR;
                     dm = (vartype_complexmatrix *)
-                                    new_complexmatrix(sm1->rows, sm1->columns);
+                              new_complexmatrix(sm1->rows, sm1->columns, false);
                     if (dm == NULL)
                         return ERR_INSUFFICIENT_MEMORY;
                     size = sm1->rows * sm1->columns;
                     for (i = 0; i < size; i++)
-                        if (sm2->array->is_string[i]) {
+                        if (is_string_at(sm2->array, i)) {
                             free_vartype((vartype *) dm);
                             return ERR_ALPHA_DATA_IS_INVALID;
                         }
@@ -1086,10 +1146,21 @@ int map_binary(const vartype *src1, const vartype *src2, vartype **dst,
                     if (sm1->rows != sm2->rows || sm1->columns != sm2->columns)
                         return ERR_DIMENSION_ERROR;
                     dm = (vartype_complexmatrix *)
-                                    new_complexmatrix(sm1->rows, sm1->columns);
+                              new_complexmatrix(sm1->rows, sm1->columns, false);
                     if (dm == NULL)
                         return ERR_INSUFFICIENT_MEMORY;
                     size = 2 * sm1->rows * sm1->columns;
+#ifndef BCD_MATH
+                    /* Complex addition and subtraction are element-wise on
+                     * the real and imaginary parts. */
+                    if ((mrr == add_rr || mrr == sub_rr)
+                            && vec_apply(vec_op(mrr), sm1->array->data, 1,
+                                         sm2->array->data, 1, dm->array->data,
+                                         size)) {
+                        *dst = (vartype *) dm;
+                        return ERR_NONE;
+                    }
+#endif
                     for (i = 0; i < size; i += 2) {
                         error = mcc(sm1->array->data[i],
                                     sm1->array->data[i + 1],
@@ -1483,3 +1554,9 @@ int add_cc(phloat xre, phloat xim, phloat yre, phloat yim,
     *zim = rim;
     return ERR_NONE;
 }
+
+void visit_sto_rcl_state(state_visitor visit, void *cd) {
+    VISIT_STATE(preserve_ij);
+    VISIT_STATE(trace_stack);
+    VISIT_STATE(temp_arg);
+}
@@ -97,4 +97,6 @@ int add_cr(phloat xre, phloat xim, phloat y, phloat *zre, phloat *zim);
 int add_cc(phloat xre, phloat xim, phloat yre, phloat yim,
                                     phloat *zre, phloat *zim);
 
+void visit_sto_rcl_state(state_visitor visit, void *cd);
+
 #endif
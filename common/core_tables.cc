@@ -379,8 +379,8 @@ static const command_spec cmd_array[] =
     { /* PUTZ */        "PUTZ",                 4, docmd_xrom,        0x0000a7cd, ARG_NONE,  FLAG_NONE },
     { /* DELP */        "DELP",                 4, docmd_xrom,        0x0000a7ce, ARG_NONE,  FLAG_NONE },
 
-    /* Byron Foster's DROP for Bigstack (Obsolete) */
-    { /* DROP */        "DROP",                 4, docmd_xrom,        0x0000a271, ARG_NONE,  FLAG_NONE },
+    /* Byron Foster's DROP for Bigstack */
+    { /* DROP */        "DROP",                 4, docmd_drop,        0x0000a271, ARG_NONE,  FLAG_NONE },
 
     /* Accelerometer, GPS, and compass support */
     { /* ACCEL */       "ACCEL",                5, docmd_accel,       0x0000a7cf, ARG_NONE,  FLAG_NONE },
@@ -442,7 +442,21 @@ static const command_spec cmd_array[] =
     { /* ANUM */       "ANUM",                  4, docmd_anum,        0x0000a642, ARG_NONE,  FLAG_NONE },
     { /* X<>F */       "X<>F",                  4, docmd_x_swap_f,    0x0000a66e, ARG_NONE,  FLAG_NONE },
     { /* RCLFLAG */    "RCLFLAG",               7, docmd_rclflag,     0x0000a660, ARG_NONE,  FLAG_NONE },
-    { /* STOFLAG */    "STOFLAG",               7, docmd_stoflag,     0x0000a66d, ARG_NONE,  FLAG_NONE }
+    { /* STOFLAG */    "STOFLAG",               7, docmd_stoflag,     0x0000a66d, ARG_NONE,  FLAG_NONE },
+
+    /* Long strings */
+    { /* ASTOX */      "ASTOX",                 5, docmd_astox,       0x0000a7da, ARG_NONE,  FLAG_NONE },
+
+    /* Big stack */
+    { /* 4STK */       "4STK",                  4, docmd_4stk,        0x0000a7db, ARG_NONE,  FLAG_NONE },
+    { /* NSTK */       "NSTK",                  4, docmd_nstk,        0x0000a7dc, ARG_NONE,  FLAG_NONE },
+    { /* DEPTH */      "DEPTH",                 5, docmd_depth,       0x0000a7dd, ARG_NONE,  FLAG_NONE },
+    { /* DROPN */      "DROPN",                 5, docmd_dropn,       0x0100f2a0, ARG_NUM99, FLAG_NONE },
+    { /* DUPN */       "DUPN",                  4, docmd_dupn,        0x0100f2a1, ARG_NUM99, FLAG_NONE },
+    { /* PICK */       "PICK",                  4, docmd_pick,        0x0100f2a2, ARG_NUM99, FLAG_NONE },
+    { /* UNPICK */     "UNPICK",                6, docmd_unpick,      0x0100f2a3, ARG_NUM99, FLAG_NONE },
+    { /* RDNN */       "R\016N",                3, docmd_rdnn,        0x0100f2a4, ARG_NUM99, FLAG_NONE },
+    { /* RUPN */       "R^N",                   3, docmd_rupn,        0x0100f2a5, ARG_NUM99, FLAG_NONE }
 };
 
 /*
@@ -365,7 +365,7 @@
 #define CMD_GETZ        326
 #define CMD_PUTZ        327
 #define CMD_DELP        328
-/* Byron Foster's Bigstack extension (Obsolete) */
+/* Byron Foster's Bigstack extension; DROP lives on in the big stack */
 #define CMD_DROP        329
 /* iPhone hardware support */
 #define CMD_ACCEL       330
@@ -424,8 +424,20 @@
 #define CMD_X_SWAP_F    379
 #define CMD_RCLFLAG     380
 #define CMD_STOFLAG     381
+/* Long strings */
+#define CMD_ASTOX       382
+/* Big stack */
+#define CMD_4STK        383
+#define CMD_NSTK        384
+#define CMD_DEPTH       385
+#define CMD_DROPN       386
+#define CMD_DUPN        387
+#define CMD_PICK        388
+#define CMD_UNPICK      389
+#define CMD_RDNN        390
+#define CMD_RUPN        391
 
-#define CMD_SENTINEL    382
+#define CMD_SENTINEL    392
 
 
 /* command_spec.argtype */
@@ -16,157 +16,355 @@
  *****************************************************************************/
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "core_globals.h"
 #include "core_helpers.h"
 #include "core_display.h"
+#include "core_main.h"
 #include "core_variables.h"
 
 
-// We cache vartype_real, vartype_complex, and vartype_string instances, to
-// cut down on the malloc/free overhead.
+// Fixed-size objects -- vartype_real, vartype_complex, vartype_string, the
+// matrix headers, and the matrix descriptors -- are carved out of slabs of
+// SLAB_OBJECTS each, and recycled through one free list per class, to cut
+// down on the malloc/free overhead. A matrix thus takes one malloc() (for
+// its data), instead of three, and an alias takes none.
+// Slabs that have become entirely free are handed back to the system by
+// trim_vartype_pools(), which runs when a program stops, when MEM asks how
+// much memory is available, and whenever a class accumulates more than
+// trim_at free objects; after each trim, that limit is set to half again the
+// number of free objects the trim could not release, so that a fragmented
+// class isn't scanned over and over again.
 
-typedef struct pool_real {
-    vartype_real r;
-    struct pool_real *next;
-} pool_real;
+#define SLAB_OBJECTS 64
+#define SLAB_TRIM_MIN 4096
 
-static pool_real *realpool = NULL;
+/* Objects are allocated in units of this size, so that they are aligned for
+ * any of their members; while an object is free, it holds the free list link.
+ */
+typedef union slab_unit {
+    union slab_unit *next;
+    phloat p;
+    int8 i;
+    void *v;
+} slab_unit;
 
-typedef struct pool_complex {
-    vartype_complex c;
-    struct pool_complex *next;
-} pool_complex;
+typedef struct slab_class {
+    slab_unit *free_list;
+    slab_unit *slabs;
+    int4 live;
+    int4 peak;
+    int4 capacity;
+    int4 slab_count;
+    int4 trim_at;
+    int4 trims;
+    int4 released;
+} slab_class;
 
-static pool_complex *complexpool = NULL;
+static const size_t slab_object_size[SLAB_CLASSES] = {
+    sizeof(vartype_real),
+    sizeof(vartype_complex),
+    sizeof(vartype_string),
+    sizeof(vartype_realmatrix),
+    sizeof(vartype_complexmatrix),
+    sizeof(realmatrix_data),
+    sizeof(complexmatrix_data)
+};
 
-typedef struct pool_string {
-    vartype_string s;
-    struct pool_string *next;
-} pool_string;
+static CORE_STATE slab_class slab_classes[SLAB_CLASSES];
 
-static pool_string *stringpool = NULL;
+static int4 slab_units(int cls) {
+    return (slab_object_size[cls] + sizeof(slab_unit) - 1) / sizeof(slab_unit);
+}
 
-vartype *new_real(phloat value) {
-    pool_real *r;
-    if (realpool == NULL) {
-        r = (pool_real *) malloc(sizeof(pool_real));
-        if (r == NULL)
+static size_t slab_bytes(int cls) {
+    return (1 + SLAB_OBJECTS * slab_units(cls)) * sizeof(slab_unit);
+}
+
+static int slab_compar(const void *a, const void *b) {
+    const slab_unit *sa = *(const slab_unit * const *) a;
+    const slab_unit *sb = *(const slab_unit * const *) b;
+    return sa < sb ? -1 : sa > sb ? 1 : 0;
+}
+
+/* Returns the index of the slab containing 'obj', that is, the last one in
+ * the sorted array that starts below it.
+ */
+static int4 owning_slab(slab_unit **slabs, int4 n, const slab_unit *obj) {
+    int4 lo = 0, hi = n - 1;
+    while (lo < hi) {
+        int4 mid = (lo + hi + 1) / 2;
+        if (slabs[mid] < obj)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+static void trim_slab_class(int cls) {
+    slab_class *sc = slab_classes + cls;
+    int4 n = sc->slab_count;
+    if (sc->capacity - sc->live < SLAB_OBJECTS)
+        return;
+    slab_unit **slabs = (slab_unit **) malloc(n * sizeof(slab_unit *));
+    int4 *unused = (int4 *) malloc(n * sizeof(int4));
+    if (slabs == NULL || unused == NULL) {
+        free(slabs);
+        free(unused);
+        return;
+    }
+    int4 i = 0;
+    for (slab_unit *slab = sc->slabs; slab != NULL; slab = slab->next) {
+        unused[i] = 0;
+        slabs[i++] = slab;
+    }
+    qsort(slabs, n, sizeof(slab_unit *), slab_compar);
+
+    /* Count the free objects in each slab... */
+    for (slab_unit *obj = sc->free_list; obj != NULL; obj = obj->next)
+        unused[owning_slab(slabs, n, obj)]++;
+
+    /* ...drop the objects of the empty ones from the free list... */
+    slab_unit **link = &sc->free_list;
+    while (*link != NULL) {
+        slab_unit *obj = *link;
+        if (unused[owning_slab(slabs, n, obj)] == SLAB_OBJECTS)
+            *link = obj->next;
+        else
+            link = &obj->next;
+    }
+
+    /* ...and then the slabs themselves */
+    sc->slabs = NULL;
+    int4 released = 0;
+    for (i = n - 1; i >= 0; i--) {
+        if (unused[i] == SLAB_OBJECTS) {
+            free(slabs[i]);
+            released++;
+        } else {
+            slabs[i]->next = sc->slabs;
+            sc->slabs = slabs[i];
+        }
+    }
+    free(slabs);
+    free(unused);
+    sc->slab_count -= released;
+    sc->capacity -= released * SLAB_OBJECTS;
+    sc->released += released;
+    sc->trims++;
+    int4 idle = sc->capacity - sc->live;
+    sc->trim_at = idle + (idle < SLAB_TRIM_MIN * 2 ? SLAB_TRIM_MIN : idle / 2);
+}
+
+void *slab_alloc(int cls) {
+    slab_class *sc = slab_classes + cls;
+    if (sc->free_list == NULL) {
+        /* The first unit of each slab links it into sc->slabs; the rest
+         * hold SLAB_OBJECTS objects.
+         */
+        int4 units = slab_units(cls);
+        slab_unit *slab = (slab_unit *) malloc(slab_bytes(cls));
+        if (slab == NULL)
             return NULL;
-        r->r.type = TYPE_REAL;
-    } else {
-        r = realpool;
-        realpool = realpool->next;
+        slab->next = sc->slabs;
+        sc->slabs = slab;
+        sc->slab_count++;
+        sc->capacity += SLAB_OBJECTS;
+        for (int i = SLAB_OBJECTS - 1; i >= 0; i--) {
+            slab_unit *obj = slab + 1 + i * units;
+            obj->next = sc->free_list;
+            sc->free_list = obj;
+        }
+    }
+    slab_unit *obj = sc->free_list;
+    sc->free_list = obj->next;
+    if (++sc->live > sc->peak)
+        sc->peak = sc->live;
+    return obj;
+}
+
+void slab_free(int cls, void *p) {
+    if (p == NULL)
+        return;
+    slab_class *sc = slab_classes + cls;
+    slab_unit *obj = (slab_unit *) p;
+    obj->next = sc->free_list;
+    sc->free_list = obj;
+    sc->live--;
+    if (sc->capacity - sc->live > (sc->trim_at == 0 ? SLAB_TRIM_MIN
+                                                    : sc->trim_at))
+        trim_slab_class(cls);
+}
+
+void trim_vartype_pools() {
+    for (int cls = 0; cls < SLAB_CLASSES; cls++)
+        trim_slab_class(cls);
+}
+
+void get_slab_stats(int cls, slab_stats *stats) {
+    slab_class *sc = slab_classes + cls;
+    stats->live = sc->live;
+    stats->peak = sc->peak;
+    stats->capacity = sc->capacity;
+    stats->slabs = sc->slab_count;
+    stats->bytes = sc->slab_count * slab_bytes(cls);
+    stats->trims = sc->trims;
+    stats->released = sc->released;
+}
+
+uint4 vartype_pool_free_bytes() {
+    uint4 bytes = 0;
+    for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+        slab_class *sc = slab_classes + cls;
+        bytes += (sc->capacity - sc->live) * slab_object_size[cls];
     }
-    r->r.x = value;
+    return bytes;
+}
+
+const char *slab_class_name(int cls) {
+    static const char *names[SLAB_CLASSES] = {
+        "real", "complex", "string", "realmatrix", "complexmatrix",
+        "realmatrix_data", "complexmatrix_data"
+    };
+    return names[cls];
+}
+
+static int store_var_at(int varindex, const char *name, int namelength, vartype *value, bool local);
+
+vartype *new_real(phloat value) {
+    vartype_real *r = (vartype_real *) slab_alloc(SLAB_REAL);
+    if (r == NULL)
+        return NULL;
+    r->type = TYPE_REAL;
+    r->x = value;
     return (vartype *) r;
 }
 
 vartype *new_complex(phloat re, phloat im) {
-    pool_complex *c;
-    if (complexpool == NULL) {
-        c = (pool_complex *) malloc(sizeof(pool_complex));
-        if (c == NULL)
-            return NULL;
-        c->c.type = TYPE_COMPLEX;
-    } else {
-        c = complexpool;
-        complexpool = complexpool->next;
-    }
-    c->c.re = re;
-    c->c.im = im;
+    vartype_complex *c = (vartype_complex *) slab_alloc(SLAB_COMPLEX);
+    if (c == NULL)
+        return NULL;
+    c->type = TYPE_COMPLEX;
+    c->re = re;
+    c->im = im;
     return (vartype *) c;
 }
 
 vartype *new_string(const char *text, int length) {
-    pool_string *s;
-    if (stringpool == NULL) {
-        s = (pool_string *) malloc(sizeof(pool_string));
-        if (s == NULL)
+    vartype_string *s = (vartype_string *) slab_alloc(SLAB_STRING);
+    if (s == NULL)
+        return NULL;
+    s->type = TYPE_STRING;
+    s->length = length;
+    if (length > SSLENV) {
+        s->t.ptr = (char *) malloc(length);
+        if (s->t.ptr == NULL) {
+            slab_free(SLAB_STRING, s);
             return NULL;
-        s->s.type = TYPE_STRING;
-    } else {
-        s = stringpool;
-        stringpool = stringpool->next;
+        }
     }
-    int i;
-    s->s.type = TYPE_STRING;
-    s->s.length = length > 6 ? 6 : length;
-    for (i = 0; i < s->s.length; i++)
-        s->s.text[i] = text[i];
+    memcpy(TXT(s), text, length);
     return (vartype *) s;
 }
 
-vartype *new_realmatrix(int4 rows, int4 columns) {
+phloat *new_phloat_array(int4 n, bool zero) {
+#ifdef BCD_MATH
+    phloat *p = (phloat *) malloc(n * sizeof(phloat));
+    if (p != NULL && zero)
+        zero_phloat_array(p, n);
+    return p;
+#else
+    /* All-zero bits is 0.0, so calloc() does the job, and for large arrays,
+     * it may even get away without touching the memory at all.
+     */
+    if (zero)
+        return (phloat *) calloc(n, sizeof(phloat));
+    else
+        return (phloat *) malloc(n * sizeof(phloat));
+#endif
+}
+
+void zero_phloat_array(phloat *p, int4 n) {
+#ifdef BCD_MATH
+    /* All-zero bits is a valid decimal zero, but not the canonical one that
+     * Phloat(0) produces, so construct one zero and replicate it, doubling
+     * the copied block each time.
+     */
+    if (n <= 0)
+        return;
+    p[0] = 0;
+    int4 done = 1;
+    while (done < n) {
+        int4 c = done < n - done ? done : n - done;
+        memcpy(p + done, p, c * sizeof(phloat));
+        done += c;
+    }
+#else
+    if (n > 0)
+        memset(p, 0, n * sizeof(phloat));
+#endif
+}
+
+vartype *new_realmatrix(int4 rows, int4 columns, bool zero) {
     double d_bytes = ((double) rows) * ((double) columns) * sizeof(phloat);
     if (((double) (int4) d_bytes) != d_bytes)
         return NULL;
 
-    vartype_realmatrix *rm = (vartype_realmatrix *)
-                                        malloc(sizeof(vartype_realmatrix));
+    vartype_realmatrix *rm = (vartype_realmatrix *) slab_alloc(SLAB_REALMATRIX);
     if (rm == NULL)
         return NULL;
-    int4 i, sz;
+    int4 sz;
     rm->type = TYPE_REALMATRIX;
     rm->rows = rows;
     rm->columns = columns;
     sz = rows * columns;
-    rm->array = (realmatrix_data *) malloc(sizeof(realmatrix_data));
+    rm->array = (realmatrix_data *) slab_alloc(SLAB_REALMATRIX_DATA);
     if (rm->array == NULL) {
-        free(rm);
+        slab_free(SLAB_REALMATRIX, rm);
         return NULL;
     }
-    rm->array->data = (phloat *) malloc(sz * sizeof(phloat));
+    rm->array->data = new_phloat_array(sz, zero);
     if (rm->array->data == NULL) {
         /* Oops */
-        free(rm->array);
-        free(rm);
+        slab_free(SLAB_REALMATRIX_DATA, rm->array);
+        slab_free(SLAB_REALMATRIX, rm);
         return NULL;
     }
-    rm->array->is_string = (char *) malloc(sz);
-    if (rm->array->is_string == NULL) {
-        /* Oops */
-        free(rm->array->data);
-        free(rm->array);
-        free(rm);
-        return NULL;
-    }
-    for (i = 0; i < sz; i++)
-        rm->array->data[i] = 0;
-    for (i = 0; i < sz; i++)
-        rm->array->is_string[i] = 0;
+    rm->array->is_string = NULL;
+    rm->array->lu = NULL;
     rm->array->refcount = 1;
     return (vartype *) rm;
 }
 
-vartype *new_complexmatrix(int4 rows, int4 columns) {
+vartype *new_complexmatrix(int4 rows, int4 columns, bool zero) {
     double d_bytes = ((double) rows) * ((double) columns) * sizeof(phloat) * 2;
     if (((double) (int4) d_bytes) != d_bytes)
         return NULL;
 
     vartype_complexmatrix *cm = (vartype_complexmatrix *)
-                                        malloc(sizeof(vartype_complexmatrix));
+                                                 slab_alloc(SLAB_COMPLEXMATRIX);
     if (cm == NULL)
         return NULL;
-    int4 i, sz;
+    int4 sz;
     cm->type = TYPE_COMPLEXMATRIX;
     cm->rows = rows;
     cm->columns = columns;
     sz = rows * columns * 2;
-    cm->array = (complexmatrix_data *) malloc(sizeof(complexmatrix_data));
+    cm->array = (complexmatrix_data *) slab_alloc(SLAB_COMPLEXMATRIX_DATA);
     if (cm->array == NULL) {
-        free(cm);
+        slab_free(SLAB_COMPLEXMATRIX, cm);
         return NULL;
     }
-    cm->array->data = (phloat *) malloc(sz * sizeof(phloat));
+    cm->array->data = new_phloat_array(sz, zero);
     if (cm->array->data == NULL) {
         /* Oops */
-        free(cm->array);
-        free(cm);
+        slab_free(SLAB_COMPLEXMATRIX_DATA, cm->array);
+        slab_free(SLAB_COMPLEXMATRIX, cm);
         return NULL;
     }
-    for (i = 0; i < sz; i++)
-        cm->array->data[i] = 0;
+    cm->array->lu = NULL;
     cm->array->refcount = 1;
     return (vartype *) cm;
 }
@@ -175,7 +373,7 @@ vartype *new_matrix_alias(vartype *m) {
     if (m->type == TYPE_REALMATRIX) {
         vartype_realmatrix *rm1 = (vartype_realmatrix *) m;
         vartype_realmatrix *rm2 = (vartype_realmatrix *)
-                                        malloc(sizeof(vartype_realmatrix));
+                                                    slab_alloc(SLAB_REALMATRIX);
         if (rm2 == NULL)
             return NULL;
         *rm2 = *rm1;
@@ -184,7 +382,7 @@ vartype *new_matrix_alias(vartype *m) {
     } else if (m->type == TYPE_COMPLEXMATRIX) {
         vartype_complexmatrix *cm1 = (vartype_complexmatrix *) m;
         vartype_complexmatrix *cm2 = (vartype_complexmatrix *)
-                                        malloc(sizeof(vartype_complexmatrix));
+                                                 slab_alloc(SLAB_COMPLEXMATRIX);
         if (cm2 == NULL)
             return NULL;
         *cm2 = *cm1;
@@ -194,65 +392,104 @@ vartype *new_matrix_alias(vartype *m) {
         return NULL;
 }
 
+/* The one matrix decomposition that is currently cached, if any. */
+static CORE_STATE lu_cache *newest_lu = NULL;
+
+static void free_lu_cache(lu_cache *c) {
+    if (c == NULL)
+        return;
+    if (c == newest_lu)
+        newest_lu = NULL;
+    free_vartype(c->lu);
+    free(c->perm);
+    free(c);
+}
+
+void invalidate_lu(vartype *m) {
+    if (m->type == TYPE_REALMATRIX) {
+        vartype_realmatrix *rm = (vartype_realmatrix *) m;
+        free_lu_cache(rm->array->lu);
+        rm->array->lu = NULL;
+    } else if (m->type == TYPE_COMPLEXMATRIX) {
+        vartype_complexmatrix *cm = (vartype_complexmatrix *) m;
+        free_lu_cache(cm->array->lu);
+        cm->array->lu = NULL;
+    }
+}
+
+/* Makes c the decomposition cached with m's data, replacing the one m had, and
+ * dropping whichever matrix held the cache before. c now belongs to m's data.
+ */
+void attach_lu(vartype *m, lu_cache *c) {
+    invalidate_lu(m);
+    if (newest_lu != NULL) {
+        *newest_lu->owner = NULL;
+        free_lu_cache(newest_lu);
+    }
+    if (m->type == TYPE_REALMATRIX)
+        c->owner = &((vartype_realmatrix *) m)->array->lu;
+    else
+        c->owner = &((vartype_complexmatrix *) m)->array->lu;
+    *c->owner = c;
+    newest_lu = c;
+}
+
 void free_vartype(vartype *v) {
     if (v == NULL)
         return;
     switch (v->type) {
-        case TYPE_REAL: {
-            pool_real *r = (pool_real *) v;
-            r->next = realpool;
-            realpool = r;
+        case TYPE_REAL:
+            slab_free(SLAB_REAL, v);
             break;
-        }
-        case TYPE_COMPLEX: {
-            pool_complex *c = (pool_complex *) v;
-            c->next = complexpool;
-            complexpool = c;
+        case TYPE_COMPLEX:
+            slab_free(SLAB_COMPLEX, v);
             break;
-        }
         case TYPE_STRING: {
-            pool_string *s = (pool_string *) v;
-            s->next = stringpool;
-            stringpool = s;
+            vartype_string *s = (vartype_string *) v;
+            if (s->length > SSLENV)
+                free(s->t.ptr);
+            slab_free(SLAB_STRING, v);
             break;
         }
         case TYPE_REALMATRIX: {
             vartype_realmatrix *rm = (vartype_realmatrix *) v;
             if (--(rm->array->refcount) == 0) {
+                release_long_strings(rm->array, 0, rm->rows * rm->columns);
                 free(rm->array->data);
                 free(rm->array->is_string);
-                free(rm->array);
+                free_lu_cache(rm->array->lu);
+                slab_free(SLAB_REALMATRIX_DATA, rm->array);
             }
-            free(rm);
+            slab_free(SLAB_REALMATRIX, rm);
             break;
         }
         case TYPE_COMPLEXMATRIX: {
             vartype_complexmatrix *cm = (vartype_complexmatrix *) v;
             if (--(cm->array->refcount) == 0) {
                 free(cm->array->data);
-                free(cm->array);
+                free_lu_cache(cm->array->lu);
+                slab_free(SLAB_COMPLEXMATRIX_DATA, cm->array);
             }
-            free(cm);
+            slab_free(SLAB_COMPLEXMATRIX, cm);
             break;
         }
     }
 }
 
 void clean_vartype_pools() {
-    while (realpool != NULL) {
-        pool_real *r = realpool;
-        realpool = r->next;
-        free(r);
-    }
-    while (complexpool != NULL) {
-        pool_complex *c = complexpool;
-        complexpool = c->next;
-        free(c);
-    }
-    while (stringpool != NULL) {
-        pool_string *s = stringpool;
-        stringpool = s->next;
-        free(s);
+    for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+        slab_class *sc = slab_classes + cls;
+        if (sc->live != 0)
+            /* Something still refers to these; leave them be */
+            continue;
+        while (sc->slabs != NULL) {
+            slab_unit *slab = sc->slabs;
+            sc->slabs = slab->next;
+            free(slab);
+        }
+        sc->free_list = NULL;
+        sc->capacity = 0;
+        sc->slab_count = 0;
     }
 }
 
@@ -271,7 +508,7 @@ vartype *dup_vartype(const vartype *v) {
         case TYPE_REALMATRIX: {
             vartype_realmatrix *rm = (vartype_realmatrix *) v;
             vartype_realmatrix *rm2 = (vartype_realmatrix *)
-                                        malloc(sizeof(vartype_realmatrix));
+                                                    slab_alloc(SLAB_REALMATRIX);
             if (rm2 == NULL)
                 return NULL;
             rm2->type = TYPE_REALMATRIX;
@@ -284,7 +521,7 @@ vartype *dup_vartype(const vartype *v) {
         case TYPE_COMPLEXMATRIX: {
             vartype_complexmatrix *cm = (vartype_complexmatrix *) v;
             vartype_complexmatrix *cm2 = (vartype_complexmatrix *)
-                                        malloc(sizeof(vartype_complexmatrix));
+                                                 slab_alloc(SLAB_COMPLEXMATRIX);
             if (cm2 == NULL)
                 return NULL;
             cm2->type = TYPE_COMPLEXMATRIX;
@@ -296,7 +533,7 @@ vartype *dup_vartype(const vartype *v) {
         }
         case TYPE_STRING: {
             vartype_string *s = (vartype_string *) v;
-            return new_string(s->text, s->length);
+            return new_string(TXT(s), s->length);
         }
         default:
             return NULL;
@@ -307,30 +544,37 @@ int disentangle(vartype *v) {
     switch (v->type) {
         case TYPE_REALMATRIX: {
             vartype_realmatrix *rm = (vartype_realmatrix *) v;
-            if (rm->array->refcount == 1)
+            if (rm->array->refcount == 1) {
+                /* The caller is going to modify the data */
+                invalidate_lu(v);
                 return 1;
-            else {
+            } else {
                 realmatrix_data *md = (realmatrix_data *)
-                                        malloc(sizeof(realmatrix_data));
+                                               slab_alloc(SLAB_REALMATRIX_DATA);
                 if (md == NULL)
                     return 0;
                 int4 sz = rm->rows * rm->columns;
                 int4 i;
                 md->data = (phloat *) malloc(sz * sizeof(phloat));
                 if (md->data == NULL) {
-                    free(md);
+                    slab_free(SLAB_REALMATRIX_DATA, md);
                     return 0;
                 }
-                md->is_string = (char *) malloc(sz);
-                if (md->is_string == NULL) {
-                    free(md->data);
-                    free(md);
-                    return 0;
+                if (rm->array->is_string == NULL)
+                    md->is_string = NULL;
+                else {
+                    md->is_string = (char *) malloc(sz);
+                    if (md->is_string == NULL) {
+                        free(md->data);
+                        slab_free(SLAB_REALMATRIX_DATA, md);
+                        return 0;
+                    }
+                    memcpy(md->is_string, rm->array->is_string, sz);
                 }
                 for (i = 0; i < sz; i++)
                     md->data[i] = rm->array->data[i];
-                for (i = 0; i < sz; i++)
-                    md->is_string[i] = rm->array->is_string[i];
+                retain_long_strings(md, 0, sz);
+                md->lu = NULL;
                 md->refcount = 1;
                 rm->array->refcount--;
                 rm->array = md;
@@ -339,22 +583,25 @@ int disentangle(vartype *v) {
         }
         case TYPE_COMPLEXMATRIX: {
             vartype_complexmatrix *cm = (vartype_complexmatrix *) v;
-            if (cm->array->refcount == 1)
+            if (cm->array->refcount == 1) {
+                /* The caller is going to modify the data */
+                invalidate_lu(v);
                 return 1;
-            else {
+            } else {
                 complexmatrix_data *md = (complexmatrix_data *)
-                                            malloc(sizeof(complexmatrix_data));
+                                            slab_alloc(SLAB_COMPLEXMATRIX_DATA);
                 if (md == NULL)
                     return 0;
                 int4 sz = cm->rows * cm->columns * 2;
                 int4 i;
                 md->data = (phloat *) malloc(sz * sizeof(phloat));
                 if (md->data == NULL) {
-                    free(md);
+                    slab_free(SLAB_COMPLEXMATRIX_DATA, md);
                     return 0;
                 }
                 for (i = 0; i < sz; i++)
                     md->data[i] = cm->array->data[i];
+                md->lu = NULL;
                 md->refcount = 1;
                 cm->array->refcount--;
                 cm->array = md;
@@ -369,8 +616,72 @@ int disentangle(vartype *v) {
     }
 }
 
+// Hash index for lookup_var(). Maps variable names to the index in vars[]
+// of the entry that is currently visible, i.e. not hidden by a local
+// variable with the same name; see name_table_slot(). store_var() updates it
+// in place; purge_var() and remove_locals() move entries in vars[] around, so
+// they rebuild it.
+
+static CORE_STATE int *var_hash = NULL;
+static CORE_STATE int var_hash_capacity = 0;
+static CORE_STATE int var_hash_count = 0;
+
+static const char *var_name_at(int index, int *length) {
+    *length = vars[index].length;
+    return vars[index].name;
+}
+
+static int *var_hash_slot(const char *name, int length) {
+    return name_table_slot(var_hash, var_hash_capacity, name, length,
+                           var_name_at);
+}
+
+void rebuild_var_index() {
+    int i;
+    vars_generation++;
+    var_hash_count = 0;
+    if (!name_table_reset(&var_hash, &var_hash_capacity, vars_count))
+        return;
+    for (i = 0; i < vars_count; i++) {
+        int *slot;
+        if (vars[i].hidden)
+            continue;
+        slot = var_hash_slot(vars[i].name, vars[i].length);
+        if (*slot == -1)
+            var_hash_count++;
+        *slot = i;
+    }
+}
+
+void free_var_index() {
+    free(var_hash);
+    var_hash = NULL;
+    var_hash_capacity = 0;
+    var_hash_count = 0;
+}
+
+/* Called after a new variable has been appended to vars[] */
+static void var_hash_insert(int index) {
+    int *slot;
+    if (var_hash_capacity == 0
+            || (var_hash_count + 1) * 2 > var_hash_capacity) {
+        rebuild_var_index();
+        return;
+    }
+    slot = var_hash_slot(vars[index].name, vars[index].length);
+    if (*slot == -1)
+        var_hash_count++;
+    *slot = index;
+}
+
 int lookup_var(const char *name, int namelength) {
     int i, j;
+    if (var_hash_capacity == 0)
+        rebuild_var_index();
+    if (var_hash_capacity != 0)
+        return *var_hash_slot(name, namelength);
+
+    /* No memory for the hash index; do it the slow way */
     for (i = vars_count - 1; i >= 0; i--) {
         if (vars[i].hidden)
             continue;
@@ -393,6 +704,26 @@ vartype *recall_var(const char *name, int namelength) {
         return vars[varindex].value;
 }
 
+/* Like lookup_var(), but for the (direct or indirect) named variable
+ * argument of a command. When a program is running, get_next_command() puts
+ * the variable's index, which it keeps cached, in arg->target, saving us the
+ * lookup.
+ */
+int lookup_arg_var(const arg_struct *arg) {
+    if (arg->target != -1 && program_running())
+        return arg->target;
+    else
+        return lookup_var(arg->val.text, arg->length);
+}
+
+vartype *recall_arg_var(const arg_struct *arg) {
+    int varindex = lookup_arg_var(arg);
+    if (varindex == -1)
+        return NULL;
+    else
+        return vars[varindex].value;
+}
+
 bool ensure_var_space(int n) {
     int nc = vars_count + n;
     if (nc > vars_capacity) {
@@ -406,7 +737,14 @@ bool ensure_var_space(int n) {
 }
 
 int store_var(const char *name, int namelength, vartype *value, bool local) {
-    int varindex = lookup_var(name, namelength);
+    return store_var_at(lookup_var(name, namelength), name, namelength, value, local);
+}
+
+int store_arg_var(const arg_struct *arg, vartype *value) {
+    return store_var_at(lookup_arg_var(arg), arg->val.text, arg->length, value, false);
+}
+
+static int store_var_at(int varindex, const char *name, int namelength, vartype *value, bool local) {
     int i;
     if (varindex == -1) {
         if (vars_count == vars_capacity) {
@@ -424,6 +762,8 @@ int store_var(const char *name, int namelength, vartype *value, bool local) {
         vars[varindex].level = local ? get_rtn_level() : -1;
         vars[varindex].hidden = false;
         vars[varindex].hiding = false;
+        var_hash_insert(varindex);
+        vars_generation++;
     } else if (local && vars[varindex].level < get_rtn_level()) {
         if (vars_count == vars_capacity) {
             int nc = vars_capacity + 25;
@@ -441,6 +781,9 @@ int store_var(const char *name, int namelength, vartype *value, bool local) {
         vars[varindex].level = get_rtn_level();
         vars[varindex].hidden = false;
         vars[varindex].hiding = true;
+        if (var_hash_capacity != 0)
+            *var_hash_slot(name, namelength) = varindex;
+        vars_generation++;
         push_indexed_matrix(name, namelength);
     } else {
         if (matedit_mode == 1 &&
@@ -478,6 +821,7 @@ void purge_var(const char *name, int namelength) {
     for (int i = varindex; i < vars_count - 1; i++)
         vars[i] = vars[i + 1];
     vars_count--;
+    rebuild_var_index();
     update_catalog();
 }
 
@@ -486,6 +830,7 @@ void purge_all_vars() {
     for (i = 0; i < vars_count; i++)
         free_vartype(vars[i].value);
     vars_count = 0;
+    rebuild_var_index();
 }
 
 int vars_exist(int real, int cpx, int matrix) {
@@ -516,12 +861,100 @@ int vars_exist(int real, int cpx, int matrix) {
     return 0;
 }
 
-int contains_no_strings(const vartype_realmatrix *rm) {
+bool alloc_is_string(vartype_realmatrix *rm) {
+    if (rm->array->is_string != NULL)
+        return true;
+    rm->array->is_string = (char *) calloc(rm->rows * rm->columns, 1);
+    return rm->array->is_string != NULL;
+}
+
+/* Long strings in matrices: the block starts with the reference count and the
+ * length, and the text follows.
+ */
+typedef struct {
+    int4 refcount;
+    int4 length;
+} long_string;
+
+#define LONG_STRING(array, i) (*(long_string **) &(array)->data[i])
+
+void get_matrix_string(const realmatrix_data *array, int4 i,
+                       const char **text, int4 *length) {
+    if (array->is_string[i] == 2) {
+        long_string *ls = LONG_STRING(array, i);
+        *text = (const char *) (ls + 1);
+        *length = ls->length;
+    } else {
+        *text = phloat_text(array->data[i]);
+        *length = phloat_length(array->data[i]);
+    }
+}
+
+vartype *recall_matrix_string(const realmatrix_data *array, int4 i) {
+    const char *text;
+    int4 length;
+    get_matrix_string(array, i, &text, &length);
+    return new_string(text, length);
+}
+
+bool put_matrix_string(vartype_realmatrix *rm, int4 i,
+                       const char *text, int4 length) {
+    if (!alloc_is_string(rm))
+        return false;
+    realmatrix_data *array = rm->array;
+    if (length <= 6) {
+        release_long_strings(array, i, i + 1);
+        array->is_string[i] = 1;
+        phloat_length(array->data[i]) = length;
+        memcpy(phloat_text(array->data[i]), text, length);
+    } else {
+        long_string *ls = (long_string *) malloc(sizeof(long_string) + length);
+        if (ls == NULL)
+            return false;
+        ls->refcount = 1;
+        ls->length = length;
+        memcpy(ls + 1, text, length);
+        release_long_strings(array, i, i + 1);
+        array->is_string[i] = 2;
+        LONG_STRING(array, i) = ls;
+    }
+    return true;
+}
+
+void retain_long_strings(const realmatrix_data *array, int4 from, int4 to) {
+    if (array->is_string == NULL)
+        return;
+    for (int4 i = from; i < to; i++)
+        if (array->is_string[i] == 2)
+            LONG_STRING(array, i)->refcount++;
+}
+
+void release_long_strings(realmatrix_data *array, int4 from, int4 to) {
+    if (array->is_string == NULL)
+        return;
+    for (int4 i = from; i < to; i++)
+        if (array->is_string[i] == 2) {
+            long_string *ls = LONG_STRING(array, i);
+            if (--ls->refcount == 0)
+                free(ls);
+            array->is_string[i] = 0;
+        }
+}
+
+int contains_no_strings(vartype_realmatrix *rm) {
+    realmatrix_data *array = rm->array;
+    if (array->is_string == NULL)
+        return 1;
     int4 size = rm->rows * rm->columns;
     int4 i;
     for (i = 0; i < size; i++)
-        if (rm->array->is_string[i])
+        if (array->is_string[i])
             return 0;
+    /* The strings have all been overwritten; drop the is_string array, so
+     * that the next check is quick again.
+     */
+    free(array->is_string);
+    array->is_string = NULL;
     return 1;
 }
 
@@ -534,10 +967,18 @@ int matrix_copy(vartype *dst, const vartype *src) {
             if (s->rows != d->rows || s->columns != d->columns)
                 return ERR_DIMENSION_ERROR;
             size = s->rows * s->columns;
-            for (i = 0; i < size; i++) {
-                d->array->is_string[i] = s->array->is_string[i];
+            if (s->array->is_string != NULL && !alloc_is_string(d))
+                return ERR_INSUFFICIENT_MEMORY;
+            /* Retain first, in case the two share long strings */
+            retain_long_strings(s->array, 0, size);
+            release_long_strings(d->array, 0, size);
+            if (s->array->is_string == NULL) {
+                free(d->array->is_string);
+                d->array->is_string = NULL;
+            } else
+                memcpy(d->array->is_string, s->array->is_string, size);
+            for (i = 0; i < size; i++)
                 d->array->data[i] = s->array->data[i];
-            }
             return ERR_NONE;
         } else if (dst->type == TYPE_COMPLEXMATRIX) {
             vartype_complexmatrix *d = (vartype_complexmatrix *) dst;
@@ -566,3 +1007,11 @@ int matrix_copy(vartype *dst, const vartype *src) {
     } else
         return ERR_INVALID_TYPE;
 }
+
+void visit_variables_state(state_visitor visit, void *cd) {
+    VISIT_STATE(slab_classes);
+    VISIT_STATE(var_hash);
+    VISIT_STATE(var_hash_capacity);
+    VISIT_STATE(var_hash_count);
+    VISIT_STATE(newest_lu);
+}
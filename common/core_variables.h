@@ -18,26 +18,96 @@
 #ifndef CORE_VARIABLES_H
 #define CORE_VARIABLES_H 1
 
+#include "core_globals.h"
 #include "core_phloat.h"
+#include "core_tables.h"
 
 vartype *new_real(phloat value);
 vartype *new_complex(phloat re, phloat im);
 vartype *new_string(const char *s, int slen);
-vartype *new_realmatrix(int4 rows, int4 columns);
-vartype *new_complexmatrix(int4 rows, int4 columns);
+/* The matrix constructors zero the new matrix, unless 'zero' is false; pass
+ * false only when the caller is going to store every element itself.
+ */
+vartype *new_realmatrix(int4 rows, int4 columns, bool zero = true);
+vartype *new_complexmatrix(int4 rows, int4 columns, bool zero = true);
+phloat *new_phloat_array(int4 n, bool zero);
+void zero_phloat_array(phloat *p, int4 n);
 vartype *new_matrix_alias(vartype *m);
+void invalidate_lu(vartype *m);
+void attach_lu(vartype *m, lu_cache *c);
 void free_vartype(vartype *v);
 void clean_vartype_pools();
+void trim_vartype_pools();
+
+/* Allocator for the fixed-size vartype headers and matrix descriptors.
+ * Objects from slab_alloc() must be released with slab_free(), using the same
+ * class, and never with free().
+ * get_slab_stats() is for monitoring; it returns the number of objects in use
+ * and the most there have ever been, the number of objects the class has room
+ * for, the number of slabs and their size in bytes, and how many times the
+ * class has been trimmed and how many slabs that has released in total.
+ * vartype_pool_free_bytes() returns the number of bytes held in reserve, in
+ * the slots of all classes that are not currently in use.
+ */
+#define SLAB_REAL 0
+#define SLAB_COMPLEX 1
+#define SLAB_STRING 2
+#define SLAB_REALMATRIX 3
+#define SLAB_COMPLEXMATRIX 4
+#define SLAB_REALMATRIX_DATA 5
+#define SLAB_COMPLEXMATRIX_DATA 6
+#define SLAB_CLASSES 7
+void *slab_alloc(int cls);
+void slab_free(int cls, void *p);
+typedef struct {
+    int4 live;
+    int4 peak;
+    int4 capacity;
+    int4 slabs;
+    uint4 bytes;
+    int4 trims;
+    int4 released;
+} slab_stats;
+void get_slab_stats(int cls, slab_stats *stats);
+uint4 vartype_pool_free_bytes();
+const char *slab_class_name(int cls);
 vartype *dup_vartype(const vartype *v);
 int disentangle(vartype *v);
 int lookup_var(const char *name, int namelength);
+void rebuild_var_index();
+void free_var_index();
 vartype *recall_var(const char *name, int namelength);
+int lookup_arg_var(const arg_struct *arg);
+vartype *recall_arg_var(const arg_struct *arg);
 bool ensure_var_space(int n);
 int store_var(const char *name, int namelength, vartype *value, bool local = false);
+int store_arg_var(const arg_struct *arg, vartype *value);
 void purge_var(const char *name, int namelength);
 void purge_all_vars();
 int vars_exist(int real, int cpx, int matrix);
-int contains_no_strings(const vartype_realmatrix *rm);
+bool alloc_is_string(vartype_realmatrix *rm);
+/* Strings in real matrices. recall_matrix_string() returns a copy of element
+ * i as a new vartype_string. put_matrix_string() replaces element i with the
+ * given string, allocating 'is_string' if necessary. Elements holding long
+ * strings (is_string[i] == 2) share their text when copied; whenever element
+ * data is copied, from one array to another, retain_long_strings() must be
+ * called on the copied range, and whenever elements are overwritten or
+ * dropped, release_long_strings() must be called on them first. The latter
+ * also clears their is_string flags.
+ */
+void get_matrix_string(const realmatrix_data *array, int4 i,
+                       const char **text, int4 *length);
+vartype *recall_matrix_string(const realmatrix_data *array, int4 i);
+bool put_matrix_string(vartype_realmatrix *rm, int4 i,
+                       const char *text, int4 length);
+void retain_long_strings(const realmatrix_data *array, int4 from, int4 to);
+void release_long_strings(realmatrix_data *array, int4 from, int4 to);
+/* Returns nonzero if none of rm's elements is a string. If rm has an
+ * is_string array but no strings are left in it, the array is freed.
+ */
+int contains_no_strings(vartype_realmatrix *rm);
 int matrix_copy(vartype *dst, const vartype *src);
 
+void visit_variables_state(state_visitor visit, void *cd);
+
 #endif
@@ -43,6 +43,37 @@
 #define F42_BIG_ENDIAN 1
 #endif
 
+/* Storage class for the emulator core's per-calculator state; see
+ * visit_globals_state() in core_globals.h. Shells that run calculators on
+ * more than one thread at a time should define FREE42_THREADS when building
+ * the core, so that each thread gets a private copy of all of it.
+ * Every CORE_STATE variable must also be passed to VISIT_STATE() in its
+ * file's visit_*_state() function; otherwise it is shared by all the
+ * calculators on a thread, and switching contexts leaves it behind.
+ * gtk/check-core-state.py checks this, and 'make batch' runs it.
+ * CORE_PER_THREAD is for variables that need a copy per thread but are not
+ * part of any one calculator, and so are not visited: constants that are set
+ * up at startup, scratch buffers, and the context bookkeeping itself.
+ */
+#ifdef FREE42_THREADS
+#define CORE_STATE thread_local
+#define CORE_PER_THREAD thread_local
+#else
+#define CORE_STATE
+#define CORE_PER_THREAD
+#endif
+
+/* Large matrix operations can be spread over a pool of worker threads; see
+ * core_linalg2.cc. Shells that want this define FREE42_WORKERS when building
+ * the core, and link with the POSIX threads library. The decimal build
+ * never uses the pool: the Intel library keeps its exception flags in a
+ * global (DECIMAL_GLOBAL_EXCEPTION_FLAGS), which the tasks would all be
+ * updating at the same time.
+ */
+#ifdef BCD_MATH
+#undef FREE42_WORKERS
+#endif
+
 /* Magic number "24kF" for the state file. */
 #define FREE42_MAGIC 0x466b3432
 #define FREE42_MAGIC_STR "24kF"
@@ -88,6 +88,27 @@ void shell_annunciators(int updn, int shf, int prt, int run, int g, int rad);
  */
 int shell_wants_cpu();
 
+/* shell_cpu_slice()
+ *
+ * Tells the emulator core how often to call shell_wants_cpu() while running
+ * a user program. The core will execute up to '*instructions' program steps
+ * between calls, but will call it sooner once '*milliseconds' have passed
+ * since the previous call, as measured by shell_milliseconds(); the clock is
+ * only sampled every few steps, so it should be cheap but need not be
+ * precise. A value of 0 for '*milliseconds' disables the time limit.
+ * The core queries this every time it resumes running a program, so the
+ * shell may change the values on the fly.
+ * Setting '*instructions' to 1 makes the core check before every single
+ * step; shells where shell_wants_cpu() is expensive should use larger
+ * values, but should keep '*milliseconds' well under 50, so that EXIT and
+ * R/S remain responsive.
+ * The same limits apply to long-running functions like INVRT, SIMQ, and
+ * PRP, which return from core_keydown() with a return value of 1 at the end
+ * of each slice; for those, '*instructions' counts fixed-size chunks of work
+ * instead of program steps.
+ */
+void shell_cpu_slice(int *instructions, int *milliseconds);
+
 /* Callback to suspend execution for the given number of milliseconds. No event
  * processing will take place during the wait, so the core can call this
  * without having to worry about core_keydown() etc. being re-entered.
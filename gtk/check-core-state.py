@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+
+# Checks that every CORE_STATE variable in the core is passed to VISIT_STATE
+# in one of the visit_*_state() functions. Variables that are missed there
+# are silently shared between calculators when the core switches contexts
+# (see CORE_STATE in free42.h), so 'make batch' runs this first, and fails if
+# any are found.
+# Usage: check-core-state.py [directory], where the directory holds the core
+# sources; the default is ../common.
+
+import os
+import re
+import sys
+
+srcdir = sys.argv[1] if len(sys.argv) > 1 else "../common"
+
+def strip_comments(text):
+    text = re.sub(r"/\*.*?\*/", " ", text, flags=re.S)
+    return re.sub(r"//[^\n]*", " ", text)
+
+def split_top(text, sep):
+    parts = []
+    depth = 0
+    cur = ""
+    for c in text:
+        if c in "([{":
+            depth += 1
+        elif c in ")]}":
+            depth -= 1
+        if c == sep and depth == 0:
+            parts.append(cur)
+            cur = ""
+        else:
+            cur += c
+    parts.append(cur)
+    return parts
+
+def declared_names(decl):
+    # Drop struct bodies and initializers, then take the name of each
+    # declarator: the identifier in (*name)(...) for function pointers, and
+    # otherwise the last identifier before any array dimensions.
+    decl = re.sub(r"\{.*\}", " ", decl, flags=re.S)
+    names = []
+    for i, d in enumerate(split_top(decl, ",")):
+        d = split_top(d, "=")[0]
+        m = re.search(r"\(\s*\*\s*(\w+)\s*\)", d)
+        if m is None:
+            d = re.sub(r"\[.*?\]", " ", d)
+            ids = re.findall(r"\w+", d)
+            if len(ids) == 0:
+                continue
+            names.append(ids[-1])
+        else:
+            names.append(m.group(1))
+    return names
+
+declared = {}
+visited = set()
+
+for fn in sorted(os.listdir(srcdir)):
+    if not re.match(r"(core_\w+|shell_spool)\.(cc|h)$", fn):
+        continue
+    text = strip_comments(open(os.path.join(srcdir, fn)).read())
+    for m in re.finditer(r"\bVISIT_STATE\(\s*(\w+)", text):
+        visited.add(m.group(1))
+    pos = 0
+    while True:
+        m = re.search(r"^[ \t]*(?:static\s+)?CORE_STATE\b", text[pos:], re.M)
+        if m is None:
+            break
+        start = pos + m.end()
+        depth = 0
+        end = start
+        while end < len(text):
+            c = text[end]
+            if c == "{":
+                depth += 1
+            elif c == "}":
+                depth -= 1
+            elif c == ";" and depth == 0:
+                break
+            end += 1
+        for name in declared_names(text[start:end]):
+            declared.setdefault(name, fn)
+        pos = end + 1
+
+missing = sorted(n for n in declared if n not in visited)
+for name in missing:
+    sys.stderr.write("%s: CORE_STATE variable '%s' is not visited\n"
+                     % (declared[name], name))
+sys.exit(1 if missing else 0)
@@ -0,0 +1,476 @@
+/*****************************************************************************
+ * Free42 -- an HP-42S calculator simulator
+ * Copyright (C) 2004-2020  Thomas Okken
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see http://www.gnu.org/licenses/.
+ *****************************************************************************/
+
+/* Headless shell, for running Free42 programs as batch jobs.
+ *
+ * Usage: free42batch [-j threads] [-s statefile]... [-r rawfile]...
+ *                    [-x values]... [-p printfile] [-v] label
+ *
+ * Loads the given state file (or starts from a hard reset), imports any
+ * *.raw program files, pastes the given input values onto the stack, runs
+ * the given global label to completion, and prints the X, Y, Z, and T
+ * registers and the elapsed time. Nothing is displayed and no keystrokes are
+ * accepted, so the program runs at full speed; PSE doesn't pause, and
+ * INPUT, PROMPT, STOP, and GETKEY end the run. Printer output is appended to
+ * printfile, if given; otherwise, it is discarded.
+ * The state file is a *.f42 file from the GTK version's ~/.free42 directory,
+ * or a state.bin from before it kept separate *.f42 files. If it can't be
+ * loaded, the job is skipped, and the exit status is nonzero; like the GUI,
+ * core_init() renames a state file it fails to read to *.corrupt.
+ *
+ * The values for -x are separated by commas, and are pasted in order, so the
+ * last one ends up in X. Every -s and every -x adds a job: one calculator,
+ * running the program once. If several state files and several input
+ * vectors are given, there must be as many of one as of the other, and they
+ * are paired up; otherwise, the single state file or input vector is used
+ * for all jobs. The jobs are spread over the given number of threads, each
+ * of which has its own copy of the core state, and their results are
+ * printed in order.
+ * With -v, each job also reports its allocator statistics on stderr.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <unistd.h>
+#ifdef FREE42_THREADS
+#include <pthread.h>
+#endif
+
+#include "shell.h"
+#include "shell_spool.h"
+#include "core_main.h"
+#include "core_globals.h"
+#include "core_helpers.h"
+#include "core_variables.h"
+
+#ifdef BCD_MATH
+#define TITLE "free42dec-batch"
+#else
+#define TITLE "free42bin-batch"
+#endif
+
+typedef struct {
+    const char *state_file_name;
+    const char *inputs;
+    bool loaded;
+    bool found;
+    char result[4][510];
+} job_struct;
+
+static int jobs_count;
+static job_struct *jobs;
+static int next_job = 0;
+static const char *label;
+static int raw_count = 0;
+static const char **raw_names;
+static bool verbose = false;
+
+static FILE *print_txt = NULL;
+static CORE_PER_THREAD bool timeout3_pending = false;
+static CORE_PER_THREAD bool quit_flag = false;
+
+#ifdef FREE42_THREADS
+static pthread_mutex_t jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t print_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* core_init() renames the state file while it's loading it, so that a crash
+ * during loading doesn't leave a state file that makes the app crash on
+ * every launch. Jobs that share a state file must therefore not load it at
+ * the same time.
+ */
+static pthread_mutex_t init_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK(m) pthread_mutex_lock(&m)
+#define UNLOCK(m) pthread_mutex_unlock(&m)
+#else
+#define LOCK(m)
+#define UNLOCK(m)
+#endif
+
+static void txt_writer(const char *text, int length);
+static void txt_newliner();
+
+
+static void usage() {
+    fprintf(stderr, "Usage: %s [-j threads] [-s statefile]... [-r rawfile]...\n"
+                    "           [-x values]... [-p printfile] [-v] label\n", TITLE);
+    exit(1);
+}
+
+static double elapsed(const struct timespec *t0, const struct timespec *t1) {
+    return (t1->tv_sec - t0->tv_sec) + (t1->tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+static void format_reg(char *abuf, const vartype *v) {
+    char buf[100];
+    int len = vartype2string(v, buf, 100);
+    len = hp2ascii(abuf, buf, len);
+    abuf[len] = 0;
+}
+
+static void paste_inputs(const char *inputs) {
+    char buf[100];
+    while (true) {
+        const char *comma = strchr(inputs, ',');
+        int len = comma == NULL ? strlen(inputs) : comma - inputs;
+        if (len > 99)
+            len = 99;
+        memcpy(buf, inputs, len);
+        buf[len] = 0;
+        core_paste(buf);
+        if (comma == NULL)
+            break;
+        inputs = comma + 1;
+    }
+}
+
+/* Reads the header of a state file, the way read_shell_state() in
+ * shell_main.cc does, and returns the state file version, and the offset
+ * where the core state starts. Version 26 and later keep the core state in
+ * its own *.f42 file, which core_init() reads from the top, so those are
+ * the files to use with -s; older versions have it following the shell
+ * state, which is skipped here. Returns false if the file can't be opened
+ * or doesn't look like a Free42 state file.
+ */
+static bool read_state_header(const char *name, int4 *version, int *offset) {
+    FILE *f = fopen(name, "rb");
+    if (f == NULL)
+        return false;
+    int4 magic, state_size, state_version;
+    bool ok = fread(&magic, 1, sizeof(int4), f) == sizeof(int4)
+            && magic == FREE42_MAGIC
+            && fread(version, 1, sizeof(int4), f) == sizeof(int4);
+    if (ok && *version > 25)
+        *offset = 0;
+    else if (ok && *version == 0)
+        /* State file version 0 does not contain shell state */
+        *offset = ftell(f);
+    else if (ok) {
+        ok = fread(&state_size, 1, sizeof(int4), f) == sizeof(int4)
+                && fread(&state_version, 1, sizeof(int4), f) == sizeof(int4)
+                && state_size >= 0
+                && fseek(f, state_size, SEEK_CUR) == 0;
+        *offset = ftell(f);
+    }
+    fclose(f);
+    return ok;
+}
+
+static void run_job(job_struct *job) {
+    int4 version = 0;
+    int offset = 0;
+    LOCK(init_mutex);
+    bool readable = job->state_file_name == NULL
+            || read_state_header(job->state_file_name, &version, &offset);
+    job->loaded = readable && core_init(job->state_file_name != NULL, version,
+                                        job->state_file_name, offset);
+    UNLOCK(init_mutex);
+    if (!job->loaded) {
+        /* core_init() hard resets if loading fails; that's no use here */
+        if (readable)
+            core_cleanup();
+        job->found = false;
+        return;
+    }
+    for (int i = 0; i < raw_count; i++)
+        core_import_programs(0, raw_names[i]);
+    if (job->inputs != NULL)
+        paste_inputs(job->inputs);
+
+    timeout3_pending = false;
+    quit_flag = false;
+    job->found = core_run_label(label);
+    while (job->found && !quit_flag) {
+        int enqueued, repeat;
+        if (core_keydown(0, &enqueued, &repeat))
+            continue;
+        if (timeout3_pending) {
+            /* PSE; carry on right away */
+            timeout3_pending = false;
+            if (core_timeout3(1))
+                continue;
+        }
+        break;
+    }
+
+    format_reg(job->result[0], reg_t);
+    format_reg(job->result[1], reg_z);
+    format_reg(job->result[2], reg_y);
+    format_reg(job->result[3], reg_x);
+    if (verbose) {
+        LOCK(print_mutex);
+        for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+            slab_stats st;
+            get_slab_stats(cls, &st);
+            fprintf(stderr, "Job %d: %s: %d live (peak %d), %d capacity, "
+                            "%d slabs (%u bytes), %d trims, %d released\n",
+                    (int) (job - jobs) + 1, slab_class_name(cls),
+                    st.live, st.peak, st.capacity, st.slabs, st.bytes,
+                    st.trims, st.released);
+        }
+        UNLOCK(print_mutex);
+    }
+    core_cleanup();
+}
+
+static void *worker(void *arg) {
+    while (true) {
+        LOCK(jobs_mutex);
+        int j = next_job++;
+        UNLOCK(jobs_mutex);
+        if (j >= jobs_count)
+            break;
+        run_job(jobs + j);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    const char *print_file_name = NULL;
+    int threads = 1;
+    int states_count = 0, inputs_count = 0;
+    const char **states = (const char **) malloc(argc * sizeof(char *));
+    const char **inputs = (const char **) malloc(argc * sizeof(char *));
+    raw_names = (const char **) malloc(argc * sizeof(char *));
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:s:r:x:p:v")) != -1) {
+        switch (opt) {
+            case 'j':
+                threads = atoi(optarg);
+                if (threads < 1)
+                    usage();
+                break;
+            case 's':
+                states[states_count++] = optarg;
+                break;
+            case 'r':
+                raw_names[raw_count++] = optarg;
+                break;
+            case 'x':
+                inputs[inputs_count++] = optarg;
+                break;
+            case 'p':
+                print_file_name = optarg;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind != argc - 1)
+        usage();
+    label = argv[optind];
+    if (states_count > 1 && inputs_count > 1 && states_count != inputs_count)
+        usage();
+
+    jobs_count = states_count > inputs_count ? states_count : inputs_count;
+    if (jobs_count == 0)
+        jobs_count = 1;
+    jobs = (job_struct *) malloc(jobs_count * sizeof(job_struct));
+    for (int i = 0; i < jobs_count; i++) {
+        jobs[i].state_file_name = states_count == 0 ? NULL
+                : states[states_count == 1 ? 0 : i];
+        jobs[i].inputs = inputs_count == 0 ? NULL
+                : inputs[inputs_count == 1 ? 0 : i];
+    }
+#ifndef FREE42_THREADS
+    /* Only one copy of the core state; see CORE_STATE in free42.h */
+    threads = 1;
+#endif
+    if (threads > jobs_count)
+        threads = jobs_count;
+
+    if (print_file_name != NULL) {
+        print_txt = fopen(print_file_name, "a");
+        if (print_txt == NULL) {
+            fprintf(stderr, "Can't open \"%s\" for output.\n", print_file_name);
+            return 1;
+        }
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+#ifdef FREE42_THREADS
+    pthread_t *tids = (pthread_t *) malloc(threads * sizeof(pthread_t));
+    for (int i = 1; i < threads; i++)
+        pthread_create(tids + i, NULL, worker, NULL);
+    worker(NULL);
+    for (int i = 1; i < threads; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+#else
+    worker(NULL);
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    int status = 0;
+    for (int i = 0; i < jobs_count; i++) {
+        job_struct *job = jobs + i;
+        if (jobs_count > 1)
+            printf("Job %d:\n", i + 1);
+        if (!job->loaded) {
+            fprintf(stderr, "Can't load state file \"%s\".\n",
+                    job->state_file_name);
+            status = 1;
+            continue;
+        }
+        if (!job->found) {
+            fprintf(stderr, "Label \"%s\" not found.\n", label);
+            status = 1;
+            continue;
+        }
+        printf("T: %s\n", job->result[0]);
+        printf("Z: %s\n", job->result[1]);
+        printf("Y: %s\n", job->result[2]);
+        printf("X: %s\n", job->result[3]);
+    }
+    printf("Elapsed: %.3f s\n", elapsed(&t0, &t1));
+
+    if (print_txt != NULL)
+        fclose(print_txt);
+    free(jobs);
+    free(states);
+    free(inputs);
+    free(raw_names);
+    return status;
+}
+
+const char *shell_platform() {
+    return VERSION " " VERSION_PLATFORM " batch";
+}
+
+void shell_blitter(const char *bits, int bytesperline, int x, int y,
+                             int width, int height) {
+    // No display
+}
+
+void shell_beeper(int frequency, int duration) {
+    // No sound
+}
+
+void shell_annunciators(int updn, int shf, int prt, int run, int g, int rad) {
+    // No display
+}
+
+int shell_wants_cpu() {
+    // No events; never yield
+    return 0;
+}
+
+void shell_cpu_slice(int *instructions, int *milliseconds) {
+    /* shell_wants_cpu() never asks for the CPU back, so there's no point
+     * in calling it often.
+     */
+    *instructions = 1000000;
+    *milliseconds = 0;
+}
+
+void shell_delay(int duration) {
+    // Full speed
+}
+
+void shell_request_timeout3(int delay) {
+    timeout3_pending = true;
+}
+
+uint4 shell_get_mem() {
+    FILE *meminfo = fopen("/proc/meminfo", "r");
+    char line[1024];
+    uint4 bytes = 0;
+    if (meminfo == NULL)
+        return 0;
+    while (fgets(line, 1024, meminfo) != NULL) {
+        if (strncmp(line, "MemFree:", 8) == 0) {
+            unsigned int kbytes;
+            if (sscanf(line + 8, "%u", &kbytes) == 1)
+                bytes = 1024 * kbytes;
+            break;
+        }
+    }
+    fclose(meminfo);
+    return bytes;
+}
+
+int shell_low_battery() {
+    return 0;
+}
+
+void shell_powerdown() {
+    quit_flag = true;
+}
+
+int8 shell_random_seed() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+uint4 shell_milliseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint4) (ts.tv_sec * 1000L + ts.tv_nsec / 1000000);
+}
+
+int shell_decimal_point() {
+    return 1;
+}
+
+void shell_print(const char *text, int length,
+                 const char *bits, int bytesperline,
+                 int x, int y, int width, int height) {
+    if (print_txt == NULL)
+        return;
+    LOCK(print_mutex);
+    if (text != NULL)
+        shell_spool_txt(text, length, txt_writer, txt_newliner);
+    else
+        shell_spool_bitmap_to_txt(bits, bytesperline, x, y, width, height, txt_writer, txt_newliner);
+    UNLOCK(print_mutex);
+}
+
+static void txt_writer(const char *text, int length) {
+    fwrite(text, 1, length, print_txt);
+}
+
+static void txt_newliner() {
+    fputc('\n', print_txt);
+}
+
+void shell_get_time_date(uint4 *time, uint4 *date, int *weekday) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    struct tm tms;
+    localtime_r(&tv.tv_sec, &tms);
+    if (date != NULL)
+        *date = ((tms.tm_year + 1900) * 100 + tms.tm_mon + 1) * 100 + tms.tm_mday;
+    if (time != NULL)
+        *time = ((tms.tm_hour * 100 + tms.tm_min) * 100 + tms.tm_sec) * 100 + tv.tv_usec / 10000;
+    if (weekday != NULL)
+        *weekday = tms.tm_wday;
+}
+
+void shell_message(const char *message) {
+    fprintf(stderr, "%s\n", message);
+}
+
+void shell_log(const char *message) {
+    fprintf(stderr, "%s\n", message);
+}
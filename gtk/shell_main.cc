@@ -953,7 +953,10 @@ static void init_shell_state(int4 version) {
             state.old_repaint = true;
             /* fall through */
         case 7:
-            /* current version (SHELL_VERSION = 7),
+            core_settings.matrix_block_size = 0;
+            /* fall through */
+        case 8:
+            /* current version (SHELL_VERSION = 8),
              * so nothing to do here since everything
              * was initialized from the state file.
              */
@@ -997,6 +1000,8 @@ static int read_shell_state(int4 *ver) {
         core_settings.matrix_outofrange = state.matrix_outofrange;
         core_settings.auto_repeat = state.auto_repeat;
     }
+    if (state_version >= 8)
+        core_settings.matrix_block_size = state.matrix_block_size;
 
     init_shell_state(state_version);
     *ver = version;
@@ -1020,6 +1025,7 @@ static int write_shell_state() {
     state.matrix_singularmatrix = core_settings.matrix_singularmatrix;
     state.matrix_outofrange = core_settings.matrix_outofrange;
     state.auto_repeat = core_settings.auto_repeat;
+    state.matrix_block_size = core_settings.matrix_block_size;
     if (fwrite(&state, 1, sizeof(state_type), statefile) != sizeof(int4))
         return 0;
 
@@ -2195,6 +2201,7 @@ static void preferencesCB() {
     static GtkWidget *printtogif;
     static GtkWidget *gifpath;
     static GtkWidget *gifheight;
+    static GtkWidget *blocksize;
 
     if (dialog == NULL) {
         dialog = gtk_dialog_new_with_buttons(
@@ -2235,6 +2242,11 @@ static void preferencesCB() {
         gifheight = gtk_entry_new();
         gtk_entry_set_max_length(GTK_ENTRY(gifheight), 5);
         gtk_grid_attach(GTK_GRID(grid), gifheight, 2, 6, 1, 1);
+        label = gtk_label_new("Matrix multiplication block size (0 = automatic):");
+        gtk_grid_attach(GTK_GRID(grid), label, 0, 7, 2, 1);
+        blocksize = gtk_entry_new();
+        gtk_entry_set_max_length(GTK_ENTRY(blocksize), 3);
+        gtk_grid_attach(GTK_GRID(grid), blocksize, 2, 7, 1, 1);
 
         g_signal_connect(G_OBJECT(browse1), "clicked", G_CALLBACK(browse_file),
                 (gpointer) new browse_file_info("Select Text File Name",
@@ -2259,6 +2271,9 @@ static void preferencesCB() {
     snprintf(maxlen, 6, "%d", state.printerGifMaxLength);
         gtk_entry_set_text(GTK_ENTRY(gifheight), maxlen);
     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(repaintwholedisplay), !state.old_repaint);
+    char bsize[4];
+    snprintf(bsize, 4, "%d", core_settings.matrix_block_size);
+    gtk_entry_set_text(GTK_ENTRY(blocksize), bsize);
 
     gtk_window_set_role(GTK_WINDOW(dialog), "Free42 Dialog");
     if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
@@ -2300,6 +2315,15 @@ static void preferencesCB() {
         } else
             state.printerGifMaxLength = 256;
 
+        s = gtk_entry_get_text(GTK_ENTRY(blocksize));
+        if (sscanf(s, "%d", &core_settings.matrix_block_size) == 1) {
+            if (core_settings.matrix_block_size < 0)
+                core_settings.matrix_block_size = 0;
+            else if (core_settings.matrix_block_size > 256)
+                core_settings.matrix_block_size = 256;
+        } else
+            core_settings.matrix_block_size = 0;
+
         state.old_repaint = !gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(repaintwholedisplay));
     }
 
@@ -2971,6 +2995,14 @@ int shell_wants_cpu() {
     return g_main_context_pending(NULL) ? 1 : 0;
 }
 
+void shell_cpu_slice(int *instructions, int *milliseconds) {
+    /* g_main_context_pending() is expensive compared to most program
+     * steps, so don't call it more often than necessary.
+     */
+    *instructions = 1000;
+    *milliseconds = 20;
+}
+
 void shell_delay(int duration) {
     gdk_display_flush(gdk_display_get_default());
     g_usleep(duration * 1000);
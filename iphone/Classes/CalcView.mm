@@ -1016,6 +1016,15 @@ int shell_wants_cpu() {
         || now.tv_sec == runner_end_time.tv_sec && now.tv_usec >= runner_end_time.tv_usec;
 }
 
+void shell_cpu_slice(int *instructions, int *milliseconds) {
+    TRACE("shell_cpu_slice");
+    /* shell_wants_cpu() ends the runner's time slice; checking the
+     * clock every couple of milliseconds is plenty for that.
+     */
+    *instructions = 1000;
+    *milliseconds = 2;
+}
+
 void shell_delay(int duration) {
     TRACE("shell_delay");
     struct timespec ts;
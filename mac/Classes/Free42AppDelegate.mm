@@ -1629,6 +1629,14 @@ int shell_wants_cpu() {
         || now.tv_sec == runner_end_time.tv_sec && now.tv_usec >= runner_end_time.tv_usec;
 }
 
+void shell_cpu_slice(int *instructions, int *milliseconds) {
+    /* shell_wants_cpu() ends the runner's 10 ms time slice; checking the
+     * clock every couple of milliseconds is plenty for that.
+     */
+    *instructions = 1000;
+    *milliseconds = 2;
+}
+
 static void read_key_map(const char *keymapfilename) {
     FILE *keymapfile = fopen(keymapfilename, "r");
     int kmcap = 0;
@@ -2181,6 +2181,11 @@ int shell_wants_cpu() {
     return PeekMessage(&msg, NULL, 0, 0, PM_NOREMOVE) != 0;
 }
 
+void shell_cpu_slice(int *instructions, int *milliseconds) {
+    *instructions = 1000;
+    *milliseconds = 20;
+}
+
 void shell_delay(int duration) {
     Sleep(duration);
 }